@@ -52,6 +52,7 @@
 #include "wgetopt.h"
 #include "sanity.h"
 #include "tokenizer.h"
+#include "exec.h"
 #include "builtin_help.h"
 #include "wildcard.h"
 #include "input_common.h"
@@ -1536,6 +1537,136 @@ static int builtin_status( wchar_t **argv )
 	return 0;
 }
 
+/**
+   The hash builtin. Used to inspect and flush the cache of command
+   lookups used by get_filename().
+*/
+static int builtin_hash( wchar_t **argv )
+{
+	int argc = builtin_count_args( argv );
+	int flush=0;
+	int res=0;
+	int i;
+	
+	woptind=0;
+	
+	const static struct woption
+		long_options[] =
+		{
+			{
+				L"help", no_argument, 0, 'h' 
+			}
+			,
+			{
+				L"flush", no_argument, 0, 'r' 
+			}
+			,
+			{ 
+				0, 0, 0, 0 
+			}
+		}
+	;		
+		
+	while( 1 )
+	{
+		int opt_index = 0;
+		
+		int opt = wgetopt_long( argc,
+								argv, 
+								L"hr", 
+								long_options, 
+								&opt_index );
+		if( opt == -1 )
+			break;
+			
+		switch( opt )
+		{
+			case 0:
+				if(long_options[opt_index].flag != 0)
+					break;
+				sb_append2( sb_err,
+							argv[0],
+							BUILTIN_ERR_UNKNOWN,
+							L" ",
+							long_options[opt_index].name,
+							L"\n",
+							(void *)0);				
+				builtin_print_help( argv[0], sb_err );
+				
+				return 1;
+				
+			case 'h':		
+				builtin_print_help( argv[0], sb_err );
+				return 0;
+
+			case 'r':		
+				flush = 1;
+				break;
+
+			case '?':
+				builtin_print_help( argv[0], sb_err );
+				
+				return 1;
+				
+		}
+		
+	}		
+
+	if( flush )
+		path_cache_flush();
+
+	if( woptind == argc )
+	{
+		array_list_t names;
+
+		if( flush )
+			return 0;
+		
+		/*
+		  Copy the names, since looking them up may flush the cache
+		*/
+		al_init( &names );
+		path_cache_get_names( &names );
+		for( i=0; i<al_get_count( &names ); i++ )
+			al_set( &names, i, wcsdup( (wchar_t *)al_get( &names, i ) ) );
+		sort_list( &names );
+		
+		for( i=0; i<al_get_count( &names ); i++ )
+		{
+			wchar_t *name = (wchar_t *)al_get( &names, i );
+			wchar_t *path = get_filename( name );
+			
+			if( path )
+				sb_append2( sb_out, name, L"\t", path, L"\n", (void *)0 );
+			free( path );
+			free( name );
+		}
+		al_destroy( &names );
+		return 0;
+	}
+	
+	/*
+	  Look up the specified commands, adding them to the cache
+	*/
+	for( i=woptind; i<argc; i++ )
+	{
+		wchar_t *path = get_filename( argv[i] );
+		if( !path )
+		{
+			sb_append2( sb_err,
+						argv[0],
+						L": ",
+						argv[i],
+						L": not found\n",
+						(void *)0 );
+			res = 1;
+		}
+		free( path );
+	}
+	
+	return res;
+}
+
 
 /**
    The eval builtin. Concatenates the arguments and calls eval on the
@@ -2437,6 +2568,7 @@ static int builtin_for( wchar_t **argv )
 	{
 		parser_push_block( FOR );
 		al_init( &current_block->param2.for_vars);
+		current_block->param3.for_stream = 0;
 		
 		int i;
 		current_block->tok_pos = parser_get_pos();
@@ -2534,6 +2666,17 @@ static int builtin_end( wchar_t **argv )
 						free( (void *)al_pop( &current_block->param2.for_vars ) );
 					}
 				}
+				else if( !al_get_count( &current_block->param2.for_vars ) &&
+						 current_block->param3.for_stream )
+				{
+					/*
+					  The values come from a command substitution
+					  that is still running. Read the next one.
+					*/
+					wchar_t *val = exec_subshell_stream_next( current_block->param3.for_stream );
+					if( val )
+						al_push( &current_block->param2.for_vars, val );
+				}
 				
 				if( al_get_count( &current_block->param2.for_vars ) )
 				{
@@ -2848,6 +2991,7 @@ void builtin_init()
 	hash_put( &builtin, L"bind", (void*) &builtin_bind );
 	hash_put( &builtin, L"random", (void*) &builtin_random );	
 	hash_put( &builtin, L"status", (void*) &builtin_status );	
+	hash_put( &builtin, L"hash", (void*) &builtin_hash );	
 	hash_put( &builtin, L"ulimit", (void*) &builtin_ulimit );	
 	
 	/* 
@@ -2905,6 +3049,7 @@ void builtin_init()
 	intern_static( L"or" );	
 	intern_static( L"begin" );	
 	intern_static( L"status" );	
+	intern_static( L"hash" );	
 	intern_static( L"ulimit" );	
 	
 	builtin_help_init();
@@ -3033,6 +3178,7 @@ const wchar_t *builtin_get_desc( const wchar_t *b )
 		hash_put( desc, L"and", L"Execute second command if first suceeds");
 		hash_put( desc, L"begin", L"Create a block of code" );
 		hash_put( desc, L"status", L"Return status information about fish" );
+		hash_put( desc, L"hash", L"Inspect or flush the command lookup cache" );
 		hash_put( desc, L"ulimit", L"Set or get the shells resurce usage limits" );
 	}
 
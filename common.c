@@ -238,16 +238,36 @@ wchar_t *str2wcs( const char *in )
 	c4++;
 	
 	wchar_t *res;
+	size_t len = strlen( in );
+	size_t i;
 	
-	res = malloc( sizeof(wchar_t)*(strlen(in)+1) );
+	res = malloc( sizeof(wchar_t)*(len+1) );
 	
 	if( !res )
 	{
 		die_mem();
 		
 	}
+
+	/*
+	  Plain ASCII is decoded the same way in every locale, so it can be
+	  copied straight into the result. Fall back to mbstowcs at the
+	  first byte outside ASCII.
+	*/
+	for( i=0; i<len; i++ )
+	{
+		if( (unsigned char)in[i] >= 0x80 )
+			break;
+		res[i] = in[i];
+	}
+	
+	if( i == len )
+	{
+		res[len] = 0;
+		return res;
+	}
 	
-	if( (size_t)-1 == mbstowcs( res, in, sizeof(wchar_t)*(strlen(in)) +1) )
+	if( (size_t)-1 == mbstowcs( res, in, len+1 ) )
 	{
 		error_count++;
 		if( error_count <=error_max )
@@ -980,15 +1000,12 @@ wchar_t *escape( const wchar_t *in,
 }
 
 
-wchar_t *unescape( const wchar_t * orig, int escape_special )
+int unescape_in_place( wchar_t *in, int escape_special )
 {
-	int in_pos, out_pos, len = wcslen( orig );
+	int in_pos, out_pos, len = wcslen( in );
 	int c;
 	int bracket_count=0;
 	wchar_t prev=0;	
-	wchar_t *in = wcsdup(orig);
-	if( !in )
-		die_mem();
 	
 	for( in_pos=0, out_pos=0; in_pos<len; prev=in[out_pos], out_pos++, in_pos++ )
 	{
@@ -998,7 +1015,6 @@ wchar_t *unescape( const wchar_t * orig, int escape_special )
 			switch( in[++in_pos] )
 			{
 				case L'\0':
-					free(in);
 					return 0;
 
 				case L'n':
@@ -1155,7 +1171,6 @@ wchar_t *unescape( const wchar_t * orig, int escape_special )
 					
 					if( end == 0 )
 					{		
-						free(in);
 						return 0;
 					}
 					
@@ -1180,7 +1195,20 @@ wchar_t *unescape( const wchar_t * orig, int escape_special )
 		}		
 	}
 	in[out_pos]=L'\0';
-	return in;	
+	return 1;
+}
+
+wchar_t *unescape( const wchar_t * orig, int escape_special )
+{
+	wchar_t *in = wcsdup(orig);
+	if( !in )
+		die_mem();
+	if( !unescape_in_place( in, escape_special ) )
+	{
+		free( in );
+		return 0;
+	}
+	return in;
 }
 
 /**
@@ -1307,6 +1335,9 @@ static char *gen_unique_nfs_filename( const char *filename )
    Attempt to acquire a lock based on a lockfile, waiting LOCKPOLLINTERVAL 
    milliseconds between polls and timing out after timeout seconds, 
    thereafter forcibly attempting to obtain the lock if force is non-zero.
+   The timeout is restarted whenever the lockfile is replaced or its
+   modification time changes, so the owner of a lock can keep it from
+   being forcibly removed by updating its modification time.
    Returns 1 on success, 0 on failure.
    To release the lock the lockfile must be unlinked.
    A unique temporary file named by appending characters to the lockfile name 
@@ -1320,6 +1351,8 @@ int acquire_lock_file( const char *lockfile, const int timeout, int force )
 	struct timeval start, end;
 	double elapsed;
 	struct stat statbuf;
+	ino_t lock_ino = 0;
+	time_t lock_mtime = 0;
 
 	/*
 	  (Re)create a unique file and check that it has one only link.
@@ -1374,6 +1407,17 @@ int acquire_lock_file( const char *lockfile, const int timeout, int force )
 			ret = 1;
 			break;
 		}
+		if( stat( lockfile, &statbuf ) == 0 &&
+			( statbuf.st_ino != lock_ino || statbuf.st_mtime != lock_mtime ) )
+		{
+			/*
+			  The lock has been refreshed by its owner or taken by
+			  someone else since the last poll, so it is not stale
+			*/
+			lock_ino = statbuf.st_ino;
+			lock_mtime = statbuf.st_mtime;
+			start = end;
+		}
 		elapsed = end.tv_sec + end.tv_usec/1000000.0 - 
 			( start.tv_sec + start.tv_usec/1000000.0 );
 		/* 
@@ -260,6 +260,15 @@ wchar_t *escape( const wchar_t *in,
 
 wchar_t *unescape( const wchar_t * in, int escape_special );
 
+/**
+   Like unescape, but modifies the specified string instead of
+   returning a new one. The unescaped string is never longer than the
+   original.
+
+   \return 0 if the string ends inside an escape sequence or a quote, 1 otherwise
+*/
+int unescape_in_place( wchar_t *in, int escape_special );
+
 void block();
 void unblock();
 
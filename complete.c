@@ -18,6 +18,7 @@
 #include <ctype.h>
 #include <pwd.h>
 #include <signal.h>
+#include <time.h>
 
 #include "config.h"
 #include "util.h"
@@ -35,6 +36,9 @@
 #include "reader.h"
 #include "history.h"
 #include "intern.h"
+#include "mimedb_common.h"
+#include "whatis.h"
+#include "xdgmime.h"
 
 #include "wutil.h"
 
@@ -106,11 +110,6 @@
 */
 #define COMPLETE_BUILTIN_DESC COMPLETE_SEP_STR L"Builtin"
 
-/**
-   The command to run to get a description from a file suffix
-*/
-#define SUFFIX_CMD_STR L"mimedb 2>/dev/null -fd "
-
 /**
    The maximum number of commands on which to perform description
    lookup. The lookup process is quite time consuming, so this should
@@ -134,6 +133,18 @@
 */
 #define CC_FALSE L"false"
 
+/**
+   Maximum number of directory entries to add to the executable index
+   on each call to complete_idle()
+*/
+#define EXEC_INDEX_CHUNK 64
+
+/**
+   Characters that cause a command to be expanded by expand_string,
+   which means the executable index can not be used to complete it
+*/
+#define EXEC_INDEX_SPECIAL L"$*?\\\"'(){}~%"
+
 /**
    Struct describing a completion option entry. 
 
@@ -190,7 +201,7 @@ typedef struct complete_entry
 /** First node in the linked list of all completion entries */
 static complete_entry *first_entry=0;
 
-/** Hashtable containing all descriptions that describe an executable */
+/** Hashtable mapping file suffixes to descriptions, kept for the lifetime of the shell */
 static hash_table_t *suffix_hash=0;
 
 /**
@@ -204,10 +215,294 @@ static hash_table_t *condition_cache=0;
 */
 static hash_table_t *loaded_completions=0;
 
+/**
+   Index of the executables and subdirectories of a directory in
+   $PATH, used to complete command names without reading the
+   directory and stating every file in it each time.
+*/
+typedef struct
+{
+	/** Name of the directory, ending with a slash */
+	wchar_t *dir;
+	/** Modification time of the directory when indexing started */
+	time_t mtime;
+	/** Time when indexing started */
+	time_t indexed;
+	/** 
+		Sorted list of the names in the directory, with descriptions
+		appended in the same format as expand_string() uses
+	*/
+	array_list_t names;
+	/** Directory stream while the directory is being indexed */
+	DIR *handle;
+	/** True once the whole directory has been indexed */
+	int done;
+}
+	exec_index_t;
+
+/**
+   Table of executable indexes, with directory names as keys
+*/
+static hash_table_t *exec_index=0;
+
 void complete_init()
 {
 }
 
+/**
+   Compare two strings in an executable index
+*/
+static int exec_index_cmp( const void *a, const void *b )
+{
+	return wcscmp( *(wchar_t **)a, *(wchar_t **)b );
+}
+
+/**
+   Discard the contents of an executable index, so that the directory
+   will be indexed again
+*/
+static void exec_index_reset( exec_index_t *e )
+{
+	if( e->handle )
+	{
+		closedir( e->handle );
+		e->handle = 0;
+	}
+	al_foreach( &e->names, (void (*)(const void *))&free );
+	al_truncate( &e->names, 0 );
+	e->done = 0;
+}
+
+/**
+   Free an entry in the executable index table
+*/
+static void exec_index_free( const void *key, const void *data )
+{
+	exec_index_t *e = (exec_index_t *)data;
+	exec_index_reset( e );
+	al_destroy( &e->names );
+	free( e->dir );
+	free( e );
+}
+
+/**
+   Add up to \c max more entries of a directory to its executable
+   index. The directory is opened on the first call.
+
+   \return 1 if the directory has been completely indexed, 0 otherwise
+*/
+static int exec_index_step( exec_index_t *e, int max )
+{
+	struct dirent *next;
+	string_buffer_t sb_desc;
+	int count=0;
+	
+	if( e->done )
+		return 1;
+	
+	if( !e->handle )
+	{
+		struct stat buf;
+		
+		e->indexed = time( 0 );
+		e->mtime = wstat( e->dir, &buf )?-1:buf.st_mtime;
+		
+		if( e->mtime == -1 || !(e->handle = wopendir( e->dir ) ) )
+		{
+			/*
+			  Directories that do not exist have an empty index
+			*/
+			e->done = 1;
+			return 1;
+		}
+	}
+	
+	sb_init( &sb_desc );
+	
+	while( count++ < max && (next=readdir( e->handle ))!=0 )
+	{
+		wchar_t *name = str2wcs( next->d_name );
+		wchar_t *long_name;
+		struct stat buf;
+		
+		if( !name )
+			continue;
+		
+		long_name = wcsdupcat( e->dir, name );
+		if( !long_name )
+			die_mem();
+		
+		/*
+		  Same test as wildcard_expand uses for EXECUTABLES_ONLY
+		*/
+		if( (wstat( long_name, &buf ) == 0 && S_ISDIR( buf.st_mode ) ) ||
+			waccess( long_name, X_OK ) == 0 )
+		{
+			get_desc( long_name, &sb_desc, 1 );
+			al_push( &e->names, wcsdupcat( name, (wchar_t *)sb_desc.buff ) );
+		}
+		
+		free( long_name );
+		free( name );
+	}
+	
+	sb_destroy( &sb_desc );
+	
+	if( next )
+		return 0;
+
+	closedir( e->handle );
+	e->handle = 0;
+	qsort( e->names.arr, 
+		   al_get_count( &e->names ), 
+		   sizeof( void * ), 
+		   &exec_index_cmp );
+	e->done = 1;
+	return 1;
+}
+
+/**
+   Returns the executable index for the specified directory, creating
+   an empty one if needed.
+*/
+static exec_index_t *exec_index_get( const wchar_t *dir )
+{
+	exec_index_t *e;
+	
+	if( !exec_index )
+	{
+		exec_index = malloc( sizeof( hash_table_t ) );
+		if( !exec_index )
+			die_mem();
+		hash_init( exec_index, &hash_wcs_func, &hash_wcs_cmp );
+	}
+
+	e = (exec_index_t *)hash_get( exec_index, dir );
+	if( e )
+		return e;
+	
+	e = malloc( sizeof( exec_index_t ) );
+	if( !e )
+		die_mem();
+	e->dir = wcsdup( dir );
+	al_init( &e->names );
+	e->handle = 0;
+	e->done = 0;
+	hash_put( exec_index, e->dir, e );
+	return e;
+}
+
+/**
+   Returns the directory name to use as key in the executable index
+   for the specified $PATH element, or 0 if the element can not be
+   indexed. Relative directories can not be indexed, since they
+   depend on the working directory.
+*/
+static wchar_t *exec_index_dir( const wchar_t *path )
+{
+	if( path[0] != L'/' )
+		return 0;
+	
+	return wcsdupcat( path, path[wcslen(path)-1]==L'/'?L"":L"/" );
+}
+
+/**
+   Add completions for all names in the specified directory that
+   begin with \c cmd. The directory is indexed first if the index is
+   missing or out of date.
+*/
+static void exec_index_complete( const wchar_t *dir, 
+								 const wchar_t *cmd, 
+								 array_list_t *comp )
+{
+	exec_index_t *e = exec_index_get( dir );
+	struct stat buf;
+	int len = wcslen( cmd );
+	int lo, hi;
+	
+	/*
+	  The index is out of date if the directory has been modified,
+	  or if it was indexed during the same second as it was last
+	  modified, since the modification time would not change on
+	  further modifications that second.
+	*/
+	if( e->done &&
+		( wstat( dir, &buf )?-1:buf.st_mtime ) != e->mtime )
+		exec_index_reset( e );
+	
+	if( e->done && e->mtime >= e->indexed )
+		exec_index_reset( e );
+	
+	while( !exec_index_step( e, INT_MAX ) )
+		;
+	
+	lo = 0;
+	hi = al_get_count( &e->names );
+	while( lo < hi )
+	{
+		int mid = (lo+hi)/2;
+		if( wcscmp( (wchar_t *)al_get( &e->names, mid ), cmd ) < 0 )
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	
+	for( ; lo < al_get_count( &e->names ); lo++ )
+	{
+		wchar_t *name = (wchar_t *)al_get( &e->names, lo );
+		if( wcsncmp( name, cmd, len ) != 0 )
+			break;
+		
+		/*
+		  Hidden files are only completed if the command starts with a dot
+		*/
+		if( len == 0 && name[0] == L'.' )
+			continue;
+		
+		al_push( comp, wcsdup( name + len ) );
+	}
+}
+
+int complete_idle()
+{
+	wchar_t *path = env_get( L"PATH" );
+	wchar_t *path_cpy;
+	wchar_t *nxt_path;
+	wchar_t *state;
+	int res = 0;
+	
+	if( !path )
+		return 0;
+	
+	path_cpy = wcsdup( path );
+	if( !path_cpy )
+		die_mem();
+	
+	for( nxt_path = wcstok( path_cpy, ARRAY_SEP_STR, &state );
+		 nxt_path != 0;
+		 nxt_path = wcstok( 0, ARRAY_SEP_STR, &state) )
+	{
+		wchar_t *dir = exec_index_dir( nxt_path );
+		exec_index_t *e;
+		
+		if( !dir )
+			continue;
+		
+		e = exec_index_get( dir );
+		free( dir );
+		
+		if( !e->done )
+		{
+			exec_index_step( e, EXEC_INDEX_CHUNK );
+			res = 1;
+			break;
+		}
+	}
+	
+	free( path_cpy );
+	return res;
+}
+
 /**
    This command clears the cache of condition tests created by \c condition_test().
 */
@@ -331,7 +626,10 @@ void complete_destroy()
 		hash_foreach( suffix_hash, &clear_hash_entry );
 		hash_destroy( suffix_hash );
 		free( suffix_hash );		
+		xdg_mime_shutdown();
 	}
+
+	whatis_destroy();
 	
 	if( loaded_completions )
 	{
@@ -340,6 +638,13 @@ void complete_destroy()
 		hash_destroy( loaded_completions );
 		free( loaded_completions );
 	}
+
+	if( exec_index )
+	{
+		hash_foreach( exec_index, &exec_index_free );
+		hash_destroy( exec_index );
+		free( exec_index );
+	}
 	
 }
 
@@ -788,7 +1093,9 @@ int complete_is_valid_argument( const wchar_t *str,
 }
 
 /**
-   Use the mimedb command to look up a description for a given suffix
+   Look up a description for a given suffix in the mime database.
+   This is done in-process, and the result is cached, so the mime
+   database is only searched once for each suffix.
 */
 static const wchar_t *complete_get_desc_suffix( const wchar_t *suff_orig )
 {
@@ -797,6 +1104,7 @@ static const wchar_t *complete_get_desc_suffix( const wchar_t *suff_orig )
 
 	wchar_t *suff;
 	wchar_t *pos;
+	wchar_t *desc;
 
 	if( len == 0 )
 		return COMPLETE_FILE_DESC;
@@ -810,6 +1118,8 @@ static const wchar_t *complete_get_desc_suffix( const wchar_t *suff_orig )
 	}
 
 	suff = wcsdup(suff_orig);
+	if( !suff )
+		die_mem();
 
 	for( pos=suff; *pos; pos++ )
 	{
@@ -820,43 +1130,39 @@ static const wchar_t *complete_get_desc_suffix( const wchar_t *suff_orig )
 		}
 	}
 
-	wchar_t *tmp = expand_escape( suff, 0 );
-	free(suff);
-	suff = tmp;
-
-	wchar_t *desc = (wchar_t *)hash_get( suffix_hash, suff );
+	desc = (wchar_t *)hash_get( suffix_hash, suff );
 
 	if( !desc )
 	{
+		char *suff_str = wcs2str( suff );
+		char *mime_desc;
+		
+		if( !suff_str )
+			die_mem();
 
-		wchar_t *cmd = wcsdupcat( SUFFIX_CMD_STR, suff );
+		/*
+		  The mime database matches file names, and the suffix
+		  including the leading dot is a perfectly good file name
+		*/
+		mime_desc = mimedb_get_description_for_filename( suff_str );
+		free( suff_str );
 
-		if( cmd )
+		if( mime_desc )
 		{
-
-			array_list_t l;
-			al_init( &l );
-
-			exec_subshell( cmd, &l );
-			free(cmd);
-
-			if( al_get_count( &l )>0 )
+			wchar_t *ln = str2wcs( mime_desc );
+			free( mime_desc );
+			
+			if( ln && wcscmp( ln, L"unknown" ) != 0 )
 			{
-				wchar_t *ln = (wchar_t *)al_get(&l, 0 );
-				if( wcscmp( ln, L"unknown" ) != 0 )
-				{
-					desc = wcsdupcat( COMPLETE_SEP_STR, ln);
-					/*
-					  I have decided I prefer to have the description
-					  begin in uppercase and the whole universe will just
-					  have to accept it. Hah!
-					*/
-					desc[1]=towupper(desc[1]);
-				}
+				desc = wcsdupcat( COMPLETE_SEP_STR, ln);
+				/*
+				  I have decided I prefer to have the description
+				  begin in uppercase and the whole universe will just
+				  have to accept it. Hah!
+				*/
+				desc[1]=towupper(desc[1]);
 			}
-
-			al_foreach( &l, (void (*)(const void *))&free );
-			al_destroy( &l );
+			free( ln );
 		}
 
 		if( !desc )
@@ -864,7 +1170,7 @@ static const wchar_t *complete_get_desc_suffix( const wchar_t *suff_orig )
 			desc = wcsdup(COMPLETE_FILE_DESC);
 		}
 
-		hash_put( suffix_hash, suff!=suff_orig?suff:wcsdup(suff), desc );
+		hash_put( suffix_hash, suff, desc );
 	}
 	else
 	{
@@ -1008,6 +1314,114 @@ static void copy_strings_with_prefix( array_list_t *comp_out,
 
 }
 
+/**
+   Search the whatis database for descriptions of commands starting
+   with the specified prefix, using grep, or apropos if the location
+   of the database isn't known. This is used while the index of the
+   whatis database is not ready yet.
+
+   \param cmd_start the command prefix
+   \param whatis_path the location of the whatis database, or 0
+   \param list the list that the output of grep or apropos is stored in
+   \param lookup the hash table to put the descriptions in. The keys and values point into strings in \c list.
+*/
+static void complete_cmd_desc_search( const wchar_t *cmd_start,
+									  const wchar_t *whatis_path,
+									  array_list_t *list,
+									  hash_table_t *lookup )
+{
+	int i;
+	int cmd_len = wcslen( cmd_start );
+	wchar_t *apropos_cmd=0;
+	wchar_t *esc;
+
+	esc = expand_escape( cmd_start, 1 );		
+	
+	if( !esc )
+		return;
+	
+	if( whatis_path )
+	{
+		apropos_cmd =wcsdupcat2( L"grep ^/dev/null -F <", whatis_path, L" ", esc, 0 );
+	}
+	else
+	{
+		apropos_cmd = wcsdupcat( L"apropos ^/dev/null ", esc );
+	}
+	free(esc);		
+
+	/*
+	  First locate a list of possible descriptions using a single
+	  call to apropos or a direct search if we know the location
+	  of the whatis database. This can take some time on slower
+	  systems with a large set of manuals, but it should be ok
+	  since apropos is only called once.
+	*/
+	exec_subshell( apropos_cmd, list );
+	free( apropos_cmd );
+
+	/*
+	  Then discard anything that is not a possible completion and put
+	  the result into a hashtable with the completion as key and the
+	  description as value.
+
+	  Should be reasonably fast, since no memory allocations are needed.
+	*/
+	for( i=0; i<al_get_count( list); i++ )
+	{
+		wchar_t *el = (wchar_t *)al_get( list, i );
+		wchar_t *key, *key_end, *val_begin;
+		
+		if( !el )
+			continue;
+		
+		//fwprintf( stderr, L"%ls\n", el );
+		if( wcsncmp( el, cmd_start, cmd_len ) != 0 )
+			continue;
+		//fwprintf( stderr, L"%ls\n", el );
+		key = el + cmd_len;
+
+		key_end = wcschr( el, L' ' );
+		if( !key_end )
+		{
+			key_end = wcschr( el, L'\t' );
+			if( !key_end )
+			{
+				continue;
+			}
+		}
+		
+		*key_end = 0;
+		val_begin=key_end+1;
+
+		//fwprintf( stderr, L"Key %ls\n", el );
+
+		while( *val_begin != L'-' && *val_begin)
+		{
+			val_begin++;
+		}
+		
+		if( !val_begin )
+		{
+			continue;
+		}
+		
+		val_begin++;
+			
+		while( *val_begin == L' ' || *val_begin == L'\t' )
+		{
+			val_begin++;
+		}
+		
+		if( !*val_begin )
+		{
+			continue;
+		}
+		
+		hash_put( lookup, key, val_begin );				
+	}
+}
+
 /**
    If command to complete is short enough, substitute
    the description with the whatis information for the executable.
@@ -1017,11 +1431,10 @@ static void complete_cmd_desc( const wchar_t *cmd, array_list_t *comp )
 	int i;
 	const wchar_t *cmd_start;
 	int cmd_len;
-	wchar_t *apropos_cmd=0;
 	array_list_t list;
 	hash_table_t lookup;
 	wchar_t *whatis_path = env_get( L"__fish_whatis_path" );
-	wchar_t *esc;
+	int indexed=0;
 
 	if( !cmd )
 		return;
@@ -1045,141 +1458,73 @@ static void complete_cmd_desc( const wchar_t *cmd, array_list_t *comp )
 		return;
 	}
 	
-	esc = expand_escape( cmd_start, 1 );		
+	al_init( &list );
+	hash_init( &lookup, &hash_wcs_func, &hash_wcs_cmp );
+
+	/*
+	  Use the index of the whatis database if it is ready, and search
+	  the database itself otherwise
+	*/
+	if( whatis_path )
+	{
+		indexed = !whatis_get_descriptions( whatis_path, cmd_start, &lookup );
+	}
 	
-	if( esc )
+	if( !indexed )
 	{
+		complete_cmd_desc_search( cmd_start, whatis_path, &list, &lookup );
+	}
 	
-		if( whatis_path )
-		{
-			apropos_cmd =wcsdupcat2( L"grep ^/dev/null -F <", whatis_path, L" ", esc, 0 );
-		}
-		else
-		{
-			apropos_cmd = wcsdupcat( L"apropos ^/dev/null ", esc );
-		}
-		free(esc);		
-
-		al_init( &list );
-		hash_init( &lookup, &hash_wcs_func, &hash_wcs_cmp );
+	/*
+	  Then do a lookup on every completion and if a match is found,
+	  change to the new description. 
 
-		/*
-		  First locate a list of possible descriptions using a single
-		  call to apropos or a direct search if we know the location
-		  of the whatis database. This can take some time on slower
-		  systems with a large set of manuals, but it should be ok
-		  since apropos is only called once.
-		*/
-		exec_subshell( apropos_cmd, &list );
-		/*
-		  Then discard anything that is not a possible completion and put
-		  the result into a hashtable with the completion as key and the
-		  description as value.
+	  This needs to do a reallocation for every description added, but
+	  there shouldn't be that many completions, so it should be ok.
+	*/
+	for( i=0; i<al_get_count(comp); i++ )
+	{
+		wchar_t *el = (wchar_t *)al_get( comp, i );
+		wchar_t *cmd_end = wcschr( el, 
+								   COMPLETE_SEP );
+		wchar_t *new_desc;
+	
+		if( cmd_end )
+			*cmd_end = 0;
 
-		  Should be reasonably fast, since no memory allocations are needed.
-		*/
-		for( i=0; i<al_get_count( &list); i++ )
+		new_desc = (wchar_t *)hash_get( &lookup,
+										el );
+	
+		if( new_desc )
 		{
-			wchar_t *el = (wchar_t *)al_get( &list, i );
-			wchar_t *key, *key_end, *val_begin;
-			
-			if( !el )
-				continue;
-			
-			//fwprintf( stderr, L"%ls\n", el );
-			if( wcsncmp( el, cmd_start, cmd_len ) != 0 )
-				continue;
-			//fwprintf( stderr, L"%ls\n", el );
-			key = el + cmd_len;
-
-			key_end = wcschr( el, L' ' );
-			if( !key_end )
-			{
-				key_end = wcschr( el, L'\t' );
-				if( !key_end )
-				{
-					continue;
-				}
-			}
-			
-			*key_end = 0;
-			val_begin=key_end+1;
-
-			//fwprintf( stderr, L"Key %ls\n", el );
-
-			while( *val_begin != L'-' && *val_begin)
-			{
-				val_begin++;
-			}
-			
-			if( !val_begin )
-			{
-				continue;
-			}
-			
-			val_begin++;
-				
-			while( *val_begin == L' ' || *val_begin == L'\t' )
-			{
-				val_begin++;
-			}
-			
-			if( !*val_begin )
-			{
-				continue;
-			}
+			wchar_t *new_el = wcsdupcat2( el,
+										  COMPLETE_SEP_STR,
+										  new_desc, 
+										  0 );
+			wchar_t *desc_start = new_el + wcslen( el ) + 1;
 			
 			/*
 			  And once again I make sure the first character is uppercased
 			  because I like it that way, and I get to decide these
 			  things.
 			*/
-			val_begin[0]=towupper(val_begin[0]);
-			hash_put( &lookup, key, val_begin );				
+			*desc_start = towupper( *desc_start );
+			al_set( comp, i, new_el );
+			free( el );			
 		}
-
-		/*
-		  Then do a lookup on every completion and if a match is found,
-		  change to the new description. 
-
-		  This needs to do a reallocation for every description added, but
-		  there shouldn't be that many completions, so it should be ok.
-		*/
-		for( i=0; i<al_get_count(comp); i++ )
+		else
 		{
-			wchar_t *el = (wchar_t *)al_get( comp, i );
-			wchar_t *cmd_end = wcschr( el, 
-									   COMPLETE_SEP );
-			wchar_t *new_desc;
-		
 			if( cmd_end )
-				*cmd_end = 0;
-
-			new_desc = (wchar_t *)hash_get( &lookup,
-											el );
-		
-			if( new_desc )
-			{
-				wchar_t *new_el = wcsdupcat2( el,
-											  COMPLETE_SEP_STR,
-											  new_desc, 
-											  0 );
-				al_set( comp, i, new_el );
-				free( el );			
-			}
-			else
-			{
-				if( cmd_end )
-					*cmd_end = COMPLETE_SEP;
-			}
+				*cmd_end = COMPLETE_SEP;
 		}
 	}
 	
+	if( indexed )
+		hash_foreach( &lookup, &clear_hash_entry );
 	hash_destroy( &lookup );
 	al_foreach( &list, 
 				(void(*)(const void *))&free );
 	al_destroy( &list );	
-	free( apropos_cmd );
 }
 
 /**
@@ -1226,6 +1571,20 @@ static void complete_cmd( const wchar_t *cmd,
 			 nxt_path != 0;
 			 nxt_path = wcstok( 0, ARRAY_SEP_STR, &state) )
 		{
+			wchar_t *dir;
+			
+			/*
+			  Use the executable index for plain command names. Names
+			  that would be expanded are passed to expand_string.
+			*/
+			if( !wcspbrk( cmd, EXEC_INDEX_SPECIAL ) &&
+				(dir = exec_index_dir( nxt_path ) ) )
+			{
+				exec_index_complete( dir, cmd, comp );
+				free( dir );
+				continue;
+			}
+			
 			nxt_completion = wcsdupcat2( nxt_path,
 										 (nxt_path[wcslen(nxt_path)-1]==L'/'?L"":L"/"),
 										 cmd,
@@ -45,6 +45,15 @@ void complete_init();
 */
 void complete_destroy();
 
+/**
+   Do a small amount of background work, like adding a few more
+   executables in $PATH to the index used for completing command
+   names. Should be called when the shell is idle.
+
+   \return 1 if there is more work to do, 0 otherwise
+*/
+int complete_idle();
+
 /**
 
   Add a completion. 
@@ -122,9 +122,38 @@ static hash_table_t env_read_only;
 static char **export_arr=0;
 
 /**
-   Buffer used for storing string contents for export_arr
+   Cached multibyte encoding of an exported variable
 */
-static buffer_t export_buffer;
+typedef struct
+{
+	/**
+	   The value the encoding was made from
+	*/
+	wchar_t *val;
+	/**
+	   The encoded 'key=value' string used in export_arr
+	*/
+	char *str;
+	/**
+	   The value of export_generation when this entry was last
+	   placed in export_arr
+	*/
+	int generation;
+}
+	export_entry_t;
+
+/**
+   Table of cached encodings of exported variables, keyed by
+   variable name. Only variables whose value has changed since the
+   previous call to env_export_arr are encoded again.
+*/
+static hash_table_t export_cache;
+
+/**
+   Counter used to find the entries of export_cache that are no
+   longer exported
+*/
+static int export_generation=0;
 
 
 /**
@@ -133,6 +162,33 @@ static buffer_t export_buffer;
 */
 static int has_changed = 1;
 
+/**
+   A variable whose value is computed each time it is read
+*/
+typedef struct
+{
+	/** Name of the variable */
+	const wchar_t *name;
+	/** Function that computes the value of the variable */
+	wchar_t *(*get)();
+}
+env_dynamic_t;
+
+/**
+   Table of the dynamically computed variables, indexed by name
+*/
+static hash_table_t env_dynamic_table;
+
+/**
+   Cache of variable lookups in the current scope. Maps the name of a
+   variable to the var_entry_t it resolves to from the top of the
+   stack. Entries are removed when the variable is set or erased, or
+   when a scope that hides, reveals or contains the variable is
+   pushed or popped. Dynamic and universal variables are never
+   cached.
+*/
+static hash_table_t env_lookup_cache;
+
 /**
    Free hash key and hash value
 */
@@ -146,12 +202,112 @@ static void clear_hash_entry( const void *key, const void *data )
 	free( (void *)data );
 }
 
+/**
+   Forget the cached lookup of a variable. Used as a hash_foreach
+   callback on scope tables.
+*/
+static void env_lookup_cache_forget( const void *key, const void *data )
+{
+	hash_remove( &env_lookup_cache, key, 0, 0 );
+}
+
 /**
    This stringbuffer is used to store the value of dynamically
    generated variables, such as history.
 */
 static string_buffer_t dyn_var;
 
+/**
+   Compute the value of the history variable, which contains the
+   current command line and the last few history items.
+*/
+static wchar_t *env_get_history()
+{
+	wchar_t *current;
+	int i;		
+	int add_current=0;
+	sb_clear( &dyn_var );						
+		
+	current = reader_get_buffer();
+	if( current && wcslen( current ) )
+	{
+		add_current=1;
+		sb_append( &dyn_var, current );
+	}
+		
+	for( i=add_current; i<8; i++ )
+	{
+		wchar_t *next = history_get( i-add_current );
+		if( !next )
+		{
+			debug( 1, L"No history at idx %d\n", i );
+			break;
+		}
+			
+		if( i!=0)
+			sb_append( &dyn_var, ARRAY_SEP_STR );
+		sb_append( &dyn_var, next );
+	}
+	return (wchar_t *)dyn_var.buff;
+}
+
+/**
+   Compute the value of the COLUMNS variable
+*/
+static wchar_t *env_get_columns()
+{
+	sb_clear( &dyn_var );						
+	sb_printf( &dyn_var, L"%d", common_get_width() );		
+	return (wchar_t *)dyn_var.buff;		
+}
+
+/**
+   Compute the value of the LINES variable
+*/
+static wchar_t *env_get_lines()
+{
+	sb_clear( &dyn_var );						
+	sb_printf( &dyn_var, L"%d", common_get_height() );		
+	return (wchar_t *)dyn_var.buff;
+}
+
+/**
+   Compute the value of the status variable
+*/
+static wchar_t *env_get_status()
+{
+	sb_clear( &dyn_var );			
+	sb_printf( &dyn_var, L"%d", proc_get_last_status() );		
+	return (wchar_t *)dyn_var.buff;		
+}
+
+/**
+   The dynamically computed variables
+*/
+static env_dynamic_t env_dynamic[] = 
+{
+	{
+		L"history", &env_get_history
+	}
+	,
+	{
+		L"COLUMNS", &env_get_columns
+	}
+	,
+	{
+		L"LINES", &env_get_lines
+	}
+	,
+	{
+		L"status", &env_get_status
+	}
+	,
+	{
+		0, 0
+	}
+}
+	;
+
 /**
    Variable used by env_get_names to communicate auxiliary information
    to add_key_to_hash
@@ -163,6 +319,20 @@ static int get_names_show_exported;
 */
 static int get_names_show_unexported;
 
+/**
+   Read the universal variable updates fishd has sent, at most once
+   per job. This never waits for fishd, since writes made by this
+   shell are applied to the local copy right away.
+*/
+static void universal_poll()
+{
+	if( !proc_had_barrier )
+	{
+		proc_had_barrier = 1;
+		env_universal_poll();
+	}
+}
+
 /**
    When fishd isn't started, this function is provided to
    env_universal as a callback, it tries to start up fishd. It's
@@ -231,13 +401,34 @@ static void universal_callback( int type,
 	}
 }
 
+/**
+   Free the specified export_cache key and entry
+*/
+static void export_entry_free( const void *k, const void *v )
+{
+	export_entry_t *e = (export_entry_t *)v;
+	free( (void *)k );
+	free( e->val );
+	free( e->str );
+	free( e );
+}
+
 void env_init()
 {
 	char **p;
+	env_dynamic_t *d;
 
 	sb_init( &dyn_var );
 
-	b_init( &export_buffer );
+	hash_init( &export_cache, &hash_wcs_func, &hash_wcs_cmp );
+
+	hash_init( &env_dynamic_table, &hash_wcs_func, &hash_wcs_cmp );
+	for( d=env_dynamic; d->name; d++ )
+	{
+		hash_put( &env_dynamic_table, d->name, d );
+	}
+	
+	hash_init( &env_lookup_cache, &hash_wcs_func, &hash_wcs_cmp );
 	
 	
 	/*
@@ -315,12 +506,15 @@ void env_destroy()
 	
 	sb_destroy( &dyn_var );
 
-	b_destroy( &export_buffer );
+	hash_foreach( &export_cache, &export_entry_free );
+	hash_destroy( &export_cache );
 	
 	while( &top->env != global )
 		env_pop();
 
 	hash_destroy( &env_read_only );
+	hash_destroy( &env_dynamic_table );
+	hash_destroy( &env_lookup_cache );
 	
 	hash_foreach( global, &clear_hash_entry );
 	hash_destroy( global );
@@ -385,6 +579,11 @@ void env_set( const wchar_t *key,
 		fish_setlocale(LC_ALL,val);
 	}
 
+	if( wcscmp( key, L"PATH" ) == 0 )
+	{
+		path_cache_flush();
+	}
+
 	if( wcscmp( key, L"umask" ) == 0)
 	{
 		wchar_t *end;
@@ -466,8 +665,7 @@ void env_set( const wchar_t *key,
 			}
 			else
 			{
-				if( !proc_had_barrier)
-					env_universal_barrier();
+				universal_poll();
 
 				if( env_universal_get( key ) )
 				{
@@ -504,6 +702,7 @@ void env_set( const wchar_t *key,
 		{
 			void *k, *v;
 			hash_remove( &node->env, key, (const void **)&k, (const void **)&v );
+			hash_remove( &env_lookup_cache, key, 0, 0 );
 			free( k );
 			free( v );
 
@@ -576,6 +775,7 @@ static int try_remove( env_node_t *n,
 			has_changed = 1;
 		}
 		
+		hash_remove( &env_lookup_cache, key, 0, 0 );
 		free(old_key);
 		free(old_val);
 		return 1;
@@ -607,77 +807,49 @@ wchar_t *env_get( const wchar_t *key )
 {
 	var_entry_t *res;
 	env_node_t *env = top;
+	env_dynamic_t *dyn;
 	wchar_t *item;
 	
-	if( wcscmp( key, L"history" ) == 0 )
+	res = (var_entry_t *)hash_get( &env_lookup_cache, key );
+	
+	if( !res )
 	{
-		wchar_t *current;
-		int i;		
-		int add_current=0;
-		sb_clear( &dyn_var );						
-		
-		current = reader_get_buffer();
-		if( current && wcslen( current ) )
+		dyn = (env_dynamic_t *)hash_get( &env_dynamic_table, key );
+		if( dyn )
 		{
-			add_current=1;
-			sb_append( &dyn_var, current );
+			return dyn->get();
 		}
-		
-		for( i=add_current; i<8; i++ )
+
+		while( env != 0 )
 		{
-			wchar_t *next = history_get( i-add_current );
-			if( !next )
+			const void *k;
+			res = (var_entry_t *) hash_get( &env->env, 
+											key );
+			if( res != 0 )
 			{
-				debug( 1, L"No history at idx %d\n", i );
+				k = hash_get_key( &env->env, key );
+				hash_put( &env_lookup_cache, k, res );
 				break;
 			}
-			
-			if( i!=0)
-				sb_append( &dyn_var, ARRAY_SEP_STR );
-			sb_append( &dyn_var, next );
+		
+			if( env->new_scope )
+				env = global_env;
+			else
+				env = env->next;
 		}
-		return (wchar_t *)dyn_var.buff;
-	}
-	else if( wcscmp( key, L"COLUMNS" )==0 )
-	{
-		sb_clear( &dyn_var );						
-		sb_printf( &dyn_var, L"%d", common_get_width() );		
-		return (wchar_t *)dyn_var.buff;		
-	}	
-	else if( wcscmp( key, L"LINES" )==0 )
-	{
-		sb_clear( &dyn_var );						
-		sb_printf( &dyn_var, L"%d", common_get_height() );		
-		return (wchar_t *)dyn_var.buff;
-	}
-	else if( wcscmp( key, L"status" )==0 )
-	{
-		sb_clear( &dyn_var );			
-		sb_printf( &dyn_var, L"%d", proc_get_last_status() );		
-		return (wchar_t *)dyn_var.buff;		
 	}
 	
-	while( env != 0 )
+	if( res != 0 )
 	{
-		res = (var_entry_t *) hash_get( &env->env, 
-										key );
-		if( res != 0 )
+		if( wcscmp( res->val, ENV_NULL )==0) 
 		{
-			if( wcscmp( res->val, ENV_NULL )==0) 
-			{
-				return 0;
-			}
-			else
-				return res->val;			
+			return 0;
 		}
-		
-		if( env->new_scope )
-			env = global_env;
 		else
-			env = env->next;
-	}	
-	if( !proc_had_barrier)
-		env_universal_barrier();
+			return res->val;			
+	}
+	
+	universal_poll();
 	item = env_universal_get( key );
 	
 	if( !item || (wcscmp( item, ENV_NULL )==0))
@@ -698,6 +870,11 @@ int env_exist( const wchar_t *key )
     {
         return 1;
     }
+
+	if( hash_get( &env_lookup_cache, key ) )
+	{
+		return 1;
+	}
 	
 	while( env != 0 )
 	{
@@ -713,8 +890,7 @@ int env_exist( const wchar_t *key )
 		else
 			env = env->next;
 	}	
-	if( !proc_had_barrier)
-		env_universal_barrier();
+	universal_poll();
 	item = env_universal_get( key );
 	
 	return item != 0;
@@ -735,6 +911,21 @@ static int local_scope_exports( env_node_t *n )
 	return local_scope_exports( n->next );
 }
 
+/**
+   Forget the cached lookups of all local variables visible from the
+   specified scope
+*/
+static void env_lookup_cache_forget_locals( env_node_t *n )
+{
+	while( n && n != global_env )
+	{
+		hash_foreach( &n->env, &env_lookup_cache_forget );
+		if( n->new_scope )
+			break;
+		n = n->next;
+	}
+}
+
 void env_push( int new_scope )
 {
 	env_node_t *node = malloc( sizeof(env_node_t) );
@@ -745,6 +936,11 @@ void env_push( int new_scope )
 	if( new_scope )
 	{
 		has_changed |= local_scope_exports(top);
+
+		/*
+		  The new scope hides the local variables below it
+		*/
+		env_lookup_cache_forget_locals( top );
 	}
 	top = node;	
 
@@ -762,6 +958,16 @@ void env_pop()
 			has_changed |= killme->export || local_scope_exports( killme->next );
 		}
 		
+		/*
+		  Lookups may have resolved to variables in the popped scope,
+		  or may be shadowed by the variables it hid
+		*/
+		hash_foreach( &killme->env, &env_lookup_cache_forget );
+		if( killme->new_scope )
+		{
+			env_lookup_cache_forget_locals( killme->next );
+		}
+		
 		top = top->next;
 		hash_foreach( &killme->env, &clear_hash_entry );
 		hash_destroy( &killme->env );
@@ -892,20 +1098,17 @@ static void export_func1( const void *k, const void *v, void *aux )
 }
 
 /**
-   Function used by env_export_arr to iterate over hashtable of variables
+   Encode the specified variable as a 'key=value' string suitable for
+   execve. Arrays are made into colon-separated lists.
 */
-static void export_func2( const void *k, const void *v, void *aux )
+static char *export_encode( const wchar_t *key, const wchar_t *val )
 {
-	wchar_t *key = (wchar_t *)k;
-	wchar_t *val = (wchar_t *)v;
-	
 	char *ks = wcs2str( key );
 	char *vs = wcs2str( val );
+	char *res;
+	char *pos;
+	size_t kl, vl;
 	
-	char *pos = vs;
-
-	buffer_t *out = (buffer_t *)aux;
-
 	if( !ks || !vs )
 	{
 		die_mem();
@@ -914,34 +1117,94 @@ static void export_func2( const void *k, const void *v, void *aux )
 	/*
 	  Make arrays into colon-separated lists
 	*/
-	while( *pos )
+	for( pos=vs; *pos; pos++ )
 	{
 		if( *pos == ARRAY_SEP )
 			*pos = ':';			
-		pos++;
 	}
-	int nil = 0;
+
+	kl = strlen( ks );
+	vl = strlen( vs );
 	
-	b_append( out, ks, strlen(ks) );
-	b_append( out, "=", 1 );
-	b_append( out, vs, strlen(vs) );
-	b_append( out, &nil, 1 );
+	res = malloc( kl + vl + 2 );
+	if( !res )
+	{
+		die_mem();
+	}
+	memcpy( res, ks, kl );
+	res[kl]='=';
+	memcpy( res+kl+1, vs, vl+1 );
 
 	free( ks );
 	free( vs );
+	return res;
+}
+
+/**
+   Function used by env_export_arr to iterate over hashtable of
+   variables. Makes sure the cached encoding of the variable is up
+   to date and adds it to export_arr.
+*/
+static void export_func2( const void *k, const void *v, void *aux )
+{
+	const wchar_t *key = (const wchar_t *)k;
+	const wchar_t *val = (const wchar_t *)v;
+	int *pos = (int *)aux;
+	export_entry_t *e = (export_entry_t *)hash_get( &export_cache, key );
+
+	if( !e )
+	{
+		e = malloc( sizeof( export_entry_t ) );
+		if( !e )
+		{
+			die_mem();
+		}
+		e->val = 0;
+		e->str = 0;
+		hash_put( &export_cache, wcsdup( key ), e );
+	}
+
+	if( !e->val || wcscmp( e->val, val ) )
+	{
+		free( e->val );
+		free( e->str );
+		e->val = wcsdup( val );
+		e->str = export_encode( key, val );
+		if( !e->val )
+		{
+			die_mem();
+		}
+		debug( 3, L"%s", e->str );
+	}
+	
+	e->generation = export_generation;
+	export_arr[(*pos)++] = e->str;
+}
+
+/**
+   Function used by env_export_arr to find the entries of
+   export_cache that were not part of the last export_arr
+*/
+static void export_find_stale( const void *k, const void *v, void *aux )
+{
+	export_entry_t *e = (export_entry_t *)v;
+	if( e->generation != export_generation )
+		al_push( (array_list_t *)aux, k );
 }
 
 char **env_export_arr( int recalc)
 {
-	if( recalc && !proc_had_barrier)
-		env_universal_barrier();
+	if( recalc )
+	{
+		universal_poll();
+		env_universal_sync();
+	}
 
 	if( has_changed )
 	{
 		array_list_t uni;
 		hash_table_t vals;
 		env_node_t *n=top;
-		int prev_was_null=1;
 		int pos=0;		
 		int i;
 
@@ -970,24 +1233,32 @@ char **env_export_arr( int recalc)
 		}
 		al_destroy( &uni );
 
-		export_buffer.used=0;
-		
-		hash_foreach2( &vals, &export_func2, &export_buffer );
-		hash_destroy( &vals );
-		
 		export_arr = realloc( export_arr,
 							  sizeof(char *)*(hash_get_count( &vals) + 1) );
-		
-		for( i=0; i<export_buffer.used; i++ )
+		if( !export_arr )
 		{
-			if( prev_was_null )
-			{
-				export_arr[pos++]= &export_buffer.buff[i];
-				debug( 3, L"%s", &export_buffer.buff[i]);
-			}
-			prev_was_null = (export_buffer.buff[i]==0);
+			die_mem();
 		}
+
+		export_generation++;
+		hash_foreach2( &vals, &export_func2, &pos );
 		export_arr[pos]=0;
+		hash_destroy( &vals );
+
+		/*
+		  Drop the encodings of variables that are no longer exported
+		*/
+		al_init( &uni );
+		hash_foreach2( &export_cache, &export_find_stale, &uni );
+		for( i=0; i<al_get_count( &uni ); i++ )
+		{
+			const void *key = al_get( &uni, i );
+			const void *e = hash_get( &export_cache, key );
+			hash_remove( &export_cache, key, 0, 0 );
+			export_entry_free( key, e );
+		}
+		al_destroy( &uni );
+
 		has_changed=0;
 
 	}
@@ -54,6 +54,31 @@ static void (*external_callback)( int type, const wchar_t *name, const wchar_t *
 */
 static int barrier_reply = 0;
 
+/**
+   A write to a universal variable made by this process, that fishd
+   has not yet echoed back
+*/
+typedef struct
+{
+	/** The type of the write, one of SET, SET_EXPORT or ERASE */
+	int type;
+	/** The new value, or 0 for ERASE */
+	wchar_t *val;
+}
+pending_write_t;
+
+/**
+   The writes made by this process that fishd has not yet echoed
+   back. Maps variable names to queues of pending_write_t, oldest
+   first.
+*/
+static hash_table_t pending_writes;
+
+/**
+   The total number of pending writes
+*/
+static int pending_count = 0;
+
 void env_universal_barrier();
 
 
@@ -146,6 +171,127 @@ static int get_socket( int fork_ok )
 	return s;
 }
 
+/**
+   Free a pending write
+*/
+static void pending_free( pending_write_t *w )
+{
+	free( w->val );
+	free( w );
+}
+
+/**
+   Free all pending writes of a variable. Used as a hash_foreach
+   callback.
+*/
+static void pending_free_queue( const void *key, const void *data )
+{
+	dyn_queue_t *q = (dyn_queue_t *)data;
+	while( !q_empty( q ) )
+	{
+		pending_free( (pending_write_t *)q_get( q ) );
+	}
+	q_destroy( q );
+	free( q );
+	free( (void *)key );
+}
+
+/**
+   Forget all pending writes. Used when the connection to fishd is
+   lost, since writes sent to it may never be echoed.
+*/
+static void pending_clear()
+{
+	hash_foreach( &pending_writes, &pending_free_queue );
+	hash_destroy( &pending_writes );
+	hash_init( &pending_writes, &hash_wcs_func, &hash_wcs_cmp );
+	pending_count = 0;
+}
+
+/**
+   Remember a write made by this process, so that messages from
+   fishd that were sent before it can be told apart from its echo
+*/
+static void pending_add( int type, const wchar_t *name, const wchar_t *val )
+{
+	dyn_queue_t *q = (dyn_queue_t *)hash_get( &pending_writes, name );
+	pending_write_t *w = malloc( sizeof( pending_write_t ) );
+
+	if( !w )
+		die_mem();
+	
+	w->type = type;
+	w->val = val?wcsdup( val ):0;
+	
+	if( !q )
+	{
+		q = malloc( sizeof( dyn_queue_t ) );
+		if( !q )
+			die_mem();
+		q_init( q );
+		hash_put( &pending_writes, wcsdup( name ), q );
+	}
+	
+	q_put( q, w );
+	pending_count++;
+}
+
+/**
+   Decide whether a message from fishd should be applied to the local
+   copy of the universal variables.
+
+   Writes made by this process are applied locally right away, and
+   fishd echoes every write back to every client in the order it
+   processed them. While a variable has pending writes, any message
+   about it either is the echo of a pending write, or was processed
+   by fishd before the newest one and is about to be overwritten by
+   it. Either way it is not applied, so that the local value never
+   goes back in time. Once all echoes have arrived, messages are
+   applied as usual.
+*/
+static int pending_filter( int type, const wchar_t *name, const wchar_t *val )
+{
+	dyn_queue_t *q = (dyn_queue_t *)hash_get( &pending_writes, name );
+	int i, count;
+	
+	if( !q )
+		return 1;
+
+	count = q_get_count( q );
+	for( i=0; i<count; i++ )
+	{
+		pending_write_t *w = (pending_write_t *)q_peek_pos( q, i );
+		if( ( w->type == type ) &&
+			( w->val ? ( val && wcscmp( w->val, val ) == 0 ) : !val ) )
+			break;
+	}
+	
+	if( i < count )
+	{
+		/*
+		  fishd may merge several writes to the same variable into
+		  one message, so the echo of a write also acknowledges all
+		  pending writes made before it
+		*/
+		for( ; i>=0; i-- )
+		{
+			pending_free( (pending_write_t *)q_get( q ) );
+			pending_count--;
+		}
+		
+		if( q_empty( q ) )
+		{
+			void *key;
+			hash_remove( &pending_writes, name, (const void **)&key, 0 );
+			q_destroy( q );
+			free( q );
+			free( key );
+		}
+	}
+	
+	return 0;
+}
+
 /**
    Callback function used whenever a new fishd message is recieved
 */
@@ -178,11 +324,25 @@ static void check_connection()
 		close( env_universal_server.fd );
 		env_universal_server.fd = -1;
 		env_universal_server.killme=0;
-		sb_clear( &env_universal_server.input );	
+		connection_reset( &env_universal_server );
 		env_universal_read_all();
 	}	
 }
 
+/**
+   Send a message to fishd without waiting for it to be sent
+*/
+static void send_message( message_t *msg )
+{
+	msg->count=1;
+	q_put( &env_universal_server.unsent, msg );
+	if( env_universal_server.fd != -1 )
+	{
+		try_send_all( &env_universal_server );
+		check_connection();
+	}
+}
+
 /**
    Try to establish a new connection to fishd. If successfull, end
    with call to env_universal_barrier(), to make sure everything is in
@@ -198,6 +358,7 @@ static void reconnect()
 	init = 0;
 	env_universal_server.fd = get_socket(1);
 	init = 1;
+	pending_clear();
 	if( env_universal_server.fd >= 0 )
 	{
 		env_universal_barrier();
@@ -216,13 +377,11 @@ void env_universal_init( wchar_t * p,
 	start_fishd=sf;	
 	external_callback = cb;
 	
-	env_universal_server.fd = -1;
-	env_universal_server.killme = 0;
+	connection_init( &env_universal_server, -1 );
 	env_universal_server.fd = get_socket(1);
-	memset (&env_universal_server.wstate, '\0', sizeof (mbstate_t));
-	q_init( &env_universal_server.unsent );
+	hash_init( &pending_writes, &hash_wcs_func, &hash_wcs_cmp );
 	env_universal_common_init( &callback );
-	sb_init( &env_universal_server.input );	
+	env_universal_common_set_filter( &pending_filter );
 	env_universal_read_all();	
 	init = 1;	
 	if( env_universal_server.fd >= 0 )
@@ -234,6 +393,12 @@ void env_universal_init( wchar_t * p,
 
 void env_universal_destroy()
 {
+	/*
+	  Make sure fishd has seen all our writes, so that they are
+	  saved even if we are the last client to disconnect
+	*/
+	env_universal_sync();
+
 	/*
 	  Go into blocking mode and send all data before exiting
 	*/
@@ -247,12 +412,25 @@ void env_universal_destroy()
 	}
 	close( env_universal_server.fd );
 	env_universal_server.fd =-1;
-	q_destroy( &env_universal_server.unsent );
-	sb_destroy( &env_universal_server.input );	
+	connection_destroy( &env_universal_server );
+	hash_foreach( &pending_writes, &pending_free_queue );
+	hash_destroy( &pending_writes );
+	pending_count = 0;
 	env_universal_common_destroy();
 	init = 0;
 }
 
+void env_universal_detach()
+{
+	if( env_universal_server.fd >= 0 )
+		close( env_universal_server.fd );
+	env_universal_server.fd = -1;
+	/*
+	  Don't try to get a connection of our own
+	*/
+	get_socket_count = RECONNECT_COUNT;
+}
+
 
 /**
    Read all available messages from the server.
@@ -293,6 +471,23 @@ wchar_t *env_universal_get( const wchar_t *name )
 	return env_universal_common_get( name );
 }
 
+void env_universal_poll()
+{
+	if( !init || ( env_universal_server.fd == -1 ))
+		return;
+	
+	if( !q_empty( &env_universal_server.unsent ) )
+		try_send_all( &env_universal_server );	
+	read_message( &env_universal_server );
+	check_connection();
+}
+
+void env_universal_sync()
+{
+	if( pending_count )
+		env_universal_barrier();
+}
+
 int env_universal_get_export( const wchar_t *name )
 {
 	return env_universal_common_get_export( name );
@@ -376,10 +571,17 @@ void env_universal_set( const wchar_t *name, const wchar_t *value, int export )
 		debug( 1, L"Could not create universal variable message" );
 		return;
 	}
+
+	/*
+	  Apply the write locally right away instead of waiting for fishd
+	  to echo it back
+	*/
+	pending_add( export?SET_EXPORT:SET, name, value?value:L"" );
+	env_universal_common_set( name, value?value:L"", export );
+	send_message( msg );
 	
-	msg->count=1;
-	q_put( &env_universal_server.unsent, msg );
-	env_universal_barrier();
+	if( external_callback )
+		external_callback( export?SET_EXPORT:SET, name, value?value:L"" );
 }
 
 void env_universal_remove( const wchar_t *name )
@@ -393,9 +595,15 @@ void env_universal_remove( const wchar_t *name )
 		   name );
 
 	msg= create_message( ERASE, name, 0);
-	msg->count=1;
-	q_put( &env_universal_server.unsent, msg );
-	env_universal_barrier();
+	if( !msg )
+		return;
+
+	pending_add( ERASE, name, 0 );
+	env_universal_common_remove( name );
+	send_message( msg );
+
+	if( external_callback )
+		external_callback( ERASE, name, 0 );
 }
 
 void env_universal_get_names( array_list_t *l,
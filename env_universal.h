@@ -23,6 +23,14 @@ void env_universal_init();
 */
 void env_universal_destroy();
 
+/**
+   Stop using the connection to fishd without telling fishd about
+   it. This is used by forked copies of the shell, which share the
+   connection with their parent. Universal variables can still be
+   read, but no new values are received.
+*/
+void env_universal_detach();
+
 /**
    Get the value of a universal variable
 */
@@ -35,7 +43,9 @@ wchar_t *env_universal_get( const wchar_t *name );
 int env_universal_get_export( const wchar_t *name );
 
 /**
-   Set the value of a universal variable
+   Set the value of a universal variable. The local copy is updated
+   right away, and the change is sent to fishd without waiting for a
+   reply.
 */
 void env_universal_set( const wchar_t *name, const wchar_t *val, int export );
 /**
@@ -60,8 +70,24 @@ void env_universal_get_names( array_list_t *l,
 							  int show_unexported );
 
 /**
-   Synchronize with fishd
+   Synchronize with fishd. Blocks until fishd has processed all
+   messages sent by this process, and all messages it sent before
+   that have been read.
 */
 void env_universal_barrier();
 
+/**
+   Read any messages fishd has already sent, and send any queued
+   messages that fit in the socket buffer. Never blocks.
+*/
+void env_universal_poll();
+
+/**
+   Synchronize with fishd if it has not yet echoed back all writes
+   made by this process, so that other processes can see them. Since
+   writes are applied to the local copy right away, reads never need
+   to do this.
+*/
+void env_universal_sync();
+
 #endif
@@ -8,11 +8,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <wchar.h>
+#include <string.h>
 #include <strings.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <pwd.h>
 #include <errno.h>
 #include <sys/stat.h>
@@ -55,6 +57,11 @@
 */
 #define BARRIER_REPLY_MBS "BARRIER_REPLY"
 
+/**
+   Maximum number of messages to write using a single system call
+*/
+#define SEND_COUNT 64
+
 /**
    Error message
 */
@@ -85,6 +92,14 @@ void (*callback)( int type,
 				  const wchar_t *key, 
 				  const wchar_t *val );
 
+/**
+   Function deciding whether a SET or ERASE message should be applied
+   to the table of universal variables, or 0 to apply all messages
+*/
+static int (*filter)( int type, 
+					  const wchar_t *key, 
+					  const wchar_t *val );
+
 
 /**
    Variable used by env_get_names to communicate auxiliary information
@@ -113,6 +128,11 @@ static void erase( const void *key,
 }
 
 
+void env_universal_common_set_filter( int (*f)( int type, const wchar_t *key, const wchar_t *val ) )
+{
+	filter = f;
+}
+
 void env_universal_common_destroy()
 {
 	hash_foreach( &env_universal_var, &erase );
@@ -120,38 +140,83 @@ void env_universal_common_destroy()
 }
 
 
+void connection_init( connection_t *c, int fd )
+{
+	c->fd = fd;
+	c->killme = 0;
+	c->next = 0;
+	q_init( &c->unsent );
+	sb_init( &c->input );
+	connection_reset( c );
+}
+
+void connection_reset( connection_t *c )
+{
+	c->sent = 0;
+	c->read_buff_used = c->read_buff_pos = 0;
+	sb_clear( &c->input );
+	memset( &c->wstate, '\0', sizeof( mbstate_t ) );
+}
+
+void connection_destroy( connection_t *c )
+{
+	while( !q_empty( &c->unsent ) )
+	{
+		message_t *msg = (message_t *)q_get( &c->unsent );
+		msg->count--;
+		if( !msg->count )
+			free( msg );
+	}
+	q_destroy( &c->unsent );
+	sb_destroy( &c->input );
+}
+
 void read_message( connection_t *src )
 {
 	while( 1 )
 	{
 		char b;		
-		int read_res = read( src->fd, &b, 1 );
 		wchar_t res=0;
-		
-		if( read_res < 0 )
+
+		/*
+		  The read position is kept in the connection rather than in
+		  a local variable, since the callback function could
+		  potentially call read_message, and must then continue
+		  where we are.
+		*/
+		if( src->read_buff_pos == src->read_buff_used )
 		{
-			if( errno != EAGAIN && 
-				errno != EINTR )
+			int read_res = read( src->fd, src->read_buff, ENV_UNIVERSAL_BUFFER_SIZE );
+		
+			if( read_res < 0 )
 			{
-				debug( 2, L"Read error on fd %d, set killme flag", src->fd );
-				wperror( L"read" );
-				src->killme = 1;
+				if( errno != EAGAIN && 
+					errno != EINTR )
+				{
+					debug( 2, L"Read error on fd %d, set killme flag", src->fd );
+					wperror( L"read" );
+					src->killme = 1;
+				}
+				return;
 			}
-			return;
-		}
-		if( read_res == 0 )
-		{
-			src->killme = 1;
-			debug( 3, L"Fd %d has reached eof, set killme flag", src->fd );
-			if( src->input.used > 0 )
+			if( read_res == 0 )
 			{
-				debug( 1, 
-				       L"Universal variable connection closed while reading command. Partial command recieved: '%ls'", 
-				       (wchar_t *)src->input.buff  );
+				src->killme = 1;
+				debug( 3, L"Fd %d has reached eof, set killme flag", src->fd );
+				if( src->input.used > 0 )
+				{
+					debug( 1, 
+						   L"Universal variable connection closed while reading command. Partial command recieved: '%ls'", 
+						   (wchar_t *)src->input.buff  );
+				}
+				return;
 			}
-			return;
+			src->read_buff_pos = 0;
+			src->read_buff_used = read_res;
 		}
 		
+		b = src->read_buff[src->read_buff_pos++];
+		
 		int sz = mbrtowc( &res, &b, 1, &src->wstate );
 		
 		if( sz == -1 )
@@ -186,7 +251,7 @@ void read_message( connection_t *src )
 	}
 }
 
-static void remove_entry( wchar_t *name )
+static void remove_entry( const wchar_t *name )
 {
 	void *k, *v;
 	hash_remove( &env_universal_var, 
@@ -197,6 +262,27 @@ static void remove_entry( wchar_t *name )
 	free( v );
 }
 
+void env_universal_common_set( const wchar_t *key, const wchar_t *val, int export )
+{
+	var_entry_t *entry = 
+		malloc( sizeof(var_entry_t) + sizeof(wchar_t)*(wcslen(val)+1) );			
+	wchar_t *name = wcsdup( key );
+	
+	if( !entry || !name )
+		die_mem();
+
+	entry->export=export;
+	wcscpy( entry->val, val );
+	
+	remove_entry( name );
+	hash_put( &env_universal_var, name, entry );
+}
+
+void env_universal_common_remove( const wchar_t *key )
+{
+	remove_entry( key );
+}
+
 static int match( const wchar_t *msg, const wchar_t *cmd )
 {
 	size_t len = wcslen( cmd );
@@ -239,21 +325,16 @@ static void parse_message( wchar_t *msg,
 
 			val = unescape( val, 0 );
 			
-			var_entry_t *entry = 
-				malloc( sizeof(var_entry_t) + sizeof(wchar_t)*(wcslen(val)+1) );			
-			if( !entry )
-				die_mem();
-			entry->export=export;
-			
-			wcscpy( entry->val, val );
-			remove_entry( key );
-			
-			hash_put( &env_universal_var, key, entry );
-			
-			if( callback )
+			if( !filter || filter( export?SET_EXPORT:SET, key, val ) )
 			{
-				callback( export?SET_EXPORT:SET, key, val );
+				env_universal_common_set( key, val, export );
+			
+				if( callback )
+				{
+					callback( export?SET_EXPORT:SET, key, val );
+				}
 			}
+			free( key );
 			free(val );
 		}
 		else
@@ -280,15 +361,27 @@ static void parse_message( wchar_t *msg,
 			debug( 1, PARSE_ERR, msg );
 		}
 
-		remove_entry( name );
-		
-		if( callback )
+		if( !filter || filter( ERASE, name, 0 ) )
 		{
-			callback( ERASE, name, 0 );
+			remove_entry( name );
+		
+			if( callback )
+			{
+				callback( ERASE, name, 0 );
+			}
 		}
 	}
 	else if( match( msg, BARRIER_STR) )
 	{
+		/*
+		  Tell the callback about the barrier, so that fishd can send
+		  any updates it is holding back before the reply
+		*/
+		if( callback )
+		{
+			callback( BARRIER, 0, 0 );
+		}
+		
 		message_t *msg = create_message( BARRIER_REPLY, 0, 0 );
 		msg->count = 1;
 		q_put( &src->unsent, msg );
@@ -307,40 +400,6 @@ static void parse_message( wchar_t *msg,
 	}		
 }
 
-int try_send( message_t *msg,
-			  int fd )
-{
-
-	debug( 3,
-		   L"before write of %d chars to fd %d", strlen(msg->body), fd );	
-
-	int res = write( fd, msg->body, strlen(msg->body) );
-		
-	if( res == -1 )
-	{
-		switch( errno )
-		{
-			case EAGAIN:
-				return 0;
-				
-			default:
-				debug( 1,
-					   L"Error while sending universal variable message to fd %d. Closing connection",
-					   fd );
-				wperror( L"write" );
-				
-				return -1;
-		}		
-	}
-	msg->count--;
-	
-	if( !msg->count )
-	{
-		free( msg );
-	}
-	return 1;
-}
-
 void try_send_all( connection_t *c )
 {
 	debug( 3,
@@ -348,20 +407,65 @@ void try_send_all( connection_t *c )
 		   c->fd );
 	while( !q_empty( &c->unsent) )
 	{
-		switch( try_send( (message_t *)q_peek( &c->unsent), c->fd ) )
+		struct iovec vec[SEND_COUNT];
+		int count = mini( q_get_count( &c->unsent ), SEND_COUNT );
+		int i;
+		ssize_t res;
+		
+		for( i=0; i<count; i++ )
 		{
-			case 1:
-				q_get( &c->unsent);
-				break;
+			message_t *msg = (message_t *)q_peek_pos( &c->unsent, i );
+			int skip = i?0:c->sent;
+			vec[i].iov_base = msg->body + skip;
+			vec[i].iov_len = strlen( msg->body ) - skip;
+		}
+		
+		res = writev( c->fd, vec, count );
+
+		if( res == -1 )
+		{
+			switch( errno )
+			{
+				case EINTR:
+					continue;
+					
+				case EAGAIN:
+					debug( 2,
+						   L"Socket full, send rest later" );	
+					return;
 				
-			case 0:
-				debug( 1,
-					   L"Socket full, send rest later" );	
-				return;
-								
-			case -1:
-				c->killme = 1;
-				return;
+				default:
+					debug( 1,
+						   L"Error while sending universal variable message to fd %d. Closing connection",
+						   c->fd );
+					wperror( L"write" );
+					c->killme = 1;
+					return;
+			}
+		}
+
+		/*
+		  Remove the messages that have been written completely, and
+		  remember how much of the last one was written
+		*/
+		for( i=0; i<count; i++ )
+		{
+			message_t *msg;
+			
+			if( (size_t)res < vec[i].iov_len )
+			{
+				c->sent += res;
+				break;
+			}
+			res -= vec[i].iov_len;
+			c->sent = 0;
+			
+			msg = (message_t *)q_get( &c->unsent );
+			msg->count--;
+			if( !msg->count )
+			{
+				free( msg );
+			}
 		}
 	}
 }
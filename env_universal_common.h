@@ -36,6 +36,11 @@
 */
 #define SOCK_FILENAME "fishd.socket."
 
+/**
+   Size of the buffer used for reading from a connection
+*/
+#define ENV_UNIVERSAL_BUFFER_SIZE 1024
+
 /**
    The different types of commands that can be sent between client/server
 */
@@ -62,6 +67,11 @@ typedef struct connection
 	   Queue of onsent messages
 	*/
 	dyn_queue_t unsent;
+	/**
+	   Number of bytes of the first message in the unsent queue that
+	   have already been written
+	*/
+	int sent;
 	/**
 	   Set to one when this connection should be killed
 	*/
@@ -75,6 +85,19 @@ typedef struct connection
 	   newline is encountered, the buffer is parsed and cleared.
 	*/
 	string_buffer_t input;
+
+	/**
+	   Data read from the socket that has not been decoded yet
+	*/
+	char read_buff[ENV_UNIVERSAL_BUFFER_SIZE];
+	/**
+	   Number of bytes in read_buff
+	*/
+	int read_buff_used;
+	/**
+	   Position of the next byte to decode in read_buff
+	*/
+	int read_buff_pos;
 	
 	/**
 	   Link to the next connection
@@ -93,13 +116,32 @@ typedef struct
 }
 	message_t;
 
+/**
+   Initialize a connection on the specified file descriptor
+*/
+void connection_init( connection_t *c, int fd );
+
+/**
+   Free the memory used by a connection, including any messages that
+   have not been sent. Does not close the file descriptor.
+*/
+void connection_destroy( connection_t *c );
+
+/**
+   Forget about any partially read or written messages, e.g. because
+   the connection has been lost and a new one is being established
+*/
+void connection_reset( connection_t *c );
+
 /**
    Read all available messages on this connection
 */
 void read_message( connection_t * );
 
 /**
-   Send as many messages as possible without blocking to the connection
+   Send as many messages as possible without blocking to the
+   connection. Several messages are written using a single system
+   call.
 */
 void try_send_all( connection_t *c );
 
@@ -118,6 +160,26 @@ void env_universal_common_init(void (*cb)(int type, const wchar_t *key, const wc
 */
 void env_universal_common_destroy();
 
+/**
+   Set a function that decides whether a SET or ERASE message that
+   was received should be applied. The function is called with the
+   type, name and value of the message, and should return 0 if the
+   message should be ignored.
+*/
+void env_universal_common_set_filter( int (*f)( int type, const wchar_t *key, const wchar_t *val ) );
+
+/**
+   Set the value of a universal variable in the local table, without
+   sending any messages
+*/
+void env_universal_common_set( const wchar_t *key, const wchar_t *val, int export );
+
+/**
+   Erase a universal variable from the local table, without sending
+   any messages
+*/
+void env_universal_common_remove( const wchar_t *key );
+
 /**
    Add all variable names to the specified list
 */
@@ -58,6 +58,11 @@ pid_t getpgid( pid_t pid );
 */
 #define FORK_ERROR L"Could not create child process - exiting"
 
+/**
+   Number of bytes to read at a time from a streamed command substitution
+*/
+#define READ_CHUNK 4096
+
 
 /**
    List of all pipes used by internal pipes. These must be closed in
@@ -527,11 +532,13 @@ static void io_untransmogrify( io_data_t * in, io_data_t *out )
    passing to eval, call eval, and clean up morphed redirections.
 
    \param def the code to evaluate
+   \param tokens pre-lexed tokens of def, or 0 if def should be tokenized
    \param block_type the type of block to push on evaluation
    \param io the io redirections to be performed on this block
 */
 
 static int internal_exec_helper( const wchar_t *def, 
+								 tok_cache_t *tokens,
 								 int block_type,
 								 io_data_t *io )
 {
@@ -542,7 +549,10 @@ static int internal_exec_helper( const wchar_t *def,
 
 	signal_unblock();
 	
-	eval( def, io_internal, block_type );		
+	if( tokens )
+		eval_cached( tokens, io_internal, block_type );
+	else
+		eval( def, io_internal, block_type );		
 
 	signal_block();
 
@@ -794,7 +804,10 @@ void exec( job_t *j )
 					j->io = io_add( j->io, io_buffer );
 				}
 				
-				internal_exec_helper( def, TOP, j->io );
+				internal_exec_helper( def, 
+									  function_get_tokens( p->argv[0] ), 
+									  TOP, 
+									  j->io );
 				
 				parser_allow_function();
 				parser_pop_block();
@@ -811,7 +824,7 @@ void exec( job_t *j )
 					j->io = io_add( j->io, io_buffer );
 				}
 				
-				internal_exec_helper( p->argv[0], TOP, j->io );			
+				internal_exec_helper( p->argv[0], 0, TOP, j->io );			
 				break;
 				
 			}
@@ -1220,42 +1233,166 @@ int exec_subshell( const wchar_t *cmd,
 	
 	is_subshell = prev_subshell;
 	
-	b_append( io_buffer->param2.out_buffer, &z, 1 );
-	
-	begin=end=io_buffer->param2.out_buffer->buff;	
-	
 	if( l )
 	{
-		while( 1 )
+		buffer_t *b = io_buffer->param2.out_buffer;
+		char *stop;
+		
+		b_append( b, &z, 1 );
+		begin = b->buff;
+		stop = b->buff + b->used - 1;
+		
+		/*
+		  Split the output into lines using memchr, which is much
+		  faster than looking at one character at a time
+		*/
+		while( begin < stop )
 		{
-			switch( *end )
-			{
-				case 0:
-				
-					if( begin != end )
-					{
-						wchar_t *el = str2wcs( begin );
-						if( el )
-							al_push( l, el );
-					}				
-					io_buffer_destroy( io_buffer );
-				
-					return status;
-				
-				case '\n':
-				{
-					wchar_t *el;
-					*end=0;
-					el = str2wcs( begin );				
-					al_push( l, el );
-					begin = end+1;
-					break;
-				}
-			}
-			end++;
+			wchar_t *el;
+			
+			end = memchr( begin, '\n', stop-begin );
+			if( !end )
+				end = stop;
+			*end = 0;
+			
+			el = str2wcs( begin );
+			if( el )
+				al_push( l, el );
+			begin = end+1;
 		}
 	}
 	
 	io_buffer_destroy( io_buffer );
 	return status;	
 }
+
+subshell_stream_t *exec_subshell_stream( const wchar_t *cmd )
+{
+	subshell_stream_t *s;
+	int fd[2];
+	pid_t pid;
+
+	if( exec_pipe( fd ) == -1 )
+		return 0;
+
+	/*
+	  Make sure output buffered by this process isn't written twice
+	*/
+	fflush( stdout );
+	
+	pid = fork();
+	if( pid == -1 )
+	{
+		wperror( L"fork" );
+		exec_close( fd[0] );
+		exec_close( fd[1] );
+		return 0;
+	}
+	
+	if( pid == 0 )
+	{
+		/*
+		  This is the child process. Run the command with the write
+		  end of the pipe as stdout, and exit when done. The
+		  connection to fishd belongs to the parent.
+		*/
+		env_universal_detach();
+		exec_close( fd[0] );
+		if( dup2( fd[1], 1 ) == -1 )
+		{
+			wperror( L"dup2" );
+			exit(1);
+		}
+		exec_close( fd[1] );
+		
+		is_subshell=1;
+		eval( cmd, 0, SUBST );
+		exit( proc_get_last_status() );
+	}
+	
+	exec_close( fd[1] );
+	
+	s = malloc( sizeof( subshell_stream_t ) );
+	if( !s )
+		die_mem();
+	s->fd = fd[0];
+	b_init( &s->buff );
+	s->pos = 0;
+	return s;
+}
+
+wchar_t *exec_subshell_stream_next( subshell_stream_t *s )
+{
+	buffer_t *b = &s->buff;
+	
+	while( 1 )
+	{
+		char *begin = b->buff + s->pos;
+		size_t len = b->used - s->pos;
+		char *end = len?memchr( begin, '\n', len ):0;
+		wchar_t *el;
+		int l;
+		
+		if( end || ( s->fd == -1 && len ) )
+		{
+			/*
+			  A whole line, or the last line if it isn't terminated
+			  by a newline. Lines that can't be converted are
+			  skipped, just like exec_subshell does.
+			*/
+			if( end )
+			{
+				s->pos += end-begin+1;
+			}
+			else
+			{
+				end = b->buff + b->used;
+				s->pos = b->used;
+			}
+			*end = 0;
+			el = str2wcs( begin );
+			if( el )
+				return el;
+			continue;
+		}
+		
+		if( s->fd == -1 )
+			return 0;
+		
+		/*
+		  Drop the lines that have already been returned, so that
+		  the buffer only ever needs to hold a single line
+		*/
+		if( s->pos )
+		{
+			memmove( b->buff, begin, len );
+			b->used = len;
+			s->pos = 0;
+		}
+		
+		/*
+		  Reserve room for the null that terminates the last line
+		*/
+		b_reserve( b, READ_CHUNK+1 );
+		l = read_blocked( s->fd, b->buff + b->used, READ_CHUNK );
+		if( l > 0 )
+		{
+			b->used += l;
+		}
+		else if( l == 0 || errno != EINTR )
+		{
+			if( l == -1 )
+				wperror( L"read" );
+			exec_close( s->fd );
+			s->fd = -1;
+		}
+	}
+}
+
+void exec_subshell_stream_destroy( subshell_stream_t *s )
+{
+	if( s->fd != -1 )
+		exec_close( s->fd );
+	b_destroy( &s->buff );
+	free( s );
+}
@@ -62,6 +62,47 @@ void exec( job_t *j );
 int exec_subshell( const wchar_t *cmd, 
 				   array_list_t *l );
 
+/**
+   A command substitution whose output is read one line at a time,
+   while the command is still running in a separate process.
+*/
+typedef struct subshell_stream
+{
+	/** The read end of the pipe the command writes to, or -1 after end of file */
+	int fd;
+	/** Output that has been read but not yet returned */
+	buffer_t buff;
+	/** Offset of the first byte in buff that has not been returned */
+	size_t pos;
+}
+	subshell_stream_t;
+
+/**
+   Start evaluating the expression cmd in a forked copy of the
+   shell. Changes the command makes to the shell state, such as
+   setting variables, are not seen by this shell, so this should only
+   be used for commands that don't make any.
+
+   \return the new stream, or 0 if the command could not be started
+*/
+subshell_stream_t *exec_subshell_stream( const wchar_t *cmd );
+
+/**
+   Read the next line of output from a command started by \c
+   exec_subshell_stream, waiting for it to be written if
+   necessary. Only one line of output is kept in memory at any time.
+
+   \return the next line, which should be freed by the caller, or 0 if there is no more output
+*/
+wchar_t *exec_subshell_stream_next( subshell_stream_t *s );
+
+/**
+   Stop reading from the specified stream and free it. If the command
+   is still running, it will get a SIGPIPE the next time it writes
+   output.
+*/
+void exec_subshell_stream_destroy( subshell_stream_t *s );
+
 
 /**
    Loops over close until thesyscall was run without beeing
@@ -77,6 +77,29 @@ parameter expansion.
 */
 #define LAST_STR L"last"
 
+arena_t expand_arena;
+
+void expand_free( void *str )
+{
+	if( !arena_contains( &expand_arena, str ) )
+		free( str );
+}
+
+/**
+   Make sure the specified string was allocated using malloc, so that
+   it can be handed to the caller of expand_string
+*/
+static wchar_t *expand_keep( wchar_t *str )
+{
+	if( arena_contains( &expand_arena, str ) )
+	{
+		str = wcsdup( str );
+		if( !str )
+			die_mem();
+	}
+	return str;
+}
+
 /**
    Return the environment variable value for the string starting at in 
 */
@@ -596,7 +619,7 @@ static int expand_pid( wchar_t *in,
 		if( wcscmp( (in+1), SELF_STR )==0 )
 		{
 			wchar_t *str= malloc( sizeof(wchar_t)*32);
-			free(in);
+			expand_free( in );
 			swprintf( str, 32, L"%d", getpid() );
 			al_push( out, str );
 			
@@ -609,7 +632,7 @@ static int expand_pid( wchar_t *in,
 			if( proc_last_bg_pid > 0 )
 			{
 				str = malloc( sizeof(wchar_t)*32);
-				free(in);
+				expand_free( in );
 				swprintf( str, 32, L"%d", proc_last_bg_pid );
 				al_push( out, str );
 			}
@@ -628,7 +651,7 @@ static int expand_pid( wchar_t *in,
 //		fwprintf( stderr, L"no match\n" );
 		
 		if( flags & ACCEPT_INCOMPLETE )
-			free( in );
+			expand_free( in );
 		else
 		{
 			*in = L'%';
@@ -639,13 +662,34 @@ static int expand_pid( wchar_t *in,
 	else
 	{
 //		fwprintf( stderr, L"match\n" );
-		free( in );
+		expand_free( in );
 	}
 	
 	return 1;
 }
 
 
+/**
+   Like expand_variable_array, but the strings are allocated from
+   expand_arena
+*/
+static void expand_variable_array_tmp( const wchar_t *val, array_list_t *out )
+{
+	wchar_t *pos, *start;
+	
+	start = arena_wcsdup( &expand_arena, val );
+	for( pos=start; *pos; pos++ )
+	{
+		if( *pos == ARRAY_SEP )
+		{
+			*pos=0;
+			al_push( out, start );
+			start=pos+1;
+		}
+	}
+	al_push( out, start );
+}
+
 /**
    Expand all environment variables in the string *ptr. 
 */
@@ -696,140 +740,117 @@ static int expand_variables( wchar_t *in, array_list_t *out )
 			
 			var_len = stop_pos - start_pos;
 			
-			if( !(var_name = malloc( sizeof(wchar_t)*(var_len+1) )))
-			{
-				die_mem();
-			}
-			else
-			{
-				wcsncpy( var_name, &in[start_pos], var_len );
-				var_name[var_len]='\0';
+			var_name = arena_wcsndup( &expand_arena, &in[start_pos], var_len );
 /*			printf( "Variable name is %s, len is %d\n", var_name, var_len );*/
-				wchar_t *var_val_orig = expand_var( var_name );
-		
-				if( var_val_orig && (var_val = wcsdup( var_val_orig) ) )
-				{
-					int all_vars=1;
-					array_list_t idx;
-					al_init( &idx );
-					al_init( &l );
+			var_val = expand_var( var_name );
+	
+			if( var_val )
+			{
+				int all_vars=1;
+				array_list_t idx;
+				al_init( &idx );
+				al_init( &l );
+				
+				if( in[stop_pos] == L'[' )
+				{						
+					wchar_t *end;
 					
-					if( in[stop_pos] == L'[' )
-					{						
-						wchar_t *end;
+					all_vars = 0;
+	
+					stop_pos++;
+					while( 1 )
+					{
+						int tmp;
 						
-						all_vars = 0;
-		
-						stop_pos++;
-						while( 1 )
+						while( iswspace(in[stop_pos]) || (in[stop_pos]==INTERNAL_SEPARATOR))
+							stop_pos++;
+						
+						
+						if( in[stop_pos] == L']' )
 						{
-							int tmp;
-							
-							while( iswspace(in[stop_pos]) || (in[stop_pos]==INTERNAL_SEPARATOR))
-								stop_pos++;
-							
-							
-							if( in[stop_pos] == L']' )
-							{
-								stop_pos++;
-								break;
-							}
+							stop_pos++;
+							break;
+						}
 
-							errno=0;
-							tmp = wcstol( &in[stop_pos], &end, 10 );
-							if( ( errno ) || ( end == &in[stop_pos] ) )
-							{
-								error( SYNTAX_ERROR, 
-									   L"Expected integer or \']\'", 
-									   -1 );
-								is_ok = 0;
-								break;
-							}
-							al_push( &idx, (void *)tmp );
-							stop_pos = end-in;
+						errno=0;
+						tmp = wcstol( &in[stop_pos], &end, 10 );
+						if( ( errno ) || ( end == &in[stop_pos] ) )
+						{
+							error( SYNTAX_ERROR, 
+								   L"Expected integer or \']\'", 
+								   -1 );
+							is_ok = 0;
+							break;
 						}
+						al_push( &idx, (void *)tmp );
+						stop_pos = end-in;
 					}
-							
-					if( is_ok )
-					{				
-						expand_variable_array( var_val, &l );
-						if( !all_vars )
-						{	
-							int j;
-							for( j=0; j<al_get_count( &idx ); j++)
-							{
-								int tmp = (int)al_get( &idx, j );
-								if( tmp < 1 || tmp > al_get_count( &l ) )
-								{
-									error( SYNTAX_ERROR, L"Array index out of bounds", -1 );
-									is_ok=0;
-									al_truncate( &idx, j );
-									break;
-								}				
-								else
-								{
-									/* Move string from list l to list idx */
-									al_set( &idx, j, al_get( &l, tmp-1 ) );
-									al_set( &l, tmp-1, 0 );
-								}
-							}
-							/* Free remaining strings in list l and truncate it */
-							al_foreach( &l, (void (*)(const void *))&free );
-							al_truncate( &l, 0 );
-							/* Add items from list idx back to list l */							
-							al_push_all( &l, &idx );							
-						}
-						free( var_val );
-					}				
-
-					for( j=0; j<al_get_count( &l); j++ )
-					{
-						wchar_t *next = (wchar_t *)al_get( &l, j );
+				}
 						
-						if( is_ok )
+				if( is_ok )
+				{				
+					expand_variable_array_tmp( var_val, &l );
+					if( !all_vars )
+					{	
+						int j;
+						for( j=0; j<al_get_count( &idx ); j++)
 						{
-							
-							new_len = wcslen(in) - (stop_pos-start_pos+1) + wcslen( next) +2;
-							
-							if( !(new_in = malloc( sizeof(wchar_t)*new_len )))
+							int tmp = (int)al_get( &idx, j );
+							if( tmp < 1 || tmp > al_get_count( &l ) )
 							{
-								error( OOM, L"Out of memory", -1 );				
-								is_ok = 0;
-							}
+								error( SYNTAX_ERROR, L"Array index out of bounds", -1 );
+								is_ok=0;
+								al_truncate( &idx, j );
+								break;
+							}				
 							else
 							{
-								
-								wcsncpy( new_in, in, start_pos-1 );
-								
-								if(start_pos>1 && new_in[start_pos-2]!=VARIABLE_EXPAND)
-								{									
-									new_in[start_pos-1]=INTERNAL_SEPARATOR;
-									new_in[start_pos]=L'\0';
-								}
-								else
-									new_in[start_pos-1]=L'\0';
-								
-								wcscat( new_in, next );
-								wcscat( new_in, &in[stop_pos] );
-								
-//								fwprintf( stderr, L"New value %ls\n", new_in );
-								is_ok &= expand_variables( new_in, out );
+								/* Move string from list l to list idx */
+								al_set( &idx, j, al_get( &l, tmp-1 ) );
 							}
 						}
-						free( next );
-					}					
-					al_destroy( &l );
-					al_destroy( &idx );
-					free(in);
-					free(var_name );
-					return is_ok;					
-				}
-				else
+						/* Replace the strings in list l with the ones in list idx */
+						al_truncate( &l, 0 );
+						al_push_all( &l, &idx );							
+					}
+				}				
+
+				for( j=0; j<al_get_count( &l); j++ )
 				{
-					empty = 1;
-				}
-				
-				free(var_name );				
+					wchar_t *next = (wchar_t *)al_get( &l, j );
+					
+					if( is_ok )
+					{
+						
+						new_len = wcslen(in) - (stop_pos-start_pos+1) + wcslen( next) +2;
+						
+						new_in = arena_alloc( &expand_arena, sizeof(wchar_t)*new_len );
+						
+						wcsncpy( new_in, in, start_pos-1 );
+						
+						if(start_pos>1 && new_in[start_pos-2]!=VARIABLE_EXPAND)
+						{									
+							new_in[start_pos-1]=INTERNAL_SEPARATOR;
+							new_in[start_pos]=L'\0';
+						}
+						else
+							new_in[start_pos-1]=L'\0';
+						
+						wcscat( new_in, next );
+						wcscat( new_in, &in[stop_pos] );
+						
+//								fwprintf( stderr, L"New value %ls\n", new_in );
+						is_ok &= expand_variables( new_in, out );
+					}
+				}					
+				al_destroy( &l );
+				al_destroy( &idx );
+				expand_free( in );
+				return is_ok;					
+			}
+			else
+			{
+				empty = 1;
 			}
 		}
 		prev_char = c;		
@@ -841,7 +862,7 @@ static int expand_variables( wchar_t *in, array_list_t *out )
 	}
 	else
 	{
-		free( in );
+		expand_free( in );
 	}
 	
 	return is_ok;
@@ -953,7 +974,7 @@ static int expand_brackets( wchar_t *in, int flags, array_list_t *out )
 				wchar_t *whole_item;
 				int item_len = pos-item_begin;
 				
-				whole_item = malloc( sizeof(wchar_t)*(tot_len + item_len + 1) );
+				whole_item = arena_alloc( &expand_arena, sizeof(wchar_t)*(tot_len + item_len + 1) );
 				wcsncpy( whole_item, in, len1 );
 				wcsncpy( whole_item+len1, item_begin, item_len );	
 				wcscpy( whole_item+len1+item_len, bracket_end+1 );
@@ -976,7 +997,7 @@ static int expand_brackets( wchar_t *in, int flags, array_list_t *out )
 			bracket_count--;
 		}
 	}
-	free(in);	
+	expand_free( in );
 	return 1;	
 }
 
@@ -1141,7 +1162,7 @@ static int expand_subshell( wchar_t *in, array_list_t *out )
 		
         free( sub_item2 );
     }	
-	free(in);
+	expand_free( in );
 	
 	al_destroy( &sub_res );
 	
@@ -1236,7 +1257,7 @@ static int tilde_expand( wchar_t **ptr )
 		if( !tilde_error )
 		{
 			new_in = wcsdupcat( home, old_in ); 
-			free( in );
+			expand_free( in );
 			in = new_in;
 			free(home);
 			*ptr = in;
@@ -1302,9 +1323,12 @@ static void remove_internal_separator( const void *s, int conv )
 /**
    The real expansion function. All other expansion  functions are wrappers to this one.
 */
-int expand_string( wchar_t *str,
-				   array_list_t *end_out, 
-				   int flags )
+/**
+   Perform the actual expansion for expand_string
+*/
+static int expand_string_internal( wchar_t *str,
+								   array_list_t *end_out, 
+								   int flags )
 {
 	array_list_t list1, list2;
 	array_list_t *in, *out;
@@ -1353,15 +1377,17 @@ int expand_string( wchar_t *str,
 
 		for( i=0; i<al_get_count( in ); i++ )
 		{
-			wchar_t *next;
-
-			next = expand_unescape( (wchar_t *)al_get( in, i ), 
-									1);
-
-			free( (void *)al_get( in, i ) );
+			wchar_t *next = (wchar_t *)al_get( in, i );
 
-			if( !next )
-				continue;			
+			/*
+			  We own the string, so it can be unescaped in place
+			*/
+			if( !unescape_in_place( next, 1 ) )
+			{
+				error( SYNTAX_ERROR, L"Unexpected end of string", -1 );
+				expand_free( next );
+				continue;
+			}
 			
 			if( EXPAND_SKIP_VARIABLES & flags )
 			{
@@ -1417,7 +1443,7 @@ int expand_string( wchar_t *str,
 			{
 				if( *next == PROCESS_EXPAND )
 				{
-					expand_pid( next, flags, end_out );
+					expand_pid( expand_keep( next ), flags, end_out );
 					al_destroy( in );
 					al_destroy( out );
 					return 1;
@@ -1458,7 +1484,7 @@ int expand_string( wchar_t *str,
 				{
 					wc_res = wildcard_expand( next, L"", flags, out );
 				}
-				free( next );
+				expand_free( next );
 				switch( wc_res )
 				{
 					case 0:
@@ -1482,9 +1508,10 @@ int expand_string( wchar_t *str,
 			else
 			{
 				if( flags & ACCEPT_INCOMPLETE)
-					free( next );
+					expand_free( next );
 				else
-					al_push( end_out, next );
+					al_push( end_out, 
+							 (flags & EXPAND_TEMPORARY)?next:expand_keep( next ) );
 			}		
 		}
 		al_destroy( in );
@@ -1494,6 +1521,22 @@ int expand_string( wchar_t *str,
 	return 1;
 }
 
+int expand_string( wchar_t *str,
+				   array_list_t *end_out, 
+				   int flags )
+{
+	arena_mark_t mark;
+	int res;
+
+	if( flags & EXPAND_TEMPORARY )
+		return expand_string_internal( str, end_out, flags );
+	
+	arena_mark( &expand_arena, &mark );
+	res = expand_string_internal( str, end_out, flags );
+	arena_release( &expand_arena, &mark );
+	return res;
+}
+
 
 wchar_t *expand_one( wchar_t *string, int flags )
 {
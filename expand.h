@@ -51,6 +51,15 @@
 
 #define DIRECTORIES_ONLY 32
 
+/**
+   Leave the resulting strings in expand_arena when possible instead
+   of copying them. The caller must free them using expand_free, and
+   must not use them after releasing the arena past the point where
+   expand_string was called. The temporary strings used during
+   expansion are not released either.
+*/
+#define EXPAND_TEMPORARY 64
+
 /*
   Use unencoded private-use keycodes for internal characters
 */
@@ -108,6 +117,24 @@ enum
 */
 int expand_string( wchar_t *in, array_list_t *out, int flag );
 
+/**
+   Arena that expand_string allocates its temporary strings from. The
+   parser also uses it for copies of the arguments to expand, and
+   releases everything allocated from it while evaluating a job when
+   the job is done.
+
+   Strings allocated from this arena may be passed to expand_string
+   and expand_one just like strings allocated using malloc.
+*/
+extern arena_t expand_arena;
+
+/**
+   Free a string returned by expand_string, unless it was allocated
+   from expand_arena, in which case it is freed when the arena is
+   released.
+*/
+void expand_free( void *str );
+
 /**
    expand_one is identical to expand_string, except it will fail if in
    expands to more than one string. This is used for expanding command
@@ -25,6 +25,12 @@
 
 #include <locale.h>
 #include <dirent.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <utime.h>
 
 #include "util.h"
 #include "common.h"
@@ -38,6 +44,11 @@
 #include "expand.h"
 #include "parser.h"
 #include "tokenizer.h"
+#include "history.h"
+#include "highlight.h"
+#include "env_universal_common.h"
+#include "xdgmimeint.h"
+#include "whatis.h"
 
 #define LAPS 50
 
@@ -160,6 +171,92 @@ static int stack_test( int elements )
 	return res;
 }
 
+/**
+   Test the queue, including peeking at elements when the queue has
+   wrapped around the end of its buffer
+*/
+static void q_test( int elements )
+{
+	dyn_queue_t q;
+	int i, j;
+	
+	q_init( &q );
+
+	for( i=0; i<elements; i++ )
+	{
+		q_put( &q, (void *)(2*i) );
+		q_put( &q, (void *)(2*i+1) );
+		if( (int)q_get( &q ) != i )
+		{
+			err( L"Queue returned elements in wrong order" );
+			break;
+		}
+		if( q_get_count( &q ) != i+1 )
+		{
+			err( L"Queue has wrong number of elements" );
+			break;
+		}
+		for( j=0; j<q_get_count( &q ); j++ )
+		{
+			if( (int)q_peek_pos( &q, j ) != i+j+1 )
+			{
+				err( L"Queue has wrong element at position %d", j );
+				break;
+			}
+		}
+	}
+	q_destroy( &q );
+}
+
+/**
+   Test the arena allocator, and that releasing a mark only frees
+   memory allocated after the mark was set
+*/
+static void arena_test()
+{
+	arena_t a;
+	arena_mark_t mark;
+	wchar_t *first, *str=0;
+	void *big;
+	int i;
+	
+	arena_init( &a );
+	first = arena_wcsdup( &a, L"first" );
+	arena_mark( &a, &mark );
+	
+	for( i=0; i<10000; i++ )
+	{
+		str = arena_wcsndup( &a, L"abcdefgh", i%8 );
+		if( ((long)str) % 16 )
+		{
+			err( L"Arena returned unaligned memory" );
+			break;
+		}
+		if( wcslen( str ) != i%8 || wcsncmp( str, L"abcdefgh", i%8 ) )
+		{
+			err( L"Arena string copy is wrong" );
+			break;
+		}
+		if( !arena_contains( &a, str ) )
+		{
+			err( L"Arena does not contain allocated memory" );
+			break;
+		}
+	}
+	
+	big = arena_alloc( &a, 100000 );
+	memset( big, 0, 100000 );
+	if( !arena_contains( &a, big ) )
+		err( L"Arena does not contain large allocation" );
+	
+	arena_release( &a, &mark );
+	if( arena_contains( &a, str ) || arena_contains( &a, big ) )
+		err( L"Arena contains released memory" );
+	if( !arena_contains( &a, first ) || wcscmp( first, L"first" ) )
+		err( L"Arena lost memory allocated before mark" );
+	
+	arena_destroy( &a );
+}
 
 static int hash_func( const void *data )
 {
@@ -249,6 +346,151 @@ static int hash_test( int elements )
 	
 }
 
+/**
+   The hash table used before the Robin Hood table, kept for
+   comparison in hash_perf. Uses a Mersenne number sized array with
+   plain linear probing, and calls the comparison function on every
+   probe.
+*/
+typedef struct
+{
+	/** The array containing the data */
+	hash_struct_t *arr;
+	/** Number of elements */
+	int count;
+	/** Length of array */
+	int size;
+}
+old_hash_t;
+
+/**
+   Search for a key in the old hash table
+*/
+static int old_hash_search( old_hash_t *h, const void *key )
+{
+	int pos = abs( hash_wcs_func( key ) ) % h->size;
+	while(1)
+	{
+		if( (h->arr[pos].key == 0 ) ||
+			hash_wcs_cmp( h->arr[pos].key, key ) )
+		{
+			return pos;
+		}
+		pos++;
+		pos %= h->size;
+	}
+}
+
+/**
+   Initialize an old hash table
+*/
+static void old_hash_init( old_hash_t *h )
+{
+	h->size = 42;
+	h->count = 0;
+	h->arr = calloc( h->size, sizeof(hash_struct_t) );
+}
+
+/**
+   Insert a key into an old hash table, rehashing every key when the
+   table grows
+*/
+static void old_hash_put( old_hash_t *h, const void *key, const void *data )
+{
+	int pos;
+	
+	if( (float)(h->count+1)/h->size > 0.75f )
+	{
+		hash_struct_t *old_arr = h->arr;
+		int old_size = h->size;
+		int i;
+		
+		h->size = maxi( (h->size+1)*2-1, 128 );
+		h->arr = calloc( h->size, sizeof(hash_struct_t) );
+		for( i=0; i<old_size; i++ )
+		{
+			if( old_arr[i].key )
+			{
+				pos = old_hash_search( h, old_arr[i].key );
+				h->arr[pos] = old_arr[i];
+			}
+		}
+		free( old_arr );
+	}
+
+	pos = old_hash_search( h, key );
+	if( h->arr[pos].key == 0 )
+		h->count++;
+	h->arr[pos].key = key;
+	h->arr[pos].data = data;
+}
+
+/**
+   Look up a key in an old hash table
+*/
+static const void *old_hash_get( old_hash_t *h, const void *key )
+{
+	int pos = old_hash_search( h, key );
+	return h->arr[pos].key?h->arr[pos].data:0;
+}
+
+/**
+   Compare the speed of hash_table_t and the old hash table, using
+   string keys like most tables in fish. Each key is inserted, and
+   then looked up once along with one key that is not in the table.
+*/
+static void hash_perf( int elements )
+{
+	wchar_t **keys = malloc( sizeof(wchar_t *)*elements*2 );
+	hash_table_t h;
+	old_hash_t o;
+	long long t1, t2, t3;
+	int i;
+	int found=0;
+	
+	if( !keys )
+		die_mem();
+	
+	for( i=0; i<elements*2; i++ )
+	{
+		string_buffer_t sb;
+		sb_init( &sb );
+		sb_printf( &sb, L"fish_var_%d", i );
+		keys[i] = (wchar_t *)sb.buff;
+	}
+
+	t1 = get_time();
+	hash_init( &h, &hash_wcs_func, &hash_wcs_cmp );
+	for( i=0; i<elements; i++ )
+		hash_put( &h, keys[i], keys[i] );
+	for( i=0; i<elements*2; i++ )
+		found += hash_get( &h, keys[i] ) != 0;
+	hash_destroy( &h );
+
+	t2 = get_time();
+	old_hash_init( &o );
+	for( i=0; i<elements; i++ )
+		old_hash_put( &o, keys[i], keys[i] );
+	for( i=0; i<elements*2; i++ )
+		found += old_hash_get( &o, keys[i] ) != 0;
+	free( o.arr );
+	t3 = get_time();
+
+	if( found != 2*elements )
+	{
+		err( L"Found %d keys in hash tables, expected %d", found, 2*elements );
+	}
+	
+	say( L"Hashtable uses %f microseconds per string key at size %d, old hashtable used %f",
+		 ((double)(t2-t1))/elements,
+		 elements,
+		 ((double)(t3-t2))/elements );
+
+	for( i=0; i<elements*2; i++ )
+		free( keys[i] );
+	free( keys );
+}
+
 static int al_test( int sz)
 {
 	int i;	
@@ -311,6 +553,8 @@ static void test_util()
 		long t1, t2;
 		pq_test( 1<<i );
 		stack_test( 1<<i );
+		if( i < 10 )
+			q_test( 1<<i );
 		t1 = get_time();
 		hash_test( 1<<i );
 		t2 = get_time();
@@ -321,7 +565,13 @@ static void test_util()
 		al_test( 1<<i );
 	}
 
+	for( i=10; i<18; i+=2 )
+	{
+		hash_perf( 1<<i );
+	}
+
 	sb_test();
+	arena_test();
 	
 	
 /*
@@ -407,6 +657,67 @@ static void test_tok()
 			}
 		}
 	}
+
+	{
+		wchar_t *str = L"for i in a b (echo c)\n\t# comment\n\techo $i >/dev/null ^&1 | cat &\nend;echo \"quoted $i\"";
+		tok_cache_t *cache;
+		tokenizer t2;
+		int i, mark=-1;
+		
+		say( L"Test cached tokenization" );
+
+		cache = tok_cache_create( str );
+		if( !cache )
+		{
+			err( L"Could not create token cache" );
+		}
+		else
+		{
+			/*
+			  Read the string twice, jumping back to the fourth token
+			  the first time, and check that every token is identical
+			  to the one read by a regular tokenizer.
+			*/
+			tok_init( &t, str, 0 );
+			tok_init_cached( &t2, cache );
+			tok_cache_release( cache );
+			
+			for( i=0; tok_has_next( &t ) || tok_has_next( &t2 ); i++ )
+			{
+				if( tok_last_type( &t ) != tok_last_type( &t2 ) ||
+					tok_get_pos( &t ) != tok_get_pos( &t2 ) ||
+					tok_has_next( &t ) != tok_has_next( &t2 ) ||
+					(tok_last_type( &t ) == TOK_STRING &&
+					 wcscmp( tok_last( &t ), tok_last( &t2 ) ) ) )
+				{
+					err( L"Cached token number %d differs", i+1 );
+					break;
+				}
+				
+				if( i == 3 )
+					mark = tok_get_pos( &t );
+				
+				if( i == 12 )
+				{
+					tok_set_pos( &t, mark );
+					tok_set_pos( &t2, mark );
+				}
+				else
+				{
+					tok_next( &t );
+					tok_next( &t2 );
+				}
+			}
+			
+			tok_destroy( &t );
+			tok_destroy( &t2 );
+		}
+
+		if( tok_cache_create( L"echo (foo" ) )
+		{
+			err( L"Token cache created for invalid input" );
+		}
+	}
 	
 
 		
@@ -533,7 +844,1046 @@ static void test_expand()
 	{
 		err( L"Cannot skip wildcard expantion" );
 	}
+
+	env_set( L"fish_expand_test", L"x" ARRAY_SEP_STR L"y" ARRAY_SEP_STR L"z", ENV_GLOBAL );
+	
+	if( !expand_test( L"a$fish_expand_test", 0, L"ax", L"ay", L"az", 0 ) )
+	{
+		err( L"Array variable expantion is broken" );
+	}
+
+	if( !expand_test( L"{1,2}$fish_expand_test[3 1]", 0, L"1z", L"2z", L"1x", L"2x", 0 ) )
+	{
+		err( L"Array index expantion is broken" );
+	}
+	
+	env_remove( L"fish_expand_test", ENV_GLOBAL );
+	
+}
+
+/**
+   Number of entries in the history used by perf_history
+*/
+#define HISTORY_PERF_SIZE 500000
+
+/**
+   Number of entries in the history used by perf_history that match
+   the search string
+*/
+#define HISTORY_PERF_MATCHES 500
+
+/**
+   Search backwards through the history until the search string no
+   longer matches anything. Returns the number of matches.
+*/
+static int history_search_all( const wchar_t *needle )
+{
+	int matches = 0;
+	const wchar_t *prev = 0;
+	
+	history_reset();
+	while( 1 )
+	{
+		const wchar_t *res = history_prev_match( needle );
+		if( res == needle || res == prev )
+			break;
+		prev = res;
+		matches++;
+	}
+	return matches;
+}
+
+/**
+   Check that a lock file is not removed as stale while its owner
+   keeps updating its modification time
+*/
+static void test_history_lock( const char *dir )
+{
+	char lock[PATH_MAX];
+	struct timeval start, end;
+	pid_t pid;
+	int i;
+
+	snprintf( lock, sizeof(lock), "%s/.fish_tests_lock", dir );
+
+	if( !acquire_lock_file( lock, 2, 0 ) )
+	{
+		err( L"Could not create lock file" );
+		return;
+	}
+
+	switch( pid = fork() )
+	{
+		case -1:
+			err( L"Could not fork lock owner" );
+			unlink( lock );
+			return;
+
+		case 0:
+		{
+			/*
+			  Hold the lock for three seconds, longer than the
+			  timeout below, refreshing it twice a second
+			*/
+			for( i=0; i<6; i++ )
+			{
+				usleep( 500000 );
+				utime( lock, 0 );
+			}
+			unlink( lock );
+			_exit( 0 );
+		}
+	}
+
+	gettimeofday( &start, 0 );
+	if( !acquire_lock_file( lock, 2, 1 ) )
+	{
+		err( L"Could not obtain lock file after it was released" );
+	}
+	gettimeofday( &end, 0 );
+
+	if( end.tv_sec + end.tv_usec/1000000.0 - 
+		( start.tv_sec + start.tv_usec/1000000.0 ) < 2.5 )
+	{
+		err( L"Lock file was removed while its owner was refreshing it" );
+	}
+
+	waitpid( pid, 0, 0 );
+	unlink( lock );
+}
+
+/**
+   Old history file contents used by test_history_old_format
+*/
+#define HISTORY_OLD_FORMAT "echo old\nls\n"
+
+/**
+   Check that a history file in the old format is loaded, but only
+   converted by a shell that holds the lock for it
+*/
+static void test_history_old_format( const char *dir )
+{
+	char file[64], lock[PATH_MAX], buff[64];
+	FILE *f;
+	size_t len;
+
+	snprintf( file, sizeof(file), "%s/.fish_tests_history", dir );
+	snprintf( lock, sizeof(lock), "%s.lock", file );
+
+	if( !(f = fopen( file, "w" ) ) )
+	{
+		err( L"Could not create old history file" );
+		return;
+	}
+	fputs( HISTORY_OLD_FORMAT, f );
+	fclose( f );
+
+	/*
+	  A directory can't be removed as a stale lock file, so the lock
+	  can't be obtained while it exists
+	*/
+	if( mkdir( lock, 0700 ) )
+	{
+		err( L"Could not create history lock" );
+		return;
+	}
+
+	history_init();
+	history_set_mode( L"fish_tests" );
+	history_add( L"pwd" );
+
+	if( !history_get( 0 ) || wcscmp( history_get( 0 ), L"pwd" ) ||
+		!history_get( 1 ) || wcscmp( history_get( 1 ), L"ls" ) ||
+		!history_get( 2 ) || wcscmp( history_get( 2 ), L"echo old" ) )
+	{
+		err( L"Old history file was not loaded without the lock" );
+	}
+	history_destroy();
+
+	len = 0;
+	if( (f = fopen( file, "r" ) ) )
+	{
+		len = fread( buff, 1, sizeof(buff), f );
+		fclose( f );
+	}
+	if( len != strlen( HISTORY_OLD_FORMAT ) ||
+		memcmp( buff, HISTORY_OLD_FORMAT, len ) )
+	{
+		err( L"Old history file was changed without holding the lock" );
+	}
+
+	rmdir( lock );
+
+	/*
+	  Loading converts the file now, and the next load must find the
+	  same items
+	*/
+	history_init();
+	history_set_mode( L"fish_tests" );
+	history_destroy();
+	history_init();
+	history_set_mode( L"fish_tests" );
+
+	if( !history_get( 0 ) || wcscmp( history_get( 0 ), L"ls" ) ||
+		!history_get( 1 ) || wcscmp( history_get( 1 ), L"echo old" ) ||
+		history_get( 2 ) )
+	{
+		err( L"Old history file was not converted correctly" );
+	}
+	history_destroy();
+}
+
+/**
+   Benchmark loading and searching a large history. The history file
+   is written in the old, line based format, so that it is converted
+   when it is first loaded. A search string of three characters or
+   more uses the search index, while a shorter one makes the history
+   test every item.
+*/
+static void perf_history( const char *dir )
+{
+	char fn[PATH_MAX];
+	FILE *out;
+	long long t1, t2, t3, t4, t5, t6;
+	int i, matches;
+
+	snprintf( fn, PATH_MAX, "%s/.fish_tests_perf_history", dir );
+	if( !(out = fopen( fn, "w" )) )
+	{
+		err( L"Could not create history file for benchmark" );
+		return;
+	}
+	
+	for( i=0; i<HISTORY_PERF_SIZE; i++ )
+	{
+		if( i % (HISTORY_PERF_SIZE/HISTORY_PERF_MATCHES) == 0 )
+			fprintf( out, "grep -r needle%d src\n", i );
+		else
+			fprintf( out, "make -C build%d target%d\n", i%997, i );
+	}
+	fclose( out );
+
+	t1 = get_time();
+	history_init();
+	history_set_mode( L"fish_tests_perf" );
+	history_destroy();
+	t2 = get_time();
+
+	history_init();
+	history_set_mode( L"fish_tests_perf" );
+	t3 = get_time();
+	history_first();
+	t4 = get_time();
+
+	matches = history_search_all( L"needle" );
+	t5 = get_time();
+	if( matches != HISTORY_PERF_MATCHES )
+		err( L"Indexed history search found %d matches, expected %d", matches, HISTORY_PERF_MATCHES );
+
+	matches = history_search_all( L"ne" );
+	t6 = get_time();
+	if( matches != HISTORY_PERF_MATCHES )
+		err( L"Unindexed history search found %d matches, expected %d", matches, HISTORY_PERF_MATCHES );
+
+	say( L"History conversion uses %f microseconds per item at size %d",
+		 (double)(t2-t1)/HISTORY_PERF_SIZE,
+		 HISTORY_PERF_SIZE );
+	say( L"History startup takes %f microseconds, loading uses %f microseconds per item",
+		 (double)(t3-t2),
+		 (double)(t4-t3)/HISTORY_PERF_SIZE );
+	say( L"History search uses %f microseconds per match with the index, %f microseconds per match without it",
+		 (double)(t5-t4)/HISTORY_PERF_MATCHES,
+		 (double)(t6-t5)/HISTORY_PERF_MATCHES );
+
+	history_destroy();
+	unlink( fn );
+}
+
+/**
+   Check if the specified string is an element of the exported
+   variable array
+*/
+static int env_is_exported( const char *str )
+{
+	char **arr = env_export_arr( 0 );
+	
+	for( ; *arr; arr++ )
+	{
+		if( strcmp( *arr, str ) == 0 )
+			return 1;
+	}
+	return 0;
+}
+
+/**
+   Test that variable lookups give the right value as scopes are
+   pushed and popped and variables are set and erased, since lookups
+   are cached. Also check that the exported variable array follows
+   changes, since it is built incrementally.
+*/
+static void test_env()
+{
+	wchar_t *key = L"fish_test_var";
+	wchar_t *val;
+	
+	say( L"Testing variable scopes" );
+
+	env_set( key, L"global", ENV_GLOBAL );
+	if( !(val = env_get( key )) || wcscmp( val, L"global" ) )
+		err( L"Global variable has wrong value" );
+
+	env_push( 0 );
+	env_set( key, L"block", ENV_LOCAL );
+	if( !(val = env_get( key )) || wcscmp( val, L"block" ) )
+		err( L"Block scope variable has wrong value" );
+
+	env_push( 1 );
+	if( !(val = env_get( key )) || wcscmp( val, L"global" ) )
+		err( L"Function scope does not hide block scope variable" );
+	env_set( key, L"function", ENV_LOCAL );
+	if( !(val = env_get( key )) || wcscmp( val, L"function" ) )
+		err( L"Function scope variable has wrong value" );
+	env_pop();
+	
+	if( !(val = env_get( key )) || wcscmp( val, L"block" ) )
+		err( L"Block scope variable not visible after popping function scope" );
+	env_pop();
+	
+	if( !(val = env_get( key )) || wcscmp( val, L"global" ) )
+		err( L"Global variable not visible after popping block scope" );
+
+	env_set( key, L"changed", 0 );
+	if( !(val = env_get( key )) || wcscmp( val, L"changed" ) )
+		err( L"Changed variable has wrong value" );
+	
+	env_remove( key, 0 );
+	if( env_get( key ) )
+		err( L"Erased variable still has a value" );
+
+	if( !env_get( L"status" ) )
+		err( L"Dynamic variable has no value" );
+
+	say( L"Testing exported variables" );
+
+	env_set( key, L"one", ENV_GLOBAL | ENV_EXPORT );
+	if( !env_is_exported( "fish_test_var=one" ) )
+		err( L"Exported variable missing from environment" );
+
+	env_set( key, L"two", 0 );
+	if( !env_is_exported( "fish_test_var=two" ) || env_is_exported( "fish_test_var=one" ) )
+		err( L"Changed exported variable has wrong value in environment" );
+
+	env_remove( key, 0 );
+	if( env_is_exported( "fish_test_var=two" ) )
+		err( L"Erased variable still in environment" );
+}
+
+/**
+   Number of updates sent by the busy client in each round of test_fishd
+*/
+#define FISHD_TEST_UPDATES 1000
+
+/**
+   Number of rounds in test_fishd. Whether fishd reads the two writes
+   of a round at once depends on timing, so the test is repeated.
+*/
+#define FISHD_TEST_ROUNDS 20
+
+/**
+   Connect to the fishd using the specified socket directory. Retries
+   for a while, since fishd may still be starting.
+
+   \return the socket, or -1 on failure
+*/
+static int test_fishd_connect( const char *dir )
+{
+	struct sockaddr_un local;
+	int i;
+
+	local.sun_family = AF_UNIX;
+	snprintf( local.sun_path, sizeof(local.sun_path), "%s/%sfish_tests", dir, SOCK_FILENAME );
+
+	for( i=0; i<100; i++ )
+	{
+		int s = socket( AF_UNIX, SOCK_STREAM, 0 );
+		if( s == -1 )
+			return -1;
+		if( connect( s, (struct sockaddr *)&local, sizeof(local) ) == 0 )
+			return s;
+		close( s );
+		usleep( 10000 );
+	}
+	return -1;
+}
+
+/**
+   Write a string to a connection to fishd
+*/
+static void test_fishd_send( int s, const char *str, size_t len )
+{
+	while( len > 0 )
+	{
+		ssize_t res = write( s, str, len );
+		if( res <= 0 )
+		{
+			err( L"Could not write to fishd" );
+			return;
+		}
+		str += res;
+		len -= res;
+	}
+}
+
+/**
+   Read everything fishd sends on a connection, up to and including a
+   barrier reply, and append it to the specified buffer as a null
+   terminated string
+*/
+static void test_fishd_read( int s, buffer_t *b )
+{
+	const char *reply = "BARRIER_REPLY\n";
+	size_t reply_len = strlen( reply );
+	size_t start = b->used;
+	char c;
+
+	/*
+	  Read one byte at a time, so that nothing sent after the reply is
+	  consumed
+	*/
+	do
+	{
+		if( read( s, &c, 1 ) != 1 )
+		{
+			err( L"Lost connection to fishd" );
+			break;
+		}
+		b_append( b, &c, 1 );
+	}
+	while( b->used - start < reply_len ||
+		   memcmp( (char *)b->buff + b->used - reply_len, reply, reply_len ) != 0 );
+	b_append( b, "", 1 );
+}
+
+/**
+   Find the last message in a string of messages from fishd that
+   starts with the specified prefix
+*/
+static const char *test_fishd_last( const char *str, const char *prefix )
+{
+	const char *res = 0;
+
+	while( (str = strstr( str, prefix ) ) )
+		res = str++;
+	return res;
+}
+
+/**
+   Test that fishd echoes every write to the client that made it, even
+   when two clients set the same variable at once. Clients ignore
+   messages about a variable until they see that echo, so a missing
+   echo leaves them with a stale value.
+
+   A private fishd is started in a temporary directory. One client
+   keeps it busy with a large batch of updates, while two other
+   clients set the same variable, so that fishd usually reads both
+   writes before it sends anything.
+*/
+static void test_fishd()
+{
+	char tmpl[64] = "/tmp/fish_tests.XXXXXX";
+	int alive[2];
+	int a=-1, b=-1, c=-1;
+	buffer_t busy, out_a, out_b, out_c;
+	const char *last_a, *last_b;
+	char dummy;
+	DIR *dir;
+	struct dirent *next;
+	int i;
+
+	say( L"Testing fishd" );
+
+	if( !mkdtemp( tmpl ) )
+	{
+		err( L"Could not create temporary directory for fishd test" );
+		return;
+	}
+
+	/*
+	  fishd inherits the write end of this pipe, so reading from it
+	  returns once fishd has quit
+	*/
+	if( pipe( alive ) == -1 )
+	{
+		err( L"Could not create pipe for fishd test" );
+		rmdir( tmpl );
+		return;
+	}
+
+	switch( fork() )
+	{
+		case -1:
+			err( L"Could not fork fishd" );
+			break;
+
+		case 0:
+		{
+			int null = open( "/dev/null", O_WRONLY );
+			dup2( null, 2 );
+			close( alive[0] );
+			setenv( "FISHD_SOCKET_DIR", tmpl, 1 );
+			setenv( "HOME", tmpl, 1 );
+			setenv( "USER", "fish_tests", 1 );
+			execl( "./fishd", "fishd", (char *)0 );
+			_exit( 1 );
+		}
+	}
+	close( alive[1] );
+
+	b_init( &busy );
+	b_init( &out_a );
+	b_init( &out_b );
+	b_init( &out_c );
+
+	if( (a = test_fishd_connect( tmpl )) == -1 ||
+		(b = test_fishd_connect( tmpl )) == -1 ||
+		(c = test_fishd_connect( tmpl )) == -1 )
+	{
+		err( L"Could not connect to fishd" );
+	}
+	else
+	{
+		for( i=0; i<FISHD_TEST_UPDATES; i++ )
+		{
+			char line[64];
+			snprintf( line, sizeof(line), "SET fish_tests_busy:%d\n", i );
+			b_append( &busy, line, strlen( line ) );
+		}
+		b_append( &busy, "BARRIER\n", strlen( "BARRIER\n" ) );
+
+		for( i=0; i<FISHD_TEST_ROUNDS; i++ )
+		{
+			char set_a[64], set_b[64];
+
+			snprintf( set_a, sizeof(set_a), "SET fish_tests_x:a%d\n", i );
+			snprintf( set_b, sizeof(set_b), "SET fish_tests_x:b%d\n", i );
+			out_a.used = out_b.used = out_c.used = 0;
+
+			test_fishd_send( c, busy.buff, busy.used );
+			test_fishd_send( a, set_a, strlen( set_a ) );
+			test_fishd_send( b, set_b, strlen( set_b ) );
+			test_fishd_read( c, &out_c );
+
+			/*
+			  After the barrier on b, fishd has sent both writes to
+			  both clients, so the last barrier on a gets the rest
+			*/
+			test_fishd_send( a, "BARRIER\n", strlen( "BARRIER\n" ) );
+			test_fishd_read( a, &out_a );
+			/* Drop the null terminator, so that the next read is appended */
+			out_a.used--;
+			test_fishd_send( b, "BARRIER\n", strlen( "BARRIER\n" ) );
+			test_fishd_read( b, &out_b );
+			test_fishd_send( a, "BARRIER\n", strlen( "BARRIER\n" ) );
+			test_fishd_read( a, &out_a );
+
+			if( !strstr( (char *)out_a.buff, set_a ) ||
+				!strstr( (char *)out_b.buff, set_b ) )
+			{
+				err( L"fishd did not echo a write to the client that made it" );
+				break;
+			}
+
+			last_a = test_fishd_last( (char *)out_a.buff, "SET fish_tests_x:" );
+			last_b = test_fishd_last( (char *)out_b.buff, "SET fish_tests_x:" );
+			if( !last_a || !last_b ||
+				strcspn( last_a, "\n" ) != strcspn( last_b, "\n" ) ||
+				strncmp( last_a, last_b, strcspn( last_a, "\n" ) ) )
+			{
+				err( L"Clients of fishd disagree about the value of a variable" );
+				break;
+			}
+		}
+	}
+
+	if( a != -1 )
+		close( a );
+	if( b != -1 )
+		close( b );
+	if( c != -1 )
+		close( c );
+
+	read( alive[0], &dummy, 1 );
+	close( alive[0] );
+
+	b_destroy( &busy );
+	b_destroy( &out_a );
+	b_destroy( &out_b );
+	b_destroy( &out_c );
+
+	if( (dir = opendir( tmpl ) ) )
+	{
+		while( (next = readdir( dir ) ) )
+		{
+			char file[PATH_MAX];
+			if( next->d_name[0] == '.' && ( !next->d_name[1] || !strcmp( next->d_name, ".." ) ) )
+				continue;
+			snprintf( file, sizeof(file), "%s/%s", tmpl, next->d_name );
+			unlink( file );
+		}
+		closedir( dir );
+	}
+	rmdir( tmpl );
+}
+
+/**
+   Test the command lookup cache used by get_filename(), using a
+   temporary directory as $PATH.
+*/
+static void test_path_cache()
+{
+	char tmpl[64] = "/tmp/fish_tests.XXXXXX";
+	char file[64];
+	wchar_t *dir;
+	wchar_t *old_path;
+	wchar_t *res;
+	int fd;
+	
+	say( L"Testing command lookup cache" );
+
+	if( !mkdtemp( tmpl ) )
+	{
+		err( L"Could not create temporary directory for command lookup test" );
+		return;
+	}
+	snprintf( file, sizeof(file), "%s/fish_test_cmd", tmpl );
+	
+	dir = str2wcs( tmpl );
+	old_path = env_get( L"PATH" );
+	old_path = old_path?wcsdup( old_path ):0;
+	env_set( L"PATH", dir, ENV_GLOBAL );
+
+	if( (res = get_filename( L"fish_test_cmd" ) ) )
+	{
+		err( L"Found nonexisting command '%ls'", res );
+		free( res );
+	}
+	
+	fd = open( file, O_WRONLY|O_CREAT, 0700 );
+	if( fd == -1 )
+	{
+		err( L"Could not create test command" );
+	}
+	else
+	{
+		close( fd );
+	}
+	
+	if( !(res = get_filename( L"fish_test_cmd" ) ) )
+	{
+		err( L"Command created after a failed lookup was not found" );
+	}
+	free( res );
+
+	unlink( file );
+	
+	if( !(res = get_filename_cached( L"fish_test_cmd" ) ) )
+	{
+		err( L"Command lookup was not cached" );
+	}
+	free( res );
+
+	env_set( L"PATH", L"/bin", ENV_GLOBAL );
+	env_set( L"PATH", dir, ENV_GLOBAL );
+	if( (res = get_filename_cached( L"fish_test_cmd" ) ) )
+	{
+		err( L"Command lookup cache was not flushed on PATH change" );
+		free( res );
+	}
+
+	fd = open( file, O_WRONLY|O_CREAT, 0700 );
+	if( fd != -1 )
+		close( fd );
+	free( get_filename( L"fish_test_cmd" ) );
+	unlink( file );
+
+	path_cache_flush();
+	if( (res = get_filename_cached( L"fish_test_cmd" ) ) )
+	{
+		err( L"Command lookup cache was not flushed" );
+		free( res );
+	}
+	
+	env_set( L"PATH", old_path, ENV_GLOBAL );
+	free( old_path );
+	free( dir );
+	rmdir( tmpl );
+}
+
+/**
+   Check the description of a command found in the whatis index
+*/
+static void test_whatis_desc( hash_table_t *h, const wchar_t *key, const wchar_t *expected )
+{
+	wchar_t *desc = (wchar_t *)hash_get( h, key );
+
+	if( !desc )
+	{
+		err( L"No description of '%ls' found in whatis index", key );
+	}
+	else if( wcscmp( desc, expected ) != 0 )
+	{
+		err( L"Description of '%ls' is '%ls', expected '%ls'", key, desc, expected );
+	}
+}
+
+/**
+   Free hash key and hash value
+*/
+static void test_whatis_free( const void *key, const void *data )
+{
+	free( (void *)key );
+	free( (void *)data );
+}
+
+/**
+   Test the index of the whatis database used to describe commands
+*/
+static void test_whatis()
+{
+	char tmpl[64] = "/tmp/fish_tests.XXXXXX";
+	char whatis[64], index[64];
+	wchar_t *dir, *wwhatis, *windex;
+	wchar_t *old_home;
+	hash_table_t h;
+	FILE *f;
+	int i, res;
+	
+	say( L"Testing whatis index" );
+
+	if( !mkdtemp( tmpl ) )
+	{
+		err( L"Could not create temporary directory for whatis test" );
+		return;
+	}
+	snprintf( whatis, sizeof(whatis), "%s/whatis", tmpl );
+	snprintf( index, sizeof(index), "%s/.fish_whatis", tmpl );
+
+	if( !(f = fopen( whatis, "w" ) ) )
+	{
+		err( L"Could not create whatis database" );
+		rmdir( tmpl );
+		return;
+	}
+	fputs( "ls (1)               - list directory contents\n"
+		   "lsblk (8)            - list block devices\n"
+		   "ls (3)               - not the first description\n"
+		   "cat (1) - concatenate files and print on the standard output\n"
+		   "lsfoo without a description\n", f );
+	fclose( f );
+
+	dir = str2wcs( tmpl );
+	wwhatis = str2wcs( whatis );
+	windex = str2wcs( index );
+	old_home = env_get( L"HOME" );
+	old_home = old_home?wcsdup( old_home ):0;
+	env_set( L"HOME", dir, ENV_GLOBAL );
+
+	if( whatis_build_index( wwhatis, windex ) )
+	{
+		err( L"Could not build whatis index" );
+	}
+	
+	hash_init( &h, &hash_wcs_func, &hash_wcs_cmp );
+	if( whatis_get_descriptions( wwhatis, L"ls", &h ) )
+	{
+		err( L"Whatis index could not be used" );
+	}
+	else
+	{
+		if( hash_get_count( &h ) != 2 )
+			err( L"Found %d commands starting with 'ls' in whatis index, expected 2", hash_get_count( &h ) );
+		test_whatis_desc( &h, L"", L"list directory contents" );
+		test_whatis_desc( &h, L"blk", L"list block devices" );
+	}
+	hash_foreach( &h, &test_whatis_free );
+	hash_destroy( &h );
+
+	/*
+	  A changed database should make the index be rebuilt in the
+	  background
+	*/
+	if( (f = fopen( whatis, "a" ) ) )
+	{
+		fputs( "cp (1) - copy files and directories\n", f );
+		fclose( f );
+	}
+
+	hash_init( &h, &hash_wcs_func, &hash_wcs_cmp );
+	if( !whatis_get_descriptions( wwhatis, L"c", &h ) )
+	{
+		err( L"Whatis index was used after the database changed" );
+	}
+	for( i=0; i<50; i++ )
+	{
+		if( !(res = whatis_get_descriptions( wwhatis, L"c", &h ) ) )
+			break;
+		usleep( 100000 );
+	}
+	if( res )
+	{
+		err( L"Whatis index was not rebuilt in the background" );
+	}
+	else
+	{
+		if( hash_get_count( &h ) != 2 )
+			err( L"Found %d commands starting with 'c' in whatis index, expected 2", hash_get_count( &h ) );
+		test_whatis_desc( &h, L"p", L"copy files and directories" );
+	}
+	hash_foreach( &h, &test_whatis_free );
+	hash_destroy( &h );
+
+	whatis_destroy();
+	env_set( L"HOME", old_home, ENV_GLOBAL );
+	free( old_home );
+	free( dir );
+	free( wwhatis );
+	free( windex );
+	unlink( whatis );
+	unlink( index );
+	rmdir( tmpl );
+}
+
+/**
+   Check that a magic index lookup gives the expected candidates
+*/
+static void test_magic_index_lookup( XdgMimeMagicIndex *index,
+									 const char *data,
+									 int *expected,
+									 int n_expected )
+{
+	const int *candidates;
+	int n_candidates;
+	int i;
+	
+	n_candidates = _xdg_mime_magic_index_lookup( index, data, strlen( data ), &candidates );
+	if( n_candidates != n_expected )
+	{
+		err( L"Magic index gave %d candidates for '%s', expected %d", n_candidates, data, n_expected );
+		return;
+	}
+	
+	for( i=0; i<n_expected; i++ )
+	{
+		if( candidates[i] != expected[i] )
+		{
+			err( L"Magic index gave candidate %d for '%s', expected %d", candidates[i], data, expected[i] );
+		}
+	}
+}
+
+/**
+   Test the index used to find the magic rules worth trying for a file
+*/
+static void test_magic_index()
+{
+	XdgMimeMagicIndex *index;
+	int first_a[] = { 0, 1, 2 };
+	int first_b[] = { 1, 2, 3 };
+	int short_a[] = { 0, 1 };
+	int empty[] = { 1 };
+	
+	say( L"Testing magic index" );
+	
+	index = _xdg_mime_magic_index_new();
+	if( !index )
+	{
+		err( L"Could not create magic index" );
+		return;
+	}
+	
+	_xdg_mime_magic_index_add( index, 0, 0, 'A' );
+	_xdg_mime_magic_index_add( index, 1, -1, 0 );
+	_xdg_mime_magic_index_add( index, 2, 0, 'B' );
+	_xdg_mime_magic_index_add( index, 2, 4, 'A' );
+	_xdg_mime_magic_index_add( index, 3, 2, 'A' );
+	_xdg_mime_magic_index_add( index, 3, 3, 'A' );
+	
+	test_magic_index_lookup( index, "AxxxA", first_a, 3 );
+	test_magic_index_lookup( index, "BxAAA", first_b, 3 );
+	test_magic_index_lookup( index, "A", short_a, 2 );
+	test_magic_index_lookup( index, "", empty, 1 );
+	
+	_xdg_mime_magic_index_free( index );
+}
+
+/**
+   Check that highlighting a command line that was only partially
+   changed since the last call gives the same colors as highlighting
+   it from scratch.
+*/
+static void test_highlight_edit( wchar_t *buff )
+{
+	int len = wcslen( buff );
+	int *color = malloc( sizeof(int)*(len+1) );
+	int *full = malloc( sizeof(int)*(len+1) );
+	array_list_t errors;
+	
+	if( !color || !full )
+		die_mem();
+	
+	al_init( &errors );
+	
+	highlight_shell( buff, color, len, 0 );
+	highlight_shell( buff, full, len, &errors );
+	if( memcmp( color, full, sizeof(int)*len ) != 0 )
+	{
+		err( L"Incremental highlighting of '%ls' differs from full highlighting", buff );
+	}
+	
+	al_foreach( &errors, (void (*)(const void *))&free );
+	al_destroy( &errors );
+	free( color );
+	free( full );
+}
+
+/**
+   Test incremental syntax highlighting by typing a command line one
+   character at a time and then editing it in the middle.
+*/
+static void test_highlight()
+{
+	wchar_t *line = L"echo foo -n | cat > /tmp/x; builtin -h; ls -l \"a b\" (echo x) ^/dev/null # c";
+	wchar_t *edits[] = 
+		{
+			L"echo foo -n | cat > /tmp/x; builtin ls -h; ls -l \"a b\" (echo x) ^/dev/null # c",
+			L"echo foo -n | cat > /tmp/x; builtin l -h; ls -l \"a b\" (echo x) ^/dev/null # c",
+			L"echo foo -n | cat > /tmp/x; builtin l -h; l -l \"a b\" (echo x) ^/dev/null # c",
+			L"echo foo -n | cat > /tmp/x; builtin l -h; l -l \"a b (echo x) ^/dev/null # c",
+			L"echo foo -n | cat > /tmp/x; builtin l -h; l -l \"a b\" (echo x) ^/dev/null # c",
+			L"echo foo -n | cat  /tmp/x; builtin l -h; l -l \"a b\" (echo x) ^/dev/null # c",
+			L"echo foo -n ; cat  /tmp/x; builtin l -h; l -l \"a b\" (echo x) ^/dev/null # c",
+			L"echo foo -n ;cat  /tmp/x; builtin l -h; l -l \"a b\" (echo x) ^/dev/null # c",
+			L"echo foo -n ;cat  /tmp/x; builtin l -h; l -l \"a b\" (echo x) ^/dev/null # c",
+			L"ls",
+			0
+		}
+	;
+	wchar_t *buff;
+	int i;
+
+	say( L"Testing incremental syntax highlighting" );
+	
+	highlight_cache_flush();
+
+	buff = wcsdup( line );
+	for( i=1; i<=wcslen( line ); i++ )
+	{
+		buff[i]=0;
+		test_highlight_edit( buff );
+		buff[i]=line[i];
+	}
+	free( buff );
 	
+	for( i=0; edits[i]; i++ )
+	{
+		test_highlight_edit( edits[i] );
+	}
+	
+	highlight_cache_flush();
+}
+
+/**
+   Test the history list. The history is saved to a temporary
+   directory, which is used as $HOME while testing.
+*/
+static void test_history()
+{
+	char tmpl[64] = "/tmp/fish_tests.XXXXXX";
+	wchar_t *dir;
+	wchar_t *old_home;
+	
+	say( L"Testing history" );
+
+	if( !mkdtemp( tmpl ) )
+	{
+		err( L"Could not create temporary directory for history test" );
+		return;
+	}
+	
+	dir = str2wcs( tmpl );
+	old_home = env_get( L"HOME" );
+	old_home = old_home?wcsdup( old_home ):0;
+	env_set( L"HOME", dir, ENV_GLOBAL );
+
+	history_init();
+	history_set_mode( L"fish_tests" );
+	history_add( L"foo" );
+	history_add( L"bar" );
+	history_add( L"baz" );
+	history_add( L"foo" );
+
+	if( !history_get( 0 ) || wcscmp( history_get( 0 ), L"foo" ) ||
+		!history_get( 2 ) || wcscmp( history_get( 2 ), L"bar" ) ||
+		history_get( 3 ) )
+	{
+		err( L"History duplicates are not moved to the end of the history" );
+	}
+
+	history_reset();
+	if( wcscmp( history_prev_match( L"ba" ), L"baz" ) ||
+		wcscmp( history_prev_match( L"ba" ), L"bar" ) ||
+		wcscmp( history_next_match( L"ba" ), L"baz" ) ||
+		wcscmp( history_next_match( L"ba" ), L"ba" ) )
+	{
+		err( L"History search returned the wrong item" );
+	}
+
+	history_reset();
+	if( wcscmp( history_prev_match( L"foo" ), L"foo" ) ||
+		wcscmp( history_prev_match( L"baz" ), L"baz" ) ||
+		wcscmp( history_prev_match( L"baz" ), L"baz" ) ||
+		wcscmp( history_next_match( L"foo" ), L"foo" ) ||
+		wcscmp( history_next_match( L"foo" ), L"foo" ) )
+	{
+		err( L"Indexed history search returned the wrong item" );
+	}
+
+	/*
+	  Save the history and load it again
+	*/
+	history_destroy();
+	history_init();
+	history_set_mode( L"fish_tests" );
+	history_add( L"bar" );
+	history_destroy();
+	history_init();
+	history_set_mode( L"fish_tests" );
+	
+	if( !history_get( 0 ) || wcscmp( history_get( 0 ), L"bar" ) ||
+		!history_get( 1 ) || wcscmp( history_get( 1 ), L"foo" ) ||
+		!history_get( 2 ) || wcscmp( history_get( 2 ), L"baz" ) ||
+		history_get( 3 ) )
+	{
+		err( L"History was not saved correctly" );
+	}
+
+	history_destroy();
+
+	test_history_lock( tmpl );
+	test_history_old_format( tmpl );
+	perf_history( tmpl );
+	
+	if( old_home )
+	{
+		env_set( L"HOME", old_home, ENV_GLOBAL );
+		free( old_home );
+	}
+	free( dir );
+
+	strcat( tmpl, "/.fish_tests_history" );
+	unlink( tmpl );
+	*strrchr( tmpl, '/' ) = 0;
+	rmdir( tmpl );
 }
 
 
@@ -631,6 +1981,13 @@ int main( int argc, char **argv )
 	test_tok();
 	test_parser();
 	test_expand();
+	test_env();
+	test_fishd();
+	test_path_cache();
+	test_magic_index();
+	test_whatis();
+	test_highlight();
+	test_history();
 		
 	say( L"Encountered %d errors in low-level tests", err_count );
 
@@ -3,10 +3,13 @@
 The universal variable server. fishd is automatically started by fish
 if a fishd server isn't already running. fishd reads any saved
 variables from ~/.fishd, and takes care of commonication between fish
-instances. When no clients are running, fishd will automatically shut
-down and save.
+instances. Every change is appended to a journal, which is
+periodically compacted into a snapshot of all variables. When no
+clients are running, fishd will automatically shut down and save.
 
 */
+#include "config.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <wchar.h>
@@ -16,6 +19,8 @@ down and save.
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <pwd.h>
 #include <fcntl.h>
 
@@ -23,6 +28,10 @@ down and save.
 #include <locale.h>
 #include <signal.h>
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #include "util.h"
 #include "common.h"
 #include "wutil.h"
@@ -45,6 +54,38 @@ down and save.
 */
 #define FILE ".fishd."
 
+/**
+   Suffix of the variable snapshot file
+*/
+#define SNAPSHOT_POSTFIX ".db"
+
+/**
+   Suffix of the variable journal file
+*/
+#define JOURNAL_POSTFIX ".log"
+
+/**
+   Suffix of the temporary file a new snapshot is written to before
+   it replaces the old one
+*/
+#define TMP_POSTFIX ".tmp"
+
+/**
+   Magic string at the start of the snapshot and journal files
+*/
+#define STORE_MAGIC "#fishd variable store 1\n"
+
+/**
+   The journal is compacted into a new snapshot once it has more than
+   this many records, and more records than the snapshot
+*/
+#define JOURNAL_MIN_COMPACT 256
+
+/**
+   Maximum number of events to handle per call to epoll_wait
+*/
+#define EVENT_COUNT 64
+
 /**
    Maximum length of hostname. Longer hostnames are truncated
 */
@@ -70,6 +111,81 @@ static connection_t *conn;
 */
 static int sock;
 
+/**
+   Set when a connection has been marked for removal by setting its
+   killme flag
+*/
+static int need_reap;
+
+/**
+   Updates received from clients that have not yet been broadcast.
+   Maps a variable name to the message describing its latest change,
+   so that several changes to the same variable received at once from
+   the same client are only sent once.
+*/
+static hash_table_t pending_updates;
+
+/**
+   The client that the updates in pending_updates were received from
+*/
+static connection_t *pending_src;
+
+/**
+   The client that messages are currently being read from
+*/
+static connection_t *current_src;
+
+/**
+   The names of the variables in pending_updates, in the order they
+   were first changed
+*/
+static array_list_t pending_order;
+
+#ifdef HAVE_SYS_EPOLL_H
+/**
+   The epoll instance used to wait for the socket and all client
+   connections
+*/
+static int epoll_fd;
+#endif
+
+/**
+   Header of a record in the snapshot or the journal. The record
+   header is followed by key_len characters of key and val_len
+   characters of value, neither of them null terminated.
+*/
+typedef struct
+{
+	/**
+	   The type of the update, one of SET, SET_EXPORT or ERASE
+	*/
+	int type;
+	/**
+	   Length of the variable name
+	*/
+	int key_len;
+	/**
+	   Length of the value. Always zero for ERASE records.
+	*/
+	int val_len;
+}
+	record_t;
+
+/**
+   File descriptor of the journal, opened for appending
+*/
+static int journal_fd = -1;
+
+/**
+   Number of records in the journal
+*/
+static int journal_records;
+
+/**
+   Number of records in the snapshot
+*/
+static int snapshot_records;
+
 /**
    Constructs the fish socket filename
 */
@@ -222,35 +338,93 @@ unlock:
 }
 
 /**
-   Event handler. Broadcasts updates to all clients.
+   Send all updates remembered by broadcast to all clients. The same
+   message is shared by all connections. It keeps a count of the
+   connections it has not been sent to yet, and is freed when that
+   count reaches zero.
 */
-static void broadcast( int type, const wchar_t *key, const wchar_t *val )
+static void flush_updates()
 {
 	connection_t *c;
-	message_t *msg;
+	int i;
 
-	if( !conn )
+	if( !al_get_count( &pending_order ) )
 		return;
 	
-	msg = create_message( type, key, val );
-	
 	/*
-	  Don't merge these loops, or try_send_all can free the message
+	  Don't merge these loops, or try_send_all can free a message
 	  prematurely
 	*/
-	
-	for( c = conn; c; c=c->next )
+	for( i=0; i<al_get_count( &pending_order ); i++ )
 	{
-		msg->count++;
-		q_put( &c->unsent, msg );
-	}	
+		wchar_t *name = (wchar_t *)al_get( &pending_order, i );
+		message_t *msg = (message_t *)hash_get( &pending_updates, name );
+		
+		for( c = conn; c; c=c->next )
+		{
+			msg->count++;
+			q_put( &c->unsent, msg );
+		}
+		
+		if( !msg->count )
+			free( msg );
+		
+		hash_remove( &pending_updates, name, 0, 0 );
+		free( name );
+	}
+	al_truncate( &pending_order, 0 );
+	pending_src = 0;
 	
 	for( c = conn; c; c=c->next )
 	{
 		try_send_all( c );
+		need_reap |= c->killme;
 	}	
 }
 
+/**
+   Event handler. Remembers updates so that they can be broadcast to
+   all clients by flush_updates.
+*/
+static void broadcast( int type, const wchar_t *key, const wchar_t *val )
+{
+	message_t *msg;
+	message_t *old;
+
+	if( !conn )
+		return;
+
+	/*
+	  A client ignores messages about a variable until it has seen
+	  the echo of its own latest write to it, so writes from different
+	  clients must never be merged
+	*/
+	if( current_src != pending_src )
+	{
+		flush_updates();
+		pending_src = current_src;
+	}
+	
+	msg = create_message( type, key, val );
+	
+	old = (message_t *)hash_get( &pending_updates, key );
+	if( old )
+	{
+		free( old );
+		hash_put( &pending_updates, hash_get_key( &pending_updates, key ), msg );
+	}
+	else
+	{
+		wchar_t *name = wcsdup( key );
+		if( !name )
+		{
+			die_mem();
+		}
+		hash_put( &pending_updates, name, msg );
+		al_push( &pending_order, name );
+	}
+}
+
 /**
    Make program into a creature of the night.
 */
@@ -273,6 +447,13 @@ static void daemonize()
 			act.sa_flags=0;
 			act.sa_handler=SIG_IGN;
 			sigaction( SIGHUP, &act, 0);
+			/*
+			  Clients no longer wait for the echo of their own
+			  writes, so they may hang up with messages still
+			  queued for them. Make that a write error on the
+			  connection instead of a fatal signal.
+			*/
+			sigaction( SIGPIPE, &act, 0);
 			break;
 		}
 		
@@ -297,15 +478,16 @@ static void daemonize()
 }
 
 /**
-   Load or save all variables
+   Construct the name of a file used to store the universal variables
+   of this host, by appending the specified suffix to
+   ~/.fishd.HOSTNAME. The returned string must be free()d.
 */
-void load_or_save( int save)
+static char *store_filename( const char *postfix )
 {
 	struct passwd *pw;
 	char *name;
 	char *dir = getenv( "HOME" );
 	char hostname[HOSTNAME_LEN];
-	connection_t c;
 	
 	if( !dir )
 	{
@@ -315,218 +497,659 @@ void load_or_save( int save)
 	
 	gethostname( hostname, HOSTNAME_LEN );
 	
-	name = malloc( strlen(dir)+ strlen(FILE)+ strlen(hostname) + 2 );
+	name = malloc( strlen(dir)+ strlen(FILE)+ strlen(hostname) + strlen(postfix) + 2 );
+	if( !name )
+	{
+		die_mem();
+	}
 	strcpy( name, dir );
 	strcat( name, "/" );
 	strcat( name, FILE );
 	strcat( name, hostname );
+	strcat( name, postfix );
+	return name;
+}
+
+/**
+   Append the header of a snapshot or journal file to the specified
+   buffer. The header includes the size of wchar_t, since that is
+   how the variables are stored.
+*/
+static void store_header( buffer_t *b )
+{
+	int wsize = sizeof( wchar_t );
+	b_append( b, STORE_MAGIC, strlen( STORE_MAGIC ) );
+	b_append( b, &wsize, sizeof( int ) );
+}
+
+/**
+   Append a record describing an update to the specified buffer
+*/
+static void store_record( buffer_t *b, int type, const wchar_t *key, const wchar_t *val )
+{
+	record_t r;
 	
-	debug( 1, L"Open file for %s: '%s'", 
-		   save?"saving":"loading", 
-		   name );
+	r.type = type;
+	r.key_len = wcslen( key );
+	r.val_len = (type==ERASE)?0:wcslen( val );
 	
-	c.fd = open( name, save?(O_CREAT | O_TRUNC | O_WRONLY):O_RDONLY, 0600);
-	free( name );
+	b_append( b, &r, sizeof( record_t ) );
+	b_append( b, key, sizeof( wchar_t )*r.key_len );
+	if( r.val_len )
+		b_append( b, val, sizeof( wchar_t )*r.val_len );
+}
+
+/**
+   Write the whole buffer to the specified file descriptor
+
+   \return 0 on success, -1 on failure
+*/
+static int write_all( int fd, buffer_t *b )
+{
+	size_t done = 0;
 	
-	if( c.fd == -1 )
+	while( done < b->used )
 	{
-		debug( 1, L"Could not open load/save file. No previous saves?" );
-		wperror( L"open" );
-		return;		
+		ssize_t res = write( fd, b->buff+done, b->used-done );
+		if( res == -1 )
+		{
+			if( errno == EINTR )
+				continue;
+			return -1;
+		}
+		done += res;
 	}
-	debug( 1, L"File open on fd %d", c.fd );
+	return 0;
+}
 
-	sb_init( &c.input );
-	memset (&c.wstate, '\0', sizeof (mbstate_t));
-	q_init( &c.unsent );
+/**
+   Apply the updates stored in the specified snapshot or journal
+   data. Replay stops at the first incomplete record, which is what
+   is left behind if fishd dies while appending to the journal.
 
-	if( save )
-		enqueue_all( &c );
-	else
-		read_message( &c );
+   \return the number of records applied, or -1 if the data does not
+   have a valid header
+*/
+static int store_replay( const char *data, size_t len )
+{
+	size_t pos = strlen( STORE_MAGIC ) + sizeof( int );
+	int wsize;
+	int count = 0;
+	wchar_t nul = 0;
+	buffer_t key, val;
+	
+	if( len < pos || memcmp( data, STORE_MAGIC, strlen( STORE_MAGIC ) ) != 0 )
+		return -1;
+	
+	memcpy( &wsize, data+strlen( STORE_MAGIC ), sizeof( int ) );
+	if( wsize != sizeof( wchar_t ) )
+		return -1;
+
+	b_init( &key );
+	b_init( &val );
+	
+	while( len - pos >= sizeof( record_t ) )
+	{
+		record_t r;
+		size_t need;
+		
+		memcpy( &r, data+pos, sizeof( record_t ) );
+		if( r.key_len <= 0 || r.val_len < 0 )
+			break;
+		
+		need = sizeof( record_t ) + sizeof( wchar_t )*((size_t)r.key_len + r.val_len);
+		if( len - pos < need )
+			break;
+		pos += sizeof( record_t );
+
+		/*
+		  The mapping need not be aligned for wchar_t, so the strings
+		  are copied out instead of being used in place
+		*/
+		key.used = val.used = 0;
+		b_append( &key, data+pos, sizeof( wchar_t )*r.key_len );
+		b_append( &key, &nul, sizeof( wchar_t ) );
+		pos += sizeof( wchar_t )*r.key_len;
+		b_append( &val, data+pos, sizeof( wchar_t )*r.val_len );
+		b_append( &val, &nul, sizeof( wchar_t ) );
+		pos += sizeof( wchar_t )*r.val_len;
+
+		switch( r.type )
+		{
+			case SET:
+			case SET_EXPORT:
+				env_universal_common_set( (wchar_t *)key.buff,
+										  (wchar_t *)val.buff,
+										  r.type == SET_EXPORT );
+				break;
+
+			case ERASE:
+				env_universal_common_remove( (wchar_t *)key.buff );
+				break;
+		}
+		count++;
+	}
 
-	q_destroy( &c.unsent );
-	sb_destroy( &c.input );
-	close( c.fd );
+	b_destroy( &key );
+	b_destroy( &val );
+	return count;
 }
 
-static void load()
+/**
+   Map the specified snapshot or journal file into memory and apply
+   the updates it contains.
+
+   \return the number of records applied, or -1 if the file could not
+   be read
+*/
+static int store_load( const char *name )
 {
-	load_or_save(0);
+	struct stat buf;
+	void *data;
+	int fd;
+	int res;
+	
+	fd = open( name, O_RDONLY );
+	if( fd == -1 )
+		return -1;
+
+	if( fstat( fd, &buf ) == -1 )
+	{
+		wperror( L"fstat" );
+		close( fd );
+		return -1;
+	}
+	
+	if( buf.st_size == 0 )
+	{
+		close( fd );
+		return 0;
+	}
+	
+	data = mmap( 0, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if( data == MAP_FAILED )
+	{
+		wperror( L"mmap" );
+		return -1;
+	}
+	
+	res = store_replay( (char *)data, buf.st_size );
+	if( res == -1 )
+	{
+		debug( 1, L"File '%s' is not a valid fishd variable store", name );
+	}
+	munmap( data, buf.st_size );
+	return res;
 }
 
+/**
+   Start a new, empty journal and open it for appending
+*/
+static void journal_reset()
+{
+	char *name = store_filename( JOURNAL_POSTFIX );
+	buffer_t b;
+	
+	if( journal_fd != -1 )
+		close( journal_fd );
+	
+	journal_fd = open( name, 
+					   O_CREAT | O_WRONLY | O_APPEND | O_TRUNC, 
+					   0600 );
+	free( name );
+	
+	if( journal_fd == -1 )
+	{
+		debug( 1, L"Could not open journal file" );
+		wperror( L"open" );
+		return;
+	}
+	
+	b_init( &b );
+	store_header( &b );
+	if( write_all( journal_fd, &b ) == -1 )
+	{
+		wperror( L"write" );
+	}
+	b_destroy( &b );
+	journal_records = 0;
+}
 
+/**
+   Write all variables to a new snapshot and empty the journal. The
+   snapshot is written to a temporary file which is then renamed over
+   the old one, so there is always a complete snapshot on disk. If
+   fishd dies before the journal is emptied, replaying the journal on
+   top of the new snapshot gives the same result.
+*/
 static void save()
 {
-	load_or_save(1);
+	char *name = store_filename( SNAPSHOT_POSTFIX );
+	char *tmp = store_filename( SNAPSHOT_POSTFIX TMP_POSTFIX );
+	array_list_t names;
+	buffer_t b;
+	int fd;
+	int i;
+	
+	debug( 1, L"Write snapshot to '%s'", name );
+
+	b_init( &b );
+	al_init( &names );
+	store_header( &b );
+	env_universal_common_get_names( &names, 1, 1 );
+	for( i=0; i<al_get_count( &names ); i++ )
+	{
+		wchar_t *key = (wchar_t *)al_get( &names, i );
+		store_record( &b, 
+					  env_universal_common_get_export( key )?SET_EXPORT:SET,
+					  key,
+					  env_universal_common_get( key ) );
+	}
+	
+	fd = open( tmp, O_CREAT | O_TRUNC | O_WRONLY, 0600 );
+	if( fd == -1 )
+	{
+		debug( 1, L"Could not open snapshot file" );
+		wperror( L"open" );
+	}
+	else
+	{
+		if( write_all( fd, &b ) == -1 || fsync( fd ) == -1 )
+		{
+			wperror( L"write" );
+			close( fd );
+			unlink( tmp );
+		}
+		else
+		{
+			close( fd );
+			if( rename( tmp, name ) == -1 )
+			{
+				wperror( L"rename" );
+				unlink( tmp );
+			}
+			else
+			{
+				snapshot_records = al_get_count( &names );
+				journal_reset();
+			}
+		}
+	}
+	
+	al_destroy( &names );
+	b_destroy( &b );
+	free( tmp );
+	free( name );
 }
 
 /**
-   Do all sorts of boring initialization.
+   Append an update to the journal, and compact the journal into a
+   new snapshot when it has grown larger than the snapshot
 */
-static void init()
+static void journal_append( int type, const wchar_t *key, const wchar_t *val )
 {
-	program_name=L"fishd";
+	buffer_t b;
 
-	sock = get_socket();
-	daemonize();	
-	fish_setlocale( LC_ALL, L"" );	
-	env_universal_common_init( &broadcast );
+	if( journal_fd == -1 )
+		return;
 	
-	load();	
+	b_init( &b );
+	store_record( &b, type, key, val );
+	if( write_all( journal_fd, &b ) == -1 )
+	{
+		wperror( L"write" );
+	}
+	b_destroy( &b );
+	
+	journal_records++;
+	if( journal_records > maxi( JOURNAL_MIN_COMPACT, snapshot_records ) )
+	{
+		save();
+	}
 }
 
+/**
+   Load the variables saved in the text format used by earlier
+   versions of fishd, which have no snapshot or journal
+*/
+static void load_legacy()
+{
+	char *name = store_filename( "" );
+	connection_t c;
+	int fd;
+	
+	fd = open( name, O_RDONLY );
+	free( name );
+	
+	if( fd == -1 )
+	{
+		debug( 1, L"Could not open load file. No previous saves?" );
+		return;		
+	}
+	debug( 1, L"File open on fd %d", fd );
 
-int main( int argc, char ** argv )
+	connection_init( &c, fd );
+	read_message( &c );
+	connection_destroy( &c );
+	close( fd );
+}
+
+/**
+   Load all variables from the snapshot and replay the journal on top
+   of it. Falls back to the old text format if there is no snapshot.
+*/
+static void load()
 {
-	int child_socket, t;
-	struct sockaddr_un remote;
-	int max_fd;
-	int update_count=0;
+	char *name = store_filename( SNAPSHOT_POSTFIX );
+	int res = store_load( name );
+	free( name );
 	
-	fd_set read_fd, write_fd;
+	if( res == -1 )
+	{
+		debug( 1, L"No snapshot found, looking for old style save file" );
+		load_legacy();
+		save();
+		return;
+	}
 	
-	init();
+	snapshot_records = res;
 	
-	while(1) 
+	name = store_filename( JOURNAL_POSTFIX );
+	res = store_load( name );
+	free( name );
+
+	/*
+	  Compact right away, so that new records are never appended
+	  after a partially written one
+	*/
+	if( res > 0 )
+		save();
+	else
+		journal_reset();
+}
+
+/**
+   Callback for updates received from clients. Records the update in
+   the journal and remembers it for broadcasting. A barrier request
+   from a client causes all remembered updates to be sent, so that
+   they reach the client before the barrier reply.
+*/
+static void update( int type, const wchar_t *key, const wchar_t *val )
+{
+	switch( type )
 	{
-		connection_t *c;
-		int res;
+		case SET:
+		case SET_EXPORT:
+		case ERASE:
+			journal_append( type, key, val );
+			broadcast( type, key, val );
+			break;
 
-		t=sizeof( remote );		
-		
-		FD_ZERO( &read_fd );
-		FD_ZERO( &write_fd );
-		FD_SET( sock, &read_fd );
-		max_fd = sock+1;
-		for( c=conn; c; c=c->next )
+		case BARRIER:
+			flush_updates();
+			break;
+	}
+}
+
+/**
+   Start waiting for events on the specified connection
+*/
+static void watch( connection_t *c )
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+
+	/*
+	  Connections are edge triggered, since read_message and
+	  try_send_all always continue until the socket would block
+	*/
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.ptr = c;
+	if( epoll_ctl( epoll_fd, EPOLL_CTL_ADD, c->fd, &ev ) == -1 )
+	{
+		wperror( L"epoll_ctl" );
+		c->killme = 1;
+		need_reap = 1;
+	}
+#endif
+}
+
+/**
+   Accept all pending connections on the socket
+*/
+static void accept_connections()
+{
+	while( 1 )
+	{
+		struct sockaddr_un remote;
+		socklen_t t = sizeof( remote );
+		int child_socket = accept( sock, (struct sockaddr *)&remote, &t );
+		connection_t *new;
+
+		if( child_socket == -1 )
 		{
-			FD_SET( c->fd, &read_fd );
-			max_fd = maxi( max_fd, c->fd+1);
-			
-			if( ! q_empty( &c->unsent ) )
-			{
-				FD_SET( c->fd, &write_fd );
-			}
+			if( errno == EAGAIN || errno == EINTR )
+				return;
+			wperror( L"accept" );
+			exit(1);
 		}
-		
-		res=select( max_fd, &read_fd, &write_fd, 0, 0 );
-		
-		if( res==-1 )
+
+		debug( 1, L"Connected with new child on fd %d", child_socket );
+
+		if( fcntl( child_socket, F_SETFL, O_NONBLOCK ) != 0 )
 		{
-			wperror( L"select" );
-			exit(1);
+			wperror( L"fcntl" );
+			close( child_socket );
+			continue;
 		}
+
+		new = malloc( sizeof(connection_t));
+		if( !new )
+		{
+			die_mem();
+		}
+		connection_init( new, child_socket );
+		new->next = conn;
+		send( new->fd, GREETING, strlen(GREETING), MSG_DONTWAIT );
+		enqueue_all( new );				
+		conn=new;
+		watch( new );
+	}
+}
+
+/**
+   Wait for something to happen on the socket or on any of the
+   connections, and handle it
+*/
+static void handle_events()
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event events[EVENT_COUNT];
+	int i;
+	int res = epoll_wait( epoll_fd, events, EVENT_COUNT, -1 );
+	
+	if( res == -1 )
+	{
+		if( errno == EINTR )
+			return;
+		wperror( L"epoll_wait" );
+		exit(1);
+	}
+	
+	for( i=0; i<res; i++ )
+	{
+		connection_t *c = (connection_t *)events[i].data.ptr;
 		
-		if( FD_ISSET( sock, &read_fd ) )
+		if( !c )
 		{
-			if( (child_socket = 
-				 accept( sock, 
-						 (struct sockaddr *)&remote, 
-						 &t) ) == -1) {
-				wperror( L"accept" );
-				exit(1);
-			}
-			else
-			{
-				debug( 1, L"Connected with new child on fd %d", child_socket );
-
-				if( fcntl( child_socket, F_SETFL, O_NONBLOCK ) != 0 )
-				{
-					wperror( L"fcntl" );
-					close( child_socket );		
-				}
-				else
-				{
-					connection_t *new = malloc( sizeof(connection_t));
-					new->fd = child_socket;
-					new->next = conn;
-					q_init( &new->unsent );
-					new->killme=0;				
-					sb_init( &new->input );
-					memset (&new->wstate, '\0', sizeof (mbstate_t));					
-					send( new->fd, GREETING, strlen(GREETING), MSG_DONTWAIT );
-					enqueue_all( new );				
-					conn=new;
-				}
-			}
+			accept_connections();
+			continue;
 		}
 		
-		for( c=conn; c; c=c->next )
+		if( events[i].events & EPOLLOUT )
 		{
-			if( FD_ISSET( c->fd, &write_fd ) )
-			{
-				try_send_all( c );
-			}
+			try_send_all( c );
 		}
 		
-		for( c=conn; c; c=c->next )
+		if( events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP) )
 		{
-			if( FD_ISSET( c->fd, &read_fd ) )
-			{
-				read_message( c );
-
-				/*
-				  Occasionally we save during normal use, so that we
-				  won't lose everything on a system crash
-				*/
-				update_count++;
-				if( update_count >= 64 )
-				{
-					save();
-					update_count = 0;
-				}
-			}
+			current_src = c;
+			read_message( c );
 		}
+		need_reap |= c->killme;
+	}
+#else
+	connection_t *c;
+	int max_fd;
+	int res;
+	fd_set read_fd, write_fd;
+
+	FD_ZERO( &read_fd );
+	FD_ZERO( &write_fd );
+	FD_SET( sock, &read_fd );
+	max_fd = sock+1;
+	for( c=conn; c; c=c->next )
+	{
+		FD_SET( c->fd, &read_fd );
+		max_fd = maxi( max_fd, c->fd+1);
 		
-		connection_t *prev=0;
-		c=conn;
+		if( ! q_empty( &c->unsent ) )
+		{
+			FD_SET( c->fd, &write_fd );
+		}
+	}
+	
+	res=select( max_fd, &read_fd, &write_fd, 0, 0 );
+	
+	if( res==-1 )
+	{
+		if( errno == EINTR )
+			return;
+		wperror( L"select" );
+		exit(1);
+	}
+	
+	if( FD_ISSET( sock, &read_fd ) )
+	{
+		accept_connections();
+	}
+	
+	for( c=conn; c; c=c->next )
+	{
+		if( FD_ISSET( c->fd, &write_fd ) )
+		{
+			try_send_all( c );
+		}
 		
-		while( c )
+		if( FD_ISSET( c->fd, &read_fd ) )
+		{
+			current_src = c;
+			read_message( c );
+		}
+		need_reap |= c->killme;
+	}
+#endif
+}
+
+/**
+   Close and remove all connections that have their killme flag
+   set. When the last client is gone, save and exit.
+*/
+static void reap_connections()
+{
+	connection_t *prev=0;
+	connection_t *c=conn;
+
+	if( !need_reap )
+		return;
+	need_reap = 0;
+	
+	while( c )
+	{
+		if( c->killme )
 		{
-			if( c->killme )
+			debug( 1, L"Close connection %d", c->fd );
+			
+			close(c->fd );
+			connection_destroy( c );
+			
+			if( prev )
 			{
-				debug( 1, L"Close connection %d", c->fd );
-
-				close(c->fd );
-				sb_destroy( &c->input );
-
-				while( !q_empty( &c->unsent ) )
-				{
-					message_t *msg = (message_t *)q_get( &c->unsent );
-					msg->count--;
-					if( !msg->count )
-						free( msg );
-				}
-				
-				q_destroy( &c->unsent );				
-				if( prev )
-				{
-					prev->next=c->next;
-				}
-				else
-				{
-					conn=c->next;
-				}
-				
-				free(c);
-				
-				c=(prev?prev->next:conn);
-				
+				prev->next=c->next;
 			}
 			else
 			{
-				prev=c;
-				c=c->next;
+				conn=c->next;
 			}
+			
+			free(c);
+			
+			c=(prev?prev->next:conn);
 		}
-		if( !conn )
+		else
 		{
-			debug( 0, L"No more clients. Quitting" );
-			save();			
-			env_universal_common_destroy();
-			exit(0);
+			prev=c;
 			c=c->next;
-		}		
+		}
+	}
+
+	if( !conn )
+	{
+		debug( 0, L"No more clients. Quitting" );
+		save();			
+		env_universal_common_destroy();
+		exit(0);
+	}		
+}
+
+/**
+   Do all sorts of boring initialization.
+*/
+static void init()
+{
+	program_name=L"fishd";
+
+	sock = get_socket();
+	daemonize();	
+	fish_setlocale( LC_ALL, L"" );	
+	env_universal_common_init( &update );
+	hash_init( &pending_updates, &hash_wcs_func, &hash_wcs_cmp );
+	al_init( &pending_order );
+
+#ifdef HAVE_SYS_EPOLL_H
+	{
+		struct epoll_event ev;
+		
+		epoll_fd = epoll_create( EVENT_COUNT );
+		if( epoll_fd == -1 )
+		{
+			wperror( L"epoll_create" );
+			exit(1);
+		}
+		
+		ev.events = EPOLLIN;
+		ev.data.ptr = 0;
+		if( epoll_ctl( epoll_fd, EPOLL_CTL_ADD, sock, &ev ) == -1 )
+		{
+			wperror( L"epoll_ctl" );
+			exit(1);
+		}
+	}
+#endif
+	
+	load();	
+}
+
+
+int main( int argc, char ** argv )
+{
+	init();
+	
+	while(1) 
+	{
+		handle_events();
+		flush_updates();
+		reap_connections();
 	}
 }
@@ -0,0 +1,274 @@
+/*
+	A small utility that simulates many fish instances talking to a
+	running fishd at the same time, and reports how long it took fishd
+	to distribute all the updates.
+
+	Usage: fishd_load [CLIENTS [UPDATES]]
+
+	Every client sets UPDATES universal variables, chosen from a small
+	set of names so that the clients overwrite each others values,
+	erases them again and waits for the reply to a barrier. fishd must
+	already be running, e.g. because a fish instance is. The number of
+	clients is limited by FD_SETSIZE.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <wchar.h>
+
+#include "util.h"
+#include "env_universal_common.h"
+
+/**
+   Number of different variable names used
+*/
+#define VAR_COUNT 16
+
+/**
+   The reply to a barrier, as sent by fishd
+*/
+#define REPLY "BARRIER_REPLY\n"
+
+/**
+   A simulated client
+*/
+typedef struct
+{
+	/**
+	   The socket connected to fishd
+	*/
+	int fd;
+	/**
+	   The messages to send to fishd
+	*/
+	char *out;
+	/**
+	   Length of out
+	*/
+	int out_len;
+	/**
+	   Number of bytes of out already sent
+	*/
+	int out_pos;
+	/**
+	   The last characters received, used to find the barrier reply
+	*/
+	char tail[sizeof(REPLY)];
+	/**
+	   Number of messages received
+	*/
+	int received;
+	/**
+	   Set once the barrier reply has been received
+	*/
+	int done;
+}
+	client_t;
+
+/**
+   Connect to the fishd socket, using the same name as fish does
+*/
+static int connect_fishd()
+{
+	struct sockaddr_un local;
+	char *dir = getenv( "FISHD_SOCKET_DIR" );
+	char *uname = getenv( "USER" );
+	int s;
+
+	if( !dir )
+		dir = "/tmp";
+	if( !uname )
+		uname = getpwuid( getuid() )->pw_name;
+
+	local.sun_family = AF_UNIX;
+	snprintf( local.sun_path, sizeof( local.sun_path ), "%s/%s%s", dir, SOCK_FILENAME, uname );
+
+	if( ( s = socket( AF_UNIX, SOCK_STREAM, 0 ) ) == -1 )
+		return -1;
+
+	if( connect( s, (struct sockaddr *)&local, sizeof( local ) ) == -1 ||
+		fcntl( s, F_SETFL, O_NONBLOCK ) == -1 )
+	{
+		close( s );
+		return -1;
+	}
+	return s;
+}
+
+/**
+   Create the messages the specified client will send
+*/
+static void make_messages( client_t *c, int id, int updates )
+{
+	int i;
+	int size = 64*(updates + VAR_COUNT + 1);
+	int pos = 0;
+
+	c->out = malloc( size );
+	if( !c->out )
+	{
+		perror( "malloc" );
+		exit( 1 );
+	}
+
+	for( i=0; i<updates; i++ )
+	{
+		pos += sprintf( c->out+pos, "SET fishd_load_%d:%d_%d\n", i%VAR_COUNT, id, i );
+	}
+	for( i=0; i<VAR_COUNT; i++ )
+	{
+		pos += sprintf( c->out+pos, "ERASE fishd_load_%d\n", i );
+	}
+	pos += sprintf( c->out+pos, "BARRIER\n" );
+	c->out_len = pos;
+}
+
+/**
+   Read everything available from fishd on the specified client
+*/
+static void read_client( client_t *c )
+{
+	char buff[4096];
+	int res;
+	int i;
+
+	while( ( res = read( c->fd, buff, sizeof( buff ) ) ) > 0 )
+	{
+		for( i=0; i<res; i++ )
+		{
+			memmove( c->tail, c->tail+1, sizeof( REPLY )-2 );
+			c->tail[sizeof( REPLY )-2] = buff[i];
+			if( buff[i] == '\n' )
+			{
+				c->received++;
+				if( strcmp( c->tail, REPLY ) == 0 )
+					c->done = 1;
+			}
+		}
+	}
+
+	if( res == 0 || ( errno != EAGAIN && errno != EINTR ) )
+	{
+		fprintf( stderr, "fishd_load: Lost connection to fishd\n" );
+		exit( 1 );
+	}
+}
+
+int main( int argc, char **argv )
+{
+	int count = argc>1?atoi( argv[1] ):100;
+	int updates = argc>2?atoi( argv[2] ):100;
+	int done = 0;
+	int received = 0;
+	client_t *clients;
+	long long t1, t2;
+	int i;
+
+	if( count <= 0 || updates < 0 )
+	{
+		fprintf( stderr, "Usage: fishd_load [CLIENTS [UPDATES]]\n" );
+		return 1;
+	}
+
+	clients = calloc( count, sizeof( client_t ) );
+	if( !clients )
+	{
+		perror( "calloc" );
+		return 1;
+	}
+
+	for( i=0; i<count; i++ )
+	{
+		clients[i].fd = connect_fishd();
+		if( clients[i].fd == -1 )
+		{
+			fprintf( stderr, "fishd_load: Could not connect to fishd. Is it running?\n" );
+			return 1;
+		}
+		if( clients[i].fd >= FD_SETSIZE )
+		{
+			fprintf( stderr, "fishd_load: Too many clients\n" );
+			return 1;
+		}
+		make_messages( &clients[i], i, updates );
+	}
+
+	t1 = get_time();
+
+	while( done < count )
+	{
+		fd_set read_fd, write_fd;
+		int max_fd = 0;
+
+		FD_ZERO( &read_fd );
+		FD_ZERO( &write_fd );
+		for( i=0; i<count; i++ )
+		{
+			client_t *c = &clients[i];
+			if( c->done )
+				continue;
+			FD_SET( c->fd, &read_fd );
+			if( c->out_pos < c->out_len )
+				FD_SET( c->fd, &write_fd );
+			max_fd = maxi( max_fd, c->fd+1 );
+		}
+
+		if( select( max_fd, &read_fd, &write_fd, 0, 0 ) == -1 )
+		{
+			if( errno == EINTR )
+				continue;
+			perror( "select" );
+			return 1;
+		}
+
+		for( i=0; i<count; i++ )
+		{
+			client_t *c = &clients[i];
+			if( c->done )
+				continue;
+
+			if( FD_ISSET( c->fd, &write_fd ) )
+			{
+				int res = write( c->fd, c->out+c->out_pos, c->out_len-c->out_pos );
+				if( res > 0 )
+					c->out_pos += res;
+			}
+
+			if( FD_ISSET( c->fd, &read_fd ) )
+			{
+				read_client( c );
+				if( c->done )
+				{
+					done++;
+					received += c->received;
+				}
+			}
+		}
+	}
+
+	t2 = get_time();
+
+	printf( "%d clients sent %d updates each in %.3f seconds, %f microseconds per update\n",
+			count,
+			updates,
+			(double)(t2-t1)/1000000,
+			(double)(t2-t1)/((double)count*(updates+VAR_COUNT)) );
+	printf( "Clients received %d messages, %f per update\n",
+			received,
+			(double)received/((double)count*(updates+VAR_COUNT)) );
+
+	for( i=0; i<count; i++ )
+	{
+		close( clients[i].fd );
+		free( clients[i].out );
+	}
+	free( clients );
+	return 0;
+}
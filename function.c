@@ -16,6 +16,7 @@
 #include "common.h"
 #include "intern.h"
 #include "event.h"
+#include "tokenizer.h"
 
 
 /**
@@ -28,6 +29,10 @@ typedef struct
 	/** Function description */
 	wchar_t *desc;	
 	int is_binding;
+	/** Pre-lexed tokens of the definition, created on first call */
+	tok_cache_t *tokens;
+	/** Set if the definition has been tokenized, even if that failed */
+	int is_tokenized;
 }
 	function_data_t;
 
@@ -45,6 +50,8 @@ static void clear_function_entry( const void *key,
 	function_data_t *d = (function_data_t *)data;
 	free( (void *)d->cmd );
 	free( (void *)d->desc );
+	if( d->tokens )
+		tok_cache_release( d->tokens );
 	free( (void *)d );
 }
 
@@ -76,6 +83,8 @@ void function_add( const wchar_t *name,
 	d->cmd = wcsdup( val );
 	d->desc = desc?wcsdup( desc ):0;
 	d->is_binding = is_binding;
+	d->tokens = 0;
+	d->is_tokenized = 0;
 	hash_put( &function, intern(name), d );
 
 	for( i=0; i<al_get_count( events ); i++ )
@@ -120,6 +129,21 @@ const wchar_t *function_get_definition( const wchar_t *argv )
 	return data->cmd;
 }
 	
+tok_cache_t *function_get_tokens( const wchar_t *argv )
+{
+	function_data_t *data = 
+		(function_data_t *)hash_get( &function, argv );
+	if( data == 0 )
+		return 0;
+
+	if( !data->is_tokenized )
+	{
+		data->tokens = tok_cache_create( data->cmd );
+		data->is_tokenized = 1;
+	}
+	return data->tokens;
+}
+	
 const wchar_t *function_get_desc( const wchar_t *argv )
 {
 	function_data_t *data = 
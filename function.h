@@ -11,6 +11,7 @@
 #include <wchar.h>
 
 #include "util.h"
+#include "tokenizer.h"
 
 /**
    Initialize function data   
@@ -45,6 +46,17 @@ int function_use_vars( const wchar_t *name );
 */
 const wchar_t *function_get_definition( const wchar_t *name );
 
+/**
+   Returns the pre-lexed tokens of the definition of the function
+   with the name \c name. The tokens are created the first time
+   this function is called, and are discarded when the function is
+   redefined or removed. Use tok_init_cached() or eval_cached() to
+   keep them alive while in use.
+
+   \return the tokens, or 0 if the function does not exist or its definition could not be tokenized
+*/
+tok_cache_t *function_get_tokens( const wchar_t *name );
+
 /**
    Returns the description of the function with the name \c name.
 */
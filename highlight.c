@@ -32,6 +32,47 @@ static void highlight_universal_internal( wchar_t * buff,
 										  int pos, 
 										  array_list_t *error );
 
+/**
+   The highlighting of one iteration of the token loop in
+   highlight_shell, i.e. of a single token, or of a redirection and
+   its target. Only depends on the text of the tokens and on the
+   command state before them, so it can be reused when the command
+   line is edited elsewhere.
+*/
+typedef struct
+{
+	/** Offset of the first token */
+	int start;
+	/** Offset where the tokenizer continues after the last token */
+	int end;
+	/** Whether a command had been seen before the token */
+	int had_cmd;
+	/** The last command seen before the token, or 0 */
+	wchar_t *last_cmd;
+	/** Number of colors set */
+	int color_count;
+	/** Offsets of the colors set */
+	int color_pos[2];
+	/** The colors set */
+	int color_val[2];
+}
+highlight_item_t;
+
+/**
+   The command line that was last highlighted by highlight_shell
+*/
+static wchar_t *item_buff;
+
+/**
+   The highlighted tokens of item_buff
+*/
+static highlight_item_t *item_arr;
+
+/**
+   Number of tokens in item_arr
+*/
+static int item_count;
+
 
 /**
    The environment variables used to specify the color of different tokens.
@@ -56,6 +97,91 @@ static wchar_t *hightlight_var[] =
 	;
 
 
+/**
+   Function used to check whether the current highlighting should be
+   abandoned. May be 0.
+*/
+static int (*cancel_func)();
+
+void highlight_set_cancel_func( int (*f)() )
+{
+	cancel_func = f;
+}
+
+/**
+   Free the commands of the specified range of highlighted tokens
+*/
+static void item_free_range( highlight_item_t *arr, int from, int to )
+{
+	int i;
+	for( i=from; i<to; i++ )
+		free( arr[i].last_cmd );
+}
+
+void highlight_cache_flush()
+{
+	item_free_range( item_arr, 0, item_count );
+	free( item_arr );
+	free( item_buff );
+	item_arr = 0;
+	item_buff = 0;
+	item_count = 0;
+}
+
+/**
+   Append a highlighted token to the specified array, growing it if
+   needed, and return the new token.
+*/
+static highlight_item_t *item_add( highlight_item_t **arr, 
+								   int *count, 
+								   int *size )
+{
+	if( *count >= *size )
+	{
+		int new_size = maxi( 32, 2*(*size) );
+		highlight_item_t *new_arr = realloc( *arr, sizeof(highlight_item_t)*new_size );
+		if( !new_arr )
+		{
+			die_mem();
+		}
+		*arr = new_arr;
+		*size = new_size;
+	}
+	return &(*arr)[(*count)++];
+}
+
+/**
+   Find the highlighted token of the previous command line that starts
+   at the specified offset. Returns its index, or -1 if there is
+   none. Only tokens from index \c from and on are searched.
+*/
+static int item_search( int start, int from )
+{
+	int lo = from, hi = item_count-1;
+	while( lo <= hi )
+	{
+		int mid = lo + (hi-lo)/2;
+		if( item_arr[mid].start == start )
+			return mid;
+		if( item_arr[mid].start < start )
+			lo = mid+1;
+		else
+			hi = mid-1;
+	}
+	return -1;
+}
+
+/**
+   Set the colors of a highlighted token, moved by the specified
+   offset.
+*/
+static void item_apply( highlight_item_t *item, int *color, int delta )
+{
+	int i;
+	for( i=0; i<item->color_count; i++ )
+		color[item->color_pos[i]+delta] = item->color_val[i];
+}
+
 int highlight_get_color( int highlight )
 {
 	if( highlight < 0 )
@@ -76,10 +202,17 @@ int highlight_get_color( int highlight )
 }
 
 
-void highlight_shell( wchar_t * buff, 
-					  int *color, 
-					  int pos, 
-					  array_list_t *error )
+/**
+   Perform syntax highlighting for the shell commands in buff. If
+   use_cache is true, the tokens of the previous command line that
+   lie before and after the edited part of it are not highlighted
+   again. Instead, their colors are taken from the previous call.
+*/
+static void highlight_shell_internal( wchar_t * buff, 
+									  int *color, 
+									  int pos, 
+									  array_list_t *error,
+									  int use_cache )
 {
 	tokenizer tok;
 	int had_cmd=0;
@@ -87,6 +220,14 @@ void highlight_shell( wchar_t * buff,
 	int last_val;
 	wchar_t *last_cmd=0;
 	int len = wcslen(buff);
+
+	highlight_item_t *new_arr=0;
+	int new_count=0, new_size=0;
+	int reused=0;
+	int suffix=-1;
+	int suffix_len=0;
+	int delta=0;
+	int cancelled=0;
 	
 	if( !len )
 		return;
@@ -94,12 +235,83 @@ void highlight_shell( wchar_t * buff,
 	for( i=0; buff[i] != 0; i++ )
 		color[i] = -1;
 	
-	for( tok_init( &tok, buff, TOK_SHOW_COMMENTS );
-		 tok_has_next( &tok );
-		 tok_next( &tok ) )
+	tok_init( &tok, buff, TOK_SHOW_COMMENTS );
+
+	if( use_cache && item_buff )
+	{
+		int old_len = wcslen( item_buff );
+		int prefix_len=0;
+		int max;
+		
+		while( prefix_len < mini( len, old_len ) && 
+			   buff[prefix_len] == item_buff[prefix_len] )
+			prefix_len++;
+		
+		max = mini( len, old_len ) - prefix_len;
+		while( suffix_len < max && 
+			   buff[len-suffix_len-1] == item_buff[old_len-suffix_len-1] )
+			suffix_len++;
+
+		delta = len - old_len;
+		
+		/*
+		  Reuse the tokens before the edit. The command and subcommand
+		  checks look at the token after the current one, so the
+		  following token must be before the edit as well.
+		*/
+		while( reused+1 < item_count && 
+			   item_arr[reused+1].end < prefix_len )
+		{
+			item_apply( &item_arr[reused], color, 0 );
+			*item_add( &new_arr, &new_count, &new_size ) = item_arr[reused];
+			reused++;
+		}
+
+		if( reused )
+		{
+			had_cmd = item_arr[reused].had_cmd;
+			last_cmd = item_arr[reused].last_cmd?wcsdup( item_arr[reused].last_cmd ):0;
+			tok_set_pos( &tok, item_arr[reused-1].end );
+		}
+	}
+	
+	for( ; tok_has_next( &tok ); tok_next( &tok ) )
 	{	
 		int last_type = tok_last_type( &tok );
 		int prev_argc=0;
+		int item_start = tok_get_pos( &tok );
+		int item_had_cmd = had_cmd;
+		wchar_t *item_cmd = 0;
+		
+		if( cancel_func && cancel_func() )
+		{
+			cancelled = 1;
+			break;
+		}
+		
+		if( use_cache )
+		{
+			/*
+			  If we have reached a token after the edit, and the
+			  command state is the same as last time, the rest of the
+			  command line is highlighted like last time.
+			*/
+			if( item_buff && ( item_start >= len - suffix_len ) )
+			{
+				int idx = item_search( item_start - delta, reused );
+				if( idx >= 0 && 
+					item_arr[idx].had_cmd == had_cmd &&
+					( last_cmd ? 
+					  ( item_arr[idx].last_cmd && wcscmp( last_cmd, item_arr[idx].last_cmd ) == 0 ) :
+					  !item_arr[idx].last_cmd ) )
+				{
+					suffix = idx;
+					break;
+				}
+			}
+			
+			item_cmd = last_cmd?wcsdup( last_cmd ):0;
+		}
 		
 		switch( last_type )
 		{
@@ -177,7 +389,7 @@ void highlight_shell( wchar_t * buff,
 							*/
 							is_cmd |= builtin_exists( cmd );
 							is_cmd |= function_exists( cmd );
-							is_cmd |= (tmp=get_filename( cmd )) != 0;
+							is_cmd |= (tmp=get_filename_cached( cmd )) != 0;
 							
 							/* 
 							   Could not find the command. Maybe it is a path for a implicit cd command.
@@ -347,6 +559,72 @@ void highlight_shell( wchar_t * buff,
 				break;				
 			}			
 		}
+
+		if( use_cache )
+		{
+			highlight_item_t *item = item_add( &new_arr, &new_count, &new_size );
+			int item_last = mini( tok_get_pos( &tok ), len-1 );
+			
+			item->start = item_start;
+			/*
+			  Tokenizer errors, like an unterminated quote, depend on
+			  the rest of the command line, so they are never reused
+			  as the beginning of the command line.
+			*/
+			if( last_type == TOK_ERROR || tok_last_type( &tok ) == TOK_ERROR )
+				item->end = len;
+			else
+				item->end = tok.buff - tok.orig_buff;
+			item->had_cmd = item_had_cmd;
+			item->last_cmd = item_cmd;
+			item->color_count = 0;
+			for( i=item_start; i<=item_last && item->color_count < 2; i++ )
+			{
+				if( color[i] != -1 )
+				{
+					item->color_pos[item->color_count] = i;
+					item->color_val[item->color_count] = color[i];
+					item->color_count++;
+				}
+			}
+		}
+	}
+
+	if( use_cache )
+	{
+		if( cancelled )
+		{
+			item_free_range( new_arr, reused, new_count );
+			free( new_arr );
+		}
+		else
+		{
+			/*
+			  Reuse the tokens after the edit
+			*/
+			if( suffix >= 0 )
+			{
+				for( i=suffix; i<item_count; i++ )
+				{
+					highlight_item_t *item = item_add( &new_arr, &new_count, &new_size );
+					int j;
+					
+					*item = item_arr[i];
+					item->start += delta;
+					item->end += delta;
+					for( j=0; j<item->color_count; j++ )
+						item->color_pos[j] += delta;
+					item_apply( item, color, 0 );
+				}
+			}
+
+			item_free_range( item_arr, reused, suffix>=0?suffix:item_count );
+			free( item_arr );
+			free( item_buff );
+			item_arr = new_arr;
+			item_count = new_count;
+			item_buff = wcsdup( buff );
+		}
 	}
 
 	if( last_cmd )
@@ -379,7 +657,7 @@ void highlight_shell( wchar_t * buff,
 		else
 			*end=0;
 		
-		highlight_shell( begin+1, color +(begin-buffcpy)+1, -1, error );
+		highlight_shell_internal( begin+1, color +(begin-buffcpy)+1, -1, error, 0 );
 		color[end-buffcpy]=HIGHLIGHT_PARAM;
 		
 		if( done )
@@ -414,6 +692,14 @@ void highlight_shell( wchar_t * buff,
 	}
 }
 
+void highlight_shell( wchar_t * buff, 
+					  int *color, 
+					  int pos, 
+					  array_list_t *error )
+{
+	highlight_shell_internal( buff, color, pos, error, error == 0 );
+}
+
 /**
    Perform quote and parenthesis highlighting on the specified string.
 */
@@ -21,6 +21,16 @@
 */
 void highlight_shell( wchar_t * buff, int *color, int pos, array_list_t *error );
 
+/**
+   Forget the command line last highlighted by highlight_shell. When
+   no error list is requested, highlight_shell only highlights the
+   part of the command line that changed since the last call, and
+   reuses the colors of the rest. This should be called when a
+   change to the environment, like a new function or a new current
+   directory, may change the colors of the unchanged parts.
+*/
+void highlight_cache_flush();
+
 /**
    Perform syntax highlighting for the text in buff. Matching quotes and paranthesis are highlighted. The result is
    stored in the color array as a color_code from the HIGHLIGHT_ enum
@@ -45,4 +55,13 @@ void highlight_universal( wchar_t * buff, int *color, int pos, array_list_t *err
 */
 int highlight_get_color( int highlight );
 
+/**
+   Set a function that is called between tokens while highlighting,
+   and that returns non-zero if the highlighting should be
+   abandoned. The colors produced by an abandoned call are
+   incomplete and should be discarded. Set to 0 to never abandon
+   highlighting.
+*/
+void highlight_set_cancel_func( int (*f)() );
+
 #endif
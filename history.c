@@ -4,11 +4,18 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <wchar.h>
+#include <string.h>
 #include <errno.h>
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <utime.h>
 
 
 #include "config.h"
@@ -21,159 +28,1172 @@
 #include "sanity.h"
 
 /*
-  The history is implemented using a linked list. Searches are done
-  using linear search. 
+  The history is implemented as two lists of items, with a hash table
+  index keyed on the command text. Items added in this session are
+  stored in chronological order in one list, items loaded from the
+  history file are stored in reverse chronological order in the
+  other. The position of an item is its index in the first list, or
+  minus one minus its index in the second list, so that positions
+  always increase with the age of the item.
+
+  The history file starts with HISTORY_MAGIC, followed by one record
+  per command. Each record consists of the length of the command in
+  bytes (4 bytes), the time the command was run (8 bytes), the
+  command itself and the length of the command once again, so that
+  the file can be read backwards. All numbers are stored most
+  significant byte first. Every command is appended to the history
+  file as soon as it is added, with a single write to a file opened
+  using O_APPEND while holding a lock file, so concurrent sessions
+  never lose or reorder each others commands. Duplicates are removed
+  from the file by a background process when a session exits, if
+  too many duplicates were found. History files in the old format,
+  with one command per line, are converted when they are first
+  loaded.
+
+  The history file is memory mapped when the history list is created,
+  but records are only decoded when a search or lookup moves past
+  the oldest item loaded so far. The file is scanned backwards, so
+  that the cost of starting the shell does not depend on the size of
+  the history file.
+
+  When a command that is already in the history is added again, its
+  old slot is cleared and the item is appended to the end of the
+  list of new items. This makes both duplicate detection and moving
+  an item to the end of the history O(1). Records in the history file
+  for commands that have already been seen further down in the file
+  are skipped. Cleared slots are skipped when moving through the history,
+  and a list is compacted once more than half of its slots are empty.
+
+  Substring searches use a trigram index. For every sequence of three
+  characters that occurs in any history item, a list of the positions
+  of the items containing it is kept. Positions of new items are
+  appended to one sorted list and positions of items loaded from the
+  history file to another, so both lists stay sorted without any
+  insertions in the middle. A search looks up the rarest trigram of
+  the search string and only tests the items in its position
+  list. Positions of items that have been moved are left in the
+  lists and skipped, and the whole index is rebuilt whenever the item
+  lists are compacted.
+
+  The text of all items in a history list is stored in a simple
+  arena, which is freed in one go when the history list is destroyed.
+*/
+
+/**
+   Size of each block of memory in the history arena
+*/
+#define ARENA_BLOCK_SIZE 16384
+
+/**
+   Do not compact the item lists or the history file while they
+   contain fewer than this number of unused entries
+*/
+#define COMPACT_MIN 64
+
+/**
+   Position value used for 'no item'
+*/
+#define NO_POS INT_MIN
+
+/**
+   Magic string at the start of every history file in the current format
+*/
+#define HISTORY_MAGIC "\177fish_history 2\n"
+
+/**
+   Length of HISTORY_MAGIC
+*/
+#define HISTORY_MAGIC_LEN (sizeof( HISTORY_MAGIC )-1)
+
+/**
+   Length of the header of a history record, containing the length of
+   the command and the timestamp
+*/
+#define RECORD_HEADER_LEN 12
+
+/**
+   Length of the trailer of a history record, containing the length
+   of the command
+*/
+#define RECORD_TRAILER_LEN 4
+
+/**
+   The string to append to the history file name to name the lockfile
 */
+#define LOCKPOSTFIX ".lock"
+
+/**
+   The number of seconds a lock on the history file may stay
+   unchanged before it is considered stale and removed. Sessions
+   holding the lock for a long time refresh it more often than this.
+*/
+#define LOCKTIMEOUT 2
+
+/**
+   Length of the strings used as keys in the search index
+*/
+#define TRIGRAM_LEN 3
+
+/**
+   A single history item
+*/
+typedef struct
+{
+	/**
+	   The command text
+	*/
+	wchar_t *data;
+	/**
+	   Position of this item in its history list
+	*/
+	int pos;
+	/**
+	   The time at which the command was added to the history
+	*/
+	time_t timestamp;
+}
+	history_item_t;
+
+/**
+   A list of item positions
+*/
+typedef struct
+{
+	/**
+	   Array of positions
+	*/
+	int *arr;
+	/**
+	   Number of positions in the list
+	*/
+	int count;
+	/**
+	   Length of the array
+	*/
+	int size;
+}
+	pos_list_t;
 
+/**
+   An entry in the search index, listing the positions of all the
+   items that contain a specific trigram
+*/
+typedef struct
+{
+	/**
+	   The trigram
+	*/
+	wchar_t str[TRIGRAM_LEN+1];
+	/**
+	   Positions of new items containing the trigram, in increasing order
+	*/
+	pos_list_t newer;
+	/**
+	   Positions of items loaded from the history file containing the
+	   trigram, in decreasing order
+	*/
+	pos_list_t older;
+}
+	history_trigram_t;
 
 /**
-   A struct describing the state of the interactive history
+   A struct describing the state of an interactive history
    list. Multiple states can be created. Use \c history_set_mode() to
    change between history contexts.
 */
 typedef struct
 {
 	/**
-	   Number of entries
+	   The name of this history list. The name is used to switch
+	   between history lists for different commands as well as for
+	   deciding the name of the file to save the history in.
+	*/
+	wchar_t *name;
+	/**
+	   List of history_item_t added in this session, in chronological
+	   order. Slots of items that have been moved to the end of the
+	   list are set to 0.
+	*/
+	array_list_t items;
+	/**
+	   List of history_item_t loaded from the history file, in reverse
+	   chronological order. Slots of items that have been moved to
+	   the end of the history are set to 0.
+	*/
+	array_list_t old_items;
+	/**
+	   Number of non-empty slots in the list of new items
 	*/
 	int count;
 	/**
-	   Last history item
+	   Number of non-empty slots in the list of old items
+	*/
+	int old_count;
+	/**
+	   Hash table mapping command text to history_item_t
 	*/
-	ll_node_t *last;
+	hash_table_t index;
 	/**
-	   The last item loaded from file
+	   Hash table mapping every trigram found in the history to a
+	   history_trigram_t
 	*/
-	ll_node_t *last_loaded;
+	hash_table_t trigrams;
+	/**
+	   Number of duplicate records found in the part of the history
+	   file that has been loaded. Used to decide when the file should
+	   be compacted.
+	*/
+	int file_dups;
+	/**
+	   Set if the history file is in the format used by earlier
+	   versions of fish and has not been converted yet, because the
+	   lock could not be obtained
+	*/
+	int needs_convert;
+	/**
+	   Status of the history file when it was mapped, used to detect
+	   changes made by other sessions before the file is replaced
+	*/
+	struct stat file_stat;
+	/**
+	   Position of the current search item, or NO_POS if the history
+	   is empty
+	*/
+	int current;
+	/**
+	   past_end is a kludge. It is set when the current history item
+	   is unset, i.e. a new entry is being typed.
+	*/
+	int past_end;
+	/**
+	   Contents of the history file
+	*/
+	char *map;
+	/**
+	   Length of the history file contents
+	*/
+	size_t map_len;
+	/**
+	   True if map was mapped using mmap, false if it was read into
+	   allocated memory
+	*/
+	int is_mapped;
+	/**
+	   End of the part of the history file that has not yet been
+	   loaded
+	*/
+	size_t scan_pos;
+	/**
+	   Buffer used when decoding lines from the history file
+	*/
+	wchar_t *decode_buff;
+	/**
+	   Length of decode_buff
+	*/
+	size_t decode_len;
+	/**
+	   List of memory blocks used by the arena
+	*/
+	array_list_t blocks;
+	/**
+	   Number of bytes used in the last block of the arena
+	*/
+	size_t block_used;
 }
-	history_data;
+	history_mode_t;
+
+/**
+   The current history list
+*/
+static history_mode_t *cur=0;
+
+/**
+   Hash table for storing all the history lists.
+*/
+static hash_table_t history_table;
+
+/**
+   Allocate memory from the arena of the specified history list. The
+   memory is freed when the history list is destroyed.
+*/
+static void *history_alloc( history_mode_t *m, size_t sz )
+{
+	void *res;
+
+	sz = (sz + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	if( sz > ARENA_BLOCK_SIZE/4 )
+	{
+		/*
+		  Large allocations get a block of their own, which is
+		  inserted before the last block so that the free space in
+		  the last block isn't lost
+		*/
+		int count = al_get_count( &m->blocks );
+		if( !(res = malloc( sz )) )
+			die_mem();
+		al_push( &m->blocks, res );
+		if( count )
+		{
+			al_set( &m->blocks, count, al_get( &m->blocks, count-1 ) );
+			al_set( &m->blocks, count-1, res );
+		}
+		else
+		{
+			m->block_used = ARENA_BLOCK_SIZE;
+		}
+		return res;
+	}
+
+	if( al_empty( &m->blocks ) || m->block_used + sz > ARENA_BLOCK_SIZE )
+	{
+		if( !(res = malloc( ARENA_BLOCK_SIZE )) )
+			die_mem();
+		al_push( &m->blocks, res );
+		m->block_used = 0;
+	}
+
+	res = (char *)al_peek( &m->blocks ) + m->block_used;
+	m->block_used += sz;
+	return res;
+}
+
+/**
+   Returns the item at the specified position, or 0 if the slot is empty
+*/
+static history_item_t *history_item( history_mode_t *m, int pos )
+{
+	if( pos >= 0 )
+		return (history_item_t *)al_get( &m->items, pos );
+	else
+		return (history_item_t *)al_get( &m->old_items, -pos-1 );
+}
+
+/**
+   Remove empty slots from one of the item lists of the specified
+   history list
+
+   \param m the history list
+   \param old whether to compact the list of old items or the list of new items
+*/
+static void history_compact( history_mode_t *m, int old )
+{
+	array_list_t *l = old?&m->old_items:&m->items;
+	int i, j=0;
+
+	for( i=0; i<al_get_count( l ); i++ )
+	{
+		history_item_t *item = (history_item_t *)al_get( l, i );
+
+		if( item )
+		{
+			int pos = old?-j-1:j;
+			if( item->pos == m->current )
+				m->current = pos;
+			item->pos = pos;
+			al_set( l, j++, item );
+		}
+	}
+	al_truncate( l, j );
+}
+
+/**
+   Create a new history item in the arena of the specified history
+   list, and add it to the index
+*/
+static history_item_t *history_item_new( history_mode_t *m, const wchar_t *str )
+{
+	history_item_t *item;
+	size_t len = sizeof(wchar_t)*(wcslen( str )+1);
+
+	item = history_alloc( m, sizeof( history_item_t ) );
+	item->data = history_alloc( m, len );
+	memcpy( item->data, str, len );
+	item->timestamp = 0;
+	hash_put( &m->index, item->data, item );
+	return item;
+}
+
+/**
+   Append a position to a position list, unless it is already the last
+   position in the list
+*/
+static void history_pos_push( pos_list_t *l, int pos )
+{
+	if( l->count && l->arr[l->count-1] == pos )
+		return;
+
+	if( l->count == l->size )
+	{
+		l->size = maxi( 4, 2*l->size );
+		if( !(l->arr = realloc( l->arr, sizeof(int)*l->size )) )
+			die_mem();
+	}
+	l->arr[l->count++] = pos;
+}
+
+/**
+   Add the specified item to the search index
+*/
+static void history_index_add( history_mode_t *m, history_item_t *item )
+{
+	const wchar_t *str;
+	wchar_t key[TRIGRAM_LEN+1];
+
+	if( wcslen( item->data ) < TRIGRAM_LEN )
+		return;
+
+	key[TRIGRAM_LEN]=0;
+
+	for( str=item->data; str[TRIGRAM_LEN-1]; str++ )
+	{
+		history_trigram_t *t;
+
+		wcsncpy( key, str, TRIGRAM_LEN );
+		t = (history_trigram_t *)hash_get( &m->trigrams, key );
+		if( !t )
+		{
+			t = history_alloc( m, sizeof( history_trigram_t ) );
+			wcscpy( t->str, key );
+			memset( &t->newer, 0, sizeof( pos_list_t ) );
+			memset( &t->older, 0, sizeof( pos_list_t ) );
+			hash_put( &m->trigrams, t->str, t );
+		}
+
+		history_pos_push( item->pos>=0?&t->newer:&t->older, item->pos );
+	}
+}
+
+/**
+   Empty the position lists of a trigram. Used as a hash_foreach callback.
+*/
+static void history_trigram_clear( const void *key, const void *data )
+{
+	history_trigram_t *t = (history_trigram_t *)data;
+	t->newer.count = t->older.count = 0;
+}
+
+/**
+   Free the position lists of a trigram. Used as a hash_foreach callback.
+*/
+static void history_trigram_free( const void *key, const void *data )
+{
+	history_trigram_t *t = (history_trigram_t *)data;
+	free( t->newer.arr );
+	free( t->older.arr );
+}
+
+/**
+   Rebuild the search index. This is needed whenever the item lists
+   have been compacted, since that changes the position of the items.
+*/
+static void history_index_rebuild( history_mode_t *m )
+{
+	int i;
+
+	hash_foreach( &m->trigrams, &history_trigram_clear );
+
+	for( i=0; i<al_get_count( &m->old_items ); i++ )
+	{
+		history_item_t *item = (history_item_t *)al_get( &m->old_items, i );
+		if( item )
+			history_index_add( m, item );
+	}
+
+	for( i=0; i<al_get_count( &m->items ); i++ )
+	{
+		history_item_t *item = (history_item_t *)al_get( &m->items, i );
+		if( item )
+			history_index_add( m, item );
+	}
+}
+
+/**
+   Add the specified string to the end of the specified history
+   list. If the string is already in the list, the old item is moved
+   to the end of the list.
+
+   \return the item
+*/
+static history_item_t *history_add_internal( history_mode_t *m, const wchar_t *str )
+{
+	history_item_t *item = (history_item_t *)hash_get( &m->index, str );
+	int end = al_get_count( &m->items );
+	int compacted = 0;
+
+	m->past_end=1;
+
+	if( item )
+	{
+		if( item->pos == end-1 )
+		{
+			m->current = item->pos;
+			return item;
+		}
+
+		if( item->pos >= 0 )
+		{
+			al_set( &m->items, item->pos, 0 );
+		}
+		else
+		{
+			al_set( &m->old_items, -item->pos-1, 0 );
+			m->old_count--;
+			m->count++;
+		}
+	}
+	else
+	{
+		item = history_item_new( m, str );
+		m->count++;
+	}
+
+	item->pos = end;
+	al_push( &m->items, item );
+	history_index_add( m, item );
+	m->current = end;
+
+	if( (end+1 - m->count > COMPACT_MIN) && (end+1 - m->count > m->count) )
+	{
+		history_compact( m, 0 );
+		compacted = 1;
+	}
+
+	end = al_get_count( &m->old_items );
+	if( (end - m->old_count > COMPACT_MIN) && (end - m->old_count > m->old_count) )
+	{
+		history_compact( m, 1 );
+		compacted = 1;
+	}
+
+	if( compacted )
+		history_index_rebuild( m );
+
+	return item;
+}
+
+/**
+   Returns the name of the history file for the specified history list
+*/
+static wchar_t *history_filename( const wchar_t *name )
+{
+	return wcsdupcat2( env_get(L"HOME"), L"/.", name, L"_history", 0 );
+}
+
+/**
+   Release the contents of the history file
+*/
+static void history_unmap( history_mode_t *m )
+{
+	if( !m->map )
+		return;
+
+	if( m->is_mapped )
+		munmap( m->map, m->map_len );
+	else
+		free( m->map );
+
+	m->map = 0;
+	m->map_len = m->scan_pos = 0;
+}
+
+/**
+   Acquire the lock for the specified history file. Returns the name
+   of the lock file, which must be passed to \c history_unlock to
+   release the lock, or 0 if the lock could not be obtained.
+*/
+static char *history_lock( const wchar_t *fn )
+{
+	char *nfn = wcs2str( fn );
+	char *lockfile = malloc( strlen( nfn ) + strlen( LOCKPOSTFIX ) + 1 );
+
+	if( !lockfile )
+		die_mem();
+
+	strcpy( lockfile, nfn );
+	strcat( lockfile, LOCKPOSTFIX );
+	free( nfn );
+
+	if( !acquire_lock_file( lockfile, LOCKTIMEOUT, 1 ) )
+	{
+		debug( 1, L"Could not lock history file \'%ls\'", fn );
+		free( lockfile );
+		return 0;
+	}
+	return lockfile;
+}
+
+/**
+   Update the modification time of the specified lock file, at most
+   once a second, so that sessions waiting for the lock know that its
+   owner is still alive and don't remove it
+*/
+static void history_refresh_lock( const char *lockfile )
+{
+	static time_t last=0;
+	time_t now = time( 0 );
+
+	if( now == last )
+		return;
+
+	last = now;
+	(void)utime( lockfile, 0 );
+}
+
+/**
+   Release a lock acquired using \c history_lock
+*/
+static void history_unlock( char *lockfile )
+{
+	if( !lockfile )
+		return;
+
+	(void)unlink( lockfile );
+	free( lockfile );
+}
+
+/**
+   Store an integer in the specified number of bytes, most
+   significant byte first
+*/
+static void history_put_int( char *out, unsigned long long val, int len )
+{
+	while( len-- )
+	{
+		out[len] = (char)(val & 0xff);
+		val >>= 8;
+	}
+}
+
+/**
+   Read an integer stored using \c history_put_int
+*/
+static unsigned long long history_get_int( const char *in, int len )
+{
+	unsigned long long res=0;
+	while( len-- )
+	{
+		res = (res<<8) | (unsigned char)*in++;
+	}
+	return res;
+}
+
+/**
+   Append a record for the specified item to the specified buffer
+*/
+static void history_encode( buffer_t *b, history_item_t *item )
+{
+	char head[RECORD_HEADER_LEN];
+	char *str = wcs2str( item->data );
+	size_t len;
+
+	if( !str )
+		return;
+
+	len = strlen( str );
+	history_put_int( head, len, RECORD_TRAILER_LEN );
+	history_put_int( head+RECORD_TRAILER_LEN, item->timestamp, RECORD_HEADER_LEN-RECORD_TRAILER_LEN );
+
+	b_append( b, head, RECORD_HEADER_LEN );
+	b_append( b, str, len );
+	b_append( b, head, RECORD_TRAILER_LEN );
+	free( str );
+}
+
+/**
+   Decode the specified part of the history file into the decode
+   buffer of the specified history list. Invalid byte sequences,
+   carriage returns and null characters are skipped.
+*/
+static wchar_t *history_decode( history_mode_t *m, const char *in, size_t len )
+{
+	mbstate_t state;
+	size_t i=0;
+
+	if( m->decode_len < len+1 )
+	{
+		m->decode_len = maxi( 128, len+1 );
+		free( m->decode_buff );
+		if( !(m->decode_buff = malloc( sizeof(wchar_t)*m->decode_len )) )
+			die_mem();
+	}
+
+	memset( &state, 0, sizeof(state) );
+
+	while( len > 0 )
+	{
+		wchar_t c;
+		size_t res = mbrtowc( &c, in, len, &state );
+
+		if( res == (size_t)-2 )
+			break;
+
+		if( res == (size_t)-1 )
+		{
+			memset( &state, 0, sizeof(state) );
+			res = 1;
+		}
+		else
+		{
+			if( res == 0 )
+				res = 1;
+			else if( c != L'\r' )
+				m->decode_buff[i++]=c;
+		}
+
+		in += res;
+		len -= res;
+	}
+
+	m->decode_buff[i]=0;
+	return m->decode_buff;
+}
+
+/**
+   Append all items in the specified history list to the specified
+   array_list_t, oldest item first
+*/
+static void history_collect( history_mode_t *m, array_list_t *l )
+{
+	int i;
+	for( i=-al_get_count( &m->old_items ); i<al_get_count( &m->items ); i++ )
+	{
+		history_item_t *item = history_item( m, i );
+		if( item )
+			al_push( l, item );
+	}
+}
+
+/**
+   Check that the specified history file is still the file described
+   by \c src, and copy any records that have been appended to it since
+   then to the specified file descriptor. If \c keep_tail is not set,
+   the file must not have grown.
+
+   \return 0 if the history file may be replaced, -1 otherwise
+*/
+static int history_copy_tail( const wchar_t *fn, const struct stat *src, int keep_tail, int out )
+{
+	struct stat buf;
+	char tail[4096];
+	ssize_t len;
+	int fd;
+	int res = -1;
+
+	if( (fd = wopen( fn, O_RDONLY )) == -1 )
+		return -1;
+
+	if( fstat( fd, &buf ) == 0 &&
+		buf.st_dev == src->st_dev &&
+		buf.st_ino == src->st_ino &&
+		buf.st_size >= src->st_size )
+	{
+		if( buf.st_size == src->st_size )
+		{
+			res = 0;
+		}
+		else if( keep_tail && lseek( fd, src->st_size, SEEK_SET ) != -1 )
+		{
+			while( (len = read( fd, tail, sizeof( tail ) )) > 0 )
+			{
+				if( write( out, tail, len ) != len )
+					break;
+			}
+			if( len == 0 )
+				res = 0;
+		}
+	}
+
+	close( fd );
+	return res;
+}
+
+/**
+   Replace the specified history file with a file containing the
+   specified list of items. The new file is written to a temporary
+   file unique to this process, which is then renamed, so that the
+   history is never truncated. The caller must hold the lock for the
+   history file.
+
+   A lock whose owner stops refreshing it is removed by other
+   sessions, so the file is checked against \c src, its status when
+   the items were read from it, right before it is replaced. Records
+   that have been appended since then are copied to the new file if
+   \c keep_tail is set. The file is left alone if it has been replaced
+   or, unless \c keep_tail is set, if it has grown.
+
+   \return 0 on success, -1 on failure
+*/
+static int history_write_file( const wchar_t *fn,
+							   array_list_t *items,
+							   const struct stat *src,
+							   int keep_tail,
+							   const char *lockfile )
+{
+	string_buffer_t tmp_fn;
+	char *tmp_nfn, *nfn;
+	buffer_t b;
+	int fd;
+	int i;
+	int changed = 0;
+	int res = -1;
+
+	b_init( &b );
+	b_append( &b, HISTORY_MAGIC, HISTORY_MAGIC_LEN );
+	for( i=0; i<al_get_count( items ); i++ )
+	{
+		history_encode( &b, (history_item_t *)al_get( items, i ) );
+		history_refresh_lock( lockfile );
+	}
+
+	sb_init( &tmp_fn );
+	sb_printf( &tmp_fn, L"%ls.%d", fn, getpid() );
+	tmp_nfn = wcs2str( (wchar_t *)tmp_fn.buff );
+	nfn = wcs2str( fn );
+
+	fd = wopen( (wchar_t *)tmp_fn.buff, O_WRONLY|O_CREAT|O_TRUNC, 0600 );
+	if( fd != -1 )
+	{
+		int write_res = write( fd, b.buff, b.used ) != b.used;
+
+		history_refresh_lock( lockfile );
+
+		if( !write_res && history_copy_tail( fn, src, keep_tail, fd ) )
+		{
+			debug( 2, L"History file \'%ls\' was changed by another session, not replacing it", fn );
+			changed = 1;
+		}
+
+		if( close( fd ) || write_res || changed )
+		{
+			unlink( tmp_nfn );
+		}
+		else if( rename( tmp_nfn, nfn ) == 0 )
+		{
+			res = 0;
+		}
+		else
+		{
+			unlink( tmp_nfn );
+		}
+	}
+
+	if( res && !changed )
+	{
+		debug( 1, L"The following non-fatal error occurred while saving command history to \'%ls\':", fn );
+		wperror( L"write" );
+	}
+
+	free( nfn );
+	free( tmp_nfn );
+	sb_destroy( &tmp_fn );
+	b_destroy( &b );
+	return res;
+}
+
+/**
+   Map the specified history file into memory. The file is memory
+   mapped if possible, otherwise it is read into memory. No records
+   are decoded until they are needed.
+
+   \return 1 if the file exists and is not in the current format, 0 otherwise
+*/
+static int history_map( history_mode_t *m, const wchar_t *fn )
+{
+	int fd;
+	struct stat buf;
+
+	fd = wopen( fn, O_RDONLY );
+
+	if( fd != -1 )
+	{
+		if( fstat( fd, &buf ) == 0 && buf.st_size > 0 )
+		{
+			m->file_stat = buf;
+			m->map_len = buf.st_size;
+			m->map = mmap( 0, m->map_len, PROT_READ, MAP_PRIVATE, fd, 0 );
+			m->is_mapped = 1;
+
+			if( m->map == MAP_FAILED )
+			{
+				m->is_mapped = 0;
+				if( !(m->map = malloc( m->map_len )) )
+					die_mem();
+				if( read_blocked( fd, m->map, m->map_len ) != m->map_len )
+				{
+					debug( 1, L"The following non-fatal error occurred while reading command history from \'%ls\':", m->name );
+					wperror( L"read" );
+					free( m->map );
+					m->map = 0;
+					m->map_len = 0;
+				}
+			}
+			m->scan_pos = m->map_len;
+		}
+
+		close( fd );
+	}
+	else
+	{
+		if( errno != ENOENT )
+		{
+			debug( 1, L"The following non-fatal error occurred while reading command history from \'%ls\':", m->name );
+			wperror( L"open" );
+		}
+
+	}
+
+	if( !m->map )
+		return 0;
+
+	return m->map_len < HISTORY_MAGIC_LEN ||
+		memcmp( m->map, HISTORY_MAGIC, HISTORY_MAGIC_LEN ) != 0;
+}
+
+/**
+   Check whether the specified history file exists and is in the
+   format used by earlier versions of fish
+*/
+static int history_file_is_old( const wchar_t *fn )
+{
+	char buff[HISTORY_MAGIC_LEN];
+	int fd = wopen( fn, O_RDONLY );
+	int res;
+
+	if( fd == -1 )
+		return 0;
+
+	res = read_blocked( fd, buff, HISTORY_MAGIC_LEN );
+	close( fd );
+
+	return res > 0 &&
+		( res < HISTORY_MAGIC_LEN || memcmp( buff, HISTORY_MAGIC, HISTORY_MAGIC_LEN ) != 0 );
+}
+
+/**
+   Add all lines of a mapped history file written by an earlier
+   version of fish, containing one command per line, to the specified
+   history list, and unmap the file
+*/
+static void history_read_old( history_mode_t *m )
+{
+	size_t start, end;
+
+	for( start=0; start<m->map_len; start = end+1 )
+	{
+		wchar_t *str;
+
+		for( end=start; end<m->map_len && m->map[end] != '\n'; end++ )
+			;
+
+		str = history_decode( m, m->map+start, end-start );
+		if( *str )
+			history_add_internal( m, str );
+	}
+
+	history_unmap( m );
+}
+
+/**
+   Replace the history file with a file in the current format,
+   containing all items of the specified history list. The caller
+   must hold the specified lock for the history file.
+*/
+static void history_convert( history_mode_t *m, const wchar_t *fn, const char *lockfile )
+{
+	array_list_t items;
+
+	al_init( &items );
+	history_collect( m, &items );
+	if( history_write_file( fn, &items, &m->file_stat, 0, lockfile ) == 0 )
+		m->needs_convert = 0;
+	al_destroy( &items );
+}
+
+/**
+   Open ~/.fish_history for the specified history list. History files
+   in the old format are read into memory and converted, if the lock
+   for the file can be obtained. Otherwise another shell may be
+   converting the same file, so it is left alone until the next time
+   an item is added.
+*/
+static void history_load( history_mode_t *m )
+{
+	wchar_t *fn = history_filename( m->name );
+	char *lockfile = history_lock( fn );
+
+	if( history_map( m, fn ) )
+	{
+		history_read_old( m );
+		m->needs_convert = 1;
+		if( lockfile )
+			history_convert( m, fn, lockfile );
+	}
+
+	history_unlock( lockfile );
+	free( fn );
+	m->past_end=1;
+}
+
+/**
+   Load the newest record from the history file that has not been
+   loaded yet, and add it to the end of the list of old items. Records
+   for commands that are already in the history are skipped.
+
+   \return 1 if an item was added, 0 if there are no more records in the file
+*/
+static int history_load_prev( history_mode_t *m )
+{
+	while( m->scan_pos > HISTORY_MAGIC_LEN )
+	{
+		size_t len, start, end = m->scan_pos;
+		wchar_t *str;
+
+		if( end - HISTORY_MAGIC_LEN < RECORD_HEADER_LEN + RECORD_TRAILER_LEN )
+			break;
+
+		len = history_get_int( m->map + end - RECORD_TRAILER_LEN, RECORD_TRAILER_LEN );
+		if( len > end - HISTORY_MAGIC_LEN - RECORD_HEADER_LEN - RECORD_TRAILER_LEN )
+			break;
+
+		start = end - RECORD_TRAILER_LEN - len - RECORD_HEADER_LEN;
+		if( history_get_int( m->map + start, RECORD_TRAILER_LEN ) != len )
+			break;
+
+		m->scan_pos = start;
+
+		str = history_decode( m, m->map + start + RECORD_HEADER_LEN, len );
 
+		if( !*str )
+			continue;
 
-static ll_node_t /** Last item in history */ *history_last=0, /** Current search position*/ *history_current =0;
+		if( hash_get( &m->index, str ) )
+		{
+			m->file_dups++;
+		}
+		else
+		{
+			history_item_t *item = history_item_new( m, str );
+			item->timestamp = (time_t)history_get_int( m->map + start + RECORD_TRAILER_LEN, 
+													   RECORD_HEADER_LEN - RECORD_TRAILER_LEN );
+			item->pos = -al_get_count( &m->old_items )-1;
+			al_push( &m->old_items, item );
+			history_index_add( m, item );
+			m->old_count++;
+			return 1;
+		}
+	}
 
-/**
-   We only try to save the part of the history that was written in
-   this session. This pointer keeps track of where the cutoff is.
+	if( m->scan_pos > HISTORY_MAGIC_LEN )
+	{
+		debug( 1, L"The history file for \'%ls\' is damaged, ignoring older entries", m->name );
+	}
 
-   The reason for wanting to do this is so that when two concurrent
-   fish sessions have exited, the latter one to exit won't push the
-   added history items of the prior session to the top of the history.
-*/
-static ll_node_t *last_loaded=0;
+	history_unmap( m );
+	return 0;
+}
 
 /**
-  past_end is a kludge. It is set when the current history item is
-  unset, i.e. a new entry is being typed.
+   Load all remaining records of the history file
 */
-static int past_end =1;
+static void history_load_all( history_mode_t *m )
+{
+	while( history_load_prev( m ) )
+		;
+}
 
 /**
-   Items in history
+   Create a new, empty history list with the specified name
 */
-static int history_count=0;
+static history_mode_t *history_create_mode( const wchar_t *name )
+{
+	history_mode_t *m = malloc( sizeof( history_mode_t ) );
 
-/**
-   The name of the current history list. The name is used to switch between history lists for different commands as sell as for deciding the name of the file to save the history in.
-*/
-static wchar_t *mode_name;
+	if( !m )
+		die_mem();
+
+	m->name = wcsdup( name );
+	al_init( &m->items );
+	al_init( &m->old_items );
+	hash_init( &m->index,
+			   &hash_wcs_func,
+			   &hash_wcs_cmp );
+	hash_init( &m->trigrams,
+			   &hash_wcs_func,
+			   &hash_wcs_cmp );
+	m->count=0;
+	m->old_count=0;
+	m->file_dups=0;
+	m->needs_convert=0;
+	memset( &m->file_stat, 0, sizeof( m->file_stat ) );
+	m->current=NO_POS;
+	m->past_end=1;
+	m->map=0;
+	m->map_len=0;
+	m->is_mapped=0;
+	m->scan_pos=0;
+	m->decode_buff=0;
+	m->decode_len=0;
+	al_init( &m->blocks );
+	m->block_used=0;
+	return m;
+}
 
 /**
-   Hash table for storing all the history lists.
+   Free all memory used by the specified history list
 */
-static hash_table_t history_table;
-
+static void history_free_mode( history_mode_t *m )
+{
+	history_unmap( m );
+	/*
+	  The trigrams live in the blocks, so their position lists must be
+	  freed first
+	*/
+	hash_foreach( &m->trigrams, &history_trigram_free );
+	hash_destroy( &m->trigrams );
+	al_foreach( &m->blocks, (void (*)(const void *))&free );
+	al_destroy( &m->blocks );
+	al_destroy( &m->items );
+	al_destroy( &m->old_items );
+	hash_destroy( &m->index );
+	free( m->decode_buff );
+	free( m->name );
+	free( m );
+}
 
 /**
-   Load history from ~/.fish_history
+   Returns the position of the last item before the specified
+   position, or NO_POS if there is no such item. Lines are loaded
+   from the history file as needed.
 */
-static void history_load( wchar_t *name )
+static int history_prev_pos( history_mode_t *m, int pos )
 {
-	wchar_t *fn;
-	wchar_t *buff=0;
-	int buff_len=0;
-	FILE *in_stream;
-	hash_table_t used;
-	
-	block();
-	hash_init2( &used, 
-				&hash_wcs_func,
-				&hash_wcs_cmp,
-				4096 );
-
-	fn = wcsdupcat2( env_get(L"HOME"), L"/.", name, L"_history", 0 );
-	
-	in_stream = wfopen( fn, "r" );
-	
-	if( in_stream != 0 )
-	{
-		while( !feof( in_stream ) )
-		{
-			int buff_read = fgetws2( &buff, &buff_len, in_stream );
-			if( buff_read == -1 )
-			{
-				debug( 1, L"The following non-fatal error occurred while reading command history from \'%ls\':", name );
-				wperror( L"fgetws2" );
-				fclose( in_stream );
-				free( fn );
-				free( buff );
-				unblock();				
-				return;
-			}
-
-			/*
-			  We do not call history_add here, since that would make
-			  history_load() take quadratic time, and may be
-			  unacceptably on slow systems with a long history file.
-
-			  Use a hashtable to check for duplicates instead.
-			*/
-			if( !hash_get( &used,
-						   buff ) )
-			{
-				history_count++;		
-				
-				history_current = malloc( sizeof( ll_node_t ) );
-				if( !history_current )
-				{
-					die_mem();
-					
-				}
-				
-				history_current->data=wcsdup( buff );
-
-				hash_put( &used,
-						  history_current->data, 
-						  L"" );
-				
-				history_current->next=0;
-				history_current->prev = history_last;
-				if( history_last != 0 )
-				{
-					history_last->next = history_current;
-				}
-				history_last = history_current;
-			}
-		}
-		
-		fclose( in_stream );
-	}
-	else
+	while( 1 )
 	{
-		if( errno != ENOENT )
+		pos--;
+		if( pos < 0 && -pos-1 >= al_get_count( &m->old_items ) )
 		{
-			debug( 1, L"The following non-fatal error occurred while reading command history from \'%ls\':", name );
-			wperror( L"fopen" );
+			if( !history_load_prev( m ) )
+				return NO_POS;
 		}
-		
-	}	
 
-	
-	hash_destroy( &used );
-	
-	free( buff );
-	free( fn );
-	last_loaded = history_last;
-	unblock();
+		if( history_item( m, pos ) )
+			return pos;
+	}
+}
+
+/**
+   Returns the position of the first item after the specified position,
+   or NO_POS if there is no such item
+*/
+static int history_next_pos( history_mode_t *m, int pos )
+{
+	while( ++pos < al_get_count( &m->items ) )
+	{
+		if( history_item( m, pos ) )
+			return pos;
+	}
+	return NO_POS;
 }
 
 void history_init()
@@ -183,415 +1203,529 @@ void history_init()
 			   &hash_wcs_cmp );
 }
 
-/**
-   Make sure the current history list is in the history_table.
-*/
-static void history_to_hash()
-{
-	history_data *d;
-	
-	d = (history_data *)hash_get( &history_table, 
-								  mode_name );
-	
-	if( !d )
-		d = malloc( sizeof(history_data));
-	d->last=history_last;
-	d->last_loaded=last_loaded;
-	d->count=history_count;
-	
-	hash_put( &history_table, 
-			  mode_name,
-			  d );	
-	
-}
-
-
 void history_set_mode( wchar_t *name )
 {
-	history_data *curr;
-	
-	if( mode_name )
-	{		
-		history_to_hash();		
-	}
-	curr = (history_data *)hash_get( &history_table,
-									 name );
-	if( curr )
-	{
-		mode_name = (wchar_t *)hash_get_key( &history_table,
-											 name );
-		history_current = history_last = curr->last;
-		last_loaded = curr->last_loaded;
-		history_count = curr->count;
-	}
-	else
+	cur = (history_mode_t *)hash_get( &history_table,
+									  name );
+	if( !cur )
 	{
-		history_count=0;
-		history_last = history_current = last_loaded=0;
-		mode_name = wcsdup( name );
-		history_load( name );
+		cur = history_create_mode( name );
+		history_load( cur );
+		cur->current = history_prev_pos( cur, al_get_count( &cur->items ) );
+		hash_put( &history_table,
+				  cur->name,
+				  cur );
 	}
-	
-	past_end=1;
-	
+
+	cur->past_end=1;
 }
 
 /**
-   Print history node 
+   Compare two history items by timestamp. Items with the same
+   timestamp are kept in their original order.
 */
-static void history_save_node( ll_node_t *n, FILE *out )
+static int history_item_cmp( const void *a, const void *b )
 {
-	if( n==0 )
-		return;
-	history_save_node( n->prev, out );
-	fwprintf(out, L"%ls\n", (wchar_t *)(n->data) );
+	history_item_t *c = *((history_item_t **)a);
+	history_item_t *d = *((history_item_t **)b);
+
+	if( c->timestamp != d->timestamp )
+		return c->timestamp < d->timestamp?-1:1;
+	return c->pos - d->pos;
 }
 
 /**
-   Merge the process history with the history on file, write to
-   disc. The merging operation is done so that two concurrently
-   running shells wont erase each others history.
+   Compact the specified history file by removing duplicates and
+   sorting the records by timestamp. Records appended by sessions
+   running on hosts with different clocks are merged into the right
+   order. The lock is held and refreshed for the entire operation, so
+   that other sessions wait for it instead of appending records that
+   would be lost.
 */
-static void history_save()
+static void history_compact_file( const wchar_t *name )
 {
-	wchar_t *fn;
-	FILE *out_stream;
-	/* First we save this sessions history in local variables */
-	ll_node_t *real_pos = history_last, *real_first = last_loaded;
+	history_mode_t *m = history_create_mode( name );
+	wchar_t *fn = history_filename( name );
+	char *lockfile = history_lock( fn );
+	array_list_t items;
 
-	if( !real_first )
+	if( lockfile && !history_map( m, fn ) && m->map )
 	{
-		real_first = history_current;
-		while( real_first->prev )
-			real_first = real_first->prev;
+		while( history_load_prev( m ) )
+			history_refresh_lock( lockfile );
+
+		al_init( &items );
+		history_collect( m, &items );
+		qsort( items.arr, al_get_count( &items ), sizeof( void * ), &history_item_cmp );
+		history_write_file( fn, &items, &m->file_stat, 1, lockfile );
+		al_destroy( &items );
 	}
 
-	if( real_pos == real_first )
+	history_unlock( lockfile );
+	free( fn );
+	history_free_mode( m );
+}
+
+/**
+   Start compacting the history file of the specified history list in
+   the background if the part of the file that has been loaded
+   contains too many duplicates. Since every command is appended to
+   the history file as soon as it is added, nothing else needs to be
+   saved.
+*/
+static void history_save( history_mode_t *m )
+{
+	pid_t pid;
+
+	if( !((m->file_dups > COMPACT_MIN) && (m->file_dups > m->old_count)) )
 		return;
-	
-	/* Then we load the history from file into the global pointers */
-	history_last=history_current=last_loaded=0;
-	history_count=0;
-	past_end=1;
-
-	history_load( mode_name );
-	if( real_pos != 0 )
-	{
-		/* 
-		   Rewind the session history to the first item which was
-		   added in this session
-		*/
-		while( (real_pos->prev != 0) && (real_pos->prev != real_first) )
-		{
-			real_pos = real_pos->prev;
-		}
-		
-		/* Free old history entries */
-		ll_node_t *kill_node_t = real_pos->prev;
-		while( kill_node_t != 0 )
-		{
-			ll_node_t *tmp = kill_node_t;
-			free( kill_node_t->data );
-			kill_node_t = kill_node_t->prev;
-			free( tmp );		
-		}	
-
-		/* 
-		   Add all the history entries from this session to the global
-		   history, free the old version
-		*/
-		while( real_pos != 0 )
-		{
-			ll_node_t *next = real_pos->next;
-			history_add( (wchar_t *)real_pos->data );
-			
-			free( real_pos->data );
-			free( real_pos );
-			real_pos = next;
-		}
-	}
 
-	/* Save the global history */
+	/*
+	  Fork twice, so that the compacting process is not a child of
+	  the shell and doesn't need to be waited for
+	*/
+	block();
+	switch( pid = fork() )
 	{
-		fn = wcsdupcat2( env_get(L"HOME"), L"/.", mode_name, L"_history", 0 );
-		
-		out_stream = wfopen( fn, "w" );
-		if( out_stream )
+		case -1:
+			debug( 1, L"Could not compact history file" );
+			wperror( L"fork" );
+			break;
+
+		case 0:
 		{
-			history_save_node( history_last, out_stream );
-			if( fclose( out_stream ) )
+			setsid();
+			if( fork() == 0 )
 			{
-				debug( 1, L"The following non-fatal error occurred while saving command history to \'%ls\':", fn );
-				wperror( L"fopen" );
-			}			
+				history_compact_file( m->name );
+			}
+			_exit(0);
 		}
-		else
+
+		default:
 		{
-			debug( 1, L"The following non-fatal error occurred while saving command history to \'%ls\':", fn );
-			wperror( L"fopen" );
+			waitpid( pid, 0, 0 );
+			break;
 		}
-		free( fn );	
 	}
-	
+	unblock();
 }
 
 /**
-   Save the specified mode to file
+   Compact the specified mode if needed and free it
 */
-
 static void history_destroy_mode( const void *name, const void *link )
 {
-	mode_name = (wchar_t *)name;
-	history_data *d = (history_data *)link;
-	history_last = history_current = d->last;
-	last_loaded = d->last_loaded;
-	history_count = d->count;
-	past_end=1;
+	history_mode_t *m = (history_mode_t *)link;
 
-//	fwprintf( stderr, L"Destroy history mode \'%ls\'\n", mode_name );
-		
-	if( history_last )
-	{
-		history_save();	
-		history_current = history_last;
-		while( history_current != 0 )
-		{
-			ll_node_t *tmp = history_current;
-			free( history_current->data );
-			history_current = history_current->prev;
-			free( tmp );		
-		}	
-	}
-	free( d );
-	free( mode_name );
+//	fwprintf( stderr, L"Destroy history mode \'%ls\'\n", m->name );
+
+	history_save( m );
+	history_free_mode( m );
 }
 
 void history_destroy()
 {
-	/**
-	   Make sure current mode is in table
-	*/
-	history_to_hash();		
-
 	/**
 	   Save all modes in table
 	*/
-	hash_foreach( &history_table, 
+	hash_foreach( &history_table,
 				  &history_destroy_mode );
 
 	hash_destroy( &history_table );
-	
+	cur=0;
 }
 
-
-
 /**
-   Internal search function
+   Append a record for the specified item to the history file of the
+   specified history list. The record is written using a single
+   write to a file opened with O_APPEND, while holding the lock for
+   the history file, so that records from concurrent sessions are
+   never interleaved or lost.
 */
-static ll_node_t *history_find( ll_node_t *n, const wchar_t *s )
+static void history_append( history_mode_t *m, history_item_t *item )
 {
-	if( n == 0 )
-		return 0;
-	
-	if( wcscmp( s, (wchar_t *)n->data ) == 0 )
+	wchar_t *fn = history_filename( m->name );
+	char *lockfile = history_lock( fn );
+	int fd;
+	buffer_t b;
+
+	if( m->needs_convert )
+	{
+		/*
+		  Records can't be appended to a file in the old format. Once
+		  the lock is held, the file has either been converted by
+		  another shell in the meantime, or it is converted here, with
+		  the new item as its last record.
+		*/
+		if( lockfile && !history_file_is_old( fn ) )
+		{
+			m->needs_convert = 0;
+		}
+		else
+		{
+			if( lockfile )
+				history_convert( m, fn, lockfile );
+			history_unlock( lockfile );
+			free( fn );
+			return;
+		}
+	}
+
+	b_init( &b );
+
+	fd = wopen( fn, O_WRONLY|O_APPEND|O_CREAT, 0600 );
+	if( fd != -1 )
 	{
-		return n;		
+		struct stat buf;
+		int write_res;
+
+		if( fstat( fd, &buf ) == 0 && buf.st_size == 0 )
+			b_append( &b, HISTORY_MAGIC, HISTORY_MAGIC_LEN );
+		history_encode( &b, item );
+
+		write_res = write( fd, b.buff, b.used ) != b.used;
+
+		if( close( fd ) || write_res )
+			fd = -1;
+	}
+
+	if( fd == -1 )
+	{
+		debug( 1, L"The following non-fatal error occurred while saving command history to \'%ls\':", fn );
+		wperror( L"write" );
 	}
-	else
-		return history_find( n->prev, s );
-}
 
+	history_unlock( lockfile );
+	b_destroy( &b );
+	free( fn );
+}
 
 void history_add( const wchar_t *str )
 {
-	ll_node_t *old_node;
+	history_item_t *item;
 
 	if( wcslen( str ) == 0 )
 		return;
-	
-	past_end=1;
 
-	old_node = history_find( history_last, str );
+	item = history_add_internal( cur, str );
+	item->timestamp = time( 0 );
+	history_append( cur, item );
+}
+
+/**
+   This function tests if the search string is a match for the given string
+*/
+static int history_test( const wchar_t *needle, const wchar_t *haystack )
+{
+
+/*
+	return wcsncmp( haystack, needle, wcslen(needle) )==0;
+*/
+	return wcsstr( haystack, needle ) != 0;
+}
+
+/**
+   Returns the trigram of the specified search string that occurs in
+   the fewest history items, or 0 if some trigram of the search string
+   doesn't occur in any history item
+*/
+static history_trigram_t *history_index_rarest( history_mode_t *m, const wchar_t *needle )
+{
+	history_trigram_t *res=0;
+	wchar_t key[TRIGRAM_LEN+1];
 
-	if( old_node == 0 )
+	key[TRIGRAM_LEN]=0;
+
+	for( ; needle[TRIGRAM_LEN-1]; needle++ )
 	{
-		history_count++;		
-		history_current = malloc( sizeof( ll_node_t ) );
-		history_current->data=wcsdup( str );
+		history_trigram_t *t;
+
+		wcsncpy( key, needle, TRIGRAM_LEN );
+		t = (history_trigram_t *)hash_get( &m->trigrams, key );
+		if( !t )
+			return 0;
+
+		if( !res || 
+			t->newer.count + t->older.count < res->newer.count + res->older.count )
+			res = t;
 	}
-	else
+	return res;
+}
+
+/**
+   Check if the item at the specified position exists and matches the
+   specified search string
+*/
+static int history_index_test( history_mode_t *m, int pos, const wchar_t *needle )
+{
+	history_item_t *item = history_item( m, pos );
+	return item && history_test( needle, item->data );
+}
+
+/**
+   Returns the index of the first element of the specified list that
+   is not less than pos if the list is in increasing order, or not
+   greater than pos if the list is in decreasing order.
+*/
+static int history_pos_search( pos_list_t *l, int pos, int decreasing )
+{
+	int lo=0, hi=l->count;
+
+	while( lo < hi )
 	{
-		if( old_node == last_loaded )
-		{
-			last_loaded = last_loaded->prev;
-		}
-	
-		history_current = old_node;
-		if( old_node == history_last )
-		{
-			return;
-		}
+		int mid = lo + (hi-lo)/2;
+		if( decreasing?(l->arr[mid] > pos):(l->arr[mid] < pos) )
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+   Use the search index to find the position of the last loaded item
+   before the specified position that matches the specified search
+   string. The search string must be at least TRIGRAM_LEN characters
+   long.
+*/
+static int history_index_prev( history_mode_t *m, int pos, const wchar_t *needle )
+{
+	history_trigram_t *t = history_index_rarest( m, needle );
+	int i;
 
-		if( old_node->prev != 0 )
-			old_node->prev->next = old_node->next;
-		if( old_node->next != 0 )
-			old_node->next->prev = old_node->prev;
+	if( !t )
+		return NO_POS;
+
+	for( i=history_pos_search( &t->newer, pos, 0 )-1; i>=0; i-- )
+	{
+		if( history_index_test( m, t->newer.arr[i], needle ) )
+			return t->newer.arr[i];
 	}
-	history_current->next=0;
-	history_current->prev = history_last;
-	if( history_last != 0 )
+
+	for( i=history_pos_search( &t->older, pos, 1 ); i<t->older.count; i++ )
 	{
-		history_last->next = history_current;
+		if( t->older.arr[i] == pos )
+			continue;
+		if( history_index_test( m, t->older.arr[i], needle ) )
+			return t->older.arr[i];
 	}
-	history_last = history_current;
+
+	return NO_POS;
 }
 
 /**
-   This function tests if the search string is a match for the given string
+   Use the search index to find the position of the first item after
+   the specified position that matches the specified search
+   string. The search string must be at least TRIGRAM_LEN characters
+   long.
 */
-static int history_test( const wchar_t *needle, const wchar_t *haystack )
+static int history_index_next( history_mode_t *m, int pos, const wchar_t *needle )
 {
+	history_trigram_t *t = history_index_rarest( m, needle );
+	int i;
 
-/*
-	return wcsncmp( haystack, needle, wcslen(needle) )==0;
+	if( !t )
+		return NO_POS;
+
+	for( i=history_pos_search( &t->older, pos, 1 )-1; i>=0; i-- )
+	{
+		if( t->older.arr[i] == pos )
+			continue;
+		if( history_index_test( m, t->older.arr[i], needle ) )
+			return t->older.arr[i];
+	}
+
+	for( i=history_pos_search( &t->newer, pos, 0 ); i<t->newer.count; i++ )
+	{
+		if( t->newer.arr[i] == pos )
+			continue;
+		if( history_index_test( m, t->newer.arr[i], needle ) )
+			return t->newer.arr[i];
+	}
+
+	return NO_POS;
+}
+
+/**
+   Returns the position of the last item before the specified position
+   that matches the specified search string, or NO_POS if there is no
+   such item. Short search strings are handled by testing every item,
+   longer ones use the search index. The rest of the history file is
+   loaded if no match is found among the items loaded so far.
+*/
+static int history_search_prev( history_mode_t *m, int pos, const wchar_t *needle )
+{
+	int res;
+
+	if( wcslen( needle ) < TRIGRAM_LEN )
+	{
+		while( (pos = history_prev_pos( m, pos )) != NO_POS )
+		{
+			if( history_test( needle, history_item( m, pos )->data ) )
+				return pos;
+		}
+		return NO_POS;
+	}
+
+	res = history_index_prev( m, pos, needle );
+	if( res == NO_POS && m->scan_pos > 0 )
+	{
+		history_load_all( m );
+		res = history_index_prev( m, pos, needle );
+	}
+	return res;
+}
+
+/**
+   Returns the position of the first item after the specified position
+   that matches the specified search string, or NO_POS if there is no
+   such item.
 */
-	return (int)wcsstr( haystack, needle );
+static int history_search_next( history_mode_t *m, int pos, const wchar_t *needle )
+{
+	if( wcslen( needle ) < TRIGRAM_LEN )
+	{
+		while( (pos = history_next_pos( m, pos )) != NO_POS )
+		{
+			if( history_test( needle, history_item( m, pos )->data ) )
+				return pos;
+		}
+		return NO_POS;
+	}
+
+	return history_index_next( m, pos, needle );
 }
 
 const wchar_t *history_prev_match( const wchar_t *str )
 {
-	if( history_current == 0 )
+	int prev;
+	history_item_t *item;
+
+	if( cur->current == NO_POS )
 		return str;
-	
-	if( history_current->prev == 0 )
+
+	if( cur->past_end )
 	{
-		if( history_test( str, history_current->data ) )
-			return (wchar_t *)history_current->data;
-		else
-			return str;
+		cur->past_end = 0;
+		item = history_item( cur, cur->current );
+		if( history_test( str, item->data ) )
+			return item->data;
 	}
-	if( past_end )
-		past_end = 0;
-	else
-		history_current = history_current->prev;
 
-	if( history_test( str, history_current->data) )
-		return (wchar_t *)history_current->data;
-	else
-		return history_prev_match( str );
+	prev = history_search_prev( cur, cur->current, str );
+
+	if( prev == NO_POS )
+	{
+		/*
+		  No more matches, move to the first item of the
+		  history. The search has already loaded the entire history
+		  file.
+		*/
+		history_load_all( cur );
+		cur->current = history_next_pos( cur, -al_get_count( &cur->old_items )-1 );
+		item = history_item( cur, cur->current );
+		return history_test( str, item->data )?item->data:str;
+	}
+
+	cur->current = prev;
+	return history_item( cur, cur->current )->data;
 }
 
 
 const wchar_t *history_next_match( const wchar_t *str)
 {
-	if( history_current == 0 )
+	int next;
+
+	if( cur->current == NO_POS )
 		return str;
 
-	if( history_current->next == 0 )
+	next = history_search_next( cur, cur->current, str );
+
+	if( next == NO_POS )
 	{
-		past_end = 1;
+		cur->current = history_prev_pos( cur, al_get_count( &cur->items ) );
+		cur->past_end = 1;
 		return str;
 	}
-	history_current = history_current->next;
-	
-	if( history_test( str, history_current->data ) )
-		return (wchar_t *)history_current->data;
-	else
-		return history_next_match( str );	
+
+	cur->current = next;
+	return history_item( cur, cur->current )->data;
 }
 
 void history_reset()
 {
-	history_current = history_last;
+	cur->current = history_prev_pos( cur, al_get_count( &cur->items ) );
+	cur->past_end = 1;
 }
 
 /**
-   Move to first history item
+   Move to first history item. This loads the entire history file.
 */
 void history_first()
 {
-	while( history_current->prev )
-		history_current = history_current->prev;
-	
+	if( cur->current == NO_POS )
+		return;
+
+	history_load_all( cur );
+	cur->current = history_next_pos( cur, -al_get_count( &cur->old_items )-1 );
 }
 
 wchar_t *history_get( int idx )
 {
-	ll_node_t *n=history_last;
+	int pos = al_get_count( &cur->items );
 	int i;
 	if( idx<0)
 	{
 		debug( 1, L"Tried to access negative history index %d", idx );
 		return 0;
 	}
-	
-	for( i=0; i<idx; i++ )
+
+	for( i=0; i<=idx; i++ )
 	{
-		if( !n )
-			break;
-		n=n->prev;
+		pos = history_prev_pos( cur, pos );
+		if( pos == NO_POS )
+			return 0;
 	}
-	return n?n->data:0;
+	return history_item( cur, pos )->data;
 }
 
 
 void history_sanity_check()
-{	
-	return;
-	
-	if( history_current != 0 )
-	{
-		int i;
-		int history_ok = 1;
-		int found_current = 0;
-		
-		validate_pointer( history_last, L"History root", 1);
-		
-		ll_node_t *tmp = history_last;
-		for( i=0; i<history_count; i++ )
-		{
-			found_current |= tmp == history_current;
+{
+	history_item_t *item;
 
-			if( tmp == 0 )
-			{
-				history_ok = 0;
-				debug( 1, L"History items missing" );
-				break;
-			}
+	if( !cur )
+		return;
 
-			if( (tmp->prev != 0) && (tmp->prev->next != tmp ) )
-			{
-				history_ok = 0;
-				debug( 1, L"History items order is inconsistent" );
-				break;
-			}
-			
-			validate_pointer( tmp->data, L"History data", 1);
-			if( tmp->data == 0 )
-			{
-				history_ok = 0;
-				debug( 1, L"Empty history item" );
-				break;
-			}
-			validate_pointer( tmp->prev, L"History node", 1);
-			tmp = tmp->prev;
-		}
-		if( tmp != 0 )
-		{
-			history_ok = 0;
-			debug( 1, L"History list too long" );
-		}
+	if( cur->count > al_get_count( &cur->items ) ||
+		cur->old_count > al_get_count( &cur->old_items ) )
+	{
+		debug( 1, L"History list too short" );
+		sanity_lose();
+	}
 
-		if( (i!= history_count )|| (!found_current))
-		{
-			debug( 1, L"No history item selected" );
-			history_ok=0;
-		}
-		
-		if( !history_ok )
-		{
-			sanity_lose();			
-		}
-	}	
-}
+	if( cur->scan_pos > cur->map_len )
+	{
+		debug( 1, L"History file position out of bounds" );
+		sanity_lose();
+	}
+
+	if( cur->current == NO_POS )
+		return;
+
+	item = history_item( cur, cur->current );
+	if( !item )
+	{
+		debug( 1, L"History position out of bounds" );
+		sanity_lose();
+		return;
+	}
 
+	validate_pointer( item->data, L"History data", 0 );
+	if( item->pos != cur->current )
+	{
+		debug( 1, L"History items order is inconsistent" );
+		sanity_lose();
+	}
+}
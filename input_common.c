@@ -40,11 +40,36 @@ static int lookahead_count = 0;
 */
 static int (*interrupt_handler)();
 
+/**
+   Callback function for doing background work while waiting for input
+*/
+static int (*idle_handler)();
+
 void input_common_init( int (*ih)() )
 {
 	interrupt_handler = ih;
 }
 
+void input_common_set_idle_handler( int (*ih)() )
+{
+	idle_handler = ih;
+}
+
+int input_common_has_input()
+{
+	fd_set fd;
+	struct timeval tv;
+
+	if( lookahead_count )
+		return 1;
+	
+	FD_ZERO( &fd );
+	FD_SET( 0, &fd );
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	return select( 1, &fd, 0, 0, &tv ) > 0;
+}
+
 void input_common_destroy()
 {
 	
@@ -58,6 +83,7 @@ static wint_t readb()
 {
 	unsigned char arr[1];
 	int do_loop = 0;
+	int is_idle = idle_handler != 0;
 
 	do
 	{
@@ -74,8 +100,29 @@ static wint_t readb()
 		}
 		
 		do_loop = 0;			
+
+		/*
+		  While there is background work to do, poll for input and do
+		  a bit of work each time no input is available
+		*/
+		if( is_idle )
+		{
+			struct timeval tv;
+			tv.tv_sec = 0;
+			tv.tv_usec = 0;
+			res = select( fd_max, &fd, 0, 0, &tv );
+			if( res == 0 )
+			{
+				is_idle = idle_handler();
+				do_loop = 1;
+				continue;
+			}
+		}
+		else
+		{
+			res = select( fd_max, &fd, 0, 0, 0 );
+		}
 		
-		res = select( fd_max, &fd, 0, 0, 0 );
 		if( res==-1 )
 		{
 			switch( errno )
@@ -28,6 +28,20 @@ void input_common_init( int (*ih)() );
 
 void input_common_destroy();
 
+/**
+   Set a function to call while waiting for input. The function
+   should do a small amount of work and return quickly, and return
+   non-zero if it has more work to do. It is called repeatedly until
+   input arrives or it returns zero, and again on the next read.
+*/
+void input_common_set_idle_handler( int (*ih)() );
+
+/**
+   Returns true if there is input waiting to be read, either in the
+   lookahead buffer or on stdin. Never blocks.
+*/
+int input_common_has_input();
+
 /**
    Function used by input_readch to read bytes from stdin until enough
    bytes have been read to convert them to a wchar_t. Conversion is
@@ -33,7 +33,32 @@ Utilities for io redirection.
 #include "common.h"
 #include "io.h"
 
+/**
+   Smallest amount of data to read at a time from the pipe of an
+   IO_BUFFER redirection
+*/
+#define READ_MIN 4096
+
+/**
+   Largest amount of data to read at a time from the pipe of an
+   IO_BUFFER redirection
+*/
+#define READ_MAX (1<<20)
+
+
 
+int io_buffer_read_chunk( io_data_t *d )
+{
+	buffer_t *b = d->param2.out_buffer;
+	size_t len = maxi( READ_MIN, mini( b->used, READ_MAX ) );
+	int l;
+	
+	b_reserve( b, len );
+	l = read_blocked( d->param1.pipe_fd[0], b->buff+b->used, len );
+	if( l > 0 )
+		b->used += l;
+	return l;
+}
 
 void io_buffer_read( io_data_t *d )
 {
@@ -50,9 +75,8 @@ void io_buffer_read( io_data_t *d )
 		debug( 4, L"exec_read_io_buffer: blocking read on fd %d", d->param1.pipe_fd[0] );
 		while(1)
 		{
-			char b[4096];
 			int l;
-			l=read_blocked( d->param1.pipe_fd[0], b, 4096 );
+			l=io_buffer_read_chunk( d );
 			if( l==0 )
 			{
 				break;
@@ -76,10 +100,6 @@ void io_buffer_read( io_data_t *d )
 				
 				break;				
 			}
-			else
-			{				
-				b_append( d->param2.out_buffer, b, l );				
-			}
 		}
 	}
 }
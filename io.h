@@ -84,4 +84,13 @@ io_data_t *io_buffer_create();
 */
 void io_buffer_read( io_data_t *d );
 
+/**
+   Read once from the pipe of the specified IO_BUFFER redirection,
+   straight into its output buffer. The amount read at a time grows
+   with the amount of output already buffered.
+
+   \return the return value of read_blocked
+*/
+int io_buffer_read_chunk( io_data_t *d );
+
 #endif
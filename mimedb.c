@@ -37,31 +37,13 @@ license. Read the source code of the library for more information.
 
 #include "xdgmime.h"
 #include "util.h"
+#include "mimedb_common.h"
 
 /**
    Location of the applications .desktop file, relative to a base mime directory
 */
 #define APPLICATIONS_DIR "applications/"
 
-/**
-   Location of the mime xml database, relative to a base mime directory
-*/
-#define MIME_DIR "mime/"
-/**
-   Filename suffix for XML files
-*/
-#define MIME_SUFFIX ".xml"
-
-/**
-   Start tag for comment
-*/
-#define START_TAG "<comment>"
-
-/**
-   End tab for comment
-*/
-#define STOP_TAG "</comment>"
-
 /**
    File contains cached list of mime actions
 */
@@ -184,281 +166,6 @@ static char * search_ini( const char *filename, const char *match )
 		return (char *)0;
 }
 
-/**
-  Test if the specified file exists. If it does not, also try
-  replacing dashes with slashes in \c in.
-*/
-static char *file_exists( const char *dir, const char *in )
-{
-	char *filename = my_malloc( strlen( dir ) + strlen(in) + 1 );
-	char *replaceme;
-	struct stat buf;
-
-//	fprintf( stderr, "Check %s%s\n", dir, in );
-	
-	if( !filename )
-	{
-		return 0;
-	}	
-	strcpy( filename, dir );
-	strcat( filename, in );	
-	
-	if( !stat( filename, &buf ) )
-		return filename;
-
-	free( filename );
-	
-	/*
-	  DOH! File does not exist. But all is not lost. KDE sometimes uses
-	  a slash in the name as a directory separator. We try to replace
-	  a dash with a slash and try again. 
-	*/
-	replaceme = strchr( in, '-' ); 
-	if( replaceme )
-	{
-		char *res;
-		
-		*replaceme = '/';
-		res = file_exists( dir, in );
-		*replaceme = '-';
-		return res;
-	}
-	/*
-	  OK, no more slashes left. We really are screwed. Nothing to to
-	  but admit defeat and go home.
-	*/
-	return 0;
-}
-
-
-/**
-   Try to find the specified file in any of the possible directories
-   where mime files can be located.  This code is shamelessly stolen
-   from xdg_run_command_on_dirs.
-*/
-static char *get_filename( char *f )
-{
-	char *result;
-	const char *xdg_data_home;
-	const char *xdg_data_dirs;
-	const char *ptr;
-
-	xdg_data_home = getenv ("XDG_DATA_HOME");
-	if (xdg_data_home)
-    {
-		result = file_exists( xdg_data_home, f ); 
-		if (result)
-			return result;
-    }
-	else
-    {
-		const char *home;
-
-		home = getenv ("HOME");
-		if (home != NULL)
-		{
-			char *guessed_xdg_home;
-
-			guessed_xdg_home = my_malloc (strlen (home) + strlen ("/.local/share/") + 1);
-			if( !guessed_xdg_home )
-				return 0;
-			
-			strcpy (guessed_xdg_home, home);
-			strcat (guessed_xdg_home, "/.local/share/");
-			result = file_exists( guessed_xdg_home, f ); 
-			free (guessed_xdg_home);
-
-			if (result)
-				return result;
-		}
-    }
-
-	xdg_data_dirs = getenv ("XDG_DATA_DIRS");
-	if (xdg_data_dirs == NULL)
-		xdg_data_dirs = "/usr/local/share/:/usr/share/";
-
-	ptr = xdg_data_dirs;
-
-	while (*ptr != '\000')
-    {
-		const char *end_ptr;
-		char *dir;
-		int len;
-
-		end_ptr = ptr;
-		while (*end_ptr != ':' && *end_ptr != '\000')
-			end_ptr ++;
-
-		if (end_ptr == ptr)
-		{
-			ptr++;
-			continue;
-		}
-
-		if (*end_ptr == ':')
-			len = end_ptr - ptr;
-		else
-			len = end_ptr - ptr + 1;
-		dir = my_malloc (len + 1);
-		if( !dir )
-			return 0;
-		
-		strncpy (dir, ptr, len);
-		dir[len] = '\0';
-		result = file_exists( dir, f ); 
-		
-		free (dir);
-
-		if (result)
-			return result;
-
-		ptr = end_ptr;
-    }
-	return 0;	
-}
-
-/**
-   Remove excessive whitespace from string. Replaces arbitrary sequence
-   of whitespace with a single space.  Also removes any leading and
-   trailing whitespace
-*/
-static char *munge( char *in )
-{
-	char *out = my_malloc( strlen( in )+1 );
-	char *p=out;
-	int had_whitespace = 0;
-	int printed = 0;
-	if( !out )
-	{
-		return 0;
-	}
-	
-	while( 1 )
-	{
-//		fprintf( stderr, "%c\n", *in );
-		
-		switch( *in )
-		{
-			case ' ':
-			case '\n':
-			case '\t':
-			case '\r':
-			{
-				had_whitespace = 1;
-				break;
-			}
-			case '\0':
-				*p = '\0';
-				return out;
-			default:
-			{
-				if( printed && had_whitespace )
-				{
-					*(p++)=' ';
-				}
-				printed=1;
-				had_whitespace=0;				
-				*(p++)=*in;
-				break;
-			}
-		}
-		in++;
-	}
-	fprintf( stderr, "mimedb: Unknown error in munge()\n" );
-	error=1;
-	return 0;
-}
-
-/**
-   Get description for a specified mimetype. 
-*/
-static char *get_description( const char *mimetype )
-{
-	char *fn_part;
-	
-	char *fn;
-	int fd;
-	struct stat st;
-	char *contents;
-	char *start, *stop;
-
-	fn_part = my_malloc( strlen(MIME_DIR) + strlen( mimetype) + strlen(MIME_SUFFIX) + 1 );
-
-	if( !fn_part )
-	{
-		return 0;
-	}
-
-	strcpy( fn_part, MIME_DIR );
-	strcat( fn_part, mimetype );
-	strcat( fn_part, MIME_SUFFIX );
-
-	fn = get_filename(fn_part); //malloc( strlen(MIME_DIR) +strlen( MIME_SUFFIX)+ strlen( mimetype ) + 1 );
-	free(fn_part );
-	
-	if( !fn )
-	{
-		return 0;
-	}
-
-	fd = open( fn, O_RDONLY );
-
-//	fprintf( stderr, "%s\n", fn );
-	
-	if( fd == -1 )
-	{
-		perror( "open" );
-		error=1;
-		return 0;
-	}
-	
-	if( stat( fn, &st) )
-	{
-		perror( "stat" );
-		error=1;
-		return 0;
-	}
-
-	contents = my_malloc( st.st_size + 1 );
-	if( !contents )
-	{
-		return 0;
-	}
-	
-	if( read( fd, contents, st.st_size ) != st.st_size )
-	{
-		perror( "read" );
-		error=1;
-		return 0;
-	}
-
-	close( fd );
-	free( fn );
-
-	contents[st.st_size]=0;
-
-	start = strstr( contents, START_TAG );
-	if( start )
-	{
-		start += strlen(START_TAG);
-		stop = strstr( start, STOP_TAG );
-		if( stop )
-		{
-			char *res;
-			*stop = '\0';
-			res = munge( start );
-			free( contents );
-			return res;
-		}
-	}
-	free( contents );
-	fprintf( stderr, "mimedb: No description for type %s\n", mimetype );
-	error=1;
-	return 0;
-
-}
-
-
 /**
    Get default action for a specified mimetype. 
 */
@@ -474,7 +181,7 @@ static char *get_action( const char *mimetype )
 	char *launcher_filename, *launcher_command_str, *launcher_command;
 	char *launcher_full;
 	
-	mime_filename = get_filename( DESKTOP_DEFAULT );
+	mime_filename = mimedb_get_filename( DESKTOP_DEFAULT );
 	if( !mime_filename )
 		return 0;
 	
@@ -540,7 +247,7 @@ static char *get_action( const char *mimetype )
 	strcat( launcher_full, launcher );
 	free( launcher_str );
 	
-	launcher_filename = get_filename( launcher_full );
+	launcher_filename = mimedb_get_filename( launcher_full );
 	
 	free( launcher_full );
 		
@@ -1010,6 +717,11 @@ int main (int argc, char *argv[])
 	
 	int i;
 
+	/*
+	  The mimetypes of the file arguments, when looking at file contents
+	*/
+	const char **file_mimetypes=0;
+
 	hash_table_t launch_hash;
 	
 
@@ -1144,6 +856,20 @@ int main (int argc, char *argv[])
 	
 	//fprintf( stderr, "Input %d, output %d\n", input_type, output_type );	
 
+	/*
+	  Sniff all files in one go, so the mime database is only
+	  consulted once for the whole batch
+	*/
+	if( input_type == FILEDATA && optind < argc )
+	{
+		file_mimetypes = my_malloc( sizeof(char *)*(argc-optind) );
+		if( !file_mimetypes )
+			return 1;
+		xdg_mime_get_mime_types_for_files( (const char **)argv+optind,
+										   file_mimetypes,
+										   argc-optind );
+	}
+
 	for (i = optind; (i < argc)&&(!error); i++)
     {
 		/* Convert from filename to mimetype, if needed */
@@ -1153,7 +879,7 @@ int main (int argc, char *argv[])
 		}
 		else if( input_type == FILEDATA )
 		{
-			mimetype = xdg_mime_get_mime_type_for_file(argv[i]);
+			mimetype = file_mimetypes[i-optind];
 		}
 		else
 			mimetype = xdg_mime_is_valid_mime_type(argv[i])?argv[i]:0;
@@ -1179,7 +905,12 @@ int main (int argc, char *argv[])
 			}
 			case DESCRIPTION:
 			{
-				output = get_description( mimetype );				
+				output = mimedb_get_description( mimetype );
+				if( !output )
+				{
+					fprintf( stderr, "mimedb: No description for type %s\n", mimetype );
+					error=1;
+				}
 				break;
 			}
 			case ACTION:
@@ -1260,6 +991,8 @@ int main (int argc, char *argv[])
 	if( launch_buff )
 		free( launch_buff );
 
+	free( file_mimetypes );
+
 	xdg_mime_shutdown();
 	
 	return error;	
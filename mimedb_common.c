@@ -0,0 +1,311 @@
+/** \file mimedb_common.c
+
+	Mime database lookups used both by the mimedb command and by fish
+	itself. Keeping these in a library of their own means fish can
+	describe files while completing without starting a new mimedb
+	process, and without parsing the mime database again, for every
+	suffix.
+*/
+
+#include "config.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "xdgmime.h"
+#include "mimedb_common.h"
+
+/**
+   Location of the mime xml database, relative to a base mime directory
+*/
+#define MIME_DIR "mime/"
+/**
+   Filename suffix for XML files
+*/
+#define MIME_SUFFIX ".xml"
+
+/**
+   Start tag for comment
+*/
+#define START_TAG "<comment>"
+
+/**
+   End tab for comment
+*/
+#define STOP_TAG "</comment>"
+
+/**
+  Test if the specified file exists. If it does not, also try
+  replacing dashes with slashes in \c in.
+*/
+static char *file_exists( const char *dir, const char *in )
+{
+	int dir_len = strlen( dir );
+	char *filename = malloc( dir_len + strlen(in) + 1 );
+	char *replaceme;
+	struct stat buf;
+
+	if( !filename )
+	{
+		return 0;
+	}	
+	strcpy( filename, dir );
+	strcat( filename, in );	
+	
+	if( !stat( filename, &buf ) )
+		return filename;
+
+	/*
+	  DOH! File does not exist. But all is not lost. KDE sometimes uses
+	  a slash in the name as a directory separator. We replace one
+	  dash after another with a slash and try again. 
+	*/
+	for( replaceme = strchr( filename+dir_len, '-' ); 
+		 replaceme; 
+		 replaceme = strchr( replaceme+1, '-' ) )
+	{
+		*replaceme = '/';
+		if( !stat( filename, &buf ) )
+			return filename;
+	}
+	
+	/*
+	  OK, no more dashes left. We really are screwed. Nothing to to
+	  but admit defeat and go home.
+	*/
+	free( filename );
+	return 0;
+}
+
+
+/**
+   Try to find the specified file in any of the possible directories
+   where mime files can be located.  This code is shamelessly stolen
+   from xdg_run_command_on_dirs.
+*/
+char *mimedb_get_filename( const char *f )
+{
+	char *result;
+	const char *xdg_data_home;
+	const char *xdg_data_dirs;
+	const char *ptr;
+
+	xdg_data_home = getenv ("XDG_DATA_HOME");
+	if (xdg_data_home)
+    {
+		result = file_exists( xdg_data_home, f ); 
+		if (result)
+			return result;
+    }
+	else
+    {
+		const char *home;
+
+		home = getenv ("HOME");
+		if (home != NULL)
+		{
+			char *guessed_xdg_home;
+
+			guessed_xdg_home = malloc (strlen (home) + strlen ("/.local/share/") + 1);
+			if( !guessed_xdg_home )
+				return 0;
+			
+			strcpy (guessed_xdg_home, home);
+			strcat (guessed_xdg_home, "/.local/share/");
+			result = file_exists( guessed_xdg_home, f ); 
+			free (guessed_xdg_home);
+
+			if (result)
+				return result;
+		}
+    }
+
+	xdg_data_dirs = getenv ("XDG_DATA_DIRS");
+	if (xdg_data_dirs == NULL)
+		xdg_data_dirs = "/usr/local/share/:/usr/share/";
+
+	ptr = xdg_data_dirs;
+
+	while (*ptr != '\000')
+    {
+		const char *end_ptr;
+		char *dir;
+		int len;
+
+		end_ptr = ptr;
+		while (*end_ptr != ':' && *end_ptr != '\000')
+			end_ptr ++;
+
+		if (end_ptr == ptr)
+		{
+			ptr++;
+			continue;
+		}
+
+		if (*end_ptr == ':')
+			len = end_ptr - ptr;
+		else
+			len = end_ptr - ptr + 1;
+		dir = malloc (len + 1);
+		if( !dir )
+			return 0;
+		
+		strncpy (dir, ptr, len);
+		dir[len] = '\0';
+		result = file_exists( dir, f ); 
+		
+		free (dir);
+
+		if (result)
+			return result;
+
+		ptr = end_ptr;
+    }
+	return 0;	
+}
+
+/**
+   Remove excessive whitespace from string. Replaces arbitrary sequence
+   of whitespace with a single space.  Also removes any leading and
+   trailing whitespace
+*/
+static char *munge( char *in )
+{
+	char *out = malloc( strlen( in )+1 );
+	char *p=out;
+	int had_whitespace = 0;
+	int printed = 0;
+	if( !out )
+	{
+		return 0;
+	}
+	
+	while( 1 )
+	{
+		switch( *in )
+		{
+			case ' ':
+			case '\n':
+			case '\t':
+			case '\r':
+			{
+				had_whitespace = 1;
+				break;
+			}
+			case '\0':
+				*p = '\0';
+				return out;
+			default:
+			{
+				if( printed && had_whitespace )
+				{
+					*(p++)=' ';
+				}
+				printed=1;
+				had_whitespace=0;				
+				*(p++)=*in;
+				break;
+			}
+		}
+		in++;
+	}
+}
+
+char *mimedb_get_description( const char *mimetype )
+{
+	char *fn_part;
+	
+	char *fn;
+	int fd;
+	struct stat st;
+	char *contents;
+	char *start, *stop;
+	char *res = 0;
+
+	fn_part = malloc( strlen(MIME_DIR) + strlen( mimetype) + strlen(MIME_SUFFIX) + 1 );
+
+	if( !fn_part )
+	{
+		return 0;
+	}
+
+	strcpy( fn_part, MIME_DIR );
+	strcat( fn_part, mimetype );
+	strcat( fn_part, MIME_SUFFIX );
+
+	fn = mimedb_get_filename( fn_part );
+	free( fn_part );
+	
+	if( !fn )
+	{
+		return 0;
+	}
+
+	fd = open( fn, O_RDONLY );
+	free( fn );
+	
+	if( fd == -1 )
+	{
+		return 0;
+	}
+	
+	if( fstat( fd, &st) )
+	{
+		close( fd );
+		return 0;
+	}
+
+	contents = malloc( st.st_size + 1 );
+	if( !contents )
+	{
+		close( fd );
+		return 0;
+	}
+	
+	if( read( fd, contents, st.st_size ) != st.st_size )
+	{
+		close( fd );
+		free( contents );
+		return 0;
+	}
+
+	close( fd );
+
+	contents[st.st_size]=0;
+
+	start = strstr( contents, START_TAG );
+	if( start )
+	{
+		start += strlen(START_TAG);
+		stop = strstr( start, STOP_TAG );
+		if( stop )
+		{
+			*stop = '\0';
+			res = munge( start );
+		}
+	}
+	free( contents );
+	return res;
+}
+
+char *mimedb_get_description_for_filename( const char *filename )
+{
+	const char *mimetype;
+
+	/*
+	  xdgmime loads the glob database on the first lookup, and after
+	  that only rereads it if it has changed on disk
+	*/
+	mimetype = xdg_mime_get_mime_type_from_file_name( filename );
+	if( mimetype )
+		mimetype = xdg_mime_unalias_mime_type( mimetype );
+	if( !mimetype )
+		return 0;
+	
+	return mimedb_get_description( mimetype );
+}
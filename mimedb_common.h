@@ -0,0 +1,36 @@
+/** \file mimedb_common.h
+
+	Mime database lookups used both by the mimedb command and by fish
+	itself, which uses them to describe files when completing.
+*/
+
+#ifndef FISH_MIMEDB_COMMON_H
+#define FISH_MIMEDB_COMMON_H
+
+/**
+   Try to find the specified file in any of the possible directories
+   where mime files can be located.
+
+   \param f the name of the file, relative to a base mime directory
+   \return the full path of the file, allocated using malloc, or 0 if the file could not be found
+*/
+char *mimedb_get_filename( const char *f );
+
+/**
+   Get the description of the specified mimetype from the mime xml
+   database. Whitespace in the description is normalized.
+
+   \return the description, allocated using malloc, or 0 if no description could be found
+*/
+char *mimedb_get_description( const char *mimetype );
+
+/**
+   Get the description of the mimetype of the specified filename,
+   guessed from the name only. The mime database is only loaded once,
+   and only reloaded when it changes.
+
+   \return the description, allocated using malloc, or 0 if no description could be found
+*/
+char *mimedb_get_description_for_filename( const char *filename );
+
+#endif
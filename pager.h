@@ -0,0 +1,37 @@
+/** \file pager.h
+
+	The completion pager. Prints a list of completions in as many
+	columns as will fit on the screen, and lets the user scroll
+	through the list if it is too long to fit.
+
+	The pager is used directly by the reader, and by the fish_pager
+	program.
+*/
+
+#ifndef FISH_PAGER_H
+#define FISH_PAGER_H
+
+#include <wchar.h>
+
+#include "util.h"
+
+/**
+   Print the specified list of completions below the cursor. The
+   terminal must be in non-canonical mode, and setupterm must have
+   been called.
+
+   The descriptions of the completions are modified in place, to
+   replace any series of whitespace and control characters with a
+   single space.
+
+   \param prefix the string to print before each completion
+   \param is_quoted whether the completions are printed in a quoted environment
+   \param comp the list of completions
+   \param out the key that was used to leave a scrollable list, if any, is appended here
+*/
+void pager_print( wchar_t *prefix,
+				  int is_quoted,
+				  array_list_t *comp,
+				  string_buffer_t *out );
+
+#endif
@@ -7,6 +7,7 @@ The fish parser. Contains functions for parsing code.
 #include <stdlib.h>
 #include <stdio.h>
 #include <wchar.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -16,6 +17,7 @@ The fish parser. Contains functions for parsing code.
 #include <pwd.h>
 #include <dirent.h>
 #include <signal.h>
+#include <time.h>
 
 #include "config.h"
 #include "util.h"
@@ -94,6 +96,24 @@ The fish parser. Contains functions for parsing code.
 */
 #define CMD_ERR_MSG L"Expected command"
 
+/**
+   Maximum number of entries in the command lookup cache. The cache
+   is flushed when it grows beyond this, since syntax highlighting
+   looks up every prefix of the commands the user types.
+*/
+#define PATH_CACHE_MAX 1024
+
+/**
+   Modification time used for directories in $PATH that do not exist
+*/
+#define PATH_MTIME_MISSING ((time_t)-2)
+
+/**
+   Modification time used for directories in $PATH that were modified
+   too recently to trust their modification time
+*/
+#define PATH_MTIME_UNKNOWN ((time_t)-1)
+
 /** Last error code */
 int error_code;
 
@@ -138,6 +158,52 @@ static array_list_t profile_data;
 */
 static int eval_level=-1;
 
+/**
+   A directory in $PATH, and its modification time when the command
+   lookup cache was last validated.
+*/
+typedef struct
+{
+	/** Name of the directory */
+	wchar_t *dir;
+	/** Modification time, or one of PATH_MTIME_MISSING and PATH_MTIME_UNKNOWN */
+	time_t mtime;
+}
+path_dir_t;
+
+/**
+   Command lookup cache, mapping command names to the full path of the
+   command, or to path_cache_missing if the command was not found.
+*/
+static hash_table_t path_cache;
+
+/**
+   Value stored in the command lookup cache for commands that were
+   not found.
+*/
+static wchar_t path_cache_missing[] = L"";
+
+/**
+   The value of $PATH the command lookup cache was built for
+*/
+static wchar_t *path_cache_path;
+
+/**
+   The directories of path_cache_path, as path_dir_t structs
+*/
+static array_list_t path_cache_dirs;
+
+/**
+   The last time the directory modification times were checked
+*/
+static time_t path_cache_checked;
+
+/**
+   The command substitution started by the for command that was parsed
+   last, waiting to be handed to the for block
+*/
+static subshell_stream_t *for_stream=0;
+
 static int parse_job( process_t *p,
 					  job_t *j,
 					  tokenizer *tok );
@@ -213,6 +279,8 @@ void parser_pop_block()
 			al_foreach( &current_block->param2.for_vars, 
 						(void (*)(const void *))&free );
 			al_destroy( &current_block->param2.for_vars );
+			if( current_block->param3.for_stream )
+				exec_subshell_stream_destroy( current_block->param3.for_stream );
 			break;
 		}
 
@@ -554,7 +622,210 @@ static void error_arg( int ec, const wchar_t *es, const wchar_t *ea, int p )
 	free(msg);
 }
 
-wchar_t *get_filename( const wchar_t *cmd )
+/**
+   Free a key/value pair of the command lookup cache
+*/
+static void path_cache_free_entry( const void *key, const void *data )
+{
+	free( (void *)key );
+	if( data != path_cache_missing )
+		free( (void *)data );
+}
+
+/**
+   Remove all entries from the command lookup cache, but keep the
+   list of directories.
+*/
+static void path_cache_clear()
+{
+	hash_foreach( &path_cache, &path_cache_free_entry );
+	hash_destroy( &path_cache );
+	hash_init( &path_cache, &hash_wcs_func, &hash_wcs_cmp );
+}
+
+/**
+   Returns the modification time of the specified directory, or
+   PATH_MTIME_MISSING if it does not exist. Directories modified
+   during the current second get PATH_MTIME_UNKNOWN, since they may
+   change again without changing their modification time.
+*/
+static time_t path_cache_mtime( const wchar_t *dir, time_t now )
+{
+	struct stat buf;
+	if( wstat( dir, &buf ) )
+		return PATH_MTIME_MISSING;
+	if( buf.st_mtime >= now )
+		return PATH_MTIME_UNKNOWN;
+	return buf.st_mtime;
+}
+
+/**
+   Make sure the command lookup cache is valid for the current value
+   of $PATH. The cache is flushed if $PATH has changed, and, at most
+   once per second, if any directory in $PATH has been modified.
+*/
+static void path_cache_validate( const wchar_t *path )
+{
+	time_t now = time( 0 );
+	int i;
+	
+	if( !path_cache_path || wcscmp( path, path_cache_path ) != 0 )
+	{
+		wchar_t *path_cpy, *nxt, *state;
+		
+		path_cache_flush();
+		free( path_cache_path );
+		path_cache_path = wcsdup( path );
+		path_cpy = wcsdup( path );
+		if( !path_cache_path || !path_cpy )
+			die_mem();
+		
+		for( nxt = wcstok( path_cpy, ARRAY_SEP_STR, &state );
+			 nxt != 0;
+			 nxt = wcstok( 0, ARRAY_SEP_STR, &state) )
+		{
+			path_dir_t *d = malloc( sizeof( path_dir_t ) );
+			if( !d )
+				die_mem();
+			d->dir = wcsdup( nxt );
+			d->mtime = path_cache_mtime( nxt, now );
+			al_push( &path_cache_dirs, d );
+		}
+		free( path_cpy );
+		path_cache_checked = now;
+		return;
+	}
+
+	if( now == path_cache_checked )
+		return;
+	path_cache_checked = now;
+
+	for( i=0; i<al_get_count( &path_cache_dirs ); i++ )
+	{
+		path_dir_t *d = (path_dir_t *)al_get( &path_cache_dirs, i );
+		time_t mtime = path_cache_mtime( d->dir, now );
+		
+		if( mtime != d->mtime || mtime == PATH_MTIME_UNKNOWN )
+		{
+			path_cache_clear();
+		}
+		d->mtime = mtime;
+	}
+}
+
+void path_cache_flush()
+{
+	int i;
+	
+	path_cache_clear();
+
+	for( i=0; i<al_get_count( &path_cache_dirs ); i++ )
+	{
+		path_dir_t *d = (path_dir_t *)al_get( &path_cache_dirs, i );
+		free( d->dir );
+		free( d );
+	}
+	al_truncate( &path_cache_dirs, 0 );
+	free( path_cache_path );
+	path_cache_path = 0;
+}
+
+/**
+   Add the names of all commands in the command lookup cache that
+   were found to the specified list
+*/
+static void path_cache_add_name( const void *key, 
+								 const void *data,
+								 void *aux )
+{
+	if( data != path_cache_missing )
+		al_push( (array_list_t *)aux, key );
+}
+
+void path_cache_get_names( array_list_t *list )
+{
+	hash_foreach2( &path_cache, &path_cache_add_name, list );
+}
+
+/**
+   Search $PATH for the specified command. This is the uncached part
+   of get_filename().
+*/
+static wchar_t *path_search( const wchar_t *cmd, const wchar_t *path )
+{
+	/*
+	  Allocate string long enough to hold the whole command
+	*/
+	wchar_t *new_cmd = malloc( sizeof(wchar_t)*(wcslen(cmd)+wcslen(path)+2) );
+	/* 
+	   We tokenize a copy of the path, since strtok modifies
+	   its arguments 
+	*/
+	wchar_t *path_cpy = wcsdup( path );
+	wchar_t *nxt_path;
+	wchar_t *state;
+
+	if( (new_cmd==0) || (path_cpy==0) )
+	{
+		die_mem();
+	}
+
+	for( nxt_path = wcstok( path_cpy, ARRAY_SEP_STR, &state );
+		 nxt_path != 0;
+		 nxt_path = wcstok( 0, ARRAY_SEP_STR, &state) )
+	{
+		int path_len = wcslen( nxt_path );
+		wcscpy( new_cmd, nxt_path );
+		if( new_cmd[path_len-1] != '/' )
+		{
+			new_cmd[path_len++]='/';
+		}
+		wcscpy( &new_cmd[path_len], cmd );
+		if( waccess( new_cmd, X_OK )==0 )
+		{
+			struct stat buff;
+			if( wstat( new_cmd, &buff )==-1 )
+			{
+				if( errno != EACCES )
+					wperror( L"stat" );
+				continue;
+			}
+			if( S_ISREG(buff.st_mode) )
+			{
+				free( path_cpy );
+				return new_cmd;
+			}
+		}
+		else
+		{
+			switch( errno )
+			{
+				case ENOENT:
+				case ENAMETOOLONG:
+				case EACCES:
+				case ENOTDIR:
+					break;
+				default:
+					debug( 1,
+						   L"Error while searching for command %d",
+						   new_cmd );
+					wperror( L"access" );
+			}
+		}
+	}
+	free( path_cpy );
+	free( new_cmd );
+	return 0;
+}
+
+/**
+   Find the full path of an executable, using the command lookup
+   cache for commands without a slash.
+
+   \param cmd The name of the executable.
+   \param trust_missing Whether cached failures to find the command are trusted. If not, the command is searched for again.
+*/
+static wchar_t *path_lookup( const wchar_t *cmd, int trust_missing )
 {
 	wchar_t *path;
 
@@ -575,75 +846,48 @@ wchar_t *get_filename( const wchar_t *cmd )
 		path = env_get(L"PATH");
 		if( path != 0 )
 		{
-			/*
-			  Allocate string long enough to hold the whole command
-			*/
-			wchar_t *new_cmd = malloc( sizeof(wchar_t)*(wcslen(cmd)+wcslen(path)+2) );
-			/* 
-			   We tokenize a copy of the path, since strtok modifies
-			   its arguments 
-			*/
-			wchar_t *path_cpy = wcsdup( path );
-			wchar_t *nxt_path = path;
-			wchar_t *state;
-
-			if( (new_cmd==0) || (path_cpy==0) )
+			wchar_t *res;
+			void *key, *data;
+			
+			path_cache_validate( path );
+			
+			res = (wchar_t *)hash_get( &path_cache, cmd );
+			if( res && ( res != path_cache_missing || trust_missing ) )
 			{
-				die_mem();
-				
+				return res==path_cache_missing?0:wcsdup( res );
 			}
-
-			for( nxt_path = wcstok( path_cpy, ARRAY_SEP_STR, &state );
-				 nxt_path != 0;
-				 nxt_path = wcstok( 0, ARRAY_SEP_STR, &state) )
-			{
-				int path_len = wcslen( nxt_path );
-				wcscpy( new_cmd, nxt_path );
-				if( new_cmd[path_len-1] != '/' )
-				{
-					new_cmd[path_len++]='/';
-				}
-				wcscpy( &new_cmd[path_len], cmd );
-				if( waccess( new_cmd, X_OK )==0 )
-				{
-					struct stat buff;
-					if( wstat( new_cmd, &buff )==-1 )
-					{
-						if( errno != EACCES )
-							wperror( L"stat" );
-						continue;
-					}
-					if( S_ISREG(buff.st_mode) )
-					{
-						free( path_cpy );
-						return new_cmd;
-					}
-				}
-				else
-				{
-					switch( errno )
-					{
-						case ENOENT:
-						case ENAMETOOLONG:
-						case EACCES:
-						case ENOTDIR:
-							break;
-						default:
-							debug( 1,
-								   L"Error while searching for command %d",
-								   new_cmd );
-							wperror( L"access" );
-					}
-				}
-			}
-			free( path_cpy );
-			free( new_cmd );
+			
+			res = path_search( cmd, path );
+
+			hash_remove( &path_cache, 
+						 cmd, 
+						 (const void **)&key, 
+						 (const void **)&data );
+			if( key )
+				path_cache_free_entry( key, data );
+			
+			if( hash_get_count( &path_cache ) >= PATH_CACHE_MAX )
+				path_cache_clear();
+			hash_put( &path_cache, 
+					  wcsdup( cmd ), 
+					  res?wcsdup( res ):path_cache_missing );
+			return res;
 		}
 	}
 
 	return 0;
 }
 
+wchar_t *get_filename( const wchar_t *cmd )
+{
+	return path_lookup( cmd, 0 );
+}
+
+wchar_t *get_filename_cached( const wchar_t *cmd )
+{
+	return path_lookup( cmd, 1 );
+}
+
 void parser_init()
 {
 	if( profile )
@@ -651,6 +895,8 @@ void parser_init()
 		al_init( &profile_data);
 	}
 	al_init( &forbidden_function );
+	hash_init( &path_cache, &hash_wcs_func, &hash_wcs_cmp );
+	al_init( &path_cache_dirs );
 }
 
 void print_profile( array_list_t *p, 
@@ -724,6 +970,9 @@ void parser_destroy()
 	}
 	
 	al_destroy( &forbidden_function );
+	path_cache_flush();
+	hash_destroy( &path_cache );
+	al_destroy( &path_cache_dirs );
 }
 
 /**
@@ -909,6 +1158,155 @@ int parser_is_help( wchar_t *s, int min_match )
 		( len >= 3 && (wcsncmp( L"--help", s, len ) == 0) );
 }
 
+/**
+   Create the argument vector of a process from the specified list of
+   arguments. The vector and the strings it points to are stored in a
+   single block of memory, so that free_process can release them with
+   one call to free. The strings in the list are freed and the list is
+   emptied.
+*/
+static wchar_t **parse_make_argv( array_list_t *args )
+{
+	int i;
+	int count = al_get_count( args );
+	size_t len = 0;
+	wchar_t **res;
+	wchar_t *pos;
+
+	for( i=0; i<count; i++ )
+		len += wcslen( (wchar_t *)al_get( args, i ) )+1;
+
+	res = malloc( sizeof(wchar_t *)*(count+1) + sizeof(wchar_t)*len );
+	if( !res )
+		die_mem();
+
+	pos = (wchar_t *)(res+count+1);
+	for( i=0; i<count; i++ )
+	{
+		wchar_t *arg = (wchar_t *)al_get( args, i );
+		size_t arg_len = wcslen( arg )+1;
+		
+		memcpy( pos, arg, sizeof(wchar_t)*arg_len );
+		res[i] = pos;
+		pos += arg_len;
+		expand_free( arg );
+	}
+	res[count]=0;
+	al_truncate( args, 0 );
+	
+	return res;
+}
+
+/**
+   Expand the specified argument string and add the result to args
+*/
+static void parse_expand_arg( wchar_t *str, int pos, array_list_t *args )
+{
+	/*
+	  The arguments only need to live until parse_make_argv has copied
+	  them, so leave them in the arena
+	*/
+	if( !expand_string( arena_wcsdup( &expand_arena, str ),
+						args,
+						EXPAND_TEMPORARY )
+		)
+	{
+		err_pos=pos;
+		if( error_code == 0 )
+		{
+			error_arg( SYNTAX_ERROR,
+					   L"Could not expand string",
+					   str,
+					   pos );
+		}
+	}
+}
+
+/**
+   Test if the output of the specified command substitution can be
+   handed to a for loop one line at a time while the command is still
+   running. Since this means running the command in a forked copy of
+   the shell, it is only done if that makes no difference, i.e. if
+   every command is an external command and there are no nested
+   command substitutions.
+*/
+static int parser_can_stream( const wchar_t *cmd )
+{
+	tokenizer tok;
+	int is_cmd=1;
+	int res=1;
+	
+	for( tok_init( &tok, cmd, 0 );
+		 res && tok_has_next( &tok );
+		 tok_next( &tok ) )
+	{
+		switch( tok_last_type( &tok ) )
+		{
+			case TOK_STRING:
+			{
+				wchar_t *str = tok_last( &tok );
+				
+				if( wcschr( str, L'(' ) )
+				{
+					res = 0;
+				}
+				else if( is_cmd )
+				{
+					res = !wcspbrk( str, L"$*?{~%\\'\"" ) &&
+						!parser_is_reserved( str ) &&
+						!builtin_exists( str ) &&
+						!function_exists( str );
+					is_cmd = 0;
+				}
+				break;
+			}
+			
+			case TOK_PIPE:
+			case TOK_END:
+				is_cmd = 1;
+				break;
+
+			case TOK_REDIRECT_OUT:
+			case TOK_REDIRECT_IN:
+			case TOK_REDIRECT_APPEND:
+			case TOK_REDIRECT_FD:
+				res = !is_cmd;
+				break;
+				
+			default:
+				res = 0;
+				break;
+		}
+	}
+	tok_destroy( &tok );
+	return res;
+}
+
+/**
+   Test if the specified argument of a for command consists of a
+   single command substitution that can be streamed.
+
+   \return the command to run, or 0 if the argument should be expanded as usual
+*/
+static wchar_t *parser_for_stream_cmd( wchar_t *str )
+{
+	wchar_t *begin, *end;
+	wchar_t *cmd;
+	
+	if( expand_locate_subshell( str, &begin, &end, 0 ) != 1 ||
+		begin != str ||
+		*(end+1) )
+		return 0;
+	
+	cmd = wcsndup( begin+1, end-begin-1 );
+	if( !parser_can_stream( cmd ) )
+	{
+		free( cmd );
+		return 0;
+	}
+	return cmd;
+}
+
 /**
    Parse options for the specified job
 
@@ -926,6 +1324,14 @@ static void parse_job_main_loop( process_t *p,
 
 	int proc_is_count=0;
 
+	/*
+	  A for loop argument that may be streamed, and its position. It
+	  is only streamed if it turns out to be the last argument.
+	*/
+	wchar_t *stream_arg=0;
+	wchar_t *stream_cmd=0;
+	int stream_pos=0;
+
 	/*
 	  Test if this is the 'count' command. We need to special case
 	  count, since it should display a help message on 'count .h',
@@ -946,6 +1352,14 @@ static void parse_job_main_loop( process_t *p,
 		
 		/* debug( 2, L"Read token %ls\n", wcsdup(tok_last( tok )) ); */
 		
+		if( stream_arg && tok_last_type( tok ) != TOK_END )
+		{
+			parse_expand_arg( stream_arg, stream_pos, args );
+			free( stream_arg );
+			free( stream_cmd );
+			stream_arg = stream_cmd = 0;
+		}
+		
 		switch( tok_last_type( tok ) )
 		{
 			case TOK_PIPE:
@@ -957,7 +1371,7 @@ static void parse_job_main_loop( process_t *p,
 					return;					
 				}
 				p->pipe_fd = wcstol( tok_last( tok ), 0, 10 );
-				p->argv = list_to_char_arr( args );
+				p->argv = parse_make_argv( args );
 				p->next = calloc( 1, sizeof( process_t ) );
 				if( p->next == 0 )
 				{
@@ -978,7 +1392,29 @@ static void parse_job_main_loop( process_t *p,
 				j->fg = 0;
 			case TOK_END:
 			{
-				p->argv = list_to_char_arr( args );
+				if( stream_arg )
+				{
+					for_stream = exec_subshell_stream( stream_cmd );
+					if( for_stream )
+					{
+						/*
+						  Pass the first line to the for builtin. The
+						  for block reads the rest as it goes.
+						*/
+						wchar_t *first = exec_subshell_stream_next( for_stream );
+						if( first )
+							al_push( args, first );
+					}
+					else
+					{
+						parse_expand_arg( stream_arg, stream_pos, args );
+					}
+					free( stream_arg );
+					free( stream_cmd );
+					stream_arg = stream_cmd = 0;
+				}
+				
+				p->argv = parse_make_argv( args );
 				if( tok_has_next(tok))
 					tok_next(tok);
 				
@@ -1023,19 +1459,22 @@ static void parse_job_main_loop( process_t *p,
 						wcscpy( p->actual_cmd, L"count" );
 					}
 					
-					if( !expand_string( wcsdup(tok_last( tok )),
-										args,
-										0 )
-						)
+					if( p->type == INTERNAL_BUILTIN &&
+						al_get_count( args ) == 3 &&
+						wcscmp( al_get( args, 0 ), L"for" ) == 0 &&
+						wcscmp( al_get( args, 2 ), L"in" ) == 0 &&
+						( stream_cmd = parser_for_stream_cmd( tok_last( tok ) ) ) )
 					{
-						err_pos=tok_get_pos( tok );
-						if( error_code == 0 )
-						{
-							error_arg( SYNTAX_ERROR,
-									   L"Could not expand string",
-									   tok_last(tok),
-									   tok_get_pos( tok ) );
-						}
+						/*
+						  Don't run the command substitution yet, it can
+						  be streamed if this is the last argument
+						*/
+						stream_arg = wcsdup( tok_last( tok ) );
+						stream_pos = tok_get_pos( tok );
+					}
+					else
+					{
+						parse_expand_arg( tok_last( tok ), tok_get_pos( tok ), args );
 					}
 				}
 
@@ -1497,10 +1936,29 @@ static int parse_job( process_t *p,
 
 	if( is_new_block )
 	{
-		const wchar_t *end=parser_find_end( tok_string( tok ) + 
-											current_tokenizer_pos );
+		const wchar_t *end;
+		int end_mark = tok_get_mark( tok, current_tokenizer_pos );
 		tokenizer subtok;
 		int make_sub_block = j->first_process != p;
+
+		/*
+		  The end of a block only depends on the string being
+		  evaluated, so it is remembered as a token mark and only
+		  searched for the first time the block is executed.
+		*/
+		if( end_mark >= 0 )
+		{
+			end = tok_string( tok ) + end_mark;
+		}
+		else
+		{
+			end = parser_find_end( tok_string( tok ) + 
+								   current_tokenizer_pos );
+			if( end )
+				tok_set_mark( tok, 
+							  current_tokenizer_pos, 
+							  end - tok_string( tok ) );
+		}
 	
 		if( !end )
 		{
@@ -1563,7 +2021,7 @@ static int parse_job( process_t *p,
 	{
 		if( p->type == INTERNAL_BUILTIN && parser_skip_arguments( (wchar_t *)al_get(&args, 0) ) )
 		{
-			p->argv = list_to_char_arr( &args );
+			p->argv = parse_make_argv( &args );
 //			tok_next(tok);
 		}
 		else
@@ -1579,7 +2037,7 @@ static int parse_job( process_t *p,
 		  vector is on error, so we do an internal cleanup here.
 		*/
 		al_foreach( &args,
-					(void (*)(const void *))&free );
+					(void (*)(const void *))&expand_free );
 		free(p->argv);		
 		p->argv=0;		
 		/*
@@ -1663,6 +2121,8 @@ static void eval_job( tokenizer *tok )
 	long long t1=0, t2=0, t3=0;
 	profile_element_t *p=0;
 	int skip = 0;
+	block_t *prev_block = 0;
+	arena_mark_t mark;
 
 	if( profile )
 	{
@@ -1713,6 +2173,13 @@ static void eval_job( tokenizer *tok )
 			}
 			
 
+			/*
+			  Temporary strings used while parsing the job are
+			  allocated from the expansion arena, and all freed
+			  when the job is done
+			*/
+			arena_mark( &expand_arena, &mark );
+
 			if( parse_job( j->first_process, j, tok ) &&
 				j->first_process->argv )
 			{
@@ -1738,6 +2205,7 @@ static void eval_job( tokenizer *tok )
 				}
 				
 				skip |= current_block->skip;
+				prev_block = current_block;
 				
 				if(!skip )
 				{
@@ -1788,7 +2256,27 @@ static void eval_job( tokenizer *tok )
 				*/
 				job_free( j );
 			}
+
+			if( for_stream )
+			{
+				/*
+				  Hand a streamed command substitution to the for
+				  block it was started for
+				*/
+				if( current_block->type == FOR &&
+					current_block->outer == prev_block )
+				{
+					current_block->param3.for_stream = for_stream;
+				}
+				else
+				{
+					exec_subshell_stream_destroy( for_stream );
+				}
+				for_stream = 0;
+			}
+			
 			current_block->job = 0;
+			arena_release( &expand_arena, &mark );
 			break;
 		}
 		
@@ -1825,7 +2313,14 @@ static void eval_job( tokenizer *tok )
 	//	debug( 2, L"end eval_job()\n" );
 }
 
-int eval( const wchar_t *cmd, io_data_t *io, int block_type )
+/**
+   Evaluate the specified string, using the specified token cache
+   instead of tokenizing the string if it is non-null. 
+*/
+static int eval_internal( const wchar_t *cmd, 
+						  tok_cache_t *cache,
+						  io_data_t *io, 
+						  int block_type )
 {
 	int forbid_count;
 	int code;
@@ -1864,7 +2359,10 @@ int eval( const wchar_t *cmd, io_data_t *io, int block_type )
 	
 	forbid_count = al_get_count( &forbidden_function );
 	
-	tok_init( current_tokenizer, cmd, 0 );
+	if( cache )
+		tok_init_cached( current_tokenizer, cache );
+	else
+		tok_init( current_tokenizer, cmd, 0 );
 	error_code = 0;
 	
 	event_fire( 0, 0 );		
@@ -1952,6 +2450,30 @@ int eval( const wchar_t *cmd, io_data_t *io, int block_type )
 	return code;
 }
 
+int eval( const wchar_t *cmd, io_data_t *io, int block_type )
+{
+	tok_cache_t *cache;
+	int res;
+	
+	/*
+	  Compile the string into a token cache before evaluating it, so
+	  that loop bodies are replayed instead of tokenized again on
+	  every iteration. Strings with tokenizer errors are evaluated
+	  directly, so that errors are reported where they occur.
+	*/
+	cache = cmd?tok_cache_create( cmd ):0;
+	if( !cache )
+		return eval_internal( cmd, 0, io, block_type );
+
+	res = eval_internal( tok_cache_string( cache ), cache, io, block_type );
+	tok_cache_release( cache );
+	return res;
+}
+
+int eval_cached( tok_cache_t *cache, io_data_t *io, int block_type )
+{
+	return eval_internal( tok_cache_string( cache ), cache, io, block_type );
+}
 
 int parser_test( wchar_t * buff,
 				 int babble )
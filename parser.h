@@ -10,6 +10,7 @@
 #include "proc.h"
 #include "util.h"
 #include "parser.h"
+#include "tokenizer.h"
 
 /**
    block_t represents a block of commands. 
@@ -58,6 +59,7 @@ typedef struct block
 	union
 	{
 		int function_is_binding; /**< Whether a function is a keybinding */
+		struct subshell_stream *for_stream; /**< Command substitution to read further values of a for block from, or 0 */
 	} param3;
 
 	/**
@@ -147,12 +149,36 @@ extern io_data_t *block_io;
 
 /**
   Finds the full path of an executable in a newly allocated string.
+  Lookups of commands without a slash are cached, but failures to
+  find a command are always checked again.
   
   \param cmd The name of the executable.
   \return 0 if the command can not be found, the path of the command otherwise.
 */
 wchar_t *get_filename( const wchar_t *cmd );
 
+/**
+  Like get_filename(), but also trusts cached failures to find a
+  command, which may be up to a second out of date. This is suitable
+  for tasks like syntax highlighting, where it is more important to
+  be fast than to always be right.
+*/
+wchar_t *get_filename_cached( const wchar_t *cmd );
+
+/**
+  Flush the command lookup cache used by get_filename(). The cache
+  is flushed automatically when $PATH changes or a directory in
+  $PATH is modified.
+*/
+void path_cache_flush();
+
+/**
+  Insert the names of all commands in the command lookup cache into
+  the specified list. The names are not copies and should not be
+  freed.
+*/
+void path_cache_get_names( array_list_t *list );
+
 /**
   Evaluate the expressions contained in cmd.
 
@@ -164,6 +190,18 @@ wchar_t *get_filename( const wchar_t *cmd );
 */
 int eval( const wchar_t *cmd, io_data_t *io, int block_type );
 
+/**
+  Evaluate the tokens of a token cache. This is equivalent to
+  calling eval() on the string the cache was created from, but the
+  string is not tokenized again.
+
+  \param cache the tokens to evaluate
+  \param io the io redirections of the block. May be null.
+  \param block_type The type of block to push on the block stack
+  \return 0 on success.
+*/
+int eval_cached( tok_cache_t *cache, io_data_t *io, int block_type );
+
 /**
   Evaluate line as a list of parameters, i.e. tokenize it and perform parameter expansion and subshell execution on the tokens.
   The output is inserted into output, and should be freed by the caller.
@@ -54,11 +54,6 @@ Some of the code in this file is based on code from the Glibc manual.
 */
 #define MESS_SIZE 256
 
-/**
-   Size of buffer for reading buffered output
-*/
-#define BUFFER_SIZE 4096
-
 /** Status of last process to exit */
 static int last_status=0;
 
@@ -102,8 +97,6 @@ void proc_init()
 */
 static void free_process( process_t *p )
 {
-	wchar_t **arg;
-	
 	if( p==0 )
 		return;
 
@@ -112,16 +105,10 @@ static void free_process( process_t *p )
 	free_process( p->next );
 	debug( 3, L"Free process %ls", p->actual_cmd );
 	free( p->actual_cmd );
-	if( p->argv != 0 )
-	{
-		debug( 3, L"Process has argument vector" );
-		for( arg=p->argv; *arg; arg++ )
-		{
-			debug( 3, L"Free argument %ls", *arg );
-			free( *arg );
-		}		
-		free(p->argv );
-	}
+	/*
+	  The argument strings are stored in the same block as the vector
+	*/
+	free( p->argv );
 	free( p );
 }
 
@@ -794,11 +781,9 @@ static void read_try( job_t *j )
 		debug( 3, L"proc::read_try('%ls')\n", j->command );
 		while(1)
 		{
-			char b[BUFFER_SIZE];
 			int l;
 			
-			l=read_blocked( buff->param1.pipe_fd[0],
-					b, BUFFER_SIZE );
+			l=io_buffer_read_chunk( buff );
 			if( l==0 )
 			{
 				break;
@@ -813,10 +798,6 @@ static void read_try( job_t *j )
 				}				
 				break;
 			}
-			else
-			{
-				b_append( buff->param2.out_buffer, b, l );
-			}
 			
 		}
 	}
@@ -825,11 +806,15 @@ static void read_try( job_t *j )
 void job_continue (job_t *j, int cont)
 {
 	/*
-	  Put job first in the job list
+	  Put job first in the job list. Signals are blocked while doing
+	  so, since the status of a process that exits while its job is
+	  not in the list would be lost.
 	*/
+	signal_block();
 	job_remove( j );
 	j->next = first_job;
 	first_job = j;
+	signal_unblock();
 	j->notified = 0;
 	
 	debug( 3,
@@ -930,11 +915,27 @@ void job_continue (job_t *j, int cont)
 							  speed boost (A factor 3 startup time
 							  improvement on my 300 MHz machine) on
 							  short-lived jobs.
+
+							  Signals are blocked while checking the
+							  job again, since if the signal handler
+							  reaped the last process of the job before
+							  the call to waitpid, waitpid would wait
+							  for some unrelated child, like a
+							  background job or a command substitution
+							  streamed into a for loop, which may never
+							  exit.
 							*/
 							int status;						
-							pid_t pid = waitpid(-1, &status, WUNTRACED );
-							if( pid > 0 )
-								handle_child_status( pid, status );
+							pid_t pid;
+
+							signal_block();
+							if( !job_is_stopped( j ) && !job_last_is_completed( j ) )
+							{
+								pid = waitpid(-1, &status, WUNTRACED );
+								if( pid > 0 )
+									handle_child_status( pid, status );
+							}
+							signal_unblock();
 							break;
 						}
 								
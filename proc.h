@@ -74,7 +74,11 @@ typedef struct process
 		INTERNAL_EXEC
 	*/
 	int type;
-	/** argv parameter for for execv, builtin_run, etc. */
+	/** 
+		argv parameter for for execv, builtin_run, etc. The strings
+		are stored in the same allocation as the vector itself, so
+		the whole argument vector is freed with a single call to free.
+	*/
 	wchar_t **argv;
 	/** actual command to pass to exec in case of EXTERNAL or INTERNAL_EXEC */
 	wchar_t *actual_cmd;       
@@ -155,14 +159,10 @@ extern int is_event;
 extern job_t *first_job;   
 
 /**
-   Whether a universal variable barrier roundtrip has already been
-   made for this command. Such a roundtrip only needs to be done once
-   on a given command, unless a unversal variable value is
-   changed. Once this has been done, this variable is set to 1, so
-   that no more roundtrips need to be done.
-
-   Both setting it to one when it should be zero and the opposite may
-   cause concurrency bugs.
+   Whether universal variable updates have already been read from
+   fishd for this command. This only needs to be done once on a given
+   command, since changes made by this shell are applied locally
+   right away. Once this has been done, this variable is set to 1.
 */
 extern int proc_had_barrier;
 
@@ -72,6 +72,7 @@ commence.
 #include "function.h"
 #include "output.h"
 #include "signal.h"
+#include "pager.h"
 
 /**
 	Maximum length of prefix string when printing completion
@@ -192,6 +193,12 @@ typedef struct reader_data
 	*/
 	int *output_color;
 
+	/**
+	   True if the colors in color may be out of date. The buffer is
+	   highlighted again the next time the shell is idle.
+	*/
+	int highlight_pending;
+
 	/**
 	   Should the prompt command be reexecuted on the next repaint
 	*/
@@ -718,6 +725,7 @@ void reader_init()
 void reader_destroy()
 {
 	al_destroy( &current_filename);
+	highlight_cache_flush();
 	if( readline_buffer )
 	{
 		sb_destroy( readline_buffer );
@@ -762,19 +770,85 @@ void repaint()
 }
 
 /**
-   Make sure color values are correct, and repaint if they are not.
+   Make sure color values are correct. Highlighting is done the next
+   time the shell is idle, and the command line is repainted then if
+   the colors have changed.
 */
 static void check_colors()
+{
+	data->highlight_pending = 1;
+}
+
+/**
+   Highlight the command line right away, and repaint it if the
+   colors have changed.
+*/
+static void update_colors()
 {
 	reader_super_highlight_me_plenty( data->buff, data->new_color, data->buff_pos, 0 );
+	data->highlight_pending = 0;
 	if( memcmp( data->new_color, data->color, sizeof(int)*data->buff_len )!=0 )
 	{
 		memcpy( data->color, data->new_color,  sizeof(int)*data->buff_len );
-
 		repaint();
 	}
 }
 
+/**
+   Guess the color of a newly inserted character at the specified
+   position from its neighbours, so that it can be drawn before the
+   buffer is highlighted again.
+*/
+static int guess_color( int pos )
+{
+	if( iswspace( data->buff[pos] ) )
+		return 0;
+	if( pos > 0 )
+		return data->color[pos-1];
+	if( pos+1 < data->buff_len )
+		return data->color[pos+1];
+	return HIGHLIGHT_NORMAL;
+}
+
+/**
+   Do background work while waiting for input. Highlights the
+   command line if its colors are out of date, and then lets the
+   completion code do its background work.
+
+   Highlighting is abandoned as soon as more input arrives, since the
+   buffer is about to change. Results that were computed for a buffer
+   that has since changed are never used.
+*/
+static int reader_idle()
+{
+	if( data && data->highlight_pending )
+	{
+		highlight_set_cancel_func( &input_common_has_input );
+		reader_super_highlight_me_plenty( data->buff, 
+										  data->new_color,
+										  data->buff_pos, 
+										  0 );
+		highlight_set_cancel_func( 0 );
+		
+		/*
+		  If a key was pressed, the highlighting may be incomplete,
+		  and the buffer is about to change anyway
+		*/
+		if( input_common_has_input() )
+			return 1;
+
+		data->highlight_pending = 0;
+		if( memcmp( data->new_color, data->color, sizeof(int)*data->buff_len )!=0 )
+		{
+			memcpy( data->color, data->new_color,  sizeof(int)*data->buff_len );
+			repaint();
+		}
+		return 1;
+	}
+	
+	return complete_idle();
+}
+
 /**
    Stat stdout and stderr and save result.
 
@@ -859,7 +933,7 @@ static void remove_backward()
 
 		memmove( &data->color[data->buff_pos-1],
 				 &data->color[data->buff_pos],
-				 sizeof(wchar_t)*(data->buff_len-data->buff_pos+1) );
+				 sizeof(int)*(data->buff_len-data->buff_pos+1) );
 	}
 	data->buff_pos--;
 	data->buff_len--;
@@ -869,13 +943,13 @@ static void remove_backward()
 	data->buff[data->buff_len]='\0';
 //	wcscpy(data->search_buff,data->buff);
 
-	reader_super_highlight_me_plenty( data->buff,
-									  data->new_color,
-									  data->buff_pos,
-									  0 );
-	if( (!force_repaint()) && ( memcmp( data->new_color,
-										data->color,
-										sizeof(int)*data->buff_len )==0 ) &&
+	/*
+	  Delete the character using the old colors, and highlight the
+	  buffer again once the shell is idle
+	*/
+	data->highlight_pending = 1;
+
+	if( (!force_repaint()) &&
 		( delete_character != 0) && (wdt==1) )
 	{
 		/*
@@ -892,10 +966,6 @@ static void remove_backward()
 	}
 	else
 	{
-		memcpy( data->color,
-				data->new_color,
-				sizeof(int) * data->buff_len );
-
 		repaint();
 	}
 }
@@ -944,18 +1014,14 @@ static int insert_char( int c )
 	data->buff_len++;
 	data->buff[data->buff_len]='\0';
 
-	/* Syntax highlight */
-
-	reader_super_highlight_me_plenty( data->buff,
-									  data->new_color,
-									  data->buff_pos-1,
-									  0 );
-	data->color[data->buff_pos-1] = data->new_color[data->buff_pos-1];
+	/* 
+	   Draw the character using the old colors, and highlight the
+	   buffer again once the shell is idle
+	*/
+	data->color[data->buff_pos-1] = guess_color( data->buff_pos-1 );
+	data->highlight_pending = 1;
 
-	/* Check if the coloring has changed */
-	if( (!force_repaint()) && ( memcmp( data->new_color,
-										data->color,
-										sizeof(int)*data->buff_len )==0 ) &&
+	if( (!force_repaint()) &&
 		( insert_character ||
 		  ( data->buff_pos == data->buff_len ) ||
 		  enter_insert_mode) )
@@ -983,9 +1049,7 @@ static int insert_char( int c )
 	}
 	else
 	{
-		/* Nope, colors are off, so we repaint the entire command line */
-		memcpy( data->color, data->new_color, sizeof(int) * data->buff_len );
-
+		/* The terminal can not insert characters, so we repaint the entire command line */
 		repaint();
 	}
 //	wcscpy(data->search_buff,data->buff);
@@ -999,6 +1063,7 @@ static int insert_char( int c )
 static int insert_str(wchar_t *str)
 {
 	int len = wcslen( str );
+	int i;
 	if( len < 4 )
 	{
 		while( (*str)!=0 )
@@ -1018,20 +1083,22 @@ static int insert_str(wchar_t *str)
 					 &data->buff[data->buff_pos],
 					 sizeof(wchar_t)*(data->buff_len-data->buff_pos) );
 		}
+		memmove( &data->color[data->buff_pos+len],
+				 &data->color[data->buff_pos],
+				 sizeof(int)*(data->buff_len-data->buff_pos-len) );
 		memmove( &data->buff[data->buff_pos], str, sizeof(wchar_t)*len );
-		data->buff_pos += len;
 		data->buff[data->buff_len]='\0';
+		for( i=0; i<len; i++ )
+		{
+			data->color[data->buff_pos+i] = guess_color( data->buff_pos+i );
+		}
+		data->buff_pos += len;
 
-		/* Syntax highlight */
-		
-		reader_super_highlight_me_plenty( data->buff,
-										  data->new_color,
-										  data->buff_pos-1,
-										  0 );
-		memcpy( data->color, data->new_color, sizeof(int) * data->buff_len );
-		
-		/* repaint */
-
+		/* 
+		   Repaint using the old colors, and highlight the buffer
+		   again once the shell is idle
+		*/
+		data->highlight_pending = 1;
 		repaint();
 		
 	}
@@ -1247,65 +1314,33 @@ static void completion_insert( wchar_t *val, int is_complete )
 }
 
 /**
-   Run the fish_pager command to display the completion list, and
-   insert the result into the backbuffer.
+   Display the completion list using the pager, and push any keys
+   that were used to leave the pager back onto the input.
 */
 
 static void run_pager( wchar_t *prefix, int is_quoted, array_list_t *comp )
 {
-	int i;
-	string_buffer_t cmd;
-	wchar_t * prefix_esc;
+	string_buffer_t out;
+	wchar_t *tmp;
 
-	if( !prefix || (wcslen(prefix)==0))
-		prefix_esc = wcsdup(L"\"\"");
-	else
-		prefix_esc = escape( prefix,1);
+	sb_init( &out );
 
-	sb_init( &cmd );
-	sb_printf( &cmd, 
-			   L"fish_pager %d %ls", 
-			   is_quoted, 
-			   prefix_esc );
-	
-	free( prefix_esc );
-	
-	for( i=0; i<al_get_count( comp); i++ )
-	{
-		wchar_t *el = escape( (wchar_t*)al_get( comp, i ),1);		
-		sb_printf( &cmd, L" %ls", el );
-		free(el);
-	}
-	
-	term_donate();	
-	
-	io_data_t *out = io_buffer_create();
-	
-	eval( (wchar_t *)cmd.buff, out, TOP);
-	term_steal();	
-
-	io_buffer_read( out );
-	
-	sb_destroy( &cmd );
-	
+	/*
+	  Don't do background work while the pager waits for a key, it
+	  may repaint the command line on top of the list
+	*/
+	input_common_set_idle_handler( 0 );
+	pager_print( prefix?prefix:L"", is_quoted, comp, &out );
+	input_common_set_idle_handler( &reader_idle );
 
-	int nil=0;	
-	b_append( out->param2.out_buffer, &nil, 1 );
-	
-	wchar_t *tmp;
-	wchar_t *str = str2wcs((char *)out->param2.out_buffer->buff);
-	
-	if( str )
+	for( tmp = (wchar_t *)out.buff + wcslen((wchar_t *)out.buff)-1;
+		 tmp >= (wchar_t *)out.buff;
+		 tmp-- )
 	{
-		for( tmp = str + wcslen(str)-1; tmp >= str; tmp-- )
-		{
-			input_unreadch( *tmp );
-		}		
-		free( str );
+		input_unreadch( *tmp );
 	}
-	
-	io_buffer_destroy( out);
-	
+
+	sb_destroy( &out );
 }
 
 /**
@@ -1457,6 +1492,13 @@ static void reader_interactive_init()
 
 	input_init();
 	kill_init();
+	
+	/*
+	  Highlight the command line and index the executables in $PATH
+	  while waiting for input
+	*/
+	input_common_set_idle_handler( &reader_idle );
+	
 	shell_pgid = getpgrp ();
 
 	/* Loop until we are in the foreground.  */
@@ -2423,6 +2465,12 @@ wchar_t *reader_readline()
 
 	data->exec_prompt=1;
 
+	/*
+	  The previous command may have changed the environment, so the
+	  colors of the last command line can not be reused
+	*/
+	highlight_cache_flush();
+	data->highlight_pending = 0;
 	reader_super_highlight_me_plenty( data->buff, data->color, data->buff_pos, 0 );
 	repaint();
 
@@ -2692,7 +2740,7 @@ wchar_t *reader_readline()
 					}
 					finished=1;
 					data->buff_pos=data->buff_len;
-					check_colors();
+					update_colors();
 					writestr( L"\n" );
 				}
 				else
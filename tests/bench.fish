@@ -0,0 +1,14 @@
+#!/usr/local/bin/fish
+#
+# Run the script benchmarks. Each *.bench file is run in a separate
+# shell, and the time it takes is printed in milliseconds. The output
+# of the benchmarks is discarded.
+
+echo Running script benchmarks
+
+for i in *.bench
+	set start (date +%s%N)
+	../fish <$i >/dev/null ^/dev/null
+	set stop (date +%s%N)
+	echo Benchmark $i took (expr \( $stop - $start \) / 1000000) ms
+end
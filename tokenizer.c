@@ -59,6 +59,49 @@
 */
 #define FD_STR_MAX_LEN 16
 
+/**
+   A single token of a token cache
+*/
+typedef struct
+{
+	/** Offset in the string where reading of this token started */
+	int start;
+	/** Offset of the token itself, after any leading whitespace and comments */
+	int pos;
+	/** Offset of the first character after the token */
+	int end;
+	/** Type of the token */
+	int type;
+	/** Whether there are more tokens after this one */
+	int has_next;
+	/** Type of last quote after reading this token */
+	wchar_t quote;
+	/** Offset of the token string in the string pool, or -1 if the token does not set a string */
+	int str;
+	/** Length of the token string */
+	int len;
+	/** Mark set on this token using tok_set_mark(), or -1 */
+	int mark;
+}
+tok_cached_t;
+
+/**
+   A pre-lexed token stream
+*/
+struct tok_cache
+{
+	/** A copy of the string the tokens were read from */
+	wchar_t *orig_buff;
+	/** Array of tokens, ordered by position */
+	tok_cached_t *tokens;
+	/** Number of tokens */
+	int count;
+	/** All token strings, each one null terminated */
+	wchar_t *pool;
+	/** Number of tokenizers and other owners using this cache */
+	int refcount;
+};
+
 const static wchar_t *tok_desc[] =
 {
 	L"Tokenizer not yet initialized",
@@ -160,9 +203,215 @@ void tok_init( tokenizer *tok, const wchar_t *b, int flags )
 
 }
 
+void tok_init_cached( tokenizer *tok, tok_cache_t *cache )
+{
+	memset( tok, 0, sizeof( tokenizer) );
+
+	cache->refcount++;
+	tok->cache = cache;
+	tok->orig_buff = tok->buff = cache->orig_buff;
+	tok->has_next = (*tok->buff != L'\0');
+
+	tok_next( tok );
+}
+
+tok_cache_t *tok_cache_create( const wchar_t *b )
+{
+	tokenizer tok;
+	tok_cache_t *cache;
+	buffer_t tokens;
+	buffer_t pool;
+	int start=0;
+	int ok=1;
+	
+	cache = malloc( sizeof( tok_cache_t ) );
+	if( !cache )
+		die_mem();
+
+	cache->orig_buff = wcsdup( b );
+	if( !cache->orig_buff )
+		die_mem();
+
+	b_init( &tokens );
+	b_init( &pool );
+	
+	for( tok_init( &tok, cache->orig_buff, 0 ); ; tok_next( &tok ) )
+	{
+		tok_cached_t t;
+		
+		t.start = start;
+		t.pos = tok.last_pos;
+		t.end = tok.buff - tok.orig_buff;
+		t.type = tok.last_type;
+		t.has_next = tok.has_next;
+		t.quote = tok.last_quote;
+		t.str = -1;
+		t.len = 0;
+		t.mark = -1;
+
+		if( t.type == TOK_ERROR )
+		{
+			ok=0;
+			break;
+		}
+
+		/*
+		  End and background tokens leave the previous token string
+		  in place, so nothing is stored for them.
+		*/
+		if( t.type != TOK_END && 
+			t.type != TOK_BACKGROUND &&
+			tok.last )
+		{
+			t.str = pool.used/sizeof(wchar_t);
+			t.len = wcslen( tok.last );
+			b_append( &pool, tok.last, sizeof(wchar_t)*(t.len+1) );
+		}
+		
+		b_append( &tokens, &t, sizeof( tok_cached_t ) );
+
+		if( !tok.has_next )
+			break;
+
+		start = t.end;
+	}
+	
+	tok_destroy( &tok );
+
+	if( !ok )
+	{
+		b_destroy( &tokens );
+		b_destroy( &pool );
+		free( cache->orig_buff );
+		free( cache );
+		return 0;
+	}
+	
+	cache->tokens = (tok_cached_t *)tokens.buff;
+	cache->count = tokens.used/sizeof( tok_cached_t );
+	cache->pool = (wchar_t *)pool.buff;
+	cache->refcount = 1;
+	return cache;
+}
+
+void tok_cache_release( tok_cache_t *cache )
+{
+	if( --cache->refcount > 0 )
+		return;
+	
+	free( cache->orig_buff );
+	free( cache->tokens );
+	free( cache->pool );
+	free( cache );
+}
+
+const wchar_t *tok_cache_string( tok_cache_t *cache )
+{
+	return cache->orig_buff;
+}
+
+/**
+   Returns the index of the first cached token at or after the
+   specified offset, using a binary search.
+*/
+static int tok_cache_search( tok_cache_t *cache, int off )
+{
+	int lo=0, hi=cache->count;
+
+	while( lo < hi )
+	{
+		int mid = (lo+hi)/2;
+		if( cache->tokens[mid].pos < off )
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+   Find the cached token that reading from the specified offset would
+   produce. This is the token following the last one read in the
+   common case, otherwise the token is found using a binary search,
+   which is what makes tok_set_pos() cheap for loops.
+
+   \return the token, or 0 if the offset is not the start of a cached token
+*/
+static tok_cached_t *tok_cache_find( tok_cache_t *cache, int idx, int off )
+{
+	if( idx < cache->count && cache->tokens[idx].start == off )
+		return &cache->tokens[idx];
+
+	idx = tok_cache_search( cache, off );
+
+	if( idx < cache->count && 
+		(cache->tokens[idx].pos == off || cache->tokens[idx].start == off ) )
+		return &cache->tokens[idx];
+
+	return 0;
+}
+
+/**
+   Read the next token from the token cache instead of lexing it.
+
+   \return 1 if the token was found in the cache, 0 otherwise
+*/
+static int tok_replay( tokenizer *tok )
+{
+	tok_cached_t *t = tok_cache_find( tok->cache, 
+									  tok->cache_idx, 
+									  tok->buff - tok->orig_buff );
+	if( !t )
+		return 0;
+	
+	if( t->str >= 0 )
+	{
+		if( !check_size( tok, t->len+1 ) )
+			return 0;
+		memcpy( tok->last, 
+				tok->cache->pool + t->str, 
+				sizeof(wchar_t)*(t->len+1) );
+	}
+	
+	tok->last_type = t->type;
+	tok->last_pos = t->pos;
+	tok->last_quote = t->quote;
+	tok->has_next = t->has_next;
+	tok->buff = tok->orig_buff + t->end;
+	tok->cache_idx = (t - tok->cache->tokens) + 1;
+	return 1;
+}
+
+int tok_get_mark( tokenizer *tok, int pos )
+{
+	int idx;
+	
+	if( !tok->cache )
+		return -1;
+	
+	idx = tok_cache_search( tok->cache, pos );
+	if( idx < tok->cache->count && tok->cache->tokens[idx].pos == pos )
+		return tok->cache->tokens[idx].mark;
+	return -1;
+}
+
+void tok_set_mark( tokenizer *tok, int pos, int mark )
+{
+	int idx;
+	
+	if( !tok->cache )
+		return;
+	
+	idx = tok_cache_search( tok->cache, pos );
+	if( idx < tok->cache->count && tok->cache->tokens[idx].pos == pos )
+		tok->cache->tokens[idx].mark = mark;
+}
+
 void tok_destroy( tokenizer *tok )
 {
 	free( tok->last );
+	if( tok->cache )
+		tok_cache_release( tok->cache );
 //	free( tok->orig_buff );
 }
 
@@ -488,6 +737,9 @@ void tok_next( tokenizer *tok )
 		return;
 	}
 
+	if( tok->cache && tok_replay( tok ) )
+		return;
+
 	while( my_iswspace(*(tok->buff) ) )
 		tok->buff++;
 
@@ -44,6 +44,12 @@ enum token_type
 */
 #define TOK_SHOW_COMMENTS 2
 
+/**
+   A pre-lexed token stream for a string that is evaluated many
+   times, such as a function body. The contents are private to
+   tokenizer.c.
+*/
+typedef struct tok_cache tok_cache_t;
 
 /**
    The tokenizer struct. 
@@ -71,6 +77,10 @@ typedef struct
 	int show_comments;
 	/** Type of last quote, can be either ' or ".*/
 	wchar_t last_quote;
+	/** Token cache to replay tokens from, or 0 if the string is lexed directly */
+	tok_cache_t *cache;
+	/** Index of the cached token expected to be read next */
+	int cache_idx;
 }
 tokenizer;
 
@@ -88,6 +98,51 @@ tokenizer;
 */
 void tok_init( tokenizer *tok, const wchar_t *b, int flags );
 
+/**
+  Initialize the tokenizer to replay the tokens of a token
+  cache. The tokenizer holds a reference to the cache until it is
+  destroyed, so the cache may be released by its owner while the
+  tokenizer is still in use. tok_string() returns the string the
+  cache was created from.
+*/
+void tok_init_cached( tokenizer *tok, tok_cache_t *cache );
+
+/**
+  Tokenize the specified string and store the resulting tokens in a
+  new token cache. The string is copied.
+
+  \return the new cache, or 0 if the string contains a tokenizer error
+*/
+tok_cache_t *tok_cache_create( const wchar_t *b );
+
+/**
+  Drop a reference to the specified token cache, and free it once no
+  tokenizer uses it.
+*/
+void tok_cache_release( tok_cache_t *cache );
+
+/**
+  Returns the string the specified token cache was created from
+*/
+const wchar_t *tok_cache_string( tok_cache_t *cache );
+
+/**
+  Returns the mark of the token at the specified position of a
+  tokenizer created using tok_init_cached(). Marks are non-negative
+  integers the user of the tokenizer can attach to tokens to
+  remember things that only depend on the string, like the end of a
+  block. They live as long as the token cache.
+
+  \return the mark, or -1 if no mark has been set or the tokenizer does not use a token cache
+*/
+int tok_get_mark( tokenizer *tok, int pos );
+
+/**
+  Set the mark of the token at the specified position. Does nothing
+  if the tokenizer does not use a token cache.
+*/
+void tok_set_mark( tokenizer *tok, int pos, int mark );
+
 /**
   Jump to the next token.
 */
@@ -42,6 +42,17 @@
 */
 #define SB_MAX_SIZE 32767
 
+/**
+   Size of the blocks arena allocations are taken from. Larger
+   allocations get a block of their own.
+*/
+#define ARENA_BLOCK_SIZE 8192
+
+/**
+   Alignment of arena allocations
+*/
+#define ARENA_ALIGNMENT 16
+
 float minf( float a,
 			float b )
 {
@@ -104,29 +115,33 @@ void q_destroy( dyn_queue_t *q )
 */
 
 /**
-   Reallocate the queue_t
+   Reallocate the queue_t. Only called when the queue is full, i.e. when
+   put_pos has caught up with get_pos.
 */
 static int q_realloc( dyn_queue_t *q )
 {
-	void **old_start = q->start;
-	void **old_stop = q->stop;
-	int diff;
-	int new_size;
-	
-	new_size = 2*(q->stop-q->start);
+	int old_size = q->stop - q->start;
+	int new_size = 2*old_size;
+	int get_idx = q->get_pos - q->start;
+	void **new_start;
 	
-	q->start=(void**)realloc( q->start, sizeof(void*)*new_size );
-	if( q->start == 0 )
+	new_start=(void**)realloc( q->start, sizeof(void*)*new_size );
+	if( new_start == 0 )
 	{
-		q->start = old_start;
 		return 0;
 	}
+
+	/*
+	  The oldest elements are at the end of the old array, and the
+	  newest ones wrap around to its start. Move the wrapped part to
+	  just after the old end, so all elements are contiguous.
+	*/
+	memcpy( new_start + old_size, new_start, sizeof(void*)*get_idx );
 	
-	diff = q->start - old_start;
-	q->get_pos += diff;
-	q->stop = &q->start[new_size];
-	memcpy( old_stop + diff, q->start, sizeof(void*)*(q->get_pos-q->start));
-	q->put_pos = old_stop + diff + (q->get_pos-q->start);
+	q->start = new_start;
+	q->stop = &new_start[new_size];
+	q->get_pos = &new_start[get_idx];
+	q->put_pos = &new_start[old_size + get_idx];
 	
 	return 1;
 }
@@ -157,6 +172,22 @@ void *q_peek( dyn_queue_t *q )
 	return *q->get_pos;
 }
  
+int q_get_count( dyn_queue_t *q )
+{
+	int count = q->put_pos - q->get_pos;
+	if( count < 0 )
+		count += q->stop - q->start;
+	return count;
+}
+
+void *q_peek_pos( dyn_queue_t *q, int pos )
+{
+	void **e = q->get_pos + pos;
+	if( e >= q->stop )
+		e -= q->stop - q->start;
+	return *e;
+}
+
 int q_empty( dyn_queue_t *q )
 {
 //	fprintf( stderr, "Queue %d is %s\n", q, (q->put_pos == q->get_pos)?"empty":"non-empty" );
@@ -176,7 +207,10 @@ void hash_init2( hash_table_t *h,
 				 size_t capacity)
 {
 	int i;
-	size_t sz = capacity*4/3+1;
+	size_t sz = 8;
+	
+	while( sz < capacity*4/3+1 )
+		sz *= 2;
 	
 	h->arr = malloc( sizeof(hash_struct_t)*sz );
 	h->size = sz;
@@ -191,7 +225,7 @@ void hash_init( hash_table_t *h,
 				int (*hash_func)(const void *key),
 				int (*compare_func)(const void *key1, const void *key2) )
 {
-	hash_init2( h, hash_func, compare_func, 31 );	
+	hash_init2( h, hash_func, compare_func, 23 );	
 }
 
 
@@ -200,29 +234,102 @@ void hash_destroy( hash_table_t *h )
 	free( h->arr );
 }
 
+/**
+   Returns how far the element at the specified position is from the
+   position its hash value maps to.
+*/
+static int hash_dist( hash_table_t *h, int pos )
+{
+	int mask = h->size-1;
+	return (pos - (int)((unsigned int)h->arr[pos].hash & mask)) & mask;
+}
+
 /**
    Search for the specified hash key in the table
-   \return index in the table, or to the first free index if the key is not in the table
+
+   Since elements are kept in Robin Hood order, the search can stop as
+   soon as an element is found that is closer to its ideal position
+   than the key would be.
+
+   \param h the hash table
+   \param key the key to search for
+   \param hv the hash value of key
+   \return index in the table, or -1 if the key is not in the table
 */
 static int hash_search( hash_table_t *h,
-						const void *key )
+						const void *key,
+						int hv )
 {
-	int hv = h->hash_func( key );
-	int pos = abs(hv) % h->size;
+	int mask = h->size-1;
+	int pos = (unsigned int)hv & mask;
+	int dist = 0;
+	
 	while(1)
 	{
-		if( (h->arr[pos].key == 0 ) ||
-			( h->compare_func( h->arr[pos].key, key ) ) )
+		hash_struct_t *e = &h->arr[pos];
+		
+		if( (e->key == 0) || (hash_dist( h, pos ) < dist ) )
+		{
+			return -1;
+		}
+		
+		if( (e->hash == hv) && h->compare_func( e->key, key ) )
 		{
 			return pos;
 		}
-		pos++;
-		pos %= h->size;
+		pos = (pos+1) & mask;
+		dist++;
 	}
 }
 
 /**
-   Reallocate the hash array. This is quite expensive, as every single entry has to be rehashed and moved.
+   Insert an element known not to be in the table. An element that is
+   further from its ideal position than the current occupant takes
+   over its slot, and the search continues with the displaced
+   element. The table must have at least one free slot.
+*/
+static void hash_insert( hash_table_t *h,
+						 const void *key,
+						 const void *data,
+						 int hv )
+{
+	int mask = h->size-1;
+	int pos = (unsigned int)hv & mask;
+	int dist = 0;
+	hash_struct_t cur;
+
+	cur.key = key;
+	cur.data = data;
+	cur.hash = hv;
+	
+	while(1)
+	{
+		int pos_dist;
+		
+		if( h->arr[pos].key == 0 )
+		{
+			h->arr[pos] = cur;
+			return;
+		}
+
+		pos_dist = hash_dist( h, pos );
+		if( pos_dist < dist )
+		{
+			hash_struct_t tmp = h->arr[pos];
+			h->arr[pos] = cur;
+			cur = tmp;
+			dist = pos_dist;
+		}
+		
+		pos = (pos+1) & mask;
+		dist++;
+	}
+}
+
+/**
+   Reallocate the hash array. Every entry has to be moved, but since
+   the hash value of every key is stored in the table, the hash
+   function is not called.
 */
 static int hash_realloc( hash_table_t *h,
 						 int sz )
@@ -254,9 +361,7 @@ static int hash_realloc( hash_table_t *h,
 	{
 		if( old_arr[i].key != 0 )
 		{
-			int pos = hash_search( h, old_arr[i].key );
-			h->arr[pos].key = old_arr[i].key;
-			h->arr[pos].data = old_arr[i].data;
+			hash_insert( h, old_arr[i].key, old_arr[i].data, old_arr[i].hash );
 		}
 	}
 	free( old_arr );
@@ -269,33 +374,34 @@ int hash_put( hash_table_t *h,
 			  const void *key,
 			  const void *data )
 {
-	int pos;
+	int hv = h->hash_func( key );
+	int pos = hash_search( h, key, hv );
+
+	if( pos >= 0 )
+	{
+		h->arr[pos].key = key;
+		h->arr[pos].data = data;
+		return 1;
+	}
 	
-	if( (float)(h->count+1)/h->size > 0.75f )
+	if( (h->count+1)*4 > h->size*3 )
 	{
-		if( !hash_realloc( h, (h->size+1) * 2 -1 ) )
+		if( !hash_realloc( h, h->size * 2 ) )
 		{
 			return 0;
 		}
 	}
 
-	pos = hash_search( h, key );
-
-	if( h->arr[pos].key == 0 )
-	{
-		h->count++;
-	}
-
-	h->arr[pos].key = key;
-	h->arr[pos].data = data;
+	hash_insert( h, key, data, hv );
+	h->count++;
 	return 1;
 }
 
 const void *hash_get( hash_table_t *h,
 					  const void *key )
 {
-	int pos = hash_search( h, key );
-	if( h->arr[pos].key == 0 )
+	int pos = hash_search( h, key, h->hash_func( key ) );
+	if( pos < 0 )
 		return 0;
 	else
 		return h->arr[pos].data;
@@ -304,8 +410,8 @@ const void *hash_get( hash_table_t *h,
 const void *hash_get_key( hash_table_t *h,
 						  const void *key )
 {
-	int pos = hash_search( h, key );
-	if( h->arr[pos].key == 0 )
+	int pos = hash_search( h, key, h->hash_func( key ) );
+	if( pos < 0 )
 		return 0;
 	else
 		return h->arr[pos].key;
@@ -321,10 +427,11 @@ void hash_remove( hash_table_t *h,
 				  const void **old_key,
 				  const void **old_val )
 {
-	int pos = hash_search( h, key );
+	int pos = hash_search( h, key, h->hash_func( key ) );
+	int mask = h->size-1;
 	int next_pos;
 
-	if( h->arr[pos].key == 0 )
+	if( pos < 0 )
 	{
 
 		if( old_key != 0 )
@@ -341,34 +448,22 @@ void hash_remove( hash_table_t *h,
 	if( old_val != 0 )
 		*old_val = h->arr[pos].data;
 
-	h->arr[pos].key = 0;
-
-	next_pos = pos+1;
-	next_pos %= h->size;
-
-	while( h->arr[next_pos].key != 0 )
+	/*
+	  Move the following elements that are not at their ideal
+	  position one step back, so that no tombstone is needed
+	*/
+	next_pos = (pos+1) & mask;
+	while( (h->arr[next_pos].key != 0) && (hash_dist( h, next_pos ) > 0) )
 	{
-
-		int hv = h->hash_func( h->arr[next_pos].key );
-		int ideal_pos = abs( hv ) % h->size;
-		int dist_old = (next_pos - ideal_pos + h->size)%h->size;
-		int dist_new = (pos - ideal_pos + h->size)%h->size;
-		if ( dist_new < dist_old )
-		{
-			h->arr[pos].key = h->arr[next_pos].key;
-			h->arr[pos].data = h->arr[next_pos].data;
-			h->arr[next_pos].key = 0;
-			pos = next_pos;
-		}
-		next_pos++;
-
-		next_pos %= h->size;
-
+		h->arr[pos] = h->arr[next_pos];
+		pos = next_pos;
+		next_pos = (next_pos+1) & mask;
 	}
+	h->arr[pos].key = 0;
 
-	if( (float)(h->count+1)/h->size < 0.2f && h->count < 63 )
+	if( (h->count+1)*8 < h->size )
 	{
-		hash_realloc( h, (h->size+1) / 2 -1 );
+		hash_realloc( h, h->size / 2 );
 	}
 
 	return;
@@ -377,8 +472,7 @@ void hash_remove( hash_table_t *h,
 int hash_contains( hash_table_t *h,
 				   const void *key )
 {
-	int pos = hash_search( h, key );
-	return h->arr[pos].key != 0;
+	return hash_search( h, key, h->hash_func( key ) ) >= 0;
 }
 
 /**
@@ -964,6 +1058,24 @@ void b_destroy( buffer_t *b )
 }
 
 
+char *b_reserve( buffer_t *b, size_t len )
+{
+	if( b->length < (b->used + len) )
+	{
+		size_t l = maxi( b->length*2,
+						 maxi( b->used+len,MIN_SIZE));
+
+		void *d = realloc( b->buff, l );
+		if( !d )
+		{
+			die_mem();
+		}
+		b->buff=d;
+		b->length = l;
+	}
+	return b->buff + b->used;
+}
+
 void b_append( buffer_t *b, const void *d, ssize_t len )
 {
 	if( len<=0 )
@@ -1010,6 +1122,130 @@ void b_append( buffer_t *b, const void *d, ssize_t len )
 	b->used+=len;
 }
 
+/**
+   Round len up to the alignment used for arena allocations
+*/
+#define ARENA_ALIGN( len ) (((len)+ARENA_ALIGNMENT-1) & ~(size_t)(ARENA_ALIGNMENT-1))
+
+/**
+   Get the memory handed out by the specified arena block
+*/
+#define ARENA_DATA( b ) (((char *)(b)) + ARENA_ALIGN( sizeof( arena_block_t ) ))
+
+void arena_init( arena_t *a )
+{
+	a->top = 0;
+	a->spare = 0;
+}
+
+void arena_destroy( arena_t *a )
+{
+	while( a->top )
+	{
+		arena_block_t *prev = a->top->prev;
+		free( a->top );
+		a->top = prev;
+	}
+	free( a->spare );
+	a->spare = 0;
+}
+
+void *arena_alloc( arena_t *a, size_t len )
+{
+	arena_block_t *b = a->top;
+	void *res;
+	
+	len = ARENA_ALIGN( len?len:1 );
+	
+	if( !b || b->size - b->used < len )
+	{
+		size_t size = len>ARENA_BLOCK_SIZE?len:ARENA_BLOCK_SIZE;
+		
+		if( a->spare && a->spare->size >= size )
+		{
+			b = a->spare;
+			a->spare = 0;
+		}
+		else
+		{
+			b = malloc( ARENA_ALIGN( sizeof( arena_block_t ) ) + size );
+			if( !b )
+				die_mem();
+			b->size = size;
+		}
+		b->used = 0;
+		b->prev = a->top;
+		a->top = b;
+	}
+	
+	res = ARENA_DATA( b ) + b->used;
+	b->used += len;
+	return res;
+}
+
+wchar_t *arena_wcsdup( arena_t *a, const wchar_t *in )
+{
+	return arena_wcsndup( a, in, wcslen( in ) );
+}
+
+wchar_t *arena_wcsndup( arena_t *a, const wchar_t *in, size_t len )
+{
+	wchar_t *res;
+	size_t i;
+	
+	for( i=0; i<len && in[i]; i++ )
+		;
+	len = i;
+	res = arena_alloc( a, sizeof( wchar_t )*(len+1) );
+	memcpy( res, in, sizeof( wchar_t )*len );
+	res[len] = 0;
+	return res;
+}
+
+void arena_mark( arena_t *a, arena_mark_t *m )
+{
+	m->block = a->top;
+	m->used = a->top?a->top->used:0;
+}
+
+void arena_release( arena_t *a, arena_mark_t *m )
+{
+	while( a->top != m->block )
+	{
+		arena_block_t *b = a->top;
+		a->top = b->prev;
+		
+		/*
+		  Keep the largest released block around for reuse
+		*/
+		if( !a->spare || a->spare->size < b->size )
+		{
+			free( a->spare );
+			a->spare = b;
+		}
+		else
+		{
+			free( b );
+		}
+	}
+	
+	if( a->top )
+		a->top->used = m->used;
+}
+
+int arena_contains( arena_t *a, const void *p )
+{
+	arena_block_t *b;
+	const char *c = (const char *)p;
+	
+	for( b=a->top; b; b=b->prev )
+	{
+		if( c >= ARENA_DATA( b ) && c < ARENA_DATA( b ) + b->used )
+			return 1;
+	}
+	return 0;
+}
+
 long long get_time()
 {
 	struct timeval time_struct;
@@ -33,6 +33,8 @@ typedef struct
 	const void *key;
 	/** Value */
 	const void *data;
+	/** The value of the hash function for key */
+	int hash;
 }
 hash_struct_t;
 
@@ -42,12 +44,17 @@ hash_struct_t;
    hash function is supplied.
 
    The hash table is implemented using a single hash function and
-   element storage directly in the array. When a collision occurs, the
-   hashtable iterates until a zero element is found. When the table is
-   75% full, it will automatically reallocate itself. This
-   reallocation takes O(n) time. The table is guaranteed to never be
-   more than 75% full or less than 30% full (Unless the table is
-   nearly empty). Its size is always a Mersenne number.
+   element storage directly in the array. Collisions are resolved
+   using linear probing with Robin Hood insertion, where an element
+   that is further from its ideal position takes over the slot of one
+   that is closer, which keeps probe sequences short. The hash value
+   of each key is stored with it, so that the comparison function is
+   only called for keys with the same hash value, and so that the
+   table can be reallocated without calling the hash function. When
+   the table is 75% full, it will automatically reallocate itself.
+   This reallocation takes O(n) time. The table is guaranteed to
+   never be more than 75% full or less than 12% full (Unless the
+   table is nearly empty). Its size is always a power of two.
 
 */
 
@@ -130,6 +137,47 @@ buffer_t;
 */
 typedef buffer_t string_buffer_t;
 
+/**
+   A block of memory in an arena_t. The memory handed out follows
+   directly after the header.
+*/
+typedef struct arena_block
+{
+	/** The block that was in use before this one was allocated */
+	struct arena_block *prev;
+	/** Number of bytes available for allocation in this block */
+	size_t size;
+	/** Number of bytes allocated from this block */
+	size_t used;
+}
+arena_block_t;
+
+/**
+   Memory arena. Allocations are taken from large blocks and are never
+   freed one by one. Instead, everything allocated after a call to
+   arena_mark is freed at once by arena_release.
+*/
+typedef struct arena
+{
+	/** The block allocations are currently taken from */
+	arena_block_t *top;
+	/** A released block kept to avoid calling malloc again */
+	arena_block_t *spare;
+}
+arena_t;
+
+/**
+   A position in an arena, as saved by arena_mark
+*/
+typedef struct arena_mark
+{
+	/** The top block at the time of the mark */
+	arena_block_t *block;
+	/** The number of bytes used in that block at the time of the mark */
+	size_t used;
+}
+arena_mark_t;
+
 	
 
 /**
@@ -169,6 +217,13 @@ int q_put( dyn_queue_t *q, void *e );
 void *q_get( dyn_queue_t *q);
 /** Return next element from queue without removing it */
 void *q_peek( dyn_queue_t *q);
+/** Return the number of elements in the queue */
+int q_get_count( dyn_queue_t *q );
+/** 
+	Return the element at the specified position without removing
+	it. Position 0 is the next element to be returned by q_get. 
+*/
+void *q_peek_pos( dyn_queue_t *q, int pos );
 /** Returns 1 if the queue is empty, 0 otherwise */
 int q_empty( dyn_queue_t *q );
 
@@ -474,6 +529,59 @@ void b_destroy( buffer_t *b );
 */
 void b_append( buffer_t *b, const void *d, ssize_t len );
 
+/**
+   Make sure there is room for at least len more bytes in the
+   specified buffer_t, and return a pointer to the unused part of the
+   buffer. Data written there can be added to the buffer by
+   increasing the used field.
+*/
+char *b_reserve( buffer_t *b, size_t len );
+
+/**
+   Initialize the specified arena
+*/
+void arena_init( arena_t *a );
+
+/**
+   Free all memory used by the specified arena
+*/
+void arena_destroy( arena_t *a );
+
+/**
+   Allocate len bytes from the specified arena. The memory is suitably
+   aligned for any kind of variable.
+*/
+void *arena_alloc( arena_t *a, size_t len );
+
+/**
+   Make a copy of the specified string in the specified arena
+*/
+wchar_t *arena_wcsdup( arena_t *a, const wchar_t *in );
+
+/**
+   Make a copy of the first len characters of the specified string in
+   the specified arena. The copy is always null terminated.
+*/
+wchar_t *arena_wcsndup( arena_t *a, const wchar_t *in, size_t len );
+
+/**
+   Remember the current position of the specified arena
+*/
+void arena_mark( arena_t *a, arena_mark_t *m );
+
+/**
+   Free everything allocated from the specified arena since the
+   specified mark was set. Marks must be released in the reverse order
+   they were set.
+*/
+void arena_release( arena_t *a, arena_mark_t *m );
+
+/**
+   Test if the specified memory was allocated from the specified
+   arena, and has not been released
+*/
+int arena_contains( arena_t *a, const void *p );
+
 /**
    Get the current time in microseconds since Jan 1, 1970
 */
@@ -0,0 +1,527 @@
+/** \file whatis.c
+
+	An index of command descriptions, built from the whatis database.
+
+	Completing command names used to search the whatis database using
+	grep every time, which takes a long time on systems with many
+	manual pages. Instead, the database is parsed once, in a separate
+	process, into an index file sorted by command name. The index is
+	memory mapped, and all commands starting with a prefix are found
+	with a binary search. The index remembers the modification time
+	and size of the whatis database it was built from, and is rebuilt
+	when the database changes.
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+
+#include "util.h"
+#include "common.h"
+#include "wutil.h"
+#include "env.h"
+#include "whatis.h"
+
+/**
+   Magic string at the start of the index file, identifying its format
+*/
+#define WHATIS_MAGIC "fishwi1"
+
+/**
+   Length of the magic string, including the terminator
+*/
+#define WHATIS_MAGIC_LEN 8
+
+/**
+   Minimum number of seconds between starting two builds of the
+   index, so that a build that fails, or is still running, is not
+   started again on every completion
+*/
+#define WHATIS_BUILD_INTERVAL 30
+
+/**
+   The header of the index file. It is followed by the offsets of
+   each entry from the start of the file, in the order of the command
+   names, and then by the name of the whatis database and the
+   entries. Every entry is a command name followed by its
+   description, both null terminated.
+*/
+typedef struct
+{
+	/** The magic string */
+	char magic[WHATIS_MAGIC_LEN];
+	/** Modification time of the whatis database the index was built from */
+	time_t mtime;
+	/** Size of the whatis database the index was built from */
+	off_t size;
+	/** Offset of the name of the whatis database */
+	int path;
+	/** Number of entries */
+	int count;
+}
+	whatis_header_t;
+
+/**
+   A command description found while parsing the whatis database
+*/
+typedef struct
+{
+	/** The command name */
+	char *name;
+	/** The description */
+	char *desc;
+	/** The line number, used to keep the first description of a command */
+	int pos;
+}
+	whatis_entry_t;
+
+/**
+   The currently mapped index, or 0
+*/
+static char *index_map=0;
+
+/**
+   Length of the currently mapped index
+*/
+static size_t index_len=0;
+
+/**
+   The time the last build of the index was started
+*/
+static time_t build_time=0;
+
+/**
+   Return the name of the index file, allocated using malloc, or 0 if
+   the home directory is not known
+*/
+static wchar_t *whatis_index_filename()
+{
+	wchar_t *home = env_get( L"HOME" );
+	return home?wcsdupcat( home, L"/.fish_whatis" ):0;
+}
+
+/**
+   Unmap the current index
+*/
+static void whatis_unmap()
+{
+	if( index_map )
+		munmap( index_map, index_len );
+	index_map = 0;
+	index_len = 0;
+}
+
+/**
+   Map the specified index file into memory
+*/
+static void whatis_map( const wchar_t *fn )
+{
+	int fd;
+	struct stat buf;
+
+	fd = wopen( fn, O_RDONLY );
+	if( fd == -1 )
+		return;
+
+	if( fstat( fd, &buf ) == 0 && buf.st_size >= sizeof( whatis_header_t ) )
+	{
+		index_map = mmap( 0, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		if( index_map == MAP_FAILED )
+		{
+			index_map = 0;
+		}
+		else
+		{
+			index_len = buf.st_size;
+		}
+	}
+
+	close( fd );
+}
+
+/**
+   Check that the mapped index was built from the current version of
+   the specified whatis database, and that it is not truncated
+*/
+static int whatis_index_valid( const char *path, struct stat *buf )
+{
+	whatis_header_t *h = (whatis_header_t *)index_map;
+
+	if( !index_map )
+		return 0;
+
+	if( memcmp( h->magic, WHATIS_MAGIC, WHATIS_MAGIC_LEN ) != 0 ||
+		h->mtime != buf->st_mtime ||
+		h->size != buf->st_size )
+		return 0;
+
+	/*
+	  The file ends with a null, so no string in it can run past the
+	  end of the file
+	*/
+	if( index_map[index_len-1] != 0 ||
+		h->count < 0 ||
+		(size_t)h->count > (index_len - sizeof( whatis_header_t ))/sizeof( int ) ||
+		h->path < 0 ||
+		h->path >= index_len )
+		return 0;
+
+	return strcmp( index_map + h->path, path ) == 0;
+}
+
+/**
+   Return the command name of the specified entry of the mapped index,
+   or 0 if the index is corrupt
+*/
+static char *whatis_entry( int i )
+{
+	whatis_header_t *h = (whatis_header_t *)index_map;
+	int *offsets = (int *)(index_map + sizeof( whatis_header_t ));
+	int data = sizeof( whatis_header_t ) + h->count*sizeof( int );
+	char *name;
+
+	if( offsets[i] < data || offsets[i] >= index_len )
+		return 0;
+
+	name = index_map + offsets[i];
+	if( name + strlen( name ) + 1 >= index_map + index_len )
+		return 0;
+
+	return name;
+}
+
+/**
+   Compare two whatis entries by command name, and then by position
+   in the whatis database
+*/
+static int whatis_entry_cmp( const void *a, const void *b )
+{
+	const whatis_entry_t *c = (const whatis_entry_t *)a;
+	const whatis_entry_t *d = (const whatis_entry_t *)b;
+	int res = strcmp( c->name, d->name );
+
+	return res?res:c->pos - d->pos;
+}
+
+/**
+   Parse a line of the whatis database, like 'ls (1) - list directory
+   contents'. The command name and the description are null
+   terminated in place.
+
+   \return 0 if the line contains a description, -1 otherwise
+*/
+static int whatis_parse_line( char *line, whatis_entry_t *e )
+{
+	char *name_end = strpbrk( line, " \t" );
+	char *desc;
+
+	if( !name_end || name_end == line )
+		return -1;
+	*name_end = 0;
+
+	desc = strchr( name_end+1, '-' );
+	if( !desc )
+		return -1;
+	desc++;
+
+	while( *desc == ' ' || *desc == '\t' )
+		desc++;
+
+	if( !*desc )
+		return -1;
+
+	e->name = line;
+	e->desc = desc;
+	return 0;
+}
+
+int whatis_build_index( const wchar_t *whatis, const wchar_t *index )
+{
+	struct stat buf;
+	whatis_header_t h;
+	whatis_entry_t *entries;
+	int count=0;
+	int *offsets;
+	buffer_t b;
+	char *contents, *line, *path;
+	wchar_t *tmp_fn;
+	char *tmp_nfn, *nfn;
+	string_buffer_t sb;
+	int fd, i, n;
+	int res = -1;
+
+	fd = wopen( whatis, O_RDONLY );
+	if( fd == -1 )
+		return -1;
+
+	if( fstat( fd, &buf ) )
+	{
+		close( fd );
+		return -1;
+	}
+
+	if( !(contents = malloc( buf.st_size+1 ) ) )
+		die_mem();
+
+	if( read_blocked( fd, contents, buf.st_size ) != buf.st_size )
+	{
+		close( fd );
+		free( contents );
+		return -1;
+	}
+	close( fd );
+	contents[buf.st_size]=0;
+
+	/*
+	  Split the database into lines, and pick out the entries
+	*/
+	n=1;
+	for( line = contents; (line = memchr( line, '\n', contents + buf.st_size - line )); line++ )
+		n++;
+
+	if( !(entries = malloc( sizeof( whatis_entry_t )*n ) ) )
+		die_mem();
+
+	for( line = contents; line; )
+	{
+		char *end = strchr( line, '\n' );
+		if( end )
+			*end++ = 0;
+
+		if( !whatis_parse_line( line, &entries[count] ) )
+		{
+			entries[count].pos = count;
+			count++;
+		}
+		line = end;
+	}
+
+	qsort( entries, count, sizeof( whatis_entry_t ), &whatis_entry_cmp );
+
+	/*
+	  Only keep the first description of every command, usually the
+	  one from section 1 of the manual
+	*/
+	n=0;
+	for( i=0; i<count; i++ )
+	{
+		if( n && strcmp( entries[n-1].name, entries[i].name ) == 0 )
+			continue;
+		entries[n++] = entries[i];
+	}
+	count = n;
+
+	if( !(offsets = malloc( sizeof( int )*(count+1) ) ) )
+		die_mem();
+
+	path = wcs2str( whatis );
+
+	memset( &h, 0, sizeof( h ) );
+	memcpy( h.magic, WHATIS_MAGIC, WHATIS_MAGIC_LEN );
+	h.mtime = buf.st_mtime;
+	h.size = buf.st_size;
+	h.count = count;
+	h.path = sizeof( h ) + sizeof( int )*count;
+
+	n = h.path + strlen( path ) + 1;
+	for( i=0; i<count; i++ )
+	{
+		offsets[i] = n;
+		n += strlen( entries[i].name ) + strlen( entries[i].desc ) + 2;
+	}
+
+	b_init( &b );
+	b_append( &b, &h, sizeof( h ) );
+	b_append( &b, offsets, sizeof( int )*count );
+	b_append( &b, path, strlen( path )+1 );
+	for( i=0; i<count; i++ )
+	{
+		b_append( &b, entries[i].name, strlen( entries[i].name )+1 );
+		b_append( &b, entries[i].desc, strlen( entries[i].desc )+1 );
+	}
+
+	/*
+	  Write to a temporary file, unique to this process, and rename it
+	  into place, so that shells never see a half written index
+	*/
+	sb_init( &sb );
+	sb_printf( &sb, L"%ls.%d", index, getpid() );
+	tmp_fn = (wchar_t *)sb.buff;
+	tmp_nfn = wcs2str( tmp_fn );
+	nfn = wcs2str( index );
+
+	fd = wopen( tmp_fn, O_WRONLY|O_CREAT|O_TRUNC, 0600 );
+	if( fd != -1 )
+	{
+		int write_res = write( fd, b.buff, b.used ) != b.used;
+
+		if( close( fd ) || write_res )
+		{
+			unlink( tmp_nfn );
+		}
+		else if( rename( tmp_nfn, nfn ) == 0 )
+		{
+			res = 0;
+		}
+		else
+		{
+			unlink( tmp_nfn );
+		}
+	}
+
+	free( nfn );
+	free( tmp_nfn );
+	sb_destroy( &sb );
+	b_destroy( &b );
+	free( path );
+	free( offsets );
+	free( entries );
+	free( contents );
+
+	return res;
+}
+
+/**
+   Start building the index of the specified whatis database in the
+   background, unless a build was started recently
+*/
+static void whatis_build_background( const wchar_t *whatis, const wchar_t *index )
+{
+	pid_t pid;
+	time_t now = time( 0 );
+
+	if( now - build_time < WHATIS_BUILD_INTERVAL )
+		return;
+	build_time = now;
+
+	/*
+	  Fork twice, so that the building process is not a child of the
+	  shell and doesn't need to be waited for
+	*/
+	block();
+	switch( pid = fork() )
+	{
+		case -1:
+			debug( 1, L"Could not build index of whatis database" );
+			wperror( L"fork" );
+			break;
+
+		case 0:
+		{
+			setsid();
+			if( fork() == 0 )
+			{
+				whatis_build_index( whatis, index );
+			}
+			_exit(0);
+		}
+
+		default:
+		{
+			waitpid( pid, 0, 0 );
+			break;
+		}
+	}
+	unblock();
+}
+
+int whatis_get_descriptions( const wchar_t *whatis,
+							 const wchar_t *prefix,
+							 hash_table_t *out )
+{
+	struct stat buf;
+	whatis_header_t *h;
+	char *path, *nprefix;
+	int prefix_len;
+	int lo, hi, i;
+
+	if( wstat( whatis, &buf ) )
+		return -1;
+
+	path = wcs2str( whatis );
+
+	if( !whatis_index_valid( path, &buf ) )
+	{
+		wchar_t *index = whatis_index_filename();
+
+		whatis_unmap();
+		if( index )
+		{
+			whatis_map( index );
+			if( !whatis_index_valid( path, &buf ) )
+			{
+				whatis_unmap();
+				whatis_build_background( whatis, index );
+			}
+		}
+		free( index );
+	}
+	free( path );
+
+	if( !index_map )
+		return -1;
+
+	h = (whatis_header_t *)index_map;
+	nprefix = wcs2str( prefix );
+	prefix_len = strlen( nprefix );
+
+	/*
+	  Find the first command name not less than the prefix. All
+	  commands starting with the prefix follow it.
+	*/
+	lo=0;
+	hi=h->count;
+	while( lo < hi )
+	{
+		int mid = lo + (hi-lo)/2;
+		char *name = whatis_entry( mid );
+
+		if( !name )
+			break;
+
+		if( strcmp( name, nprefix ) < 0 )
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+
+	for( i=lo; i<h->count; i++ )
+	{
+		char *name = whatis_entry( i );
+		wchar_t *key, *desc;
+
+		if( !name || strncmp( name, nprefix, prefix_len ) != 0 )
+			break;
+
+		key = str2wcs( name + prefix_len );
+		desc = str2wcs( name + strlen( name ) + 1 );
+		if( key && desc )
+		{
+			hash_put( out, key, desc );
+		}
+		else
+		{
+			free( key );
+			free( desc );
+		}
+	}
+
+	free( nprefix );
+	return 0;
+}
+
+void whatis_destroy()
+{
+	whatis_unmap();
+}
@@ -0,0 +1,52 @@
+/** \file whatis.h
+
+	An index of command descriptions, built from the whatis database.
+
+	The whatis database is read in the background into a sorted index
+	file, ~/.fish_whatis, which is memory mapped, so looking up the
+	descriptions of all commands starting with a prefix does not need
+	to start any new processes or scan the whole database.
+*/
+
+#ifndef FISH_WHATIS_H
+#define FISH_WHATIS_H
+
+#include <wchar.h>
+
+#include "util.h"
+
+/**
+   Find the descriptions of all commands in the specified whatis
+   database whose names start with the specified prefix. For every
+   such command, the part of its name following the prefix is used as
+   the key and its description as the value in \c out. All keys and
+   values are allocated using malloc and must be freed by the caller.
+
+   If there is no index for the current version of the whatis
+   database, an index is built in the background and nothing is
+   returned.
+
+   \param whatis the location of the whatis database
+   \param prefix the beginning of the command names
+   \param out the hash table to add descriptions to
+   \return 0 on success, -1 if the index could not be used yet
+*/
+int whatis_get_descriptions( const wchar_t *whatis,
+							 const wchar_t *prefix,
+							 hash_table_t *out );
+
+/**
+   Build the index of the specified whatis database and write it to
+   the specified file. This is what whatis_get_descriptions does in
+   the background.
+
+   \return 0 on success, -1 on failure
+*/
+int whatis_build_index( const wchar_t *whatis, const wchar_t *index );
+
+/**
+   Unmap the current index
+*/
+void whatis_destroy();
+
+#endif
@@ -87,4 +87,15 @@ int wildcard_complete( const wchar_t *str,
 						const wchar_t *(*desc_func)(const wchar_t *),
 						array_list_t *out );
 
+/**
+   Write a description of the specified file, including its type and
+   size, to the specified buffer. The description starts with
+   COMPLETE_SEP, and is the one used for file completions.
+
+   \param fn The name of the file
+   \param sb The buffer to write the description to. The buffer is cleared first.
+   \param is_cmd Whether the file is being completed as a command
+*/
+void get_desc( wchar_t *fn, string_buffer_t *sb, int is_cmd );
+
 #endif
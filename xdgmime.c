@@ -35,8 +35,11 @@
 #include "xdgmimemagic.h"
 #include "xdgmimealias.h"
 #include "xdgmimeparent.h"
+#include "xdgmimecache.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
@@ -45,6 +48,7 @@
 
 typedef struct XdgDirTimeList XdgDirTimeList;
 typedef struct XdgCallbackList XdgCallbackList;
+typedef struct XdgCacheList XdgCacheList;
 
 static int need_reread = TRUE;
 static time_t last_stat_time = 0;
@@ -55,6 +59,12 @@ static XdgAliasList *alias_list = NULL;
 static XdgParentList *parent_list = NULL;
 static XdgDirTimeList *dir_time_list = NULL;
 static XdgCallbackList *callback_list = NULL;
+static XdgCacheList *cache_list = NULL;
+
+/* The start of the file being sniffed.  The buffer is kept between
+ * calls, so sniffing many files does not allocate for each one. */
+static unsigned char *sniff_buffer = NULL;
+static size_t sniff_buffer_size = 0;
 const char *xdg_mime_type_unknown = "application/octet-stream";
 
 
@@ -73,6 +83,14 @@ struct XdgDirTimeList
   XdgDirTimeList *next;
 };
 
+/* The mime.cache files in use, in the order of the directories they
+ * were found in */
+struct XdgCacheList
+{
+  XdgMimeCache *cache;
+  XdgCacheList *next;
+};
+
 struct XdgCallbackList
 {
   XdgCallbackList *next;
@@ -113,26 +131,62 @@ xdg_dir_time_list_free (XdgDirTimeList *list)
     }
 }
 
+static void
+xdg_dir_time_list_add (char   *file_name,
+		       time_t  mtime)
+{
+  XdgDirTimeList *list;
+
+  list = xdg_dir_time_list_new ();
+  list->directory_name = file_name;
+  list->mtime = mtime;
+  list->next = dir_time_list;
+  dir_time_list = list;
+}
+
 static int
 xdg_mime_init_from_directory (const char *directory)
 {
   char *file_name;
   struct stat st;
-  XdgDirTimeList *list;
+  XdgMimeCache *cache = NULL;
 
   assert (directory != NULL);
 
+  /* Prefer the binary cache written by update-mime-database. It is
+   * mapped into memory instead of being parsed, so using it costs
+   * next to nothing. */
+  file_name = malloc (strlen (directory) + strlen ("/mime/mime.cache") + 1);
+  strcpy (file_name, directory); strcat (file_name, "/mime/mime.cache");
+  if (stat (file_name, &st) == 0)
+    {
+      cache = _xdg_mime_cache_new_from_file (file_name);
+      if (cache != NULL)
+	{
+	  XdgCacheList **tail = &cache_list;
+
+	  while (*tail)
+	    tail = &(*tail)->next;
+	  *tail = calloc (1, sizeof (XdgCacheList));
+	  (*tail)->cache = cache;
+	}
+      xdg_dir_time_list_add (file_name, st.st_mtime);
+    }
+  else
+    {
+      free (file_name);
+    }
+
+  /* The text files are still checked for changes when the cache is
+   * used, but they are only read when there is no usable cache */
   file_name = malloc (strlen (directory) + strlen ("/mime/globs") + 1);
   strcpy (file_name, directory); strcat (file_name, "/mime/globs");
   if (stat (file_name, &st) == 0)
     {
-      _xdg_mime_glob_read_from_file (global_hash, file_name);
+      if (cache == NULL)
+	_xdg_mime_glob_read_from_file (global_hash, file_name);
 
-      list = xdg_dir_time_list_new ();
-      list->directory_name = file_name;
-      list->mtime = st.st_mtime;
-      list->next = dir_time_list;
-      dir_time_list = list;
+      xdg_dir_time_list_add (file_name, st.st_mtime);
     }
   else
     {
@@ -143,19 +197,19 @@ xdg_mime_init_from_directory (const char *directory)
   strcpy (file_name, directory); strcat (file_name, "/mime/magic");
   if (stat (file_name, &st) == 0)
     {
-      _xdg_mime_magic_read_from_file (global_magic, file_name);
+      if (cache == NULL)
+	_xdg_mime_magic_read_from_file (global_magic, file_name);
 
-      list = xdg_dir_time_list_new ();
-      list->directory_name = file_name;
-      list->mtime = st.st_mtime;
-      list->next = dir_time_list;
-      dir_time_list = list;
+      xdg_dir_time_list_add (file_name, st.st_mtime);
     }
   else
     {
       free (file_name);
     }
 
+  if (cache != NULL)
+    return FALSE; /* Keep processing */
+
   file_name = malloc (strlen (directory) + strlen ("/mime/aliases") + 1);
   strcpy (file_name, directory); strcat (file_name, "/mime/aliases");
   _xdg_mime_alias_read_from_file (alias_list, file_name);
@@ -289,6 +343,17 @@ xdg_check_dir (const char *directory,
 
   assert (directory != NULL);
 
+  /* Check the cache file */
+  file_name = malloc (strlen (directory) + strlen ("/mime/mime.cache") + 1);
+  strcpy (file_name, directory); strcat (file_name, "/mime/mime.cache");
+  invalid = xdg_check_file (file_name);
+  free (file_name);
+  if (invalid)
+    {
+      *invalid_dir_list = TRUE;
+      return TRUE;
+    }
+
   /* Check the globs file */
   file_name = malloc (strlen (directory) + strlen ("/mime/globs") + 1);
   strcpy (file_name, directory); strcat (file_name, "/mime/globs");
@@ -387,6 +452,70 @@ xdg_mime_init (void)
     }
 }
 
+/* Look up the data in the magic of every cache, and pick the match with
+ * the highest priority.  The text files are only used if no cache
+ * matches. */
+static const char *
+xdg_mime_magic_lookup (const void *data,
+		       size_t      len)
+{
+  XdgCacheList *list;
+  const char *mime_type = NULL;
+  int best_priority = -1;
+
+  for (list = cache_list; list; list = list->next)
+    {
+      int priority;
+      const char *match;
+
+      match = _xdg_mime_cache_lookup_data (list->cache, data, len, &priority);
+      if (match && priority > best_priority)
+	{
+	  mime_type = match;
+	  best_priority = priority;
+	}
+    }
+
+  if (mime_type)
+    return mime_type;
+
+  return _xdg_mime_magic_lookup_data (global_magic, data, len);
+}
+
+/* The number of bytes of a file needed to check all magic */
+static int
+xdg_mime_buffer_extents (void)
+{
+  XdgCacheList *list;
+  int max_extent = _xdg_mime_magic_get_buffer_extents (global_magic);
+
+  for (list = cache_list; list; list = list->next)
+    {
+      int extent = _xdg_mime_cache_get_buffer_extents (list->cache);
+      if (extent > max_extent)
+	max_extent = extent;
+    }
+
+  return max_extent;
+}
+
+/* Return the parents of an unaliased mime type */
+static const char **
+xdg_mime_parents_lookup (const char *mime)
+{
+  XdgCacheList *list;
+  const char **parents;
+
+  for (list = cache_list; list; list = list->next)
+    {
+      parents = _xdg_mime_cache_get_mime_parents (list->cache, mime);
+      if (parents)
+	return parents;
+    }
+
+  return _xdg_mime_parent_list_lookup (parent_list, mime);
+}
+
 const char *
 xdg_mime_get_mime_type_for_data (const void *data,
 								 size_t      len)
@@ -395,7 +524,7 @@ xdg_mime_get_mime_type_for_data (const void *data,
 
   xdg_mime_init ();
 
-  mime_type = _xdg_mime_magic_lookup_data (global_magic, data, len);
+  mime_type = xdg_mime_magic_lookup (data, len);
 
   if (mime_type)
     return mime_type;
@@ -403,26 +532,25 @@ xdg_mime_get_mime_type_for_data (const void *data,
   return XDG_MIME_TYPE_UNKNOWN;
 }
 
-const char *
-xdg_mime_get_mime_type_for_file (const char *file_name)
+/* Guess the mime type of a file from its name, or failing that from its
+ * contents.  Only as much of the file as the magic can look at is read,
+ * in a single read. */
+static const char *
+xdg_mime_sniff_file (const char *file_name,
+		     int         max_extent)
 {
   const char *mime_type;
-  FILE *file;
-  unsigned char *data;
-  int max_extent;
-  int bytes_read;
   struct stat statbuf;
-  const char *base_name;
+  ssize_t bytes_read;
+  size_t len;
+  int fd;
 
   if (file_name == NULL)
     return NULL;
   if (! _xdg_utf8_validate (file_name))
     return NULL;
 
-  xdg_mime_init ();
-
-  base_name = _xdg_get_base_name (file_name);
-  mime_type = xdg_mime_get_mime_type_from_file_name (base_name);
+  mime_type = xdg_mime_get_mime_type_from_file_name (_xdg_get_base_name (file_name));
 
   if (mime_type != XDG_MIME_TYPE_UNKNOWN)
     return mime_type;
@@ -433,33 +561,33 @@ xdg_mime_get_mime_type_for_file (const char *file_name)
   if (!S_ISREG (statbuf.st_mode))
     return XDG_MIME_TYPE_UNKNOWN;
 
-  /* FIXME: Need to make sure that max_extent isn't totally broken.  This could
-   * be large and need getting from a stream instead of just reading it all
-   * in. */
-  max_extent = _xdg_mime_magic_get_buffer_extents (global_magic);
-  data = malloc (max_extent);
-  if (data == NULL)
-    return XDG_MIME_TYPE_UNKNOWN;
-        
-  file = fopen (file_name, "r");
-  if (file == NULL)
-    {
-      free (data);
-      return XDG_MIME_TYPE_UNKNOWN;
-    }
+  /* Most files are smaller than the magic extents, so there is no use
+   * in asking for more than the file holds */
+  len = max_extent > 0 ? max_extent : 0;
+  if ((size_t) statbuf.st_size < len)
+    len = statbuf.st_size;
 
-  bytes_read = fread (data, 1, max_extent, file);
-  if (ferror (file))
+  if (len > sniff_buffer_size)
     {
-      free (data);
-      fclose (file);
-      return XDG_MIME_TYPE_UNKNOWN;
+      unsigned char *buffer = realloc (sniff_buffer, len);
+
+      if (buffer == NULL)
+	return XDG_MIME_TYPE_UNKNOWN;
+      sniff_buffer = buffer;
+      sniff_buffer_size = len;
     }
 
-  mime_type = _xdg_mime_magic_lookup_data (global_magic, data, bytes_read);
+  fd = open (file_name, O_RDONLY);
+  if (fd < 0)
+    return XDG_MIME_TYPE_UNKNOWN;
+
+  bytes_read = len ? read (fd, sniff_buffer, len) : 0;
+  close (fd);
+
+  if (bytes_read < 0)
+    return XDG_MIME_TYPE_UNKNOWN;
 
-  free (data);
-  fclose (file);
+  mime_type = xdg_mime_magic_lookup (sniff_buffer, bytes_read);
 
   if (mime_type)
     return mime_type;
@@ -467,13 +595,44 @@ xdg_mime_get_mime_type_for_file (const char *file_name)
   return XDG_MIME_TYPE_UNKNOWN;
 }
 
+const char *
+xdg_mime_get_mime_type_for_file (const char *file_name)
+{
+  xdg_mime_init ();
+
+  return xdg_mime_sniff_file (file_name, xdg_mime_buffer_extents ());
+}
+
+void
+xdg_mime_get_mime_types_for_files (const char **file_names,
+				   const char **mime_types,
+				   int          n_files)
+{
+  int max_extent;
+  int i;
+
+  xdg_mime_init ();
+
+  max_extent = xdg_mime_buffer_extents ();
+  for (i = 0; i < n_files; i++)
+    mime_types[i] = xdg_mime_sniff_file (file_names[i], max_extent);
+}
+
 const char *
 xdg_mime_get_mime_type_from_file_name (const char *file_name)
 {
   const char *mime_type;
+  XdgCacheList *list;
 
   xdg_mime_init ();
 
+  for (list = cache_list; list; list = list->next)
+    {
+      mime_type = _xdg_mime_cache_lookup_file_name (list->cache, file_name);
+      if (mime_type)
+	return mime_type;
+    }
+
   mime_type = _xdg_glob_hash_lookup_file_name (global_hash, file_name);
   if (mime_type)
     return mime_type;
@@ -521,7 +680,21 @@ xdg_mime_shutdown (void)
   if( parent_list )
 	{
 	  _xdg_mime_parent_list_free ( parent_list);
+	  parent_list = NULL;
 	}
+
+  free (sniff_buffer);
+  sniff_buffer = NULL;
+  sniff_buffer_size = 0;
+
+  while (cache_list)
+    {
+      XdgCacheList *next = cache_list->next;
+
+      _xdg_mime_cache_free (cache_list->cache);
+      free (cache_list);
+      cache_list = next;
+    }
   
   
   for (list = callback_list; list; list = list->next)
@@ -535,16 +708,23 @@ xdg_mime_get_max_buffer_extents (void)
 {
   xdg_mime_init ();
   
-  return _xdg_mime_magic_get_buffer_extents (global_magic);
+  return xdg_mime_buffer_extents ();
 }
 
 const char *
 xdg_mime_unalias_mime_type (const char *mime_type)
 {
   const char *lookup;
+  XdgCacheList *list;
 
   xdg_mime_init ();
 
+  for (list = cache_list; list; list = list->next)
+    {
+      if ((lookup = _xdg_mime_cache_unalias_mime_type (list->cache, mime_type)) != NULL)
+	return lookup;
+    }
+
   if ((lookup = _xdg_mime_alias_list_lookup (alias_list, mime_type)) != NULL)
     return lookup;
 
@@ -631,7 +811,7 @@ xdg_mime_mime_type_subclass (const char *mime,
   if (strcmp (ubase, "application/octet-stream") == 0)
     return 1;
   
-  parents = _xdg_mime_parent_list_lookup (parent_list, umime);
+  parents = xdg_mime_parents_lookup (umime);
   for (; parents && *parents; parents++)
     {
       if (xdg_mime_mime_type_subclass (*parents, ubase))
@@ -650,7 +830,7 @@ xdg_mime_get_mime_parents (const char *mime)
 
   umime = xdg_mime_unalias_mime_type (mime);
 
-  return _xdg_mime_parent_list_lookup (parent_list, umime);
+  return xdg_mime_parents_lookup (umime);
 }
 
 void 
@@ -48,6 +48,7 @@ typedef void (*XdgMimeDestroy)  (void *user_data);
 #ifdef XDG_PREFIX
 #define xdg_mime_get_mime_type_for_data       XDG_ENTRY(get_mime_type_for_data)
 #define xdg_mime_get_mime_type_for_file       XDG_ENTRY(get_mime_type_for_file)
+#define xdg_mime_get_mime_types_for_files     XDG_ENTRY(get_mime_types_for_files)
 #define xdg_mime_get_mime_type_from_file_name XDG_ENTRY(get_mime_type_from_file_name)
 #define xdg_mime_is_valid_mime_type           XDG_ENTRY(is_valid_mime_type)
 #define xdg_mime_mime_type_equal              XDG_ENTRY(mime_type_equal)
@@ -68,6 +69,11 @@ extern const char *xdg_mime_type_unknown;
 const char  *xdg_mime_get_mime_type_for_data       (const void *data,
 						    size_t      len);
 const char  *xdg_mime_get_mime_type_for_file       (const char *file_name);
+/* Look up the mime types of many files at once, reading each file at
+ * most once.  mime_types must have room for n_files entries. */
+void         xdg_mime_get_mime_types_for_files     (const char **file_names,
+						    const char **mime_types,
+						    int          n_files);
 const char  *xdg_mime_get_mime_type_from_file_name (const char *file_name);
 int          xdg_mime_is_valid_mime_type           (const char *mime_type);
 int          xdg_mime_mime_type_equal              (const char *mime_a,
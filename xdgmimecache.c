@@ -0,0 +1,708 @@
+/* -*- mode: C; c-file-style: "gnu" -*- */
+/* xdgmimecache.c: Private file.  Lookups in the binary mime.cache files
+ * written by update-mime-database.
+ *
+ * More info can be found at http://www.freedesktop.org/standards/
+ *
+ * Licensed under the Academic Free License version 2.0
+ * Or under the following terms:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "xdgmimecache.h"
+#include "xdgmimeint.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+
+#ifndef MAP_FAILED
+#define MAP_FAILED ((void *) -1)
+#endif
+
+/* The cache versions we understand.  Version 1.1 added glob weights,
+ * 1.2 only added lists we do not use. */
+#define MAJOR_VERSION 1
+#define MINOR_VERSION_MIN 1
+#define MINOR_VERSION_MAX 2
+
+/* Offsets of the list offsets in the header */
+#define ALIAS_LIST_OFFSET           4
+#define PARENT_LIST_OFFSET          8
+#define LITERAL_LIST_OFFSET        12
+#define REVERSE_SUFFIX_TREE_OFFSET 16
+#define GLOB_LIST_OFFSET           20
+#define MAGIC_LIST_OFFSET          24
+#define HEADER_SIZE                40
+
+/* Glob weights are stored in the low byte, flags above it */
+#define WEIGHT_MASK          0xff
+#define CASE_SENSITIVE_FLAG 0x100
+
+/* Magic matchlets may nest, but a sane file never nests this deep */
+#define MAX_MATCHLET_DEPTH 32
+
+struct XdgMimeCache
+{
+  char *buffer;
+  size_t size;
+
+  /* Parent arrays handed out by _xdg_mime_cache_get_mime_parents, one
+   * for each entry in the parent list, built the first time they are
+   * asked for. */
+  const char ***parents;
+  xdg_uint32_t n_parents;
+
+  /* The magic matches filed by the first byte they can match, built
+   * the first time data is looked up. */
+  XdgMimeMagicIndex *magic_index;
+};
+
+/* The result of a glob lookup, used to pick the best of several
+ * matching globs */
+typedef struct
+{
+  const char *mime_type;
+  int weight;
+  int length;
+} XdgCacheGlobMatch;
+
+/* Read a big endian number from the cache.  Out of range reads return
+ * 0, so a truncated or corrupt file only makes lookups fail. */
+static xdg_uint32_t
+cache_uint32 (XdgMimeCache *cache,
+	      xdg_uint32_t  offset)
+{
+  xdg_uint32_t val;
+
+  if (offset > cache->size - 4)
+    return 0;
+
+  memcpy (&val, cache->buffer + offset, 4);
+  return ntohl (val);
+}
+
+/* Return the string at the specified offset, or NULL if the offset is
+ * out of range or the string is not terminated inside the file. */
+static const char *
+cache_string (XdgMimeCache *cache,
+	      xdg_uint32_t  offset)
+{
+  if (offset == 0 || offset >= cache->size ||
+      !memchr (cache->buffer + offset, '\0', cache->size - offset))
+    return NULL;
+
+  return cache->buffer + offset;
+}
+
+XdgMimeCache *
+_xdg_mime_cache_new_from_file (const char *file_name)
+{
+  XdgMimeCache *cache;
+  struct stat st;
+  char *buffer;
+  int major, minor;
+  int fd;
+
+  fd = open (file_name, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  if (fstat (fd, &st) < 0 || st.st_size < HEADER_SIZE)
+    {
+      close (fd);
+      return NULL;
+    }
+
+  buffer = (char *) mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+
+  if (buffer == MAP_FAILED)
+    return NULL;
+
+  major = ((unsigned char)buffer[0] << 8) | (unsigned char)buffer[1];
+  minor = ((unsigned char)buffer[2] << 8) | (unsigned char)buffer[3];
+  if (major != MAJOR_VERSION ||
+      minor < MINOR_VERSION_MIN || minor > MINOR_VERSION_MAX)
+    {
+      munmap (buffer, st.st_size);
+      return NULL;
+    }
+
+  cache = calloc (1, sizeof (XdgMimeCache));
+  if (cache == NULL)
+    {
+      munmap (buffer, st.st_size);
+      return NULL;
+    }
+
+  cache->buffer = buffer;
+  cache->size = st.st_size;
+
+  return cache;
+}
+
+void
+_xdg_mime_cache_free (XdgMimeCache *cache)
+{
+  xdg_uint32_t i;
+
+  if (cache->parents)
+    {
+      for (i = 0; i < cache->n_parents; i++)
+	free ((void *) cache->parents[i]);
+      free (cache->parents);
+    }
+
+  if (cache->magic_index)
+    _xdg_mime_magic_index_free (cache->magic_index);
+
+  munmap (cache->buffer, cache->size);
+  free (cache);
+}
+
+/* Binary search for a string in a sorted list of entries, each of
+ * which begins with the offset of its key.  Returns the offset of the
+ * entry, or 0 if there is no such entry. */
+static xdg_uint32_t
+cache_bsearch (XdgMimeCache *cache,
+	       xdg_uint32_t  list_offset,
+	       int           entry_size,
+	       const char   *key)
+{
+  xdg_uint32_t n_entries = cache_uint32 (cache, list_offset);
+  int min = 0;
+  int max = (int)n_entries - 1;
+
+  while (max >= min)
+    {
+      int mid = (min + max) / 2;
+      xdg_uint32_t entry = list_offset + 4 + entry_size * mid;
+      const char *ptr = cache_string (cache, cache_uint32 (cache, entry));
+      int cmp;
+
+      if (ptr == NULL)
+	return 0;
+
+      cmp = strcmp (ptr, key);
+      if (cmp < 0)
+	min = mid + 1;
+      else if (cmp > 0)
+	max = mid - 1;
+      else
+	return entry;
+    }
+
+  return 0;
+}
+
+/* Remember the specified match if it is better than the best one
+ * found so far.  A higher weight wins, and a longer pattern wins
+ * between equal weights. */
+static void
+cache_glob_match_add (XdgCacheGlobMatch *best,
+		      const char        *mime_type,
+		      int                weight,
+		      int                length)
+{
+  if (mime_type == NULL)
+    return;
+
+  if (best->mime_type == NULL ||
+      weight > best->weight ||
+      (weight == best->weight && length > best->length))
+    {
+      best->mime_type = mime_type;
+      best->weight = weight;
+      best->length = length;
+    }
+}
+
+/* Walk the reverse suffix tree from the end of the file name.  Every
+ * leaf below a node we reach is a glob of the form *suffix matching the
+ * file name. */
+static void
+cache_glob_lookup_suffix (XdgMimeCache      *cache,
+			  const char        *file_name,
+			  int                ignore_case,
+			  XdgCacheGlobMatch *best)
+{
+  xdg_uint32_t tree = cache_uint32 (cache, REVERSE_SUFFIX_TREE_OFFSET);
+  xdg_uint32_t n_entries = cache_uint32 (cache, tree);
+  xdg_uint32_t offset = cache_uint32 (cache, tree + 4);
+  const char *end = file_name + strlen (file_name);
+  int depth = 0;
+
+  while (end > file_name && n_entries > 0)
+    {
+      const char *start = end - 1;
+      xdg_unichar_t character;
+      xdg_uint32_t node = 0;
+      xdg_uint32_t n_children, child, i;
+      int min = 0;
+      int max = (int)n_entries - 1;
+
+      while (start > file_name && (*start & 0xc0) == 0x80)
+	start--;
+
+      character = _xdg_utf8_to_ucs4 (start);
+      if (ignore_case)
+	character = _xdg_ucs4_to_lower (character);
+
+      while (max >= min)
+	{
+	  int mid = (min + max) / 2;
+	  xdg_uint32_t match_char = cache_uint32 (cache, offset + 12 * mid);
+
+	  if (match_char < character)
+	    min = mid + 1;
+	  else if (match_char > character)
+	    max = mid - 1;
+	  else
+	    {
+	      node = offset + 12 * mid;
+	      break;
+	    }
+	}
+
+      if (node == 0)
+	return;
+
+      end = start;
+      depth++;
+      n_children = cache_uint32 (cache, node + 4);
+      child = cache_uint32 (cache, node + 8);
+
+      /* Leaves have the character 0, so they come first */
+      for (i = 0; i < n_children; i++)
+	{
+	  xdg_uint32_t leaf = child + 12 * i;
+	  xdg_uint32_t weight;
+
+	  if (cache_uint32 (cache, leaf) != 0)
+	    break;
+
+	  weight = cache_uint32 (cache, leaf + 8);
+	  if (ignore_case && (weight & CASE_SENSITIVE_FLAG))
+	    continue;
+
+	  cache_glob_match_add (best,
+				cache_string (cache, cache_uint32 (cache, leaf + 4)),
+				weight & WEIGHT_MASK,
+				depth);
+	}
+
+      n_entries = n_children;
+      offset = child;
+    }
+}
+
+/* Return a copy of the specified string with all ASCII characters in
+ * lower case.  Case insensitive literals and globs are stored in lower
+ * case in the cache. */
+static char *
+ascii_lower (const char *str)
+{
+  char *res = strdup (str);
+  char *ptr;
+
+  if (res == NULL)
+    return NULL;
+
+  for (ptr = res; *ptr; ptr++)
+    if (*ptr >= 'A' && *ptr <= 'Z')
+      *ptr += 'a' - 'A';
+
+  return res;
+}
+
+const char *
+_xdg_mime_cache_lookup_file_name (XdgMimeCache *cache,
+				  const char   *file_name)
+{
+  XdgCacheGlobMatch best;
+  xdg_uint32_t entry;
+  xdg_uint32_t list, n_globs, i;
+  char *lower;
+
+  /* First, check the literals */
+  list = cache_uint32 (cache, LITERAL_LIST_OFFSET);
+  entry = cache_bsearch (cache, list, 12, file_name);
+  if (entry)
+    return cache_string (cache, cache_uint32 (cache, entry + 4));
+
+  lower = ascii_lower (file_name);
+  if (lower == NULL)
+    return NULL;
+
+  entry = cache_bsearch (cache, list, 12, lower);
+  if (entry && !(cache_uint32 (cache, entry + 8) & CASE_SENSITIVE_FLAG))
+    {
+      free (lower);
+      return cache_string (cache, cache_uint32 (cache, entry + 4));
+    }
+
+  /* Then the simple *suffix globs */
+  memset (&best, 0, sizeof (best));
+  cache_glob_lookup_suffix (cache, file_name, FALSE, &best);
+  cache_glob_lookup_suffix (cache, file_name, TRUE, &best);
+  if (best.mime_type)
+    {
+      free (lower);
+      return best.mime_type;
+    }
+
+  /* And finally the full globs */
+  list = cache_uint32 (cache, GLOB_LIST_OFFSET);
+  n_globs = cache_uint32 (cache, list);
+  for (i = 0; i < n_globs; i++)
+    {
+      xdg_uint32_t glob_entry = list + 4 + 12 * i;
+      const char *glob = cache_string (cache, cache_uint32 (cache, glob_entry));
+      xdg_uint32_t weight = cache_uint32 (cache, glob_entry + 8);
+
+      if (glob == NULL)
+	continue;
+
+      if (fnmatch (glob, file_name, 0) == 0 ||
+	  (!(weight & CASE_SENSITIVE_FLAG) && fnmatch (glob, lower, 0) == 0))
+	{
+	  cache_glob_match_add (&best,
+				cache_string (cache, cache_uint32 (cache, glob_entry + 4)),
+				weight & WEIGHT_MASK,
+				strlen (glob));
+	}
+    }
+
+  free (lower);
+  return best.mime_type;
+}
+
+/* Test if the matchlet at the specified offset, or any of the
+ * alternatives nested in it, match the data */
+static int
+cache_magic_matchlet_compare (XdgMimeCache        *cache,
+			      xdg_uint32_t         offset,
+			      const unsigned char *data,
+			      size_t               len,
+			      int                  depth)
+{
+  xdg_uint32_t range_start = cache_uint32 (cache, offset);
+  xdg_uint32_t range_length = cache_uint32 (cache, offset + 4);
+  xdg_uint32_t value_length = cache_uint32 (cache, offset + 12);
+  xdg_uint32_t value_offset = cache_uint32 (cache, offset + 16);
+  xdg_uint32_t mask_offset = cache_uint32 (cache, offset + 20);
+  xdg_uint32_t n_children = cache_uint32 (cache, offset + 24);
+  xdg_uint32_t child_offset = cache_uint32 (cache, offset + 28);
+  const unsigned char *value, *mask = NULL;
+  xdg_uint32_t i, j;
+
+  if (depth > MAX_MATCHLET_DEPTH || value_length == 0 ||
+      value_offset > cache->size || value_length > cache->size - value_offset)
+    return FALSE;
+  value = (const unsigned char *)cache->buffer + value_offset;
+
+  if (mask_offset)
+    {
+      if (mask_offset > cache->size || value_length > cache->size - mask_offset)
+	return FALSE;
+      mask = (const unsigned char *)cache->buffer + mask_offset;
+    }
+
+  for (i = range_start; i - range_start < range_length; i++)
+    {
+      int valid_matchlet = TRUE;
+
+      if (i > len || value_length > len - i)
+	return FALSE;
+
+      /* Text is often searched for in a long range, so skip straight
+       * to where the value may start */
+      if (!mask)
+	{
+	  size_t n = len - value_length - i + 1;
+	  const unsigned char *next;
+
+	  if (n > range_length - (i - range_start))
+	    n = range_length - (i - range_start);
+	  next = memchr (data + i, value[0], n);
+	  if (next == NULL)
+	    return FALSE;
+	  i = next - data;
+	}
+
+      if (mask)
+	{
+	  for (j = 0; j < value_length; j++)
+	    {
+	      if ((value[j] & mask[j]) != (data[i + j] & mask[j]))
+		{
+		  valid_matchlet = FALSE;
+		  break;
+		}
+	    }
+	}
+      else
+	{
+	  valid_matchlet = memcmp (value, data + i, value_length) == 0;
+	}
+
+      if (valid_matchlet)
+	{
+	  if (n_children == 0)
+	    return TRUE;
+
+	  for (j = 0; j < n_children; j++)
+	    {
+	      if (cache_magic_matchlet_compare (cache, child_offset + 32 * j,
+						data, len, depth + 1))
+		return TRUE;
+	    }
+	}
+    }
+
+  return FALSE;
+}
+
+/* Return the mime type of the match at the specified offset if any of
+ * its matchlets match the data */
+static const char *
+cache_magic_match_compare (XdgMimeCache        *cache,
+			   xdg_uint32_t         match,
+			   const unsigned char *data,
+			   size_t               len,
+			   int                 *priority)
+{
+  xdg_uint32_t n_matchlets = cache_uint32 (cache, match + 8);
+  xdg_uint32_t matchlet = cache_uint32 (cache, match + 12);
+  xdg_uint32_t j;
+
+  for (j = 0; j < n_matchlets; j++)
+    {
+      if (cache_magic_matchlet_compare (cache, matchlet + 32 * j,
+					data, len, 0))
+	{
+	  const char *mime_type = cache_string (cache, cache_uint32 (cache, match + 4));
+
+	  if (mime_type)
+	    *priority = cache_uint32 (cache, match);
+	  return mime_type;
+	}
+    }
+
+  return NULL;
+}
+
+/* Return the first byte of the value of the matchlet at the specified
+ * offset, or -1 if the matchlet can not be filed in the magic index */
+static int
+cache_magic_matchlet_first_byte (XdgMimeCache *cache,
+				 xdg_uint32_t  offset)
+{
+  xdg_uint32_t range_start = cache_uint32 (cache, offset);
+  xdg_uint32_t range_length = cache_uint32 (cache, offset + 4);
+  xdg_uint32_t value_length = cache_uint32 (cache, offset + 12);
+  xdg_uint32_t value_offset = cache_uint32 (cache, offset + 16);
+  xdg_uint32_t mask_offset = cache_uint32 (cache, offset + 20);
+
+  if (range_length == 0 || range_length > XDG_MIME_MAGIC_INDEX_MAX_RANGE ||
+      range_start > INT_MAX - XDG_MIME_MAGIC_INDEX_MAX_RANGE ||
+      value_length == 0 || value_offset >= cache->size)
+    return -1;
+
+  if (mask_offset &&
+      (mask_offset >= cache->size ||
+       (unsigned char) cache->buffer[mask_offset] != 0xff))
+    return -1;
+
+  return (unsigned char) cache->buffer[value_offset];
+}
+
+/* File every match under the first byte of each of its top level
+ * matchlets, at every offset the matchlet may match at */
+static XdgMimeMagicIndex *
+cache_magic_index_new (XdgMimeCache *cache)
+{
+  xdg_uint32_t list = cache_uint32 (cache, MAGIC_LIST_OFFSET);
+  xdg_uint32_t n_matches = cache_uint32 (cache, list);
+  xdg_uint32_t first = cache_uint32 (cache, list + 8);
+  XdgMimeMagicIndex *index;
+  xdg_uint32_t i, j, k;
+
+  index = _xdg_mime_magic_index_new ();
+  if (index == NULL)
+    return NULL;
+
+  for (i = 0; i < n_matches; i++)
+    {
+      xdg_uint32_t match = first + 16 * i;
+      xdg_uint32_t n_matchlets = cache_uint32 (cache, match + 8);
+      xdg_uint32_t matchlet = cache_uint32 (cache, match + 12);
+      int indexable = TRUE;
+      int ok = TRUE;
+
+      for (j = 0; j < n_matchlets && indexable; j++)
+	indexable = cache_magic_matchlet_first_byte (cache, matchlet + 32 * j) >= 0;
+
+      if (!indexable)
+	ok = _xdg_mime_magic_index_add (index, i, -1, 0);
+
+      for (j = 0; j < n_matchlets && indexable && ok; j++)
+	{
+	  xdg_uint32_t offset = matchlet + 32 * j;
+	  xdg_uint32_t range_start = cache_uint32 (cache, offset);
+	  xdg_uint32_t range_length = cache_uint32 (cache, offset + 4);
+	  int byte = cache_magic_matchlet_first_byte (cache, offset);
+
+	  for (k = range_start; k < range_start + range_length && ok; k++)
+	    ok = _xdg_mime_magic_index_add (index, i, k, byte);
+	}
+
+      if (!ok)
+	{
+	  _xdg_mime_magic_index_free (index);
+	  return NULL;
+	}
+    }
+
+  return index;
+}
+
+const char *
+_xdg_mime_cache_lookup_data (XdgMimeCache *cache,
+			     const void   *data,
+			     size_t        len,
+			     int          *priority)
+{
+  xdg_uint32_t list = cache_uint32 (cache, MAGIC_LIST_OFFSET);
+  xdg_uint32_t n_matches = cache_uint32 (cache, list);
+  xdg_uint32_t first = cache_uint32 (cache, list + 8);
+  const char *mime_type;
+  xdg_uint32_t i;
+
+  if (cache->magic_index == NULL)
+    cache->magic_index = cache_magic_index_new (cache);
+
+  /* The matches are sorted by priority, highest first, and the index
+   * hands out candidates in the same order */
+  if (cache->magic_index)
+    {
+      const int *candidates;
+      int n_candidates;
+      int k;
+
+      n_candidates = _xdg_mime_magic_index_lookup (cache->magic_index,
+						   data, len, &candidates);
+      for (k = 0; k < n_candidates; k++)
+	{
+	  mime_type = cache_magic_match_compare (cache, first + 16 * candidates[k],
+						 data, len, priority);
+	  if (mime_type)
+	    return mime_type;
+	}
+      if (n_candidates >= 0)
+	return NULL;
+    }
+
+  for (i = 0; i < n_matches; i++)
+    {
+      mime_type = cache_magic_match_compare (cache, first + 16 * i,
+					     data, len, priority);
+      if (mime_type)
+	return mime_type;
+    }
+
+  return NULL;
+}
+
+int
+_xdg_mime_cache_get_buffer_extents (XdgMimeCache *cache)
+{
+  xdg_uint32_t list = cache_uint32 (cache, MAGIC_LIST_OFFSET);
+
+  return cache_uint32 (cache, list + 4);
+}
+
+const char *
+_xdg_mime_cache_unalias_mime_type (XdgMimeCache *cache,
+				   const char   *alias)
+{
+  xdg_uint32_t entry;
+
+  entry = cache_bsearch (cache, cache_uint32 (cache, ALIAS_LIST_OFFSET), 8, alias);
+  if (entry == 0)
+    return NULL;
+
+  return cache_string (cache, cache_uint32 (cache, entry + 4));
+}
+
+const char **
+_xdg_mime_cache_get_mime_parents (XdgMimeCache *cache,
+				  const char   *mime)
+{
+  xdg_uint32_t list = cache_uint32 (cache, PARENT_LIST_OFFSET);
+  xdg_uint32_t entry, index, parents, n_parents, i;
+  const char **res;
+  int n = 0;
+
+  entry = cache_bsearch (cache, list, 8, mime);
+  if (entry == 0)
+    return NULL;
+
+  if (cache->parents == NULL)
+    {
+      cache->n_parents = cache_uint32 (cache, list);
+      cache->parents = calloc (cache->n_parents, sizeof (const char **));
+      if (cache->parents == NULL)
+	return NULL;
+    }
+
+  index = (entry - list - 4) / 8;
+  if (cache->parents[index])
+    return cache->parents[index];
+
+  parents = cache_uint32 (cache, entry + 4);
+  n_parents = cache_uint32 (cache, parents);
+  if (n_parents > (cache->size - parents) / 4)
+    return NULL;
+
+  res = malloc ((n_parents + 1) * sizeof (const char *));
+  if (res == NULL)
+    return NULL;
+
+  for (i = 0; i < n_parents; i++)
+    {
+      const char *parent = cache_string (cache, cache_uint32 (cache, parents + 4 + 4 * i));
+      if (parent)
+	res[n++] = parent;
+    }
+  res[n] = NULL;
+
+  cache->parents[index] = res;
+  return res;
+}
@@ -0,0 +1,60 @@
+/* -*- mode: C; c-file-style: "gnu" -*- */
+/* xdgmimecache.h: Private file.  Lookups in the binary mime.cache files
+ * written by update-mime-database.
+ *
+ * More info can be found at http://www.freedesktop.org/standards/
+ *
+ * Licensed under the Academic Free License version 2.0
+ * Or under the following terms:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __XDG_MIME_CACHE_H__
+#define __XDG_MIME_CACHE_H__
+
+#include "xdgmime.h"
+
+typedef struct XdgMimeCache XdgMimeCache;
+
+#ifdef XDG_PREFIX
+#define _xdg_mime_cache_new_from_file         XDG_ENTRY(cache_new_from_file)
+#define _xdg_mime_cache_free                  XDG_ENTRY(cache_free)
+#define _xdg_mime_cache_lookup_file_name      XDG_ENTRY(cache_lookup_file_name)
+#define _xdg_mime_cache_lookup_data           XDG_ENTRY(cache_lookup_data)
+#define _xdg_mime_cache_get_buffer_extents    XDG_ENTRY(cache_get_buffer_extents)
+#define _xdg_mime_cache_unalias_mime_type     XDG_ENTRY(cache_unalias_mime_type)
+#define _xdg_mime_cache_get_mime_parents      XDG_ENTRY(cache_get_mime_parents)
+#endif
+
+/* The cache is mapped into memory, not parsed, so loading it is cheap
+ * no matter how large the database is.  Returns NULL if the file can
+ * not be mapped or is of a version we do not understand. */
+XdgMimeCache *_xdg_mime_cache_new_from_file      (const char   *file_name);
+void          _xdg_mime_cache_free               (XdgMimeCache *cache);
+const char   *_xdg_mime_cache_lookup_file_name   (XdgMimeCache *cache,
+						  const char   *file_name);
+const char   *_xdg_mime_cache_lookup_data        (XdgMimeCache *cache,
+						  const void   *data,
+						  size_t        len,
+						  int          *priority);
+int           _xdg_mime_cache_get_buffer_extents (XdgMimeCache *cache);
+const char   *_xdg_mime_cache_unalias_mime_type  (XdgMimeCache *cache,
+						  const char   *alias);
+const char  **_xdg_mime_cache_get_mime_parents   (XdgMimeCache *cache,
+						  const char   *mime);
+
+#endif /* __XDG_MIME_CACHE_H__ */
@@ -31,6 +31,7 @@
 
 #include "xdgmimeint.h"
 #include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
 
 #ifndef	FALSE
@@ -152,3 +153,184 @@ _xdg_get_base_name (const char *file_name)
   else
     return base_name + 1;
 }
+
+/* A match filed under the byte at an offset in the data.  Matches that
+ * are not filed under any particular byte have an offset of -1. */
+typedef struct
+{
+  int offset;
+  int byte;
+  int match;
+} XdgMimeMagicKey;
+
+/* A run of keys with the same offset */
+typedef struct
+{
+  int offset;
+  int start;
+  int end;
+} XdgMimeMagicOffset;
+
+struct XdgMimeMagicIndex
+{
+  XdgMimeMagicKey *keys;
+  int n_keys;
+  int n_allocated_keys;
+
+  /* Built from the keys the first time the index is used, after which
+   * no more keys may be added */
+  XdgMimeMagicOffset *offsets;
+  int n_offsets;
+  int *candidates;
+};
+
+XdgMimeMagicIndex *
+_xdg_mime_magic_index_new (void)
+{
+  return calloc (1, sizeof (XdgMimeMagicIndex));
+}
+
+void
+_xdg_mime_magic_index_free (XdgMimeMagicIndex *index)
+{
+  free (index->keys);
+  free (index->offsets);
+  free (index->candidates);
+  free (index);
+}
+
+int
+_xdg_mime_magic_index_add (XdgMimeMagicIndex *index,
+			   int                match,
+			   int                offset,
+			   int                byte)
+{
+  XdgMimeMagicKey *key;
+
+  if (index->n_keys == index->n_allocated_keys)
+    {
+      int n_allocated = index->n_allocated_keys ? 2 * index->n_allocated_keys : 64;
+      XdgMimeMagicKey *keys = realloc (index->keys, n_allocated * sizeof (XdgMimeMagicKey));
+
+      if (keys == NULL)
+	return FALSE;
+      index->keys = keys;
+      index->n_allocated_keys = n_allocated;
+    }
+
+  key = &index->keys[index->n_keys++];
+  key->offset = offset;
+  key->byte = offset < 0 ? 0 : byte;
+  key->match = match;
+  return TRUE;
+}
+
+static int
+compare_keys (const void *a,
+	      const void *b)
+{
+  const XdgMimeMagicKey *key_a = a;
+  const XdgMimeMagicKey *key_b = b;
+
+  if (key_a->offset != key_b->offset)
+    return key_a->offset < key_b->offset ? -1 : 1;
+  if (key_a->byte != key_b->byte)
+    return key_a->byte < key_b->byte ? -1 : 1;
+  return key_a->match - key_b->match;
+}
+
+static int
+compare_ints (const void *a,
+	      const void *b)
+{
+  return *(const int *) a - *(const int *) b;
+}
+
+/* Sort the keys and find where the keys of each offset start */
+static int
+_xdg_mime_magic_index_build (XdgMimeMagicIndex *index)
+{
+  int i;
+
+  index->offsets = malloc ((index->n_keys + 1) * sizeof (XdgMimeMagicOffset));
+  index->candidates = malloc ((index->n_keys + 1) * sizeof (int));
+  if (index->offsets == NULL || index->candidates == NULL)
+    {
+      free (index->offsets);
+      free (index->candidates);
+      index->offsets = NULL;
+      index->candidates = NULL;
+      return FALSE;
+    }
+
+  qsort (index->keys, index->n_keys, sizeof (XdgMimeMagicKey), compare_keys);
+
+  for (i = 0; i < index->n_keys; i++)
+    {
+      if (i == 0 || index->keys[i - 1].offset != index->keys[i].offset)
+	{
+	  index->offsets[index->n_offsets].offset = index->keys[i].offset;
+	  index->offsets[index->n_offsets].start = i;
+	  index->n_offsets++;
+	}
+      index->offsets[index->n_offsets - 1].end = i + 1;
+    }
+
+  return TRUE;
+}
+
+int
+_xdg_mime_magic_index_lookup (XdgMimeMagicIndex *index,
+			      const void        *data,
+			      size_t             len,
+			      const int        **candidates)
+{
+  const unsigned char *bytes = data;
+  int n_candidates = 0;
+  int i, j;
+
+  if (index->offsets == NULL && !_xdg_mime_magic_index_build (index))
+    return -1;
+
+  for (i = 0; i < index->n_offsets; i++)
+    {
+      XdgMimeMagicOffset *offset = &index->offsets[i];
+      int start = offset->start;
+      int end = offset->end;
+
+      if (offset->offset >= 0)
+	{
+	  int byte;
+
+	  if ((size_t) offset->offset >= len)
+	    break;
+	  byte = bytes[offset->offset];
+
+	  /* Find the keys for this byte */
+	  while (start < end)
+	    {
+	      int middle = (start + end) / 2;
+
+	      if (index->keys[middle].byte < byte)
+		start = middle + 1;
+	      else
+		end = middle;
+	    }
+	  for (end = start; end < offset->end && index->keys[end].byte == byte; end++)
+	    ;
+	}
+
+      for (j = start; j < end; j++)
+	index->candidates[n_candidates++] = index->keys[j].match;
+    }
+
+  /* A match may be filed under several keys, but must only be tried
+   * once, and in the right order */
+  qsort (index->candidates, n_candidates, sizeof (int), compare_ints);
+  for (i = 0, j = 0; i < n_candidates; i++)
+    if (j == 0 || index->candidates[j - 1] != index->candidates[i])
+      index->candidates[j++] = index->candidates[i];
+
+  *candidates = index->candidates;
+  return j;
+}
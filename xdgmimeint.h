@@ -51,6 +51,10 @@ typedef unsigned int   xdg_uint32_t;
 #define _xdg_ucs4_to_lower   XDG_ENTRY(ucs4_to_lower)
 #define _xdg_utf8_validate   XDG_ENTRY(utf8_validate)
 #define _xdg_get_base_name   XDG_ENTRY(get_ase_name)
+#define _xdg_mime_magic_index_new   XDG_ENTRY(magic_index_new)
+#define _xdg_mime_magic_index_free   XDG_ENTRY(magic_index_free)
+#define _xdg_mime_magic_index_add   XDG_ENTRY(magic_index_add)
+#define _xdg_mime_magic_index_lookup   XDG_ENTRY(magic_index_lookup)
 #endif
 
 #define SWAP_BE16_TO_LE16(val) (xdg_uint16_t)(((xdg_uint16_t)(val) << 8)|((xdg_uint16_t)(val) >> 8))
@@ -70,4 +74,34 @@ xdg_unichar_t  _xdg_ucs4_to_lower (xdg_unichar_t  source);
 int            _xdg_utf8_validate (const char    *source);
 const char    *_xdg_get_base_name (const char    *file_name);
 
+/* Magic index.  Most magic matches can only succeed if the data has
+ * one particular byte at some offset, so the matches of a magic
+ * database are filed under those offsets and bytes, and a lookup only
+ * needs to try the matches filed under the bytes the data actually
+ * has, plus the ones that could not be filed.  Matches are numbered
+ * in the order they should be tried.
+ */
+typedef struct XdgMimeMagicIndex XdgMimeMagicIndex;
+
+/* Matchlets that may match at more offsets than this are not worth
+ * filing under each of them */
+#define XDG_MIME_MAGIC_INDEX_MAX_RANGE 16
+
+XdgMimeMagicIndex *_xdg_mime_magic_index_new    (void);
+void               _xdg_mime_magic_index_free   (XdgMimeMagicIndex  *index);
+/* File a match under the byte at the specified offset, or under no byte
+ * at all if offset is -1.  A match may be filed more than once, but
+ * only before the first lookup.  Returns FALSE if out of memory. */
+int                _xdg_mime_magic_index_add    (XdgMimeMagicIndex  *index,
+						 int                 match,
+						 int                 offset,
+						 int                 byte);
+/* Set candidates to the matches that may match the data, in order, and
+ * return how many there are.  The array belongs to the index and is
+ * overwritten by the next lookup.  Returns -1 if out of memory. */
+int                _xdg_mime_magic_index_lookup (XdgMimeMagicIndex  *index,
+						 const void         *data,
+						 size_t              len,
+						 const int         **candidates);
+
 #endif /* __XDG_MIME_INT_H__ */
@@ -86,6 +86,11 @@ struct XdgMimeMagic
 {
   XdgMimeMagicMatch *match_list;
   int max_extent;
+
+  /* The matches of match_list in an array, and filed by the first byte
+   * they can match.  index is NULL if it could not be built. */
+  XdgMimeMagicMatch **matches;
+  XdgMimeMagicIndex *index;
 };
 
 static XdgMimeMagicMatch *
@@ -521,13 +526,27 @@ _xdg_mime_magic_matchlet_compare_to_data (XdgMimeMagicMatchlet *matchlet,
 {
   int i, j;
 
-  for (i = matchlet->offset; i <= matchlet->offset + matchlet->range_length; i++)
+  for (i = matchlet->offset; i < matchlet->offset + matchlet->range_length; i++)
     {
       int valid_matchlet = TRUE;
 
       if (i + matchlet->value_length > len)
 	return FALSE;
 
+      /* Skip straight to where the value may start */
+      if (!matchlet->mask && matchlet->value_length > 0)
+	{
+	  size_t n = len - matchlet->value_length - i + 1;
+	  const unsigned char *next;
+
+	  if (n > matchlet->offset + matchlet->range_length - i)
+	    n = matchlet->offset + matchlet->range_length - i;
+	  next = memchr ((const unsigned char *) data + i, matchlet->value[0], n);
+	  if (next == NULL)
+	    return FALSE;
+	  i = next - (const unsigned char *) data;
+	}
+
       if (matchlet->mask)
 	{
 	  for (j = 0; j < matchlet->value_length; j++)
@@ -641,6 +660,9 @@ _xdg_mime_magic_free (XdgMimeMagic *mime_magic)
 {
   if (mime_magic) {
     _xdg_mime_magic_match_free (mime_magic->match_list);
+    free (mime_magic->matches);
+    if (mime_magic->index)
+      _xdg_mime_magic_index_free (mime_magic->index);
     free (mime_magic);
   }
 }
@@ -658,6 +680,24 @@ _xdg_mime_magic_lookup_data (XdgMimeMagic *mime_magic,
 {
   XdgMimeMagicMatch *match;
 
+  if (mime_magic->index)
+    {
+      const int *candidates;
+      int n_candidates;
+      int i;
+
+      n_candidates = _xdg_mime_magic_index_lookup (mime_magic->index,
+						   data, len, &candidates);
+      for (i = 0; i < n_candidates; i++)
+	{
+	  match = mime_magic->matches[candidates[i]];
+	  if (_xdg_mime_magic_match_compare_to_data (match, data, len))
+	    return match->mime_type;
+	}
+      if (n_candidates >= 0)
+	return NULL;
+    }
+
   for (match = mime_magic->match_list; match; match = match->next)
     {
       if (_xdg_mime_magic_match_compare_to_data (match, data, len))
@@ -692,6 +732,80 @@ _xdg_mime_update_mime_magic_extents (XdgMimeMagic *mime_magic)
   mime_magic->max_extent = max_extent;
 }
 
+/* Return the first byte of the value of the matchlet, or -1 if the
+ * matchlet can not be filed in the magic index */
+static int
+_xdg_mime_magic_matchlet_first_byte (XdgMimeMagicMatchlet *matchlet)
+{
+  if (matchlet->offset < 0 || matchlet->range_length == 0 ||
+      matchlet->range_length > XDG_MIME_MAGIC_INDEX_MAX_RANGE ||
+      matchlet->offset > INT_MAX - XDG_MIME_MAGIC_INDEX_MAX_RANGE ||
+      matchlet->value_length == 0)
+    return -1;
+
+  if (matchlet->mask && matchlet->mask[0] != 0xff)
+    return -1;
+
+  return matchlet->value[0];
+}
+
+/* Rebuild the magic index.  Every match is filed under the first byte
+ * of each of its top level matchlets, at every offset the matchlet may
+ * match at, since one of them has to match for the match to succeed. */
+static void
+_xdg_mime_update_mime_magic_index (XdgMimeMagic *mime_magic)
+{
+  XdgMimeMagicMatch *match;
+  XdgMimeMagicMatchlet *matchlet;
+  int n_matches = 0;
+  int ok = TRUE;
+  int i, j;
+
+  free (mime_magic->matches);
+  if (mime_magic->index)
+    _xdg_mime_magic_index_free (mime_magic->index);
+
+  for (match = mime_magic->match_list; match; match = match->next)
+    n_matches++;
+
+  mime_magic->matches = malloc ((n_matches + 1) * sizeof (XdgMimeMagicMatch *));
+  mime_magic->index = _xdg_mime_magic_index_new ();
+  if (mime_magic->matches == NULL || mime_magic->index == NULL)
+    ok = FALSE;
+
+  for (i = 0, match = mime_magic->match_list; match && ok; i++, match = match->next)
+    {
+      int indexable = TRUE;
+
+      mime_magic->matches[i] = match;
+
+      for (matchlet = match->matchlet; matchlet && indexable; matchlet = matchlet->next)
+	if (matchlet->indent == 0)
+	  indexable = _xdg_mime_magic_matchlet_first_byte (matchlet) >= 0;
+
+      if (!indexable)
+	ok = _xdg_mime_magic_index_add (mime_magic->index, i, -1, 0);
+
+      for (matchlet = match->matchlet; matchlet && indexable && ok; matchlet = matchlet->next)
+	{
+	  if (matchlet->indent != 0)
+	    continue;
+
+	  for (j = 0; j < matchlet->range_length && ok; j++)
+	    ok = _xdg_mime_magic_index_add (mime_magic->index, i,
+					    matchlet->offset + j,
+					    _xdg_mime_magic_matchlet_first_byte (matchlet));
+	}
+    }
+
+  /* Without an index, lookups just try every match */
+  if (!ok && mime_magic->index)
+    {
+      _xdg_mime_magic_index_free (mime_magic->index);
+      mime_magic->index = NULL;
+    }
+}
+
 static XdgMimeMagicMatchlet *
 _xdg_mime_magic_matchlet_mirror (XdgMimeMagicMatchlet *matchlets)
 {
@@ -757,6 +871,7 @@ _xdg_mime_magic_read_magic_file (XdgMimeMagic *mime_magic,
 	}
     }
   _xdg_mime_update_mime_magic_extents (mime_magic);
+  _xdg_mime_update_mime_magic_index (mime_magic);
 }
 
 void